@@ -0,0 +1,276 @@
+#ifndef WLRAPPS_H
+#define WLRAPPS_H
+
+// libwlrapps keeps track of the toplevels of a wlroots compositor through
+// wlr-foreign-toplevel-management, or through ext-foreign-toplevel-list on
+// compositors that only offer that, and exposes them as plain records. The
+// ext list has no state (activated, minimized, ...) and takes no actions. It's
+// meant to be driven from the caller's event loop: poll the fds returned by
+// wlrapps_get_fd() and wlrapps_get_watch_fd() with the timeout from
+// wlrapps_get_timeout() and call the matching dispatch function.
+//
+// The library holds a single connection, none of the functions are thread
+// safe.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct wl_display;
+
+#define WLRAPPS_NO_PARENT UINT32_MAX
+
+enum wlrapps_flags {
+  // Watch the application directories with inotify and update the desktop
+  // entries of the toplevels when .desktop files change.
+  WLRAPPS_WATCH_DESKTOP_ENTRIES = (1 << 0),
+  // Keep going when the compositor goes away and reconnect with backoff.
+  WLRAPPS_RECONNECT = (1 << 1),
+};
+
+// What a toplevel_changed event changed.
+enum wlrapps_change {
+  WLRAPPS_CHANGED_CREATED = (1 << 0),
+  WLRAPPS_CHANGED_TITLE = (1 << 1),
+  WLRAPPS_CHANGED_APP_ID = (1 << 2),
+  WLRAPPS_CHANGED_STATE = (1 << 3),
+  WLRAPPS_CHANGED_PARENT = (1 << 4),
+};
+
+enum wlrapps_action {
+  WLRAPPS_ACTION_FOCUS,
+  WLRAPPS_ACTION_MAXIMIZE,
+  WLRAPPS_ACTION_UNMAXIMIZE,
+  WLRAPPS_ACTION_MINIMIZE,
+  WLRAPPS_ACTION_RESTORE,
+  WLRAPPS_ACTION_FULLSCREEN,
+  WLRAPPS_ACTION_UNFULLSCREEN,
+  WLRAPPS_ACTION_CLOSE,
+};
+
+// A toplevel as tracked by the library. Records are owned by the library and
+// read in place, a record stays valid until its toplevel_closed event or
+// until the connection goes away.
+struct wlrapps_toplevel {
+  uint32_t id;
+  const char *title;  // NULL until the compositor sent one
+  const char *app_id; // Lowercased unless it's a gnome app_id
+
+  // From the matching .desktop file, NULL if no entry matches.
+  const char *name;
+  const char *icon;
+  const char *startup_wm_class;
+
+  uint32_t parent_id; // WLRAPPS_NO_PARENT for toplevels without a parent
+  uint32_t mru;       // Position in the focus history, 0 is the most recent
+
+  bool maximized;
+  bool minimized;
+  bool active;
+  bool fullscreen;
+};
+
+// A downscaled copy of a toplevel's contents. The pixels live in a shared
+// memory pool that other processes can map through
+// wlrapps_get_thumbnail_pool(), starting at offset.
+struct wlrapps_thumbnail {
+  uint32_t toplevel_id;
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t format; // WL_SHM_FORMAT_ARGB8888 or WL_SHM_FORMAT_XRGB8888
+  size_t offset;
+  const uint8_t *pixels;
+  uint32_t serial; // Changes with every new frame
+  bool live;       // Kept up to date while the toplevel is damaged
+};
+
+// Every callback is optional. No events are sent while the state is loaded
+// after connecting, the records are complete once the connection is up.
+struct wlrapps_listener {
+  // A toplevel appeared or changed, changes is a mask of enum wlrapps_change.
+  void (*toplevel_changed)(const struct wlrapps_toplevel *toplevel,
+                           uint32_t changes, void *data);
+  // Sent right before the record is freed.
+  void (*toplevel_closed)(const struct wlrapps_toplevel *toplevel, void *data);
+  // WLRAPPS_RECONNECT only: the connection broke, every record is gone.
+  void (*disconnected)(void *data);
+  // WLRAPPS_RECONNECT only: a reconnect attempt succeeded and the records
+  // were loaded again.
+  void (*reconnected)(void *data);
+  // A thumbnail was captured or refreshed.
+  void (*thumbnail_updated)(const struct wlrapps_toplevel *toplevel,
+                            const struct wlrapps_thumbnail *thumbnail,
+                            void *data);
+};
+
+// ---- Setup ----
+
+// Sets up the library state and indexes the installed desktop entries.
+// flags is a mask of enum wlrapps_flags.
+void wlrapps_init(uint32_t flags, const struct wlrapps_listener *listener,
+                  void *data);
+// Connects to the compositor and loads every toplevel. On failure with
+// WLRAPPS_RECONNECT the next attempt is already scheduled.
+bool wlrapps_connect(void);
+// Disconnects and frees everything, wlrapps_init() starts over.
+void wlrapps_finish(void);
+
+// Output used by WLRAPPS_ACTION_FULLSCREEN, by its registry name. Has to be
+// set before connecting.
+void wlrapps_set_fullscreen_output(uint32_t global_name);
+
+// Keeps the toplevel ids stable across restarts. The ids of the live windows
+// are remembered in a small file at path, after a restart every window that
+// can be recognized gets its old id back. Has to be set before connecting.
+// The file is locked, returns false if another process holds it.
+bool wlrapps_set_id_cache(const char *path);
+
+// ---- Event Loop ----
+
+// The Wayland connection fd, -1 while disconnected.
+int wlrapps_get_fd(void);
+// The inotify fd for desktop entry changes, -1 if they aren't watched.
+int wlrapps_get_watch_fd(void);
+// Milliseconds until wlrapps_dispatch_timers() has work, -1 for none.
+int wlrapps_get_timeout(void);
+
+// Reads and handles the events of the Wayland fd. Returns false if the
+// connection broke and the library isn't reconnecting.
+bool wlrapps_dispatch(void);
+// Handles the events of the watch fd. Returns true if the desktop entry of
+// any toplevel changed.
+bool wlrapps_dispatch_watch(void);
+// Runs the timers that are due. Returns true if the focus history changed.
+bool wlrapps_dispatch_timers(void);
+// Sends the queued requests to the compositor.
+void wlrapps_flush(void);
+
+struct wl_display *wlrapps_get_display(void);
+
+// ---- Toplevels ----
+
+size_t wlrapps_toplevel_count(void);
+// Iterates every toplevel, oldest first.
+const struct wlrapps_toplevel *wlrapps_first_toplevel(void);
+const struct wlrapps_toplevel *
+wlrapps_next_toplevel(const struct wlrapps_toplevel *toplevel);
+// Iterates the direct children of a toplevel.
+size_t wlrapps_child_count(const struct wlrapps_toplevel *toplevel);
+const struct wlrapps_toplevel *
+wlrapps_first_child(const struct wlrapps_toplevel *toplevel);
+const struct wlrapps_toplevel *
+wlrapps_next_sibling(const struct wlrapps_toplevel *toplevel);
+const struct wlrapps_toplevel *wlrapps_find_toplevel(uint32_t id);
+
+#define wlrapps_for_each_toplevel(toplevel)                                    \
+  for (toplevel = wlrapps_first_toplevel(); toplevel;                          \
+       toplevel = wlrapps_next_toplevel(toplevel))
+
+#define wlrapps_for_each_child(child, toplevel)                                \
+  for (child = wlrapps_first_child(toplevel); child;                           \
+       child = wlrapps_next_sibling(child))
+
+// ---- Actions ----
+// Requests are queued, call wlrapps_flush() to send them.
+
+// Returns false if there is no toplevel with that id, or only
+// ext-foreign-toplevel-list knows it and it takes no actions.
+bool wlrapps_toplevel_action(uint32_t id, enum wlrapps_action action);
+// Runs the action on every toplevel selected by target, which is either a
+// toplevel id, "app:<app_id>", "output:<name>" or "all". Returns the number
+// of toplevels the action ran on, or -1 if target is invalid.
+int wlrapps_target_action(const char *target, enum wlrapps_action action);
+// Same as wlrapps_target_action(), also stores the ids of the first max_ids
+// toplevels the action ran on.
+int wlrapps_target_action_ids(const char *target, enum wlrapps_action action,
+                              uint32_t *ids, size_t max_ids);
+// Sends a wl_display.sync and calls done once the compositor has processed
+// every request sent before it and the events they caused were dispatched.
+// done is never called if the connection goes away first. Returns false
+// while disconnected.
+bool wlrapps_sync(void (*done)(void *data), void *data);
+
+// Focuses the previously active toplevel.
+void wlrapps_focus_prev(void);
+// Alt-tab through all toplevels, or through the windows of the active app.
+// The order stays frozen while cycling.
+void wlrapps_cycle(bool backwards);
+void wlrapps_focus_next_in_app(void);
+// Focuses the most recently used window of the app, or cycles through its
+// windows if one of them is already active. Returns false if there is no
+// window with that app_id.
+bool wlrapps_focus_app(const char *app_id);
+// Minimizes every visible toplevel, wlrapps_restore_layout() undoes it.
+void wlrapps_show_desktop(void);
+void wlrapps_restore_layout(void);
+
+// ---- Search ----
+
+struct wlrapps_search_result {
+  uint32_t id;
+  int32_t score; // Higher is better
+};
+
+// Fuzzy search over the titles and app_ids, case insensitive for ASCII. The
+// query matches as a subsequence, or with typos through shared trigrams.
+// Returns the number of matching toplevels and stores the best max of them,
+// best first. An empty query matches every toplevel in focus history order.
+size_t wlrapps_search(const char *query, struct wlrapps_search_result *results,
+                      size_t max);
+
+// ---- Focus Time ----
+
+struct wlrapps_usage {
+  const char *app_id; // Valid until wlrapps_finish()
+  uint64_t focused_ms;
+  uint32_t activations;
+};
+
+// Appends the focus time every app gained to the file at path once a minute,
+// a line "<unix time> <ms> <activations> <app_id>" per app. Returns false if
+// the file can't be opened.
+bool wlrapps_set_usage_log(const char *path);
+// How long each app had the focus since wlrapps_init(), including the
+// running interval. Returns the number of apps and stores max of them in no
+// particular order.
+size_t wlrapps_get_usage(struct wlrapps_usage *usage, size_t max);
+
+// ---- Memory ----
+
+// Heap bytes held by the library, by what they are for. Thumbnails have their
+// own budget and aren't included.
+struct wlrapps_memory {
+  size_t records; // Toplevels, outputs and the state kept between events
+  size_t titles;
+  size_t app_ids;
+  size_t indexes; // Search, app and desktop entry indexes
+};
+
+void wlrapps_get_memory(struct wlrapps_memory *memory);
+// Titles longer than max bytes are cut at a character boundary, 0 (the
+// default) keeps them whole. Applies to the titles received afterwards.
+void wlrapps_set_max_title_length(size_t max);
+
+// ---- Thumbnails ----
+// Captured through ext-image-copy-capture, for compositors that also offer
+// ext-foreign-toplevel-list.
+
+// Has to be called between wlrapps_init() and wlrapps_connect(). Thumbnails
+// fit into max_size x max_size and the pool holds budget bytes, once it's
+// full the least recently used thumbnail is evicted. Every captured toplevel
+// also holds a full size buffer while its capture runs. Returns false if the
+// library was built without thumbnails or the pool couldn't be created.
+bool wlrapps_enable_thumbnails(uint32_t max_size, size_t budget);
+// The pool's fd and size, -1 if thumbnails aren't enabled.
+int wlrapps_get_thumbnail_pool(size_t *size);
+// Captures the toplevel once, or with follow_damage again every time it's
+// damaged until wlrapps_stop_thumbnail(). thumbnail_updated is sent for each
+// frame. Returns false if the toplevel can't be captured.
+bool wlrapps_capture_thumbnail(uint32_t id, bool follow_damage);
+void wlrapps_stop_thumbnail(uint32_t id);
+// The latest thumbnail of a toplevel, NULL if there is none. Counts as a use
+// for the eviction.
+const struct wlrapps_thumbnail *wlrapps_get_thumbnail(uint32_t id);
+
+#endif
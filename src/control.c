@@ -0,0 +1,149 @@
+#define _POSIX_C_SOURCE 200809L
+#include "control.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Without a runtime dir the files go into /tmp/wlr-apps-<uid>, created
+// private to the user. Anything else found at that path is refused, since
+// whoever made it could replace the socket.
+static bool fallback_runtime_dir(char *dir, size_t size) {
+  int len = snprintf(dir, size, "/tmp/wlr-apps-%u", (unsigned)getuid());
+  if (len < 0 || (size_t)len >= size) {
+    return false;
+  }
+
+  if (mkdir(dir, 0700) == 0) {
+    // The umask may have taken more than the group and others bits.
+    if (chmod(dir, 0700) == -1) {
+      fprintf(stderr, "Error setting up %s: %s\n", dir, strerror(errno));
+      return false;
+    }
+  } else if (errno != EEXIST) {
+    fprintf(stderr, "Error creating %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if (lstat(dir, &st) == -1) {
+    fprintf(stderr, "Error checking %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+      (st.st_mode & 07777) != 0700) {
+    fprintf(stderr,
+            "%s isn't a directory only this user can access, set "
+            "XDG_RUNTIME_DIR.\n",
+            dir);
+    return false;
+  }
+  return true;
+}
+
+bool control_runtime_path(char *path, size_t size, const char *suffix) {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  const char *display = getenv("WAYLAND_DISPLAY");
+  int len;
+
+  // WAYLAND_DISPLAY may also be an absolute path to the compositor socket.
+  if (!display || !*display) {
+    display = "wayland-0";
+  } else if (strrchr(display, '/')) {
+    display = strrchr(display, '/') + 1;
+  }
+
+  char fallback_dir[64];
+  if (!runtime_dir || !*runtime_dir) {
+    if (!fallback_runtime_dir(fallback_dir, sizeof(fallback_dir))) {
+      return false;
+    }
+    runtime_dir = fallback_dir;
+  }
+
+  len = snprintf(path, size, "%s/wlr-apps-%s%s", runtime_dir, display, suffix);
+
+  if (len < 0 || (size_t)len >= size) {
+    fprintf(stderr, "Runtime path for display '%s' is too long\n", display);
+    return false;
+  }
+  return true;
+}
+
+bool control_socket_address(struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  return control_runtime_path(addr->sun_path, sizeof(addr->sun_path), ".sock");
+}
+
+// Commands the daemon answers, everything else is fire and forget.
+static bool command_answers(const char *message) {
+  static const char *const commands[] = {
+      "subscribe", "since", "search", "usage", "mem", "thumbnail", "wait"};
+  size_t len = strcspn(message, " ");
+
+  for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); ++i) {
+    if (strlen(commands[i]) == len && strncmp(commands[i], message, len) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+int control_send(const char *message, int sync_timeout) {
+  struct sockaddr_un addr;
+  char sync_message[CONTROL_BUFFER_SIZE];
+
+  if (!control_socket_address(&addr)) {
+    return EXIT_FAILURE;
+  }
+
+  if (sync_timeout >= 0) {
+    snprintf(sync_message, sizeof(sync_message), "sync %d %s", sync_timeout,
+             message);
+    message = sync_message;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    perror("Error creating client socket");
+    return EXIT_FAILURE;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "Error connecting to %s: ", addr.sun_path);
+    perror(NULL);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  if (send(fd, message, strlen(message), MSG_NOSIGNAL) == -1) {
+    perror("Error sending data");
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  // The daemon hangs up on everything else once it read the command.
+  int status = EXIT_SUCCESS;
+  if (sync_timeout >= 0 || command_answers(message)) {
+    char buffer[4096];
+    ssize_t len;
+    bool acknowledged = false;
+    while ((len = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+      acknowledged |= len >= 2 && strncmp(buffer, "ok", 2) == 0;
+      fwrite(buffer, 1, len, stdout);
+      fflush(stdout);
+    }
+    if ((sync_timeout >= 0 || strncmp(message, "wait ", 5) == 0 ||
+         strcmp(message, "wait") == 0) &&
+        !acknowledged) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  close(fd);
+  return status;
+}
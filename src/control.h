@@ -0,0 +1,29 @@
+#ifndef WLRAPPS_CONTROL_H
+#define WLRAPPS_CONTROL_H
+
+// The control socket shared by the wlr-apps daemon and its clients. Nothing
+// in here touches Wayland, so wlr-appsctl can be built without it.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/un.h>
+
+#define CONTROL_BUFFER_SIZE 256 // Longest command the daemon reads at once
+#define CONTROL_SYNC_TIMEOUT_MS 1000
+
+// Fills in $XDG_RUNTIME_DIR/wlr-apps-$WAYLAND_DISPLAY<suffix>, one file per
+// compositor in a directory only the user can access. Without a runtime dir
+// the directory is /tmp/wlr-apps-<uid>, created with mode 0700. Returns false
+// if the path doesn't fit or that directory isn't the user's and private.
+bool control_runtime_path(char *path, size_t size, const char *suffix);
+
+// The control socket, the runtime path with a .sock suffix.
+bool control_socket_address(struct sockaddr_un *addr);
+
+// Sends a single command to the daemon. The answers to subscriptions,
+// searches, thumbnail requests and, with a sync_timeout of 0 or more,
+// synchronous commands are relayed to stdout. Returns the exit status for
+// the client.
+int control_send(const char *message, int sync_timeout);
+
+#endif
@@ -0,0 +1,97 @@
+#include "json-escape.h"
+
+#ifdef JSON_SIMD
+#include <immintrin.h>
+#endif
+
+// The scan is vectorized where the cpu allows it, unaligned loads never cross
+// the end of the string, the tail is left to the scalar loop.
+size_t json_clean_run_scalar(const char *str, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = (unsigned char)str[i];
+    if (c < 0x20 || c == '"' || c == '\\') {
+      return i;
+    }
+  }
+  return len;
+}
+
+#ifdef JSON_SIMD
+size_t json_clean_run_sse2(const char *str, size_t len) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    // Unsigned c <= 0x1f is the same as min(c, 0x1f) == c.
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    unsigned mask = (unsigned)_mm_movemask_epi8(special);
+    if (mask) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+  return i + json_clean_run_scalar(str + i, len - i);
+}
+
+__attribute__((target("avx2"))) size_t
+json_clean_run_avx2(const char *str, size_t len) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(str + i));
+    __m256i special = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                        _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(_mm256_min_epu8(chunk, control), chunk));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(special);
+    if (mask) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+  }
+
+  // Calling the sse2 version for the rest would mix in legacy SSE encoded
+  // instructions after AVX ones, which stalls on most cpus.
+  if (i + 16 <= len) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(str + i));
+    __m128i special = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(quote)),
+                     _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(backslash))),
+        _mm_cmpeq_epi8(_mm_min_epu8(chunk, _mm256_castsi256_si128(control)),
+                       chunk));
+    unsigned mask = (unsigned)_mm_movemask_epi8(special);
+    if (mask) {
+      return i + (size_t)__builtin_ctz(mask);
+    }
+    i += 16;
+  }
+  return i + json_clean_run_scalar(str + i, len - i);
+}
+
+bool json_cpu_has_avx2(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+static size_t json_clean_run_select(const char *str, size_t len);
+
+// Resolved on the first call, the cpu doesn't change after that.
+size_t (*json_clean_run)(const char *str, size_t len) = json_clean_run_select;
+
+static size_t json_clean_run_select(const char *str, size_t len) {
+#ifdef JSON_SIMD
+  json_clean_run =
+      json_cpu_has_avx2() ? json_clean_run_avx2 : json_clean_run_sse2;
+#else
+  json_clean_run = json_clean_run_scalar;
+#endif
+  return json_clean_run(str, len);
+}
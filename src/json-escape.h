@@ -0,0 +1,30 @@
+#ifndef WLRAPPS_JSON_ESCAPE_H
+#define WLRAPPS_JSON_ESCAPE_H
+
+// The scan behind the daemon's json strings. Titles rarely need escaping, so
+// the escaper looks for the length of the clean run ahead and copies it in one
+// go. Nothing in here touches Wayland.
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#define JSON_SIMD 1 // SSE2 scan, AVX2 when the cpu has it
+#endif
+
+// Length of the prefix of str that needs no escaping, stops at a control
+// character, a quote or a backslash. Resolved to the fastest kernel the cpu
+// supports on the first call.
+extern size_t (*json_clean_run)(const char *str, size_t len);
+
+// The kernels behind json_clean_run, exposed for the tests. The scalar version
+// is the reference the others must match.
+size_t json_clean_run_scalar(const char *str, size_t len);
+#ifdef JSON_SIMD
+size_t json_clean_run_sse2(const char *str, size_t len);
+// Only call it if json_cpu_has_avx2().
+size_t json_clean_run_avx2(const char *str, size_t len);
+bool json_cpu_has_avx2(void);
+#endif
+
+#endif
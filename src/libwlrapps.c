@@ -0,0 +1,4256 @@
+#define _POSIX_C_SOURCE 200809L
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+#include "wlrapps.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client-core.h>
+#include <wayland-client.h>
+
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+#include "ext-foreign-toplevel-list-v1-client-protocol.h"
+#endif
+#ifdef WLRAPPS_THUMBNAILS
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#endif
+
+// ----- Macros -----
+
+// The highest versions understood, the bound ones are negotiated with what
+// the compositor advertises.
+#define WLR_FOREIGN_TOPLEVEL_MANAGEMENT_VERSION 3
+#define WL_SEAT_VERSION 1 // Only passed along with activate
+#define DESKTOP_INDEX_BUCKETS 256
+#define INOTIFY_BUFFER_SIZE 4096
+#define CYCLE_TIMEOUT_MS 1000
+#define APP_INDEX_BUCKETS 64
+#define WL_OUTPUT_VERSION 4
+#define MAX_OUTPUTS 32 // One bit per output in toplevel_v1.outputs
+#define RECONNECT_MIN_MS 250
+#define RECONNECT_MAX_MS 8000
+#define WL_SHM_VERSION 1
+#define EXT_FOREIGN_TOPLEVEL_LIST_VERSION 1
+#define EXT_IMAGE_CAPTURE_SOURCE_VERSION 1
+#define EXT_IMAGE_COPY_CAPTURE_VERSION 1
+#define SEARCH_BUCKET_BITS 10
+#define SEARCH_BUCKETS (1 << SEARCH_BUCKET_BITS)
+#define SEARCH_SCORE_MATCH 16
+#define SEARCH_SCORE_WORD_START 8
+#define SEARCH_SCORE_CONSECUTIVE 8
+#define SEARCH_SCORE_PREFIX 12
+#define SEARCH_SCORE_TRIGRAM 4
+#define SEARCH_MAX_GAP_PENALTY 8
+#define IDENTITY_CACHE_MAGIC 0x77616931u // "wai1", bump with the layout
+#define IDENTITY_CACHE_RECORDS 1024
+#define IDENTITY_FREE UINT32_MAX // Record id of a closed or claimed window
+#define USAGE_APPS 256 // Power of two, kept at most three quarters full
+#define USAGE_FLUSH_MS 60000
+
+// ---- Enums -----
+
+enum toplevel_state_field {
+  TOPLEVEL_STATE_MAXIMIZED = (1 << 0),
+  TOPLEVEL_STATE_MINIMIZED = (1 << 1),
+  TOPLEVEL_STATE_ACTIVATED = (1 << 2),
+  TOPLEVEL_STATE_FULLSCREEN = (1 << 3),
+  TOPLEVEL_STATE_INVALID = (1 << 4),
+};
+
+// ---- Structs ----
+
+static struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager = NULL;
+static struct wl_list toplevel_list;
+// Most recently activated first, new toplevels are appended at the end.
+static struct wl_list mru_list;
+
+struct toplevel_v1;
+struct toplevel_capture;
+
+// A toplevel of ext-foreign-toplevel-list. Alongside wlr-foreign-toplevel-
+// management it's paired with the wlr toplevel that shows the same app_id and
+// title, the oldest unpaired one if several do, so the same window is listed
+// once. Without the wlr protocol it's the only source of a toplevel_v1.
+//
+// The protocols share no key, so windows with the same app_id and title can
+// pair crosswise, and a window that gets its title in one protocol before
+// the other matches nothing until both arrived. Every done on either side
+// pairs what's unpaired and swaps the partners of pairs that stopped
+// matching, which sorts both out once the titles differ. Until then
+// identical windows may carry each other's identifier and thumbnail.
+struct ext_toplevel {
+  struct wl_list link;
+  struct ext_foreign_toplevel_handle_v1 *handle;
+  char *title;
+  char *app_id;
+  char *identifier;
+  bool done; // Got its first done event
+  struct toplevel_v1 *toplevel; // NULL until paired
+};
+
+struct toplevel_state {
+  char *title;
+  char *app_id;
+
+  uint32_t state;
+  uint32_t parent_id;
+  struct toplevel_v1 *parent;
+};
+
+// Every toplevel sharing an app_id, chained in the app index hash table.
+struct app_group {
+  struct app_group *next;
+  char *app_id;
+  struct wl_list toplevels;
+};
+
+static struct app_group *app_index[APP_INDEX_BUCKETS];
+
+struct output_v1 {
+  struct wl_list link;
+  struct wl_output *wl_output;
+  uint32_t global_name;
+  char *name; // Connector name, only sent by wl_output version 4
+  uint32_t bit;
+};
+
+static struct wl_list output_list;
+static uint32_t output_bits_used = 0;
+
+// Parent events naming a handle that has no toplevel_v1 yet, the link is
+// made as soon as that toplevel shows up.
+struct pending_parent {
+  struct wl_list link;
+  struct toplevel_v1 *child;
+  struct zwlr_foreign_toplevel_handle_v1 *parent_handle;
+};
+
+static struct wl_list pending_parent_list;
+
+// A toplevel's place in the search index.
+struct search_entry {
+  char *title; // Lowercased, NULL until indexed
+  char *app_id;
+  uint32_t *trigrams; // Distinct and sorted
+  uint32_t *slots; // Where each trigram's posting sits in its bucket
+  size_t trigram_count;
+  uint64_t mask; // See search_char_mask()
+  uint32_t stamp; // The query that last counted hits
+  uint32_t hits;
+};
+
+struct search_posting {
+  uint32_t code;
+  uint32_t trigram; // Index into the toplevel's trigrams
+  struct toplevel_v1 *toplevel;
+};
+
+struct search_bucket {
+  struct search_posting *postings;
+  size_t count;
+  size_t capacity;
+};
+
+static struct search_bucket search_index[SEARCH_BUCKETS];
+static uint32_t search_stamp = 0;
+
+// A window as the id cache remembers it. The records keep the arrival order
+// of the windows, closing one leaves a hole until the file is compacted.
+struct identity_record {
+  uint32_t id;
+  uint32_t parent_id;
+  uint64_t key; // Hash of the app_id and title
+  uint64_t identifier; // Hash of the ext-foreign-toplevel-list identifier
+};
+
+// The layout of the mmap'd file.
+struct identity_file {
+  uint32_t magic;
+  uint32_t next_id; // Ids below this were handed out before
+  uint32_t count;
+  uint32_t reserved;
+  struct identity_record records[IDENTITY_CACHE_RECORDS];
+};
+
+struct identity_cache {
+  struct identity_file *file; // NULL without a cache
+  int fd; // Holds the lock on the file
+  // The records of the last run, claimed one by one while the toplevels of
+  // a new connection are loaded.
+  struct identity_record *previous;
+  size_t previous_count;
+  bool restoring;
+};
+
+static struct identity_cache identity_cache = {.fd = -1};
+
+static uint32_t global_id = 0;
+struct toplevel_v1 {
+  struct wl_list link;
+  struct wl_list mru_link;
+  struct wl_list app_link;
+  struct app_group *app;
+  uint32_t outputs; // Bitmask of output_v1.bit
+
+  struct wl_list children; // toplevel_v1.child_link
+  struct wl_list child_link;
+  // NULL for a toplevel only ext-foreign-toplevel-list knows, it can't be
+  // acted on.
+  struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel;
+  struct ext_toplevel *ext; // NULL until paired
+  const struct desktop_entry *desktop;
+  struct toplevel_capture *capture; // Thumbnails only, NULL until captured
+  struct search_entry search;
+
+  uint32_t seed;
+  uint32_t id;
+  uint32_t identity_slot; // Record in the id cache, IDENTITY_FREE if none
+  bool announced; // The first done event was forwarded
+  struct toplevel_state current, pending;
+
+  // The record handed out to library users, points into current.
+  struct wlrapps_toplevel info;
+};
+
+static struct wl_output *pref_output = NULL;
+static struct wl_seat *seat = NULL;
+
+// A parsed .desktop file. Entries are chained in two hash tables, one keyed by
+// the desktop file id and one by StartupWMClass for app_ids that don't match
+// their file name. A hidden entry, one that was deleted, stays in the id table
+// without any fields so that it masks the id in directories with lower
+// precedence.
+struct desktop_entry {
+  struct desktop_entry *next_by_id;
+  struct desktop_entry *next_by_class;
+
+  char *id; // File name without ".desktop"
+  char *name;
+  char *icon;
+  char *wm_class;
+  size_t dir; // Index in desktop_index.dirs, lower index takes precedence
+  bool hidden;
+};
+
+struct desktop_dir {
+  char *path;
+  int wd;
+  int parent_wd; // Nearest existing ancestor, to notice the directory appear
+};
+
+struct desktop_index {
+  struct desktop_entry *by_id[DESKTOP_INDEX_BUCKETS];
+  struct desktop_entry *by_class[DESKTOP_INDEX_BUCKETS];
+
+  struct desktop_dir *dirs;
+  size_t dir_count;
+  int inotify_fd;
+};
+
+static struct desktop_index desktop_index = {.inotify_fd = -1};
+
+// Alt-tab style cycling. The MRU order is snapshotted when a cycle starts and
+// stays frozen until no cycle command arrived for CYCLE_TIMEOUT_MS, then the
+// toplevel that ended up active moves to the front.
+struct cycle_session {
+  bool active;
+  uint64_t last_ms;
+  char *app_id; // Only cycle through this app, NULL for every toplevel
+
+  uint32_t *ids;
+  size_t count;
+  size_t pos;
+};
+
+static struct cycle_session cycle_session = {0};
+
+// Toplevels minimized by show-desktop, restored by restore-layout.
+struct saved_layout {
+  uint32_t *ids;
+  size_t count;
+  uint32_t active_id;
+};
+
+static struct saved_layout saved_layout = {.active_id = UINT32_MAX};
+static bool mru_dirty = false;
+
+// Focus time per app, in an open addressed table that interns the app_ids.
+struct usage_app {
+  char *app_id; // NULL for a free slot
+  uint64_t focused_ms;
+  uint32_t activations;
+  uint64_t logged_ms; // What the log already has
+  uint32_t logged_activations;
+};
+
+struct usage {
+  struct usage_app apps[USAGE_APPS];
+  size_t count;
+  const struct toplevel_v1 *toplevel; // Active since since_ms
+  struct usage_app *focused;          // Its app, NULL if it isn't counted
+  uint64_t since_ms;
+  bool unlogged; // Focus time the log doesn't have yet
+  int log_fd;
+  uint64_t logged_at_ms;
+};
+
+static struct usage usage = {.log_fd = -1};
+
+static struct wl_display *global_display = NULL;
+static struct wl_registry *registry = NULL;
+
+// ---- Global Variables ----
+
+static const uint32_t no_parent = WLRAPPS_NO_PARENT;
+static uint32_t pref_output_id = UINT32_MAX;
+static bool reconnect_mode = false;
+static size_t max_title_length = 0; // 0 keeps titles whole
+// The compositor has no wlr-foreign-toplevel-management, the toplevels come
+// from ext-foreign-toplevel-list.
+static bool ext_backend_only = false;
+// Set while the state is loaded after connecting or torn down, no events are
+// sent to the listener meanwhile.
+static bool resyncing = false;
+static size_t toplevel_count = 0;
+static const struct wlrapps_listener *listener = NULL;
+static void *listener_data = NULL;
+static void update_toplevel_info_state(struct toplevel_v1 *toplevel);
+static const struct desktop_entry *desktop_index_lookup(const char *app_id);
+static void mru_handle_activated(struct toplevel_v1 *toplevel);
+static void update_mru_ranks(void);
+static void app_index_update(struct toplevel_v1 *toplevel);
+static void app_index_remove(struct toplevel_v1 *toplevel);
+static void search_index_update(struct toplevel_v1 *toplevel);
+static void search_index_remove(struct toplevel_v1 *toplevel);
+static bool thumbnails_handle_global(struct wl_registry *registry,
+                                     uint32_t name, const char *interface,
+                                     uint32_t version);
+static void thumbnails_toplevel_destroyed(struct toplevel_v1 *toplevel);
+static bool ext_list_handle_global(struct wl_registry *registry, uint32_t name,
+                                   const char *interface, uint32_t version);
+static void ext_list_toplevel_done(struct toplevel_v1 *toplevel);
+static void ext_list_toplevel_destroyed(struct toplevel_v1 *toplevel);
+static const char *ext_toplevel_identifier(struct toplevel_v1 *toplevel);
+static void identity_write(struct toplevel_v1 *toplevel);
+static void usage_focus(const struct toplevel_v1 *toplevel);
+static void action_focus(struct toplevel_v1 *toplevel);
+static bool run_action(struct toplevel_v1 *toplevel,
+                       void (*action)(struct toplevel_v1 *toplevel));
+
+// ---- Helper Functions ----
+
+static void notify_changed(struct toplevel_v1 *toplevel, uint32_t changes) {
+  if (!resyncing && listener && listener->toplevel_changed) {
+    update_mru_ranks();
+    listener->toplevel_changed(&toplevel->info, changes, listener_data);
+  }
+}
+
+// The version to bind a global with, the highest one both sides know.
+static uint32_t bind_version(uint32_t advertised, uint32_t supported) {
+  return advertised < supported ? advertised : supported;
+}
+
+static size_t string_size(const char *str) {
+  return str ? strlen(str) + 1 : 0;
+}
+
+// The length a title is stored with, cut at a character boundary past
+// max_title_length.
+static size_t title_length(const char *title) {
+  size_t len = strlen(title);
+  if (max_title_length == 0 || len <= max_title_length) {
+    return len;
+  }
+
+  len = max_title_length;
+  while (len > 0 && ((unsigned char)title[len] & 0xc0) == 0x80) {
+    len--;
+  }
+  return len;
+}
+
+static void set_toplevel_desktop(struct toplevel_v1 *toplevel,
+                                 const struct desktop_entry *entry) {
+  toplevel->desktop = entry;
+  toplevel->info.name = entry ? entry->name : NULL;
+  toplevel->info.icon = entry ? entry->icon : NULL;
+  toplevel->info.startup_wm_class = entry ? entry->wm_class : NULL;
+}
+
+static void set_toplevel_parent(struct toplevel_v1 *toplevel,
+                                struct toplevel_v1 *parent) {
+  if (toplevel->current.parent == parent) {
+    return;
+  }
+
+  if (toplevel->current.parent) {
+    wl_list_remove(&toplevel->child_link);
+  }
+
+  toplevel->current.parent = parent;
+  toplevel->current.parent_id = parent ? parent->id : no_parent;
+
+  if (parent) {
+    wl_list_insert(parent->children.prev, &toplevel->child_link);
+  }
+}
+
+static void copy_state(struct toplevel_state *current,
+                       struct toplevel_state *pending,
+                       struct toplevel_v1 *toplevel) {
+  bool reindex = pending->title || pending->app_id || !toplevel->search.title;
+  if (current->title && pending->title) {
+    free(current->title);
+  }
+
+  if (current->app_id && pending->app_id) {
+    free(current->app_id);
+  }
+
+  if (pending->title) {
+    current->title = pending->title;
+    pending->title = NULL;
+  }
+
+  if (pending->app_id) {
+    /*
+    This implementation is kinda dumb but it's the best I could come up with. Basically the -gtk-icontheme doesn't match upper and lowercase, meaning that
+    if your app_id is, for example, "org.xfce.Thunar" but the icon is found under "org.xfce.thunar" it will return null and empty icon. So we need to convert it to
+    lowercase first in order for gtk to return a valid icon. HOWEVER, the same thing occurs the other way arround, for example, "org.gnome.Calculator" only matches with the
+    uppercase, so if we convert ALL app_ids to lowercase this one won't match. From testing I think only gnome has the icon with upper case rather than lowecase.
+    To make things worse this seems to only happen with "org.something.something" app_ids, any other app in my testing matches correctly regardless of upper or lowercase.
+    I couldn't look deeper into how gtk handles this but could be a bug.
+    */
+    char gnome[] = "gnome";
+    char *res = strstr(pending->app_id, gnome);
+    // If the app_id doesn't contain "gnome" we convert everything to lowercase. if it does we leave it as it is.
+    if (res == NULL) {
+      for (int i = 0; i < strlen(pending->app_id); i++){
+        pending->app_id[i] = tolower(pending->app_id[i]);
+      }
+    }
+    current->app_id = pending->app_id;
+    pending->app_id = NULL;
+    app_index_update(toplevel);
+    set_toplevel_desktop(toplevel, desktop_index_lookup(current->app_id));
+  }
+
+  if (!(pending->state & TOPLEVEL_STATE_INVALID)) {
+    current->state = pending->state;
+  }
+
+  set_toplevel_parent(toplevel, pending->parent);
+  pending->state = TOPLEVEL_STATE_INVALID;
+  if (reindex) {
+    search_index_update(toplevel);
+  }
+
+  update_toplevel_info_state(toplevel);
+}
+
+// Points the record at the current state, the strings are shared and not
+// copied.
+static void update_toplevel_info_state(struct toplevel_v1 *toplevel) {
+  struct wlrapps_toplevel *info = &toplevel->info;
+
+  info->title = toplevel->current.title;
+  info->app_id = toplevel->current.app_id;
+  info->parent_id = toplevel->current.parent_id;
+  info->maximized = toplevel->current.state & TOPLEVEL_STATE_MAXIMIZED;
+  info->minimized = toplevel->current.state & TOPLEVEL_STATE_MINIMIZED;
+  info->active = toplevel->current.state & TOPLEVEL_STATE_ACTIVATED;
+  info->fullscreen = toplevel->current.state & TOPLEVEL_STATE_FULLSCREEN;
+}
+
+// ---- Desktop Entry Index ----
+
+// FNV-1a over the lowercased string, app_ids are compared case insensitively
+// since copy_state() lowercases most of them.
+static uint32_t hash_string_nocase(const char *str) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)str; *p; ++p) {
+    hash ^= (uint32_t)tolower(*p);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void free_desktop_entry(struct desktop_entry *entry) {
+  free(entry->id);
+  free(entry->name);
+  free(entry->icon);
+  free(entry->wm_class);
+  free(entry);
+}
+
+static char *trim_desktop_value(char *value) {
+  size_t len = strlen(value);
+  while (len > 0 && isspace((unsigned char)value[len - 1])) {
+    value[--len] = '\0';
+  }
+  return value;
+}
+
+// Parses the [Desktop Entry] group of a .desktop file, returns NULL if the file
+// can't be read. An entry marked as hidden comes back as a placeholder.
+static struct desktop_entry *parse_desktop_file(const char *dir_path,
+                                                const char *file_name,
+                                                size_t dir) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s/%s", dir_path, file_name) >=
+      (int)sizeof(path)) {
+    return NULL;
+  }
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return NULL;
+  }
+
+  struct desktop_entry *entry = calloc(1, sizeof(*entry));
+  if (!entry) {
+    fclose(file);
+    return NULL;
+  }
+
+  entry->id = strndup(file_name, strlen(file_name) - strlen(".desktop"));
+  entry->dir = dir;
+
+  bool in_main_group = false;
+  bool hidden = false;
+  char *line = NULL;
+  size_t line_cap = 0;
+
+  while (getline(&line, &line_cap, file) != -1) {
+    if (line[0] == '[') {
+      // The main group comes first, anything after it are actions.
+      if (in_main_group) {
+        break;
+      }
+      in_main_group = strncmp(line, "[Desktop Entry]", 15) == 0;
+      continue;
+    }
+
+    if (!in_main_group) {
+      continue;
+    }
+
+    char *value = strchr(line, '=');
+    if (!value) {
+      continue;
+    }
+    *value++ = '\0';
+    trim_desktop_value(line);
+    trim_desktop_value(value);
+
+    // Localized keys such as Name[de] are skipped by the exact comparison.
+    if (strcmp(line, "Name") == 0 && !entry->name) {
+      entry->name = strdup(value);
+    } else if (strcmp(line, "Icon") == 0 && !entry->icon) {
+      entry->icon = strdup(value);
+    } else if (strcmp(line, "StartupWMClass") == 0 && !entry->wm_class) {
+      entry->wm_class = strdup(value);
+    } else if (strcmp(line, "Hidden") == 0 && strcmp(value, "true") == 0) {
+      hidden = true;
+    }
+  }
+
+  free(line);
+  fclose(file);
+
+  if (!entry->id) {
+    free_desktop_entry(entry);
+    return NULL;
+  }
+
+  if (hidden) {
+    free(entry->name);
+    free(entry->icon);
+    free(entry->wm_class);
+    entry->name = entry->icon = entry->wm_class = NULL;
+    entry->hidden = true;
+  }
+  return entry;
+}
+
+static bool has_desktop_suffix(const char *file_name) {
+  size_t len = strlen(file_name);
+  size_t suffix_len = strlen(".desktop");
+  return len > suffix_len &&
+         strcmp(file_name + len - suffix_len, ".desktop") == 0;
+}
+
+static struct desktop_entry **desktop_id_slot(const char *id) {
+  struct desktop_entry **slot =
+      &desktop_index.by_id[hash_string_nocase(id) % DESKTOP_INDEX_BUCKETS];
+  while (*slot && strcasecmp((*slot)->id, id) != 0) {
+    slot = &(*slot)->next_by_id;
+  }
+  return slot;
+}
+
+static void desktop_index_unlink(struct desktop_entry *entry) {
+  struct desktop_entry **slot = desktop_id_slot(entry->id);
+  if (*slot == entry) {
+    *slot = entry->next_by_id;
+  }
+
+  if (entry->wm_class) {
+    slot = &desktop_index.by_class[hash_string_nocase(entry->wm_class) %
+                                   DESKTOP_INDEX_BUCKETS];
+    while (*slot && *slot != entry) {
+      slot = &(*slot)->next_by_class;
+    }
+    if (*slot) {
+      *slot = entry->next_by_class;
+    }
+  }
+
+  // Drop any reference before the entry gets freed, the caller refreshes them.
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (toplevel->desktop == entry) {
+      set_toplevel_desktop(toplevel, NULL);
+    }
+  }
+}
+
+// Inserts the entry unless a directory with higher precedence already
+// provides the same id. Returns false if the entry was discarded.
+static bool desktop_index_insert(struct desktop_entry *entry) {
+  struct desktop_entry **slot = desktop_id_slot(entry->id);
+  struct desktop_entry *existing = *slot;
+
+  if (existing) {
+    if (existing->dir < entry->dir) {
+      free_desktop_entry(entry);
+      return false;
+    }
+    desktop_index_unlink(existing);
+    free_desktop_entry(existing);
+    slot = desktop_id_slot(entry->id);
+  }
+
+  entry->next_by_id = *slot;
+  *slot = entry;
+
+  if (entry->wm_class) {
+    struct desktop_entry **class_slot =
+        &desktop_index.by_class[hash_string_nocase(entry->wm_class) %
+                                DESKTOP_INDEX_BUCKETS];
+    entry->next_by_class = *class_slot;
+    *class_slot = entry;
+  }
+
+  return true;
+}
+
+// Removes the entry provided by dir and falls back to the same file name in a
+// directory with lower precedence, if there is one.
+static void desktop_index_remove(const char *file_name, size_t dir) {
+  char *id = strndup(file_name, strlen(file_name) - strlen(".desktop"));
+  if (!id) {
+    return;
+  }
+
+  struct desktop_entry *existing = *desktop_id_slot(id);
+  free(id);
+
+  if (!existing || existing->dir != dir) {
+    return;
+  }
+
+  desktop_index_unlink(existing);
+  free_desktop_entry(existing);
+
+  for (size_t i = dir + 1; i < desktop_index.dir_count; ++i) {
+    struct desktop_entry *entry =
+        parse_desktop_file(desktop_index.dirs[i].path, file_name, i);
+    if (entry) {
+      desktop_index_insert(entry);
+      return;
+    }
+  }
+}
+
+static const struct desktop_entry *desktop_index_lookup(const char *app_id) {
+  if (app_id == NULL) {
+    return NULL;
+  }
+
+  struct desktop_entry *entry = *desktop_id_slot(app_id);
+  if (entry && !entry->hidden) {
+    return entry;
+  }
+
+  entry = desktop_index.by_class[hash_string_nocase(app_id) %
+                                 DESKTOP_INDEX_BUCKETS];
+  while (entry && strcasecmp(entry->wm_class, app_id) != 0) {
+    entry = entry->next_by_class;
+  }
+  return entry;
+}
+
+static void add_desktop_dir(const char *base, const char *suffix) {
+  struct desktop_dir *dirs =
+      realloc(desktop_index.dirs,
+              (desktop_index.dir_count + 1) * sizeof(struct desktop_dir));
+  if (!dirs) {
+    return;
+  }
+  desktop_index.dirs = dirs;
+
+  size_t len = strlen(base) + strlen(suffix) + strlen("/applications") + 1;
+  char *path = malloc(len);
+  if (!path) {
+    return;
+  }
+  snprintf(path, len, "%s%s/applications", base, suffix);
+
+  dirs[desktop_index.dir_count].path = path;
+  dirs[desktop_index.dir_count].wd = -1;
+  dirs[desktop_index.dir_count].parent_wd = -1;
+  desktop_index.dir_count++;
+}
+
+// Lists the application directories in XDG precedence order, XDG_DATA_HOME
+// first followed by every entry of XDG_DATA_DIRS.
+static void collect_desktop_dirs(void) {
+  const char *data_home = getenv("XDG_DATA_HOME");
+  const char *home = getenv("HOME");
+  if (data_home && *data_home) {
+    add_desktop_dir(data_home, "");
+  } else if (home && *home) {
+    add_desktop_dir(home, "/.local/share");
+  }
+
+  const char *data_dirs = getenv("XDG_DATA_DIRS");
+  if (!data_dirs || !*data_dirs) {
+    data_dirs = "/usr/local/share:/usr/share";
+  }
+
+  char *dirs = strdup(data_dirs);
+  if (!dirs) {
+    return;
+  }
+  char *saveptr = NULL;
+  for (char *dir = strtok_r(dirs, ":", &saveptr); dir;
+       dir = strtok_r(NULL, ":", &saveptr)) {
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+      dir[--len] = '\0';
+    }
+    add_desktop_dir(dir, "");
+  }
+  free(dirs);
+}
+
+// Parses every entry of the directory that isn't shadowed by a directory with
+// higher precedence.
+static void scan_desktop_dir(size_t dir) {
+  DIR *handle = opendir(desktop_index.dirs[dir].path);
+  if (!handle) {
+    return;
+  }
+
+  struct dirent *dirent;
+  while ((dirent = readdir(handle)) != NULL) {
+    if (!has_desktop_suffix(dirent->d_name)) {
+      continue;
+    }
+    // Skip the parse if a directory with higher precedence has the id.
+    char *id =
+        strndup(dirent->d_name, strlen(dirent->d_name) - strlen(".desktop"));
+    const struct desktop_entry *existing = id ? *desktop_id_slot(id) : NULL;
+    free(id);
+    if (existing && existing->dir < dir) {
+      continue;
+    }
+
+    struct desktop_entry *entry =
+        parse_desktop_file(desktop_index.dirs[dir].path, dirent->d_name, dir);
+    if (entry) {
+      desktop_index_insert(entry);
+    }
+  }
+  closedir(handle);
+}
+
+// Drops every entry the directory provided, lower precedence directories fill
+// in where they have the same file.
+static void desktop_index_drop_dir(size_t dir) {
+  for (size_t i = 0; i < DESKTOP_INDEX_BUCKETS; ++i) {
+    struct desktop_entry *entry = desktop_index.by_id[i];
+    while (entry) {
+      if (entry->dir != dir) {
+        entry = entry->next_by_id;
+        continue;
+      }
+      char file_name[NAME_MAX + 1];
+      snprintf(file_name, sizeof(file_name), "%s.desktop", entry->id);
+      desktop_index_remove(file_name, dir);
+      entry = desktop_index.by_id[i]; // The chain changed, start over
+    }
+  }
+}
+
+// Watches the directory, or when it doesn't exist (yet) its nearest existing
+// ancestor so that the directory showing up gets noticed. Returns true if the
+// directory itself is watched.
+static bool watch_desktop_dir(size_t dir) {
+  struct desktop_dir *desktop_dir = &desktop_index.dirs[dir];
+  int fd = desktop_index.inotify_fd;
+
+  if (desktop_dir->wd == -1) {
+    desktop_dir->wd =
+        inotify_add_watch(fd, desktop_dir->path,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                              IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF |
+                              IN_ONLYDIR);
+  }
+
+  // The ancestor stays watched while the directory exists, deleting and
+  // recreating it is noticed the same way. Watches on the same inode share a
+  // descriptor, IN_MASK_ADD keeps another directory's mask.
+  int old_parent_wd = desktop_dir->parent_wd;
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s", desktop_dir->path);
+  desktop_dir->parent_wd = -1;
+  char *slash;
+  while (desktop_dir->parent_wd == -1 && (slash = strrchr(path, '/'))) {
+    if (slash == path) {
+      slash[1] = '\0'; // The root directory
+    } else {
+      *slash = '\0';
+    }
+    desktop_dir->parent_wd =
+        inotify_add_watch(fd, path,
+                          IN_CREATE | IN_MOVED_TO | IN_ONLYDIR | IN_MASK_ADD);
+    if (slash == path) {
+      break;
+    }
+  }
+
+  if (old_parent_wd != -1 && old_parent_wd != desktop_dir->parent_wd) {
+    bool shared = false;
+    for (size_t i = 0; i < desktop_index.dir_count; ++i) {
+      shared |= desktop_index.dirs[i].parent_wd == old_parent_wd ||
+                desktop_index.dirs[i].wd == old_parent_wd;
+    }
+    if (!shared) {
+      inotify_rm_watch(fd, old_parent_wd);
+    }
+  }
+
+  return desktop_dir->wd != -1;
+}
+
+// Builds the index from every application directory. When watch is set the
+// directories are also added to an inotify instance so that later changes only
+// re-parse the files that were touched. Directories that don't exist yet are
+// picked up when they are created.
+static void desktop_index_init(bool watch) {
+  collect_desktop_dirs();
+
+  if (watch) {
+    desktop_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (desktop_index.inotify_fd == -1) {
+      perror("Error creating inotify instance");
+    }
+  }
+
+  for (size_t i = 0; i < desktop_index.dir_count; ++i) {
+    if (desktop_index.inotify_fd != -1) {
+      watch_desktop_dir(i);
+    }
+    scan_desktop_dir(i);
+  }
+}
+
+static void desktop_index_finish(void) {
+  for (size_t i = 0; i < DESKTOP_INDEX_BUCKETS; ++i) {
+    struct desktop_entry *entry = desktop_index.by_id[i];
+    while (entry) {
+      struct desktop_entry *next = entry->next_by_id;
+      free_desktop_entry(entry);
+      entry = next;
+    }
+  }
+
+  for (size_t i = 0; i < desktop_index.dir_count; ++i) {
+    free(desktop_index.dirs[i].path);
+  }
+  free(desktop_index.dirs);
+
+  if (desktop_index.inotify_fd != -1) {
+    close(desktop_index.inotify_fd);
+  }
+  desktop_index = (struct desktop_index){.inotify_fd = -1};
+}
+
+// Points every toplevel at its (possibly changed) desktop entry. Returns true
+// if any of them changed.
+static bool refresh_desktop_entries(void) {
+  bool changed = false;
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    const struct desktop_entry *entry =
+        desktop_index_lookup(toplevel->current.app_id);
+    if (entry != toplevel->desktop) {
+      set_toplevel_desktop(toplevel, entry);
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Handles an event on the ancestor of directories that didn't exist, any of
+// them may have appeared (or one of their parents, moving the watch closer).
+// Returns true if the index changed.
+static bool handle_desktop_parent_event(const struct inotify_event *event) {
+  if (!(event->mask & (IN_CREATE | IN_MOVED_TO)) ||
+      !(event->mask & IN_ISDIR)) {
+    return false;
+  }
+
+  bool index_changed = false;
+  for (size_t dir = 0; dir < desktop_index.dir_count; ++dir) {
+    struct desktop_dir *desktop_dir = &desktop_index.dirs[dir];
+    if (desktop_dir->parent_wd != event->wd || desktop_dir->wd != -1) {
+      continue;
+    }
+    // Files copied in before the watch was added only show up in the scan.
+    if (watch_desktop_dir(dir)) {
+      scan_desktop_dir(dir);
+      index_changed = true;
+    }
+  }
+  return index_changed;
+}
+
+// Applies the pending inotify events, only the files named in the events are
+// parsed again. Returns true if any toplevel got a different desktop entry.
+static bool handle_desktop_index_events(void) {
+  char buffer[INOTIFY_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool index_changed = false;
+  ssize_t len;
+
+  while ((len = read(desktop_index.inotify_fd, buffer, sizeof(buffer))) > 0) {
+    for (char *ptr = buffer; ptr < buffer + len;
+         ptr += sizeof(struct inotify_event) +
+                ((struct inotify_event *)ptr)->len) {
+      const struct inotify_event *event = (const struct inotify_event *)ptr;
+
+      index_changed |= handle_desktop_parent_event(event);
+
+      size_t dir;
+      for (dir = 0; dir < desktop_index.dir_count; ++dir) {
+        if (desktop_index.dirs[dir].wd == event->wd) {
+          break;
+        }
+      }
+      if (dir == desktop_index.dir_count) {
+        continue;
+      }
+
+      // A directory that was moved away keeps its watch, removing it queues
+      // the IN_IGNORED a deleted one gets.
+      if (event->mask & IN_MOVE_SELF) {
+        inotify_rm_watch(desktop_index.inotify_fd, event->wd);
+        continue;
+      }
+      if (event->mask & IN_IGNORED) {
+        desktop_index.dirs[dir].wd = -1;
+        desktop_index_drop_dir(dir);
+        // Recreated before the event was read, otherwise the ancestor watch
+        // notices it later.
+        if (watch_desktop_dir(dir)) {
+          scan_desktop_dir(dir);
+        }
+        index_changed = true;
+        continue;
+      }
+
+      if (event->len == 0 || !has_desktop_suffix(event->name)) {
+        continue;
+      }
+
+      if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        struct desktop_entry *entry =
+            parse_desktop_file(desktop_index.dirs[dir].path, event->name, dir);
+        if (entry) {
+          desktop_index_insert(entry);
+        } else {
+          desktop_index_remove(event->name, dir);
+        }
+      } else {
+        desktop_index_remove(event->name, dir);
+      }
+      index_changed = true;
+    }
+  }
+
+  return index_changed && refresh_desktop_entries();
+}
+
+// ---- Wayland Callback Functions ----
+
+static void toplevel_handle_title(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    const char *title) {
+  struct toplevel_v1 *toplevel = data;
+  size_t len = title_length(title);
+  free(toplevel->pending.title);
+  toplevel->pending.title = NULL;
+
+  // Compositors resend titles that didn't change, those need neither a copy
+  // nor a reindex.
+  const char *current = toplevel->current.title;
+  if (current && strncmp(current, title, len) == 0 && current[len] == '\0') {
+    return;
+  }
+  toplevel->pending.title = strndup(title, len);
+}
+
+static void toplevel_handle_app_id(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    const char *app_id) {
+  struct toplevel_v1 *toplevel = data;
+  free(toplevel->pending.app_id);
+  toplevel->pending.app_id = strdup(app_id);
+}
+
+static void toplevel_handle_output_enter(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    struct wl_output *output) {
+  struct toplevel_v1 *toplevel = data;
+  struct output_v1 *output_v1 = wl_output_get_user_data(output);
+  if (output_v1) {
+    toplevel->outputs |= output_v1->bit;
+  }
+}
+
+static void toplevel_handle_output_leave(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    struct wl_output *output) {
+  struct toplevel_v1 *toplevel = data;
+  struct output_v1 *output_v1 = wl_output_get_user_data(output);
+  if (output_v1) {
+    toplevel->outputs &= ~output_v1->bit;
+  }
+}
+
+static uint32_t array_to_state(struct wl_array *array) {
+  uint32_t state = 0;
+  uint32_t *entry;
+
+  wl_array_for_each(entry, array) {
+    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED)
+      state |= TOPLEVEL_STATE_MAXIMIZED;
+    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED)
+      state |= TOPLEVEL_STATE_MINIMIZED;
+    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED)
+      state |= TOPLEVEL_STATE_ACTIVATED;
+    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN)
+      state |= TOPLEVEL_STATE_FULLSCREEN;
+  }
+
+  return state;
+}
+
+static void toplevel_handle_state(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    struct wl_array *state) {
+  struct toplevel_v1 *toplevel = data;
+  toplevel->pending.state = array_to_state(state);
+}
+
+static void finish_toplevel_state(struct toplevel_state *state) {
+  free(state->title);
+  free(state->app_id);
+}
+
+static void forget_pending_parent(struct toplevel_v1 *child) {
+  struct pending_parent *pending, *tmp;
+  wl_list_for_each_safe(pending, tmp, &pending_parent_list, link) {
+    if (pending->child == child) {
+      wl_list_remove(&pending->link);
+      free(pending);
+    }
+  }
+}
+
+static void toplevel_handle_parent(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
+    struct zwlr_foreign_toplevel_handle_v1 *zwlr_parent) {
+  struct toplevel_v1 *toplevel = data;
+  toplevel->pending.parent = NULL;
+  toplevel->pending.parent_id = no_parent;
+
+  // A newer parent event replaces a link that wasn't resolved yet.
+  forget_pending_parent(toplevel);
+
+  if (zwlr_parent) {
+    // Every handle carries its toplevel_v1 as user data, no list walk needed.
+    struct toplevel_v1 *parent =
+        zwlr_foreign_toplevel_handle_v1_get_user_data(zwlr_parent);
+
+    if (parent) {
+      toplevel->pending.parent = parent;
+      toplevel->pending.parent_id = parent->id;
+      return;
+    }
+
+    struct pending_parent *pending = calloc(1, sizeof(*pending));
+    if (!pending) {
+      fprintf(stderr, "Failed to allocate memory for pending parent\n");
+      return;
+    }
+    pending->child = toplevel;
+    pending->parent_handle = zwlr_parent;
+    wl_list_insert(&pending_parent_list, &pending->link);
+  }
+}
+
+// Links the children whose parent event arrived before this toplevel did.
+// Returns true if any announced child changed.
+static bool resolve_pending_parents(struct toplevel_v1 *parent) {
+  bool changed = false;
+  struct pending_parent *pending, *tmp;
+
+  wl_list_for_each_safe(pending, tmp, &pending_parent_list, link) {
+    if (pending->parent_handle != parent->zwlr_toplevel) {
+      continue;
+    }
+
+    struct toplevel_v1 *child = pending->child;
+    child->pending.parent = parent;
+    child->pending.parent_id = parent->id;
+    // A child that wasn't announced yet is hidden from everyone, its first
+    // done carries the parent along with its creation.
+    if (child->announced) {
+      set_toplevel_parent(child, parent);
+      update_toplevel_info_state(child);
+      notify_changed(child, WLRAPPS_CHANGED_PARENT);
+      changed = true;
+    }
+
+    wl_list_remove(&pending->link);
+    free(pending);
+  }
+
+  return changed;
+}
+
+static void toplevel_handle_done(
+    void *data,
+     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
+  struct toplevel_v1 *toplevel = data;
+  uint32_t changes = 0;
+  if (!toplevel->announced) {
+    changes |= WLRAPPS_CHANGED_CREATED;
+    toplevel->announced = true;
+  }
+  if (toplevel->pending.title) {
+    changes |= WLRAPPS_CHANGED_TITLE;
+  }
+  if (toplevel->pending.app_id) {
+    changes |= WLRAPPS_CHANGED_APP_ID;
+  }
+  if (!(toplevel->pending.state & TOPLEVEL_STATE_INVALID) &&
+      toplevel->pending.state != toplevel->current.state) {
+    changes |= WLRAPPS_CHANGED_STATE;
+  }
+  if (toplevel->pending.parent != toplevel->current.parent) {
+    changes |= WLRAPPS_CHANGED_PARENT;
+  }
+
+  bool state_valid = !(toplevel->pending.state & TOPLEVEL_STATE_INVALID);
+  bool was_active = toplevel->current.state & TOPLEVEL_STATE_ACTIVATED;
+  bool is_active = toplevel->pending.state & TOPLEVEL_STATE_ACTIVATED;
+  bool activated = state_valid && is_active && !was_active;
+  bool deactivated = state_valid && !is_active && was_active;
+
+  copy_state(&toplevel->current, &toplevel->pending, toplevel);
+
+  if (activated) {
+    mru_handle_activated(toplevel);
+    usage_focus(toplevel);
+  } else if (deactivated && usage.toplevel == toplevel) {
+    usage_focus(NULL);
+  }
+  ext_list_toplevel_done(toplevel);
+  if (changes & (WLRAPPS_CHANGED_CREATED | WLRAPPS_CHANGED_TITLE |
+                 WLRAPPS_CHANGED_APP_ID | WLRAPPS_CHANGED_PARENT)) {
+    identity_write(toplevel);
+  }
+
+  notify_changed(toplevel, changes);
+}
+
+// Drops every reference to the toplevel and frees it, used both when the
+// compositor closes it and when the connection is torn down.
+static void destroy_toplevel(struct toplevel_v1 *toplevel) {
+  struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel =
+      toplevel->zwlr_toplevel;
+
+  wl_list_remove(&toplevel->link);
+  toplevel_count--;
+
+  // Orphan the children, both the applied and the not yet applied links.
+  struct toplevel_v1 *other;
+  wl_list_for_each(other, &toplevel_list, link) {
+    if (other->pending.parent == toplevel) {
+      other->pending.parent = NULL;
+      other->pending.parent_id = no_parent;
+    }
+    if (other->current.parent == toplevel) {
+      set_toplevel_parent(other, NULL);
+      update_toplevel_info_state(other);
+      notify_changed(other, WLRAPPS_CHANGED_PARENT);
+    }
+  }
+  set_toplevel_parent(toplevel, NULL);
+
+  forget_pending_parent(toplevel);
+  struct pending_parent *pending, *tmp;
+  wl_list_for_each_safe(pending, tmp, &pending_parent_list, link) {
+    if (pending->parent_handle == zwlr_toplevel) {
+      wl_list_remove(&pending->link);
+      free(pending);
+    }
+  }
+  wl_list_remove(&toplevel->mru_link);
+  mru_dirty = true;
+  if (usage.toplevel == toplevel) {
+    usage_focus(NULL);
+  }
+  app_index_remove(toplevel);
+  search_index_remove(toplevel);
+  thumbnails_toplevel_destroyed(toplevel);
+  ext_list_toplevel_destroyed(toplevel);
+
+  if (zwlr_toplevel) {
+    zwlr_foreign_toplevel_handle_v1_destroy(zwlr_toplevel);
+  }
+
+  finish_toplevel_state(&toplevel->current);
+  finish_toplevel_state(&toplevel->pending);
+
+  free(toplevel);
+}
+
+static void
+toplevel_handle_closed(void *data,
+                       struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
+  struct toplevel_v1 *toplevel = data;
+
+  if (!resyncing && listener && listener->toplevel_closed) {
+    listener->toplevel_closed(&toplevel->info, listener_data);
+  }
+
+  // Only a window the compositor closed is forgotten, the ones torn down
+  // with the connection keep their ids for the next run.
+  if (identity_cache.file && toplevel->identity_slot != IDENTITY_FREE) {
+    identity_cache.file->records[toplevel->identity_slot].id = IDENTITY_FREE;
+  }
+  destroy_toplevel(toplevel);
+}
+
+static const struct zwlr_foreign_toplevel_handle_v1_listener toplevel_impl = {
+    .title = toplevel_handle_title,
+    .app_id = toplevel_handle_app_id,
+    .output_enter = toplevel_handle_output_enter,
+    .output_leave = toplevel_handle_output_leave,
+    .state = toplevel_handle_state,
+    .done = toplevel_handle_done,
+    .closed = toplevel_handle_closed,
+    .parent = toplevel_handle_parent};
+
+// A new record, listed once its first done event is applied. Whichever
+// protocol announced the toplevel attaches its handle.
+static struct toplevel_v1 *create_toplevel(void) {
+  struct toplevel_v1 *toplevel = calloc(1, sizeof(*toplevel));
+  if (!toplevel) {
+    fprintf(stderr, "Failed to allocate memory for toplevel\n");
+    return NULL;
+  }
+
+  toplevel->id = global_id;
+  global_id++;
+  toplevel->identity_slot = IDENTITY_FREE;
+
+  toplevel->current.parent_id = no_parent;
+  toplevel->pending.parent_id = no_parent;
+  toplevel->info.id = toplevel->id;
+  toplevel->info.parent_id = no_parent;
+  wl_list_init(&toplevel->children);
+
+  // Oldest first, which is the order the records are iterated in.
+  wl_list_insert(toplevel_list.prev, &toplevel->link);
+  wl_list_insert(mru_list.prev, &toplevel->mru_link);
+  toplevel_count++;
+  mru_dirty = true;
+  return toplevel;
+}
+
+static void toplevel_manager_handle_toplevel(
+     void *data,
+     struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager,
+    struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
+  struct toplevel_v1 *toplevel = create_toplevel();
+  if (!toplevel) {
+    return;
+  }
+
+  toplevel->zwlr_toplevel = zwlr_toplevel;
+  zwlr_foreign_toplevel_handle_v1_add_listener(zwlr_toplevel, &toplevel_impl,
+                                               toplevel);
+
+  resolve_pending_parents(toplevel);
+}
+
+static void toplevel_manager_handle_finished(
+    void *data, struct zwlr_foreign_toplevel_manager_v1 *manager) {
+  zwlr_foreign_toplevel_manager_v1_destroy(manager);
+  toplevel_manager = NULL;
+}
+
+static const struct zwlr_foreign_toplevel_manager_v1_listener
+    toplevel_manager_impl = {
+        .toplevel = toplevel_manager_handle_toplevel,
+        .finished = toplevel_manager_handle_finished,
+};
+
+static void output_handle_geometry(void *data, struct wl_output *wl_output,
+                                   int32_t x, int32_t y, int32_t physical_width,
+                                   int32_t physical_height, int32_t subpixel,
+                                   const char *make, const char *model,
+                                   int32_t transform) {}
+
+static void output_handle_mode(void *data, struct wl_output *wl_output,
+                               uint32_t flags, int32_t width, int32_t height,
+                               int32_t refresh) {}
+
+static void output_handle_done(void *data, struct wl_output *wl_output) {}
+
+static void output_handle_scale(void *data, struct wl_output *wl_output,
+                                int32_t factor) {}
+
+static void output_handle_name(void *data, struct wl_output *wl_output,
+                               const char *name) {
+  struct output_v1 *output = data;
+  free(output->name);
+  output->name = strdup(name);
+}
+
+static void output_handle_description(void *data, struct wl_output *wl_output,
+                                      const char *description) {}
+
+static const struct wl_output_listener output_impl = {
+    .geometry = output_handle_geometry,
+    .mode = output_handle_mode,
+    .done = output_handle_done,
+    .scale = output_handle_scale,
+    .name = output_handle_name,
+    .description = output_handle_description,
+};
+
+// Every output is bound so that toplevels report which outputs they are on,
+// outputs can then be targeted by name or by their registry name.
+static void add_output(struct wl_registry *registry, uint32_t name,
+                       uint32_t version) {
+  if (output_bits_used == UINT32_MAX) {
+    fprintf(stderr, "More than %d outputs, ignoring output %u\n", MAX_OUTPUTS,
+            name);
+    return;
+  }
+
+  struct output_v1 *output = calloc(1, sizeof(*output));
+  if (!output) {
+    fprintf(stderr, "Failed to allocate memory for output\n");
+    return;
+  }
+
+  output->global_name = name;
+  output->bit = ~output_bits_used & (output_bits_used + 1);
+  output_bits_used |= output->bit;
+  output->wl_output =
+      wl_registry_bind(registry, name, &wl_output_interface,
+                       bind_version(version, WL_OUTPUT_VERSION));
+  wl_output_add_listener(output->wl_output, &output_impl, output);
+  wl_list_insert(output_list.prev, &output->link);
+
+  if (name == pref_output_id) {
+    pref_output = output->wl_output;
+  }
+}
+
+static void remove_output(uint32_t name) {
+  struct output_v1 *output;
+  wl_list_for_each(output, &output_list, link) {
+    if (output->global_name != name) {
+      continue;
+    }
+
+    struct toplevel_v1 *toplevel;
+    wl_list_for_each(toplevel, &toplevel_list, link) {
+      toplevel->outputs &= ~output->bit;
+    }
+
+    if (pref_output == output->wl_output) {
+      pref_output = NULL;
+    }
+
+    output_bits_used &= ~output->bit;
+    wl_list_remove(&output->link);
+    if (wl_output_get_version(output->wl_output) >=
+        WL_OUTPUT_RELEASE_SINCE_VERSION) {
+      wl_output_release(output->wl_output);
+    } else {
+      wl_output_destroy(output->wl_output);
+    }
+    free(output->name);
+    free(output);
+    return;
+  }
+}
+
+static struct output_v1 *find_output(const char *name) {
+  char *endptr;
+  unsigned long global_name = strtoul(name, &endptr, 10);
+  bool numeric = endptr != name && *endptr == '\0';
+
+  struct output_v1 *output;
+  wl_list_for_each(output, &output_list, link) {
+    if ((output->name && strcmp(output->name, name) == 0) ||
+        (numeric && output->global_name == global_name)) {
+      return output;
+    }
+  }
+  return NULL;
+}
+
+static void handle_global( void *data,
+                          struct wl_registry *registry, uint32_t name,
+                          const char *interface, uint32_t version) {
+
+  if (ext_list_handle_global(registry, name, interface, version) ||
+      thumbnails_handle_global(registry, name, interface, version)) {
+    return;
+  }
+
+  if (strcmp(interface, wl_output_interface.name) == 0) {
+    add_output(registry, name, version);
+  } else if (strcmp(interface,
+                    zwlr_foreign_toplevel_manager_v1_interface.name) == 0 &&
+             !toplevel_manager) {
+    toplevel_manager = wl_registry_bind(
+        registry, name, &zwlr_foreign_toplevel_manager_v1_interface,
+        bind_version(version, WLR_FOREIGN_TOPLEVEL_MANAGEMENT_VERSION));
+
+    zwlr_foreign_toplevel_manager_v1_add_listener(toplevel_manager,
+                                                  &toplevel_manager_impl, NULL);
+  } else if (strcmp(interface, wl_seat_interface.name) == 0 && seat == NULL) {
+    seat = wl_registry_bind(registry, name, &wl_seat_interface,
+                            bind_version(version, WL_SEAT_VERSION));
+  }
+}
+
+static void handle_global_remove( void *data,
+                                  struct wl_registry *registry,
+                                  uint32_t name) {
+  remove_output(name);
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = handle_global,
+    .global_remove = handle_global_remove,
+};
+
+static struct toplevel_v1 *toplevel_by_id_or_bail(int32_t id) {
+  if (id == -1) {
+    return NULL;
+  }
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (toplevel->id == (uint32_t)id) {
+      return toplevel;
+    }
+  }
+  return 0;
+}
+
+// ---- App Index ----
+
+static struct app_group **app_group_slot(const char *app_id) {
+  struct app_group **slot =
+      &app_index[hash_string_nocase(app_id) % APP_INDEX_BUCKETS];
+  while (*slot && strcasecmp((*slot)->app_id, app_id) != 0) {
+    slot = &(*slot)->next;
+  }
+  return slot;
+}
+
+static struct app_group *find_app_group(const char *app_id) {
+  return app_id ? *app_group_slot(app_id) : NULL;
+}
+
+static void app_index_remove(struct toplevel_v1 *toplevel) {
+  struct app_group *group = toplevel->app;
+  if (!group) {
+    return;
+  }
+
+  wl_list_remove(&toplevel->app_link);
+  toplevel->app = NULL;
+
+  if (wl_list_empty(&group->toplevels)) {
+    struct app_group **slot = app_group_slot(group->app_id);
+    *slot = group->next;
+    free(group->app_id);
+    free(group);
+  }
+}
+
+// Moves the toplevel to the group of its current app_id, called whenever
+// copy_state() applies a new app_id.
+static void app_index_update(struct toplevel_v1 *toplevel) {
+  const char *app_id = toplevel->current.app_id;
+  if (toplevel->app && strcasecmp(toplevel->app->app_id, app_id) == 0) {
+    return;
+  }
+
+  app_index_remove(toplevel);
+
+  struct app_group **slot = app_group_slot(app_id);
+  if (!*slot) {
+    struct app_group *group = calloc(1, sizeof(*group));
+    if (!group || !(group->app_id = strdup(app_id))) {
+      free(group);
+      fprintf(stderr, "Failed to allocate memory for app group\n");
+      return;
+    }
+    wl_list_init(&group->toplevels);
+    *slot = group;
+  }
+
+  toplevel->app = *slot;
+  wl_list_insert((*slot)->toplevels.prev, &toplevel->app_link);
+}
+
+// ---- Search Index ----
+
+// Every distinct trigram of the lowercased titles and app_ids points back to
+// its toplevels, so a query counts the trigrams it shares with each of them
+// without looking at their text. Matching is byte wise, only ASCII is case
+// folded.
+
+static uint32_t search_bucket_of(uint32_t code) {
+  return (code * 2654435761u) >> (32 - SEARCH_BUCKET_BITS);
+}
+
+static bool search_is_separator(char c) {
+  return c == ' ' || c == '-' || c == '_' || c == '.' || c == '/' ||
+         c == ':' || c == '\n';
+}
+
+// One bit per letter and digit, the remaining bytes share the upper bits. A
+// subsequence match needs every bit of the query.
+static uint64_t search_char_mask(const char *text) {
+  uint64_t mask = 0;
+  for (; *text; ++text) {
+    unsigned char c = (unsigned char)*text;
+    if (c >= 'a' && c <= 'z') {
+      mask |= 1ull << (c - 'a');
+    } else if (c >= '0' && c <= '9') {
+      mask |= 1ull << (26 + c - '0');
+    } else {
+      mask |= 1ull << (36 + c % 28);
+    }
+  }
+  return mask;
+}
+
+static char *search_lowercase(const char *text) {
+  char *lower = strdup(text ? text : "");
+  if (lower) {
+    for (char *c = lower; *c; ++c) {
+      *c = (char)tolower((unsigned char)*c);
+    }
+  }
+  return lower;
+}
+
+static int compare_codes(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Appends the trigram codes of text, three bytes each.
+static size_t search_trigrams(const char *text, uint32_t *codes) {
+  size_t count = 0;
+  for (size_t len = strlen(text); len >= 3; --len, ++text) {
+    codes[count++] = (uint32_t)(unsigned char)text[0] << 16 |
+                     (uint32_t)(unsigned char)text[1] << 8 |
+                     (uint32_t)(unsigned char)text[2];
+  }
+  return count;
+}
+
+static size_t search_unique(uint32_t *codes, size_t count) {
+  size_t unique = 0;
+  qsort(codes, count, sizeof(*codes), compare_codes);
+  for (size_t i = 0; i < count; ++i) {
+    if (unique == 0 || codes[unique - 1] != codes[i]) {
+      codes[unique++] = codes[i];
+    }
+  }
+  return unique;
+}
+
+// A bucket gives back memory once it's a quarter full, otherwise every title
+// with new trigrams would leave the buckets at their peak for good.
+static void search_bucket_trim(struct search_bucket *bucket) {
+  if (bucket->count == 0) {
+    free(bucket->postings);
+    *bucket = (struct search_bucket){0};
+    return;
+  }
+  if (bucket->capacity <= 4 || bucket->count > bucket->capacity / 4) {
+    return;
+  }
+
+  struct search_posting *postings = realloc(
+      bucket->postings, bucket->capacity / 2 * sizeof(*bucket->postings));
+  if (postings) {
+    bucket->postings = postings;
+    bucket->capacity /= 2;
+  }
+}
+
+static void search_index_remove(struct toplevel_v1 *toplevel) {
+  struct search_entry *entry = &toplevel->search;
+
+  // Swap removal, the moved posting tells its owner where it went.
+  for (size_t i = 0; i < entry->trigram_count; ++i) {
+    struct search_bucket *bucket =
+        &search_index[search_bucket_of(entry->trigrams[i])];
+    struct search_posting *posting = &bucket->postings[entry->slots[i]];
+    *posting = bucket->postings[--bucket->count];
+    posting->toplevel->search.slots[posting->trigram] = entry->slots[i];
+    search_bucket_trim(bucket);
+  }
+
+  free(entry->title);
+  free(entry->app_id);
+  free(entry->trigrams);
+  free(entry->slots);
+  *entry = (struct search_entry){0};
+}
+
+// Reindexes the toplevel, called whenever copy_state() applies a new title or
+// app_id.
+static void search_index_update(struct toplevel_v1 *toplevel) {
+  struct search_entry *entry = &toplevel->search;
+  search_index_remove(toplevel);
+
+  entry->title = search_lowercase(toplevel->current.title);
+  entry->app_id = search_lowercase(toplevel->current.app_id);
+  size_t max_codes = (entry->title ? strlen(entry->title) : 0) +
+                     (entry->app_id ? strlen(entry->app_id) : 0);
+  entry->trigrams = malloc((max_codes + 1) * sizeof(*entry->trigrams));
+  entry->slots = malloc((max_codes + 1) * sizeof(*entry->slots));
+  if (!entry->title || !entry->app_id || !entry->trigrams || !entry->slots) {
+    fprintf(stderr, "Failed to allocate memory for the search index\n");
+    search_index_remove(toplevel);
+    return;
+  }
+
+  entry->mask =
+      search_char_mask(entry->title) | search_char_mask(entry->app_id);
+  size_t count = search_trigrams(entry->title, entry->trigrams);
+  count += search_trigrams(entry->app_id, entry->trigrams + count);
+  count = search_unique(entry->trigrams, count);
+
+  for (size_t i = 0; i < count; ++i) {
+    struct search_bucket *bucket =
+        &search_index[search_bucket_of(entry->trigrams[i])];
+    if (bucket->count == bucket->capacity) {
+      size_t capacity = bucket->capacity ? bucket->capacity * 2 : 4;
+      struct search_posting *postings =
+          realloc(bucket->postings, capacity * sizeof(*postings));
+      if (!postings) {
+        fprintf(stderr, "Failed to allocate memory for the search index\n");
+        return;
+      }
+      bucket->postings = postings;
+      bucket->capacity = capacity;
+    }
+    entry->slots[i] = (uint32_t)bucket->count;
+    bucket->postings[bucket->count++] =
+        (struct search_posting){entry->trigrams[i], (uint32_t)i, toplevel};
+    entry->trigram_count = i + 1;
+  }
+}
+
+static void search_index_finish(void) {
+  for (size_t i = 0; i < SEARCH_BUCKETS; ++i) {
+    free(search_index[i].postings);
+    search_index[i] = (struct search_bucket){0};
+  }
+}
+
+// Scores query as a subsequence of text, -1 if it isn't one. Each matched
+// character scores, more at the start of a word or right after the previous
+// match, and characters skipped in between cost a little. Every position
+// the first character occurs at is tried.
+static int fuzzy_score(const char *text, const char *query) {
+  int best = -1;
+
+  for (const char *start = strchr(text, query[0]); start;
+       start = strchr(start + 1, query[0])) {
+    const char *q = query, *prev = NULL;
+    int score = start == text ? SEARCH_SCORE_PREFIX : 0;
+
+    for (const char *t = start; *q && *t; ++t) {
+      if (*t != *q) {
+        continue;
+      }
+      score += SEARCH_SCORE_MATCH;
+      if (t == text || search_is_separator(t[-1])) {
+        score += SEARCH_SCORE_WORD_START;
+      }
+      if (prev && t == prev + 1) {
+        score += SEARCH_SCORE_CONSECUTIVE;
+      } else if (prev) {
+        score -= t - prev - 1 < SEARCH_MAX_GAP_PENALTY
+                     ? (int)(t - prev - 1)
+                     : SEARCH_MAX_GAP_PENALTY;
+      }
+      prev = t;
+      q++;
+    }
+
+    // If the rest doesn't match from here it won't from any later start.
+    if (*q) {
+      break;
+    }
+    best = score > best ? score : best;
+  }
+  return best;
+}
+
+struct search_match {
+  struct toplevel_v1 *toplevel;
+  int32_t score;
+};
+
+// Best score first, the most recently used toplevel wins ties.
+static int compare_matches(const void *a, const void *b) {
+  const struct search_match *x = a, *y = b;
+  if (x->score != y->score) {
+    return x->score > y->score ? -1 : 1;
+  }
+  return x->toplevel->info.mru < y->toplevel->info.mru ? -1
+         : x->toplevel->info.mru > y->toplevel->info.mru;
+}
+
+// A toplevel matches if the query is a subsequence of its title or app_id,
+// or for typos if it shares at least half of the query's trigrams.
+size_t wlrapps_search(const char *text, struct wlrapps_search_result *results,
+                      size_t max) {
+  char *query = search_lowercase(text);
+  size_t query_len = query ? strlen(query) : 0;
+  uint32_t *codes = malloc((query_len + 1) * sizeof(*codes));
+  struct search_match *matches =
+      malloc((toplevel_count + 1) * sizeof(*matches));
+  size_t count = 0;
+
+  if (!query || !codes || !matches) {
+    fprintf(stderr, "Failed to allocate memory for the search\n");
+    goto out;
+  }
+
+  update_mru_ranks();
+
+  size_t code_count = search_unique(codes, search_trigrams(query, codes));
+  search_stamp++;
+  for (size_t i = 0; i < code_count; ++i) {
+    struct search_bucket *bucket = &search_index[search_bucket_of(codes[i])];
+    for (size_t j = 0; j < bucket->count; ++j) {
+      struct search_posting *posting = &bucket->postings[j];
+      if (posting->code != codes[i]) {
+        continue;
+      }
+      struct search_entry *entry = &posting->toplevel->search;
+      if (entry->stamp != search_stamp) {
+        entry->stamp = search_stamp;
+        entry->hits = 0;
+      }
+      entry->hits++;
+    }
+  }
+
+  uint64_t query_mask = search_char_mask(query);
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    struct search_entry *entry = &toplevel->search;
+    if (!entry->title) {
+      continue;
+    }
+
+    int score = 0;
+    uint32_t hits = entry->stamp == search_stamp ? entry->hits : 0;
+    if (query_len > 0) {
+      score = -1;
+      if ((entry->mask & query_mask) == query_mask) {
+        int title_score = fuzzy_score(entry->title, query);
+        int app_id_score = fuzzy_score(entry->app_id, query);
+        score = title_score > app_id_score ? title_score : app_id_score;
+      }
+      if (score < 0 && (code_count == 0 || hits * 2 < code_count)) {
+        continue;
+      }
+      score = (score > 0 ? score : 0) + (int)hits * SEARCH_SCORE_TRIGRAM;
+    }
+    matches[count++] = (struct search_match){toplevel, score};
+  }
+
+  qsort(matches, count, sizeof(*matches), compare_matches);
+  for (size_t i = 0; i < count && i < max; ++i) {
+    results[i].id = matches[i].toplevel->id;
+    results[i].score = matches[i].score;
+  }
+
+out:
+  free(query);
+  free(codes);
+  free(matches);
+  return count;
+}
+
+// ---- Identity Cache ----
+
+// Toplevel ids only mean something within one run. The cache file mirrors
+// the live windows, so after a restart the new handles can take over the ids
+// of the windows they most likely are: the same ext-foreign-toplevel-list
+// identifier if the compositor gave one, otherwise the same app_id and title,
+// preferring the same parent. Windows with the same app_id and title keep
+// their order: the oldest live one gets the lowest of their old ids.
+
+static uint64_t identity_hash(uint64_t hash, const char *str) {
+  for (const unsigned char *p = (const unsigned char *)(str ? str : ""); *p;
+       ++p) {
+    hash ^= *p;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static uint64_t identity_key(const struct toplevel_v1 *toplevel) {
+  uint64_t hash =
+      identity_hash(14695981039346656037ull, toplevel->current.app_id);
+  // Keeps ("ab", "c") apart from ("a", "bc").
+  hash = (hash ^ 0xff) * 1099511628211ull;
+  return identity_hash(hash, toplevel->current.title);
+}
+
+// 0 if the compositor didn't identify the toplevel.
+static uint64_t identity_identifier(struct toplevel_v1 *toplevel) {
+  const char *identifier = ext_toplevel_identifier(toplevel);
+  return identifier ? identity_hash(14695981039346656037ull, identifier) | 1
+                    : 0;
+}
+
+// Drops the holes, keeping the arrival order of the live windows.
+static void identity_compact(void) {
+  struct identity_file *file = identity_cache.file;
+  struct identity_record *records = malloc(sizeof(file->records));
+  if (!records) {
+    return;
+  }
+  memcpy(records, file->records, sizeof(file->records));
+
+  uint32_t count = 0;
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (toplevel->identity_slot != IDENTITY_FREE) {
+      file->records[count] = records[toplevel->identity_slot];
+      toplevel->identity_slot = count++;
+    }
+  }
+  file->count = count;
+  free(records);
+}
+
+// Mirrors the toplevel into its record. The file always describes the live
+// windows, even a daemon that got killed leaves a usable cache behind.
+static void identity_write(struct toplevel_v1 *toplevel) {
+  struct identity_file *file = identity_cache.file;
+  if (!file || identity_cache.restoring) {
+    return;
+  }
+
+  bool append = toplevel->identity_slot == IDENTITY_FREE;
+  if (append && file->count == IDENTITY_CACHE_RECORDS) {
+    identity_compact();
+  }
+  if (append && file->count == IDENTITY_CACHE_RECORDS) {
+    return;
+  }
+
+  uint32_t slot = append ? file->count : toplevel->identity_slot;
+  file->records[slot] = (struct identity_record){
+      .id = toplevel->id,
+      .parent_id = toplevel->current.parent_id,
+      .key = identity_key(toplevel),
+      .identifier = identity_identifier(toplevel),
+  };
+  if (append) {
+    toplevel->identity_slot = slot;
+    file->count++;
+  }
+  if (file->next_id < global_id) {
+    file->next_id = global_id;
+  }
+}
+
+// Takes the records in the file as the candidates for the toplevels about to
+// be loaded, either from the last run or from the connection that broke.
+static void identity_restore_begin(void) {
+  struct identity_file *file = identity_cache.file;
+  if (!file) {
+    return;
+  }
+
+  free(identity_cache.previous);
+  identity_cache.previous_count = 0;
+  identity_cache.previous =
+      malloc((file->count + 1) * sizeof(*identity_cache.previous));
+  if (!identity_cache.previous) {
+    fprintf(stderr, "Failed to allocate memory for the id cache\n");
+    return;
+  }
+
+  for (uint32_t i = 0; i < file->count; ++i) {
+    if (file->records[i].id < file->next_id) {
+      identity_cache.previous[identity_cache.previous_count++] =
+          file->records[i];
+    }
+  }
+
+  // Fresh ids can't collide with the ones about to be restored.
+  if (global_id < file->next_id) {
+    global_id = file->next_id;
+  }
+  identity_cache.restoring = true;
+}
+
+// The unclaimed record with the lowest id, the oldest window, that could be
+// the toplevel. A NULL parent_id matches any parent.
+static struct identity_record *identity_match(uint64_t key,
+                                              uint64_t identifier,
+                                              const uint32_t *parent_id) {
+  struct identity_record *best = NULL;
+  for (size_t i = 0; i < identity_cache.previous_count; ++i) {
+    struct identity_record *record = &identity_cache.previous[i];
+    if (record->id == IDENTITY_FREE || record->key != key) {
+      continue;
+    }
+    // Two different identifiers are two different windows.
+    if (identifier && record->identifier) {
+      continue;
+    }
+    if (parent_id && record->parent_id != *parent_id) {
+      continue;
+    }
+    if (!best || record->id < best->id) {
+      best = record;
+    }
+  }
+  return best;
+}
+
+static bool identity_restored(const struct toplevel_v1 *toplevel) {
+  // Fresh ids start at next_id, identity_restore_begin() saw to it.
+  return toplevel->id < identity_cache.file->next_id;
+}
+
+static void identity_claim(struct toplevel_v1 *toplevel,
+                           struct identity_record *record) {
+  if (record) {
+    toplevel->id = record->id;
+    record->id = IDENTITY_FREE;
+  }
+}
+
+static void identity_restore_by_identifier(struct toplevel_v1 *toplevel) {
+  uint64_t identifier = identity_identifier(toplevel);
+  if (!identifier) {
+    return;
+  }
+  for (size_t i = 0; i < identity_cache.previous_count; ++i) {
+    struct identity_record *record = &identity_cache.previous[i];
+    if (record->id != IDENTITY_FREE && record->identifier == identifier) {
+      identity_claim(toplevel, record);
+      return;
+    }
+  }
+}
+
+// Toplevels come in creation order, each takes the oldest record that fits,
+// so the k-th window with a key gets the k-th record with it.
+static void identity_restore(struct toplevel_v1 *toplevel, bool same_parent) {
+  if (identity_restored(toplevel)) {
+    return;
+  }
+  uint32_t parent_id =
+      toplevel->current.parent ? toplevel->current.parent->id : no_parent;
+  identity_claim(toplevel, identity_match(identity_key(toplevel),
+                                          identity_identifier(toplevel),
+                                          same_parent ? &parent_id : NULL));
+}
+
+// Runs once the toplevels of a new connection are loaded, before anyone saw
+// their ids.
+static void identity_restore_finish(void) {
+  if (!identity_cache.restoring) {
+    return;
+  }
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    identity_restore_by_identifier(toplevel);
+  }
+  // Same key and parent first, parents before their children so those can
+  // be told apart by the parent's restored id. What is left matches on the
+  // key alone.
+  for (int pass = 0; pass < 4; ++pass) {
+    bool children = pass & 1, same_parent = pass < 2;
+    wl_list_for_each(toplevel, &toplevel_list, link) {
+      if ((toplevel->current.parent != NULL) == children) {
+        identity_restore(toplevel, same_parent);
+      }
+    }
+  }
+
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    toplevel->info.id = toplevel->id;
+    toplevel->current.parent_id =
+        toplevel->current.parent ? toplevel->current.parent->id : no_parent;
+    toplevel->pending.parent_id =
+        toplevel->pending.parent ? toplevel->pending.parent->id : no_parent;
+    update_toplevel_info_state(toplevel);
+  }
+
+  free(identity_cache.previous);
+  identity_cache.previous = NULL;
+  identity_cache.previous_count = 0;
+  identity_cache.restoring = false;
+
+  identity_cache.file->count = 0;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    identity_write(toplevel);
+  }
+}
+
+static void identity_cache_finish(void) {
+  if (identity_cache.file) {
+    munmap(identity_cache.file, sizeof(*identity_cache.file));
+  }
+  if (identity_cache.fd != -1) {
+    close(identity_cache.fd);
+  }
+  free(identity_cache.previous);
+  identity_cache = (struct identity_cache){.fd = -1};
+}
+
+// ---- Focus History ----
+
+static uint64_t monotonic_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void mru_move_to_front(struct toplevel_v1 *toplevel) {
+  if (mru_list.next == &toplevel->mru_link) {
+    return;
+  }
+  wl_list_remove(&toplevel->mru_link);
+  wl_list_insert(&mru_list, &toplevel->mru_link);
+  mru_dirty = true;
+}
+
+static void mru_handle_activated(struct toplevel_v1 *toplevel) {
+  // While cycling the order stays frozen, it's settled when the cycle ends.
+  if (!cycle_session.active) {
+    mru_move_to_front(toplevel);
+  }
+}
+
+// Writes the position in the MRU list of every toplevel to its record, only
+// done when the records are read and only when the order changed.
+static void update_mru_ranks(void) {
+  if (!mru_dirty) {
+    return;
+  }
+
+  uint32_t rank = 0;
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &mru_list, mru_link) {
+    toplevel->info.mru = rank++;
+  }
+
+  mru_dirty = false;
+}
+
+static struct toplevel_v1 *active_toplevel(void) {
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &mru_list, mru_link) {
+    if (toplevel->current.state & TOPLEVEL_STATE_ACTIVATED) {
+      return toplevel;
+    }
+  }
+  return NULL;
+}
+
+static void end_cycle_session(void) {
+  if (!cycle_session.active) {
+    return;
+  }
+
+  struct toplevel_v1 *toplevel = active_toplevel();
+  if (toplevel) {
+    mru_move_to_front(toplevel);
+  }
+
+  free(cycle_session.ids);
+  free(cycle_session.app_id);
+  cycle_session = (struct cycle_session){0};
+}
+
+// Ends the cycle session once it timed out. Returns true if the MRU order
+// changed because of it.
+static bool expire_cycle_session(void) {
+  if (!cycle_session.active ||
+      monotonic_ms() - cycle_session.last_ms < CYCLE_TIMEOUT_MS) {
+    return false;
+  }
+  end_cycle_session();
+  return mru_dirty;
+}
+
+// Milliseconds until the current cycle session expires, -1 if there is none.
+static int cycle_poll_timeout(void) {
+  if (!cycle_session.active) {
+    return -1;
+  }
+  uint64_t elapsed = monotonic_ms() - cycle_session.last_ms;
+  return elapsed >= CYCLE_TIMEOUT_MS ? 0 : (int)(CYCLE_TIMEOUT_MS - elapsed);
+}
+
+static bool start_cycle_session(const char *app_id) {
+  size_t length = (size_t)wl_list_length(&mru_list);
+  if (length == 0) {
+    return false;
+  }
+
+  uint32_t *ids = malloc(length * sizeof(uint32_t));
+  if (!ids) {
+    return false;
+  }
+
+  size_t count = 0;
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &mru_list, mru_link) {
+    if (app_id && (!toplevel->current.app_id ||
+                   strcmp(toplevel->current.app_id, app_id) != 0)) {
+      continue;
+    }
+    ids[count++] = toplevel->id;
+  }
+
+  if (count == 0) {
+    free(ids);
+    return false;
+  }
+
+  cycle_session.active = true;
+  cycle_session.app_id = app_id ? strdup(app_id) : NULL;
+  cycle_session.ids = ids;
+  cycle_session.count = count;
+  cycle_session.pos = 0;
+  return true;
+}
+
+// Steps through the snapshotted MRU order, starting a new session if there is
+// none or the previous one cycled through a different app.
+static void cycle_focus(const char *app_id, bool backwards) {
+  expire_cycle_session();
+
+  if (cycle_session.active &&
+      ((app_id == NULL) != (cycle_session.app_id == NULL) ||
+       (app_id && strcmp(app_id, cycle_session.app_id) != 0))) {
+    end_cycle_session();
+  }
+
+  if (!cycle_session.active && !start_cycle_session(app_id)) {
+    return;
+  }
+  cycle_session.last_ms = monotonic_ms();
+
+  // Skip over toplevels that were closed since the session started.
+  for (size_t tries = 0; tries < cycle_session.count; ++tries) {
+    if (backwards) {
+      cycle_session.pos = (cycle_session.pos + cycle_session.count - 1) %
+                          cycle_session.count;
+    } else {
+      cycle_session.pos = (cycle_session.pos + 1) % cycle_session.count;
+    }
+
+    struct toplevel_v1 *toplevel =
+        toplevel_by_id_or_bail(cycle_session.ids[cycle_session.pos]);
+    if (toplevel) {
+      run_action(toplevel, action_focus);
+      return;
+    }
+  }
+}
+
+void wlrapps_focus_prev(void) {
+  end_cycle_session();
+
+  struct wl_list *prev = mru_list.next->next;
+  if (mru_list.next == &mru_list || prev == &mru_list) {
+    return;
+  }
+
+  struct toplevel_v1 *toplevel = wl_container_of(prev, toplevel, mru_link);
+  run_action(toplevel, action_focus);
+}
+
+void wlrapps_focus_next_in_app(void) {
+  struct toplevel_v1 *active = active_toplevel();
+  if (active && active->current.app_id) {
+    cycle_focus(active->current.app_id, false);
+  }
+}
+
+void wlrapps_cycle(bool backwards) { cycle_focus(NULL, backwards); }
+
+// ---- Focus Time ----
+
+// Looks the app up, interning it on first sight. NULL once the table is full,
+// that app's focus time then goes uncounted.
+static struct usage_app *usage_lookup(const char *app_id) {
+  if (!app_id) {
+    app_id = "";
+  }
+
+  size_t mask = USAGE_APPS - 1;
+  for (size_t i = hash_string_nocase(app_id) & mask;; i = (i + 1) & mask) {
+    struct usage_app *app = &usage.apps[i];
+    if (!app->app_id) {
+      if (usage.count >= USAGE_APPS / 4 * 3) {
+        return NULL;
+      }
+      app->app_id = strdup(app_id);
+      if (!app->app_id) {
+        return NULL;
+      }
+      usage.count++;
+      return app;
+    }
+    if (strcasecmp(app->app_id, app_id) == 0) {
+      return app;
+    }
+  }
+}
+
+// Closes the running interval and starts one for toplevel, NULL if nothing
+// has the focus anymore. Called on every focus change, so it stays in memory.
+static void usage_focus(const struct toplevel_v1 *toplevel) {
+  uint64_t now = monotonic_ms();
+  if (usage.focused) {
+    usage.focused->focused_ms += now - usage.since_ms;
+    usage.unlogged = true;
+  }
+
+  usage.toplevel = toplevel;
+  usage.focused = toplevel ? usage_lookup(toplevel->current.app_id) : NULL;
+  if (usage.focused) {
+    usage.focused->activations++;
+    usage.unlogged = true;
+  }
+  usage.since_ms = now;
+}
+
+// Appends what every app gained since the last flush to the log.
+static void usage_flush(void) {
+  uint64_t now = monotonic_ms();
+  usage.logged_at_ms = now;
+  if (usage.focused) {
+    usage.focused->focused_ms += now - usage.since_ms;
+    usage.since_ms = now;
+  }
+  if (usage.log_fd == -1 || !usage.unlogged) {
+    return;
+  }
+
+  char buffer[4096];
+  size_t length = 0;
+  long long time_now = (long long)time(NULL);
+  bool failed = false;
+  for (size_t i = 0; i < USAGE_APPS && !failed; ++i) {
+    struct usage_app *app = &usage.apps[i];
+    if (!app->app_id || (app->focused_ms == app->logged_ms &&
+                         app->activations == app->logged_activations)) {
+      continue;
+    }
+
+    if (sizeof(buffer) - length < 512) {
+      failed = write(usage.log_fd, buffer, length) != (ssize_t)length;
+      length = 0;
+    }
+    int written = snprintf(
+        buffer + length, sizeof(buffer) - length, "%lld %llu %u %.256s\n",
+        time_now, (unsigned long long)(app->focused_ms - app->logged_ms),
+        app->activations - app->logged_activations, app->app_id);
+    length += (size_t)written;
+    app->logged_ms = app->focused_ms;
+    app->logged_activations = app->activations;
+  }
+  if (!failed && length > 0) {
+    failed = write(usage.log_fd, buffer, length) != (ssize_t)length;
+  }
+  if (failed) {
+    perror("Failed to write the usage log");
+  }
+  usage.unlogged = false;
+}
+
+// Milliseconds until the next flush, -1 without a log.
+static int usage_poll_timeout(void) {
+  if (usage.log_fd == -1) {
+    return -1;
+  }
+  uint64_t elapsed = monotonic_ms() - usage.logged_at_ms;
+  return elapsed >= USAGE_FLUSH_MS ? 0 : (int)(USAGE_FLUSH_MS - elapsed);
+}
+
+static void usage_finish(void) {
+  usage_flush();
+  if (usage.log_fd != -1) {
+    close(usage.log_fd);
+  }
+  for (size_t i = 0; i < USAGE_APPS; ++i) {
+    free(usage.apps[i].app_id);
+  }
+  memset(&usage, 0, sizeof(usage));
+  usage.log_fd = -1;
+}
+
+
+// ---- Actions ----
+
+typedef void (*toplevel_action)(struct toplevel_v1 *toplevel);
+
+static void action_focus(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_activate(toplevel->zwlr_toplevel, seat);
+}
+
+static void action_maximize(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_set_maximized(toplevel->zwlr_toplevel);
+}
+
+static void action_unmaximize(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_unset_maximized(toplevel->zwlr_toplevel);
+}
+
+static void action_minimize(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_set_minimized(toplevel->zwlr_toplevel);
+}
+
+static void action_restore(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_unset_minimized(toplevel->zwlr_toplevel);
+}
+
+// Fullscreen came with version 2 of wlr-foreign-toplevel-management.
+static bool can_fullscreen(struct toplevel_v1 *toplevel) {
+  if (zwlr_foreign_toplevel_handle_v1_get_version(toplevel->zwlr_toplevel) <
+      ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_FULLSCREEN_SINCE_VERSION) {
+    fprintf(stderr, "The compositor doesn't support fullscreen requests\n");
+    return false;
+  }
+  return true;
+}
+
+static void action_fullscreen(struct toplevel_v1 *toplevel) {
+  if (!can_fullscreen(toplevel)) {
+    return;
+  }
+  if (pref_output_id != UINT32_MAX && pref_output == NULL) {
+    fprintf(stderr, "Could not find output %i\n", pref_output_id);
+  }
+  zwlr_foreign_toplevel_handle_v1_set_fullscreen(toplevel->zwlr_toplevel,
+                                                 pref_output);
+}
+
+static void action_unfullscreen(struct toplevel_v1 *toplevel) {
+  if (!can_fullscreen(toplevel)) {
+    return;
+  }
+  zwlr_foreign_toplevel_handle_v1_unset_fullscreen(toplevel->zwlr_toplevel);
+}
+
+static void action_close(struct toplevel_v1 *toplevel) {
+  zwlr_foreign_toplevel_handle_v1_close(toplevel->zwlr_toplevel);
+}
+
+static const toplevel_action actions[] = {
+    [WLRAPPS_ACTION_FOCUS] = action_focus,
+    [WLRAPPS_ACTION_MAXIMIZE] = action_maximize,
+    [WLRAPPS_ACTION_UNMAXIMIZE] = action_unmaximize,
+    [WLRAPPS_ACTION_MINIMIZE] = action_minimize,
+    [WLRAPPS_ACTION_RESTORE] = action_restore,
+    [WLRAPPS_ACTION_FULLSCREEN] = action_fullscreen,
+    [WLRAPPS_ACTION_UNFULLSCREEN] = action_unfullscreen,
+    [WLRAPPS_ACTION_CLOSE] = action_close,
+};
+
+// Toplevels only ext-foreign-toplevel-list knows have no handle to send
+// requests to. Returns false for those.
+static bool run_action(struct toplevel_v1 *toplevel, toplevel_action action) {
+  if (!toplevel->zwlr_toplevel) {
+    return false;
+  }
+  action(toplevel);
+  return true;
+}
+
+static toplevel_action action_for_id(enum wlrapps_action action) {
+  if ((size_t)action >= sizeof(actions) / sizeof(actions[0])) {
+    return NULL;
+  }
+  return actions[action];
+}
+
+// The toplevels an action was sent to, see wlrapps_target_action_ids().
+struct target_ids {
+  uint32_t *ids;
+  size_t max;
+  int count;
+};
+
+static void apply_to_toplevel(struct toplevel_v1 *toplevel,
+                              toplevel_action action,
+                              struct target_ids *result) {
+  if (!run_action(toplevel, action)) {
+    return;
+  }
+  if ((size_t)result->count < result->max) {
+    result->ids[result->count] = toplevel->info.id;
+  }
+  result->count++;
+}
+
+// See wlrapps_target_action(). The requests are only queued, the caller
+// flushes them to the compositor in one go.
+static int apply_to_target(const char *target, toplevel_action action,
+                           struct target_ids *result) {
+  struct toplevel_v1 *toplevel, *tmp;
+
+  if (strncmp(target, "app:", 4) == 0) {
+    struct app_group *group = find_app_group(target + 4);
+    if (group) {
+      wl_list_for_each_safe(toplevel, tmp, &group->toplevels, app_link) {
+        apply_to_toplevel(toplevel, action, result);
+      }
+    }
+  } else if (strncmp(target, "output:", 7) == 0) {
+    struct output_v1 *output = find_output(target + 7);
+    if (output) {
+      wl_list_for_each_safe(toplevel, tmp, &toplevel_list, link) {
+        if (toplevel->outputs & output->bit) {
+          apply_to_toplevel(toplevel, action, result);
+        }
+      }
+    }
+  } else if (strcmp(target, "all") == 0) {
+    wl_list_for_each_safe(toplevel, tmp, &toplevel_list, link) {
+      apply_to_toplevel(toplevel, action, result);
+    }
+  } else {
+    char *endptr;
+    long id = strtol(target, &endptr, 10);
+    if (endptr == target || *endptr != '\0' || id < 0) {
+      return -1;
+    }
+    if ((toplevel = toplevel_by_id_or_bail((int32_t)id))) {
+      apply_to_toplevel(toplevel, action, result);
+    }
+  }
+
+  return result->count;
+}
+
+// Dock click behaviour, focuses the most recently used window of the app or
+// cycles through its windows if one of them is already active.
+bool wlrapps_focus_app(const char *app_id) {
+  struct app_group *group = find_app_group(app_id);
+  if (!group) {
+    return false;
+  }
+
+  struct toplevel_v1 *active = active_toplevel();
+  if (active && active->app == group) {
+    cycle_focus(group->app_id, false);
+    return true;
+  }
+
+  end_cycle_session();
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &mru_list, mru_link) {
+    if (toplevel->app == group) {
+      run_action(toplevel, action_focus);
+      break;
+    }
+  }
+  return true;
+}
+
+void wlrapps_show_desktop(void) {
+  size_t length = (size_t)wl_list_length(&toplevel_list);
+  uint32_t *ids = length ? malloc(length * sizeof(uint32_t)) : NULL;
+  size_t count = 0;
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (ids && !(toplevel->current.state & TOPLEVEL_STATE_MINIMIZED)) {
+      ids[count++] = toplevel->id;
+    }
+  }
+
+  // Nothing visible means the desktop is already shown, keep the layout that
+  // was saved before so restore-layout can still bring it back.
+  if (count == 0) {
+    free(ids);
+    return;
+  }
+
+  struct toplevel_v1 *active = active_toplevel();
+  free(saved_layout.ids);
+  saved_layout.ids = ids;
+  saved_layout.count = count;
+  saved_layout.active_id = active ? active->id : UINT32_MAX;
+
+  for (size_t i = 0; i < count; ++i) {
+    if ((toplevel = toplevel_by_id_or_bail(ids[i]))) {
+      run_action(toplevel, action_minimize);
+    }
+  }
+}
+
+void wlrapps_restore_layout(void) {
+  struct toplevel_v1 *toplevel;
+  for (size_t i = 0; i < saved_layout.count; ++i) {
+    if ((toplevel = toplevel_by_id_or_bail(saved_layout.ids[i]))) {
+      run_action(toplevel, action_restore);
+    }
+  }
+
+  // Restoring can shift the focus, hand it back to the previous toplevel.
+  if ((toplevel = toplevel_by_id_or_bail(saved_layout.active_id))) {
+    run_action(toplevel, action_focus);
+  }
+
+  free(saved_layout.ids);
+  saved_layout = (struct saved_layout){.active_id = UINT32_MAX};
+}
+
+// ---- Thumbnails ----
+
+#ifdef WLRAPPS_THUMBNAILS
+
+// Captures need the toplevel's ext-foreign-toplevel-list handle, only paired
+// toplevels can be captured.
+
+// One fixed size slot of the shared memory pool, so evicting a thumbnail
+// always makes room for any other.
+struct thumbnail_slot {
+  struct wl_list lru_link; // thumbnail_cache.lru
+  struct toplevel_v1 *toplevel; // NULL while free
+  struct wlrapps_thumbnail info;
+};
+
+struct thumbnail_cache {
+  int fd;
+  uint8_t *data;
+  size_t size;
+  uint32_t max_size;
+  size_t slot_size;
+  size_t slot_count;
+  struct thumbnail_slot *slots;
+  // Most recently used first, free slots are kept at the end.
+  struct wl_list lru;
+};
+
+// The capture state of a paired toplevel.
+struct toplevel_capture {
+  struct toplevel_v1 *toplevel;
+  struct thumbnail_slot *slot;
+  struct ext_image_copy_capture_session_v1 *session;
+  struct ext_image_copy_capture_frame_v1 *frame;
+
+  // The full size buffer the compositor copies into, only kept while a
+  // session is running.
+  struct wl_buffer *buffer;
+  uint8_t *pixels;
+  size_t size;
+  uint32_t width, height, format;
+
+  // Buffer constraints, applied on the session's done event.
+  uint32_t pending_width, pending_height, pending_format;
+
+  // Damage reported for the frame in flight, in buffer coordinates.
+  uint32_t damage_x0, damage_y0, damage_x1, damage_y1;
+
+  bool fresh_buffer; // Nothing was copied into the buffer yet
+  bool wanted;       // Capture once the buffer constraints are known
+  bool follow_damage;
+};
+
+struct image {
+  uint8_t *data;
+  uint32_t width, height, stride;
+};
+
+static struct wl_shm *shm = NULL;
+static struct ext_foreign_toplevel_image_capture_source_manager_v1
+    *capture_source_manager = NULL;
+static struct ext_image_copy_capture_manager_v1 *copy_capture_manager = NULL;
+static struct thumbnail_cache thumbnail_cache = {.fd = -1};
+static uint32_t thumbnail_serial = 0;
+
+// An anonymous shared memory file, for the pool and the capture buffers.
+static int create_shm_file(size_t size) {
+  static uint32_t counter = 0;
+  char name[64];
+
+  for (int attempt = 0; attempt < 16; ++attempt) {
+    snprintf(name, sizeof(name), "/wlr-apps-%ld-%u-%llu", (long)getpid(),
+             (unsigned)counter++, (unsigned long long)monotonic_ms());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1) {
+      if (errno == EEXIST) {
+        continue;
+      }
+      break;
+    }
+
+    shm_unlink(name);
+    if (ftruncate(fd, (off_t)size) == -1) {
+      close(fd);
+      break;
+    }
+    return fd;
+  }
+
+  perror("Failed to create shared memory");
+  return -1;
+}
+
+// ---- Thumbnail Cache ----
+
+static void thumbnail_cache_finish(void) {
+  if (thumbnail_cache.data) {
+    munmap(thumbnail_cache.data, thumbnail_cache.size);
+  }
+  if (thumbnail_cache.fd != -1) {
+    close(thumbnail_cache.fd);
+  }
+  free(thumbnail_cache.slots);
+  thumbnail_cache = (struct thumbnail_cache){.fd = -1};
+}
+
+static bool thumbnail_cache_init(uint32_t max_size, size_t budget) {
+  size_t slot_size = (size_t)max_size * max_size * 4;
+  size_t slot_count = budget / slot_size;
+  if (max_size == 0 || slot_count == 0) {
+    fprintf(stderr, "The thumbnail budget doesn't fit a single thumbnail\n");
+    return false;
+  }
+
+  thumbnail_cache_finish();
+  struct thumbnail_cache *cache = &thumbnail_cache;
+  cache->max_size = max_size;
+  cache->slot_size = slot_size;
+  cache->slot_count = slot_count;
+  cache->size = slot_size * slot_count;
+  cache->fd = create_shm_file(cache->size);
+  if (cache->fd == -1) {
+    thumbnail_cache_finish();
+    return false;
+  }
+
+  cache->data = mmap(NULL, cache->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     cache->fd, 0);
+  cache->slots = calloc(slot_count, sizeof(*cache->slots));
+  if (cache->data == MAP_FAILED || !cache->slots) {
+    perror("Failed to map the thumbnail cache");
+    if (cache->data == MAP_FAILED) {
+      cache->data = NULL;
+    }
+    thumbnail_cache_finish();
+    return false;
+  }
+
+  wl_list_init(&cache->lru);
+  for (size_t i = 0; i < slot_count; ++i) {
+    struct thumbnail_slot *slot = &cache->slots[i];
+    slot->info.offset = i * slot_size;
+    slot->info.pixels = cache->data + slot->info.offset;
+    wl_list_insert(cache->lru.prev, &slot->lru_link);
+  }
+  return true;
+}
+
+static void thumbnail_slot_touch(struct thumbnail_slot *slot) {
+  wl_list_remove(&slot->lru_link);
+  wl_list_insert(&thumbnail_cache.lru, &slot->lru_link);
+}
+
+static void thumbnail_slot_release(struct toplevel_capture *capture) {
+  struct thumbnail_slot *slot = capture->slot;
+  if (!slot) {
+    return;
+  }
+
+  capture->slot = NULL;
+  slot->toplevel = NULL;
+  wl_list_remove(&slot->lru_link);
+  wl_list_insert(thumbnail_cache.lru.prev, &slot->lru_link);
+}
+
+// Takes a free slot, or evicts the least recently used thumbnail.
+static struct thumbnail_slot *
+thumbnail_slot_acquire(struct toplevel_v1 *toplevel) {
+  struct toplevel_capture *capture = toplevel->capture;
+  if (capture->slot) {
+    thumbnail_slot_touch(capture->slot);
+    return capture->slot;
+  }
+
+  struct thumbnail_slot *slot =
+      wl_container_of(thumbnail_cache.lru.prev, slot, lru_link);
+  if (slot->toplevel) {
+    slot->toplevel->capture->slot = NULL;
+  }
+
+  slot->toplevel = toplevel;
+  slot->info.toplevel_id = toplevel->id;
+  capture->slot = slot;
+  thumbnail_slot_touch(slot);
+  return slot;
+}
+
+// ---- Box Filter ----
+
+// Adds a row of bytes to the per channel column sums.
+static void box_add_row_scalar(uint32_t *sums, const uint8_t *row,
+                               size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    sums[i] += row[i];
+  }
+}
+
+#ifdef __SSE2__
+// 16 channels per iteration, widened to 32 bits in two unpack steps.
+static void box_add_row_sse2(uint32_t *sums, const uint8_t *row, size_t len) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128((const __m128i *)(row + i));
+    __m128i low = _mm_unpacklo_epi8(bytes, zero);
+    __m128i high = _mm_unpackhi_epi8(bytes, zero);
+    __m128i *out = (__m128i *)(sums + i);
+
+    _mm_storeu_si128(out, _mm_add_epi32(_mm_loadu_si128(out),
+                                        _mm_unpacklo_epi16(low, zero)));
+    _mm_storeu_si128(out + 1, _mm_add_epi32(_mm_loadu_si128(out + 1),
+                                            _mm_unpackhi_epi16(low, zero)));
+    _mm_storeu_si128(out + 2, _mm_add_epi32(_mm_loadu_si128(out + 2),
+                                            _mm_unpacklo_epi16(high, zero)));
+    _mm_storeu_si128(out + 3, _mm_add_epi32(_mm_loadu_si128(out + 3),
+                                            _mm_unpackhi_epi16(high, zero)));
+  }
+  box_add_row_scalar(sums + i, row + i, len - i);
+}
+#define box_add_row box_add_row_sse2
+#else
+#define box_add_row box_add_row_scalar
+#endif
+
+// Every destination pixel is the average of the source pixels under it, the
+// boxes are src / dst wide with the remainder spread over them. Only the
+// destination rectangle [x0, x1) x [y0, y1) is written. The rows of a box
+// are summed column wise first, which is the part that touches every source
+// byte and is vectorized, then the columns of each box.
+static bool box_filter(const struct image *src, struct image *dst, uint32_t x0,
+                       uint32_t y0, uint32_t x1, uint32_t y1) {
+  uint32_t src_x0 = (uint32_t)((uint64_t)x0 * src->width / dst->width);
+  uint32_t src_x1 = (uint32_t)((uint64_t)x1 * src->width / dst->width);
+  size_t len = (size_t)(src_x1 - src_x0) * 4;
+  uint32_t *sums = malloc(len * sizeof(*sums));
+  if (!sums) {
+    return false;
+  }
+
+  for (uint32_t y = y0; y < y1; ++y) {
+    uint32_t sy0 = (uint32_t)((uint64_t)y * src->height / dst->height);
+    uint32_t sy1 = (uint32_t)((uint64_t)(y + 1) * src->height / dst->height);
+
+    memset(sums, 0, len * sizeof(*sums));
+    for (uint32_t sy = sy0; sy < sy1; ++sy) {
+      box_add_row(sums, src->data + (size_t)sy * src->stride + src_x0 * 4,
+                  len);
+    }
+
+    uint8_t *out = dst->data + (size_t)y * dst->stride + (size_t)x0 * 4;
+    for (uint32_t x = x0; x < x1; ++x) {
+      uint32_t sx0 = (uint32_t)((uint64_t)x * src->width / dst->width);
+      uint32_t sx1 = (uint32_t)((uint64_t)(x + 1) * src->width / dst->width);
+      uint32_t count = (sx1 - sx0) * (sy1 - sy0);
+      uint32_t channels[4] = {0};
+
+      for (uint32_t sx = sx0; sx < sx1; ++sx) {
+        const uint32_t *pixel = sums + (size_t)(sx - src_x0) * 4;
+        channels[0] += pixel[0];
+        channels[1] += pixel[1];
+        channels[2] += pixel[2];
+        channels[3] += pixel[3];
+      }
+      for (int c = 0; c < 4; ++c) {
+        *out++ = (uint8_t)((channels[c] + count / 2) / count);
+      }
+    }
+  }
+
+  free(sums);
+  return true;
+}
+
+// Scales the captured frame into the toplevel's slot. Without a full redraw
+// only the thumbnail pixels whose boxes overlap the damage are recomputed.
+static void downscale_capture(struct toplevel_v1 *toplevel, bool full) {
+  struct toplevel_capture *capture = toplevel->capture;
+  struct thumbnail_slot *slot = thumbnail_slot_acquire(toplevel);
+  struct wlrapps_thumbnail *info = &slot->info;
+  uint32_t max_size = thumbnail_cache.max_size;
+  uint32_t width = capture->width, height = capture->height;
+
+  // Fit into max_size x max_size keeping the aspect ratio, never upscale.
+  if (width > max_size || height > max_size) {
+    if (width >= height) {
+      height = (uint32_t)((uint64_t)height * max_size / width);
+      width = max_size;
+    } else {
+      width = (uint32_t)((uint64_t)width * max_size / height);
+      height = max_size;
+    }
+  }
+  width = width ? width : 1;
+  height = height ? height : 1;
+
+  if (info->width != width || info->height != height ||
+      info->format != capture->format) {
+    full = true;
+  }
+  info->width = width;
+  info->height = height;
+  info->stride = width * 4;
+  info->format = capture->format;
+
+  struct image src = {capture->pixels, capture->width, capture->height,
+                      capture->width * 4};
+  struct image dst = {thumbnail_cache.data + info->offset, width, height,
+                      info->stride};
+  uint32_t x0 = 0, y0 = 0, x1 = width, y1 = height;
+  if (!full) {
+    if (capture->damage_x0 >= capture->damage_x1 ||
+        capture->damage_y0 >= capture->damage_y1) {
+      x1 = y1 = 0;
+    } else {
+      x0 = (uint32_t)((uint64_t)capture->damage_x0 * width / capture->width);
+      y0 = (uint32_t)((uint64_t)capture->damage_y0 * height / capture->height);
+      x1 = (uint32_t)((uint64_t)capture->damage_x1 * width / capture->width) + 1;
+      y1 = (uint32_t)((uint64_t)capture->damage_y1 * height / capture->height) + 1;
+      x1 = x1 < width ? x1 : width;
+      y1 = y1 < height ? y1 : height;
+    }
+  }
+
+  if (x0 < x1 && y0 < y1 && !box_filter(&src, &dst, x0, y0, x1, y1)) {
+    fprintf(stderr, "Failed to allocate memory for the thumbnail\n");
+    return;
+  }
+
+  info->serial = ++thumbnail_serial;
+  info->live = capture->follow_damage;
+  if (!resyncing && listener && listener->thumbnail_updated) {
+    listener->thumbnail_updated(&toplevel->info, info, listener_data);
+  }
+}
+
+// ---- Window Capture ----
+
+static void capture_destroy_buffer(struct toplevel_capture *capture) {
+  if (capture->buffer) {
+    wl_buffer_destroy(capture->buffer);
+    capture->buffer = NULL;
+  }
+  if (capture->pixels) {
+    munmap(capture->pixels, capture->size);
+    capture->pixels = NULL;
+  }
+  capture->size = 0;
+}
+
+// Ends the session, the thumbnail stays in the cache.
+static void capture_stop(struct toplevel_capture *capture) {
+  if (capture->frame) {
+    ext_image_copy_capture_frame_v1_destroy(capture->frame);
+    capture->frame = NULL;
+  }
+  if (capture->session) {
+    ext_image_copy_capture_session_v1_destroy(capture->session);
+    capture->session = NULL;
+  }
+  capture_destroy_buffer(capture);
+  capture->wanted = false;
+  capture->follow_damage = false;
+  if (capture->slot) {
+    capture->slot->info.live = false;
+  }
+}
+
+static bool capture_create_buffer(struct toplevel_capture *capture,
+                                  uint32_t format) {
+  size_t stride = (size_t)capture->pending_width * 4;
+  size_t size = stride * capture->pending_height;
+  int fd = create_shm_file(size);
+  if (fd == -1) {
+    return false;
+  }
+
+  uint8_t *pixels =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (pixels == MAP_FAILED) {
+    perror("Failed to map the capture buffer");
+    close(fd);
+    return false;
+  }
+
+  struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, (int32_t)size);
+  capture->buffer = wl_shm_pool_create_buffer(
+      pool, 0, (int32_t)capture->pending_width,
+      (int32_t)capture->pending_height, (int32_t)stride, format);
+  wl_shm_pool_destroy(pool);
+  close(fd);
+
+  capture->pixels = pixels;
+  capture->size = size;
+  capture->width = capture->pending_width;
+  capture->height = capture->pending_height;
+  capture->format = format;
+  capture->fresh_buffer = true;
+  return true;
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener;
+
+// Asks for the next frame. After the first one the compositor only answers
+// once the window was damaged, so a following capture costs nothing while
+// the window is idle.
+static void capture_frame(struct toplevel_capture *capture) {
+  capture->frame =
+      ext_image_copy_capture_session_v1_create_frame(capture->session);
+  ext_image_copy_capture_frame_v1_add_listener(capture->frame,
+                                               &frame_listener, capture);
+  ext_image_copy_capture_frame_v1_attach_buffer(capture->frame,
+                                                capture->buffer);
+  // The buffer keeps its contents between frames, only a new one has to be
+  // filled completely.
+  if (capture->fresh_buffer) {
+    ext_image_copy_capture_frame_v1_damage_buffer(
+        capture->frame, 0, 0, (int32_t)capture->width,
+        (int32_t)capture->height);
+  }
+  ext_image_copy_capture_frame_v1_capture(capture->frame);
+
+  capture->damage_x0 = capture->damage_y0 = UINT32_MAX;
+  capture->damage_x1 = capture->damage_y1 = 0;
+  capture->wanted = false;
+}
+
+static void frame_handle_transform(
+    void *data, struct ext_image_copy_capture_frame_v1 *frame,
+    uint32_t transform) {}
+
+static void frame_handle_damage(void *data,
+                                struct ext_image_copy_capture_frame_v1 *frame,
+                                int32_t x, int32_t y, int32_t width,
+                                int32_t height) {
+  struct toplevel_capture *capture = data;
+  if (width <= 0 || height <= 0) {
+    return;
+  }
+
+  int64_t x1 = (int64_t)x + width, y1 = (int64_t)y + height;
+  uint32_t x0 = x > 0 ? (uint32_t)x : 0;
+  uint32_t y0 = y > 0 ? (uint32_t)y : 0;
+  x1 = x1 < capture->width ? x1 : capture->width;
+  y1 = y1 < capture->height ? y1 : capture->height;
+  if (x1 <= x0 || y1 <= y0) {
+    return;
+  }
+
+  capture->damage_x0 = x0 < capture->damage_x0 ? x0 : capture->damage_x0;
+  capture->damage_y0 = y0 < capture->damage_y0 ? y0 : capture->damage_y0;
+  if ((uint32_t)x1 > capture->damage_x1) {
+    capture->damage_x1 = (uint32_t)x1;
+  }
+  if ((uint32_t)y1 > capture->damage_y1) {
+    capture->damage_y1 = (uint32_t)y1;
+  }
+}
+
+static void frame_handle_presentation_time(
+    void *data, struct ext_image_copy_capture_frame_v1 *frame,
+    uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {}
+
+static void frame_handle_ready(void *data,
+                               struct ext_image_copy_capture_frame_v1 *frame) {
+  struct toplevel_capture *capture = data;
+  struct toplevel_v1 *toplevel = capture->toplevel;
+  bool full = capture->fresh_buffer || !capture->slot;
+
+  ext_image_copy_capture_frame_v1_destroy(frame);
+  capture->frame = NULL;
+  capture->fresh_buffer = false;
+
+  downscale_capture(toplevel, full);
+
+  if (capture->follow_damage) {
+    capture_frame(capture);
+  } else {
+    capture_stop(capture);
+  }
+}
+
+static void frame_handle_failed(void *data,
+                                struct ext_image_copy_capture_frame_v1 *frame,
+                                uint32_t reason) {
+  struct toplevel_capture *capture = data;
+
+  ext_image_copy_capture_frame_v1_destroy(frame);
+  capture->frame = NULL;
+
+  // New constraints and a done event follow, capture again after those.
+  if (reason ==
+      EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS) {
+    capture->wanted = true;
+    return;
+  }
+  capture_stop(capture);
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener frame_listener = {
+    .transform = frame_handle_transform,
+    .damage = frame_handle_damage,
+    .presentation_time = frame_handle_presentation_time,
+    .ready = frame_handle_ready,
+    .failed = frame_handle_failed,
+};
+
+static void session_handle_buffer_size(
+    void *data, struct ext_image_copy_capture_session_v1 *session,
+    uint32_t width, uint32_t height) {
+  struct toplevel_capture *capture = data;
+  capture->pending_width = width;
+  capture->pending_height = height;
+}
+
+// The box filter works on any 32 bit format, these two are the ones every
+// wl_shm supports.
+static void session_handle_shm_format(
+    void *data, struct ext_image_copy_capture_session_v1 *session,
+    uint32_t format) {
+  struct toplevel_capture *capture = data;
+  if (format == WL_SHM_FORMAT_ARGB8888 ||
+      (format == WL_SHM_FORMAT_XRGB8888 &&
+       capture->pending_format == UINT32_MAX)) {
+    capture->pending_format = format;
+  }
+}
+
+static void session_handle_dmabuf_device(
+    void *data, struct ext_image_copy_capture_session_v1 *session,
+    struct wl_array *device) {}
+
+static void session_handle_dmabuf_format(
+    void *data, struct ext_image_copy_capture_session_v1 *session,
+    uint32_t format, struct wl_array *modifiers) {}
+
+static void
+session_handle_done(void *data,
+                    struct ext_image_copy_capture_session_v1 *session) {
+  struct toplevel_capture *capture = data;
+  uint32_t format = capture->pending_format;
+  capture->pending_format = UINT32_MAX;
+
+  if (format == UINT32_MAX || capture->pending_width == 0 ||
+      capture->pending_height == 0) {
+    fprintf(stderr, "Toplevel can't be captured into a shm buffer\n");
+    capture_stop(capture);
+    return;
+  }
+
+  if (!capture->buffer || capture->width != capture->pending_width ||
+      capture->height != capture->pending_height ||
+      capture->format != format) {
+    if (capture->frame) {
+      ext_image_copy_capture_frame_v1_destroy(capture->frame);
+      capture->frame = NULL;
+      capture->wanted = true;
+    }
+    capture_destroy_buffer(capture);
+    if (!capture_create_buffer(capture, format)) {
+      capture_stop(capture);
+      return;
+    }
+  }
+
+  if (capture->wanted && !capture->frame) {
+    capture_frame(capture);
+  }
+}
+
+static void
+session_handle_stopped(void *data,
+                       struct ext_image_copy_capture_session_v1 *session) {
+  capture_stop(data);
+}
+
+static const struct ext_image_copy_capture_session_v1_listener
+    session_listener = {
+        .buffer_size = session_handle_buffer_size,
+        .shm_format = session_handle_shm_format,
+        .dmabuf_device = session_handle_dmabuf_device,
+        .dmabuf_format = session_handle_dmabuf_format,
+        .done = session_handle_done,
+        .stopped = session_handle_stopped,
+};
+
+// Starts a capture, or keeps the running one. Returns false if the toplevel
+// can't be captured.
+static bool capture_toplevel(struct toplevel_v1 *toplevel, bool follow_damage) {
+  if (!toplevel->ext || !copy_capture_manager || !capture_source_manager ||
+      !shm || !thumbnail_cache.data) {
+    return false;
+  }
+
+  struct toplevel_capture *capture = toplevel->capture;
+  if (!capture) {
+    capture = calloc(1, sizeof(*capture));
+    if (!capture) {
+      fprintf(stderr, "Failed to allocate memory for the capture\n");
+      return false;
+    }
+    capture->toplevel = toplevel;
+    toplevel->capture = capture;
+  }
+
+  if (follow_damage) {
+    capture->follow_damage = true;
+    if (capture->slot) {
+      capture->slot->info.live = true;
+    }
+  }
+
+  if (capture->session) {
+    // A following session already has a frame waiting for damage.
+    if (!capture->frame) {
+      if (capture->buffer) {
+        capture_frame(capture);
+      } else {
+        capture->wanted = true;
+      }
+    }
+    return true;
+  }
+
+  struct ext_image_capture_source_v1 *source =
+      ext_foreign_toplevel_image_capture_source_manager_v1_create_source(
+          capture_source_manager, toplevel->ext->handle);
+  capture->session = ext_image_copy_capture_manager_v1_create_session(
+      copy_capture_manager, source, 0);
+  ext_image_capture_source_v1_destroy(source);
+
+  capture->pending_format = UINT32_MAX;
+  capture->wanted = true;
+  ext_image_copy_capture_session_v1_add_listener(capture->session,
+                                                 &session_listener, capture);
+  return true;
+}
+
+static void thumbnails_toplevel_unpaired(struct toplevel_v1 *toplevel) {
+  if (toplevel->capture) {
+    capture_stop(toplevel->capture);
+  }
+}
+
+static void thumbnails_toplevel_destroyed(struct toplevel_v1 *toplevel) {
+  struct toplevel_capture *capture = toplevel->capture;
+  if (!capture) {
+    return;
+  }
+
+  capture_stop(capture);
+  thumbnail_slot_release(capture);
+  free(capture);
+  toplevel->capture = NULL;
+}
+
+// The capture globals are only bound once thumbnails were enabled.
+static bool thumbnails_handle_global(struct wl_registry *registry,
+                                     uint32_t name, const char *interface,
+                                     uint32_t version) {
+  if (!thumbnail_cache.data) {
+    return false;
+  }
+
+  if (strcmp(interface, wl_shm_interface.name) == 0 && !shm) {
+    shm = wl_registry_bind(registry, name, &wl_shm_interface,
+                           bind_version(version, WL_SHM_VERSION));
+  } else if (strcmp(interface,
+                    ext_foreign_toplevel_image_capture_source_manager_v1_interface
+                        .name) == 0 &&
+             !capture_source_manager) {
+    capture_source_manager = wl_registry_bind(
+        registry, name,
+        &ext_foreign_toplevel_image_capture_source_manager_v1_interface,
+        bind_version(version, EXT_IMAGE_CAPTURE_SOURCE_VERSION));
+  } else if (strcmp(interface,
+                    ext_image_copy_capture_manager_v1_interface.name) == 0 &&
+             !copy_capture_manager) {
+    copy_capture_manager = wl_registry_bind(
+        registry, name, &ext_image_copy_capture_manager_v1_interface,
+        bind_version(version, EXT_IMAGE_COPY_CAPTURE_VERSION));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void thumbnails_finish(void) { thumbnail_cache_finish(); }
+
+// The toplevels, and with them their captures, are already gone.
+static void thumbnails_disconnect(void) {
+  if (capture_source_manager) {
+    ext_foreign_toplevel_image_capture_source_manager_v1_destroy(
+        capture_source_manager);
+    capture_source_manager = NULL;
+  }
+  if (copy_capture_manager) {
+    ext_image_copy_capture_manager_v1_destroy(copy_capture_manager);
+    copy_capture_manager = NULL;
+  }
+  if (shm) {
+    wl_shm_destroy(shm);
+    shm = NULL;
+  }
+}
+
+#else
+
+static bool thumbnails_handle_global(struct wl_registry *registry,
+                                     uint32_t name, const char *interface,
+                                     uint32_t version) {
+  return false;
+}
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+static void thumbnails_toplevel_unpaired(struct toplevel_v1 *toplevel) {}
+#endif
+static void thumbnails_toplevel_destroyed(struct toplevel_v1 *toplevel) {}
+static void thumbnails_disconnect(void) {}
+static void thumbnails_finish(void) {}
+
+#endif
+
+// ---- Ext Toplevel List ----
+
+// ext-foreign-toplevel-list is bound next to wlr-foreign-toplevel-management
+// for the compositor's stable identifiers and the thumbnails, the wlr
+// protocol still provides the state and the actions. On compositors that
+// only offer the ext list its toplevels become the records, with a title and
+// an app_id but no state, and actions on them fail.
+
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+
+static struct ext_foreign_toplevel_list_v1 *ext_toplevel_list = NULL;
+static struct wl_list ext_toplevels = {&ext_toplevels, &ext_toplevels};
+
+static bool same_string(const char *a, const char *b, bool ignore_case) {
+  a = a ? a : "";
+  b = b ? b : "";
+  return ignore_case ? strcasecmp(a, b) == 0 : strcmp(a, b) == 0;
+}
+
+static bool ext_toplevel_matches(const struct ext_toplevel *ext,
+                                 const struct toplevel_v1 *toplevel) {
+  return same_string(ext->app_id, toplevel->current.app_id, true) &&
+         same_string(ext->title, toplevel->current.title, false);
+}
+
+static void pair_toplevel(struct ext_toplevel *ext,
+                          struct toplevel_v1 *toplevel) {
+  toplevel->ext = ext;
+  ext->toplevel = toplevel;
+  identity_write(toplevel);
+}
+
+static void unpair_toplevel(struct ext_toplevel *ext) {
+  if (ext->toplevel) {
+    thumbnails_toplevel_unpaired(ext->toplevel);
+    ext->toplevel->ext = NULL;
+    ext->toplevel = NULL;
+  }
+}
+
+// Whether the ext toplevel is free to pair with another toplevel: it has no
+// partner, or one that shows a different app_id or title by now.
+static bool ext_toplevel_available(const struct ext_toplevel *ext) {
+  return ext->done &&
+         (!ext->toplevel || !ext_toplevel_matches(ext, ext->toplevel));
+}
+
+static bool toplevel_available(const struct toplevel_v1 *toplevel) {
+  return toplevel->announced &&
+         (!toplevel->ext || !ext_toplevel_matches(toplevel->ext, toplevel));
+}
+
+static void ext_toplevel_pair(struct ext_toplevel *ext);
+
+// Pairs two matching handles and gives their previous partners, which
+// matched neither, to each other. A pair that matches is never split, so
+// every repair adds one and the recursion ends.
+static void repair_toplevel(struct ext_toplevel *ext,
+                            struct toplevel_v1 *toplevel) {
+  struct ext_toplevel *old_ext = toplevel->ext;
+  struct toplevel_v1 *old_toplevel = ext->toplevel;
+  unpair_toplevel(ext);
+  if (old_ext) {
+    unpair_toplevel(old_ext);
+  }
+  pair_toplevel(ext, toplevel);
+
+  if (old_ext && old_toplevel) {
+    pair_toplevel(old_ext, old_toplevel);
+  }
+  if (old_toplevel) {
+    ext_list_toplevel_done(old_toplevel);
+  } else if (old_ext) {
+    ext_toplevel_pair(old_ext);
+  }
+}
+
+// Called on every wlr done. Pairs the toplevel if it has no partner yet, or
+// swaps partners with another pair if both only matched crosswise.
+static void ext_list_toplevel_done(struct toplevel_v1 *toplevel) {
+  if (ext_backend_only || !toplevel_available(toplevel)) {
+    return;
+  }
+
+  struct ext_toplevel *ext;
+  wl_list_for_each(ext, &ext_toplevels, link) {
+    if (ext != toplevel->ext && ext_toplevel_available(ext) &&
+        ext_toplevel_matches(ext, toplevel)) {
+      repair_toplevel(ext, toplevel);
+      return;
+    }
+  }
+}
+
+// The ext side of ext_list_toplevel_done(), called on every ext done.
+static void ext_toplevel_pair(struct ext_toplevel *ext) {
+  if (!ext_toplevel_available(ext)) {
+    return;
+  }
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (toplevel != ext->toplevel && toplevel_available(toplevel) &&
+        ext_toplevel_matches(ext, toplevel)) {
+      repair_toplevel(ext, toplevel);
+      return;
+    }
+  }
+}
+
+static void ext_list_toplevel_destroyed(struct toplevel_v1 *toplevel) {
+  if (toplevel->ext) {
+    toplevel->ext->toplevel = NULL;
+    toplevel->ext = NULL;
+  }
+}
+
+// Applies the ext toplevel to its own record, as if its wlr handle sent the
+// title and app_id followed by done.
+static void ext_toplevel_apply(struct ext_toplevel *ext) {
+  struct toplevel_v1 *toplevel = ext->toplevel;
+  if (!toplevel) {
+    if (!(toplevel = create_toplevel())) {
+      return;
+    }
+    pair_toplevel(ext, toplevel);
+  }
+
+  if (ext->title && !same_string(ext->title, toplevel->current.title, false)) {
+    free(toplevel->pending.title);
+    toplevel->pending.title = strdup(ext->title);
+  }
+  if (ext->app_id &&
+      !same_string(ext->app_id, toplevel->current.app_id, true)) {
+    free(toplevel->pending.app_id);
+    toplevel->pending.app_id = strdup(ext->app_id);
+  }
+  toplevel_handle_done(toplevel, NULL);
+}
+
+static void ext_toplevel_handle_closed(
+    void *data, struct ext_foreign_toplevel_handle_v1 *handle) {
+  struct ext_toplevel *ext = data;
+
+  if (ext->toplevel && !ext->toplevel->zwlr_toplevel) {
+    toplevel_handle_closed(ext->toplevel, NULL);
+  }
+  unpair_toplevel(ext);
+  ext_foreign_toplevel_handle_v1_destroy(handle);
+  wl_list_remove(&ext->link);
+  free(ext->title);
+  free(ext->app_id);
+  free(ext->identifier);
+  free(ext);
+}
+
+static void
+ext_toplevel_handle_done(void *data,
+                         struct ext_foreign_toplevel_handle_v1 *handle) {
+  struct ext_toplevel *ext = data;
+  ext->done = true;
+  if (ext_backend_only) {
+    ext_toplevel_apply(ext);
+    return;
+  }
+  ext_toplevel_pair(ext);
+}
+
+static void
+ext_toplevel_handle_title(void *data,
+                          struct ext_foreign_toplevel_handle_v1 *handle,
+                          const char *title) {
+  struct ext_toplevel *ext = data;
+  free(ext->title);
+  ext->title = strndup(title, title_length(title)); // Compared to wlr titles
+}
+
+static void
+ext_toplevel_handle_app_id(void *data,
+                           struct ext_foreign_toplevel_handle_v1 *handle,
+                           const char *app_id) {
+  struct ext_toplevel *ext = data;
+  free(ext->app_id);
+  ext->app_id = strdup(app_id);
+}
+
+static void ext_toplevel_handle_identifier(
+    void *data, struct ext_foreign_toplevel_handle_v1 *handle,
+    const char *identifier) {
+  struct ext_toplevel *ext = data;
+  free(ext->identifier);
+  ext->identifier = strdup(identifier);
+}
+
+static const struct ext_foreign_toplevel_handle_v1_listener
+    ext_toplevel_listener = {
+        .closed = ext_toplevel_handle_closed,
+        .done = ext_toplevel_handle_done,
+        .title = ext_toplevel_handle_title,
+        .app_id = ext_toplevel_handle_app_id,
+        .identifier = ext_toplevel_handle_identifier,
+};
+
+static void
+ext_toplevel_list_handle_toplevel(void *data,
+                                  struct ext_foreign_toplevel_list_v1 *list,
+                                  struct ext_foreign_toplevel_handle_v1 *handle) {
+  struct ext_toplevel *ext = calloc(1, sizeof(*ext));
+  if (!ext) {
+    fprintf(stderr, "Failed to allocate memory for toplevel\n");
+    ext_foreign_toplevel_handle_v1_destroy(handle);
+    return;
+  }
+
+  ext->handle = handle;
+  wl_list_insert(ext_toplevels.prev, &ext->link);
+  ext_foreign_toplevel_handle_v1_add_listener(handle, &ext_toplevel_listener,
+                                              ext);
+}
+
+static void
+ext_toplevel_list_handle_finished(void *data,
+                                  struct ext_foreign_toplevel_list_v1 *list) {
+  ext_foreign_toplevel_list_v1_destroy(list);
+  ext_toplevel_list = NULL;
+}
+
+static const struct ext_foreign_toplevel_list_v1_listener
+    ext_toplevel_list_listener = {
+        .toplevel = ext_toplevel_list_handle_toplevel,
+        .finished = ext_toplevel_list_handle_finished,
+};
+
+static bool ext_list_handle_global(struct wl_registry *registry, uint32_t name,
+                                   const char *interface, uint32_t version) {
+  if (strcmp(interface, ext_foreign_toplevel_list_v1_interface.name) != 0 ||
+      ext_toplevel_list) {
+    return false;
+  }
+
+  ext_toplevel_list =
+      wl_registry_bind(registry, name, &ext_foreign_toplevel_list_v1_interface,
+                       bind_version(version, EXT_FOREIGN_TOPLEVEL_LIST_VERSION));
+  ext_foreign_toplevel_list_v1_add_listener(ext_toplevel_list,
+                                            &ext_toplevel_list_listener, NULL);
+  return true;
+}
+
+static bool ext_list_available(void) { return ext_toplevel_list != NULL; }
+
+// The compositor's own stable identifier, once the toplevel is paired.
+static const char *ext_toplevel_identifier(struct toplevel_v1 *toplevel) {
+  return toplevel->ext ? toplevel->ext->identifier : NULL;
+}
+
+static void ext_list_count_memory(struct wlrapps_memory *memory) {
+  struct ext_toplevel *ext;
+  wl_list_for_each(ext, &ext_toplevels, link) {
+    memory->records += sizeof(*ext) + string_size(ext->identifier);
+    memory->titles += string_size(ext->title);
+    memory->app_ids += string_size(ext->app_id);
+  }
+}
+
+// The toplevels are already gone.
+static void ext_list_disconnect(void) {
+  struct ext_toplevel *ext, *ext_tmp;
+  wl_list_for_each_safe(ext, ext_tmp, &ext_toplevels, link) {
+    ext_toplevel_handle_closed(ext, ext->handle);
+  }
+
+  if (ext_toplevel_list) {
+    ext_foreign_toplevel_list_v1_destroy(ext_toplevel_list);
+    ext_toplevel_list = NULL;
+  }
+}
+
+#else
+
+static bool ext_list_handle_global(struct wl_registry *registry, uint32_t name,
+                                   const char *interface, uint32_t version) {
+  return false;
+}
+static void ext_list_toplevel_done(struct toplevel_v1 *toplevel) {}
+static void ext_list_toplevel_destroyed(struct toplevel_v1 *toplevel) {}
+static bool ext_list_available(void) { return false; }
+static const char *ext_toplevel_identifier(struct toplevel_v1 *toplevel) {
+  return NULL;
+}
+static void ext_list_count_memory(struct wlrapps_memory *memory) {}
+static void ext_list_disconnect(void) {}
+
+#endif
+
+// ---- Memory Accounting ----
+
+// Counted by walking the structures when asked, keeping the numbers costs
+// nothing while events come in. Only the requested sizes are counted, not the
+// allocator's overhead.
+
+static void count_toplevel_memory(struct wlrapps_memory *memory,
+                                  const struct toplevel_v1 *toplevel) {
+  memory->records += sizeof(*toplevel);
+  memory->titles += string_size(toplevel->current.title) +
+                    string_size(toplevel->pending.title) +
+                    string_size(toplevel->search.title);
+  memory->app_ids += string_size(toplevel->current.app_id) +
+                     string_size(toplevel->pending.app_id) +
+                     string_size(toplevel->search.app_id);
+  if (toplevel->search.trigrams) {
+    size_t max_codes = strlen(toplevel->search.title) +
+                       strlen(toplevel->search.app_id) + 1;
+    memory->indexes += 2 * max_codes * sizeof(uint32_t);
+  }
+}
+
+static void count_desktop_index_memory(struct wlrapps_memory *memory) {
+  for (size_t i = 0; i < DESKTOP_INDEX_BUCKETS; ++i) {
+    for (const struct desktop_entry *entry = desktop_index.by_id[i]; entry;
+         entry = entry->next_by_id) {
+      memory->indexes += sizeof(*entry) + string_size(entry->id) +
+                         string_size(entry->name) + string_size(entry->icon) +
+                         string_size(entry->wm_class);
+    }
+  }
+  for (size_t i = 0; i < desktop_index.dir_count; ++i) {
+    memory->indexes += sizeof(struct desktop_dir) +
+                       string_size(desktop_index.dirs[i].path);
+  }
+}
+
+void wlrapps_get_memory(struct wlrapps_memory *memory) {
+  *memory = (struct wlrapps_memory){0};
+
+  struct toplevel_v1 *toplevel;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    count_toplevel_memory(memory, toplevel);
+  }
+
+  struct pending_parent *pending;
+  wl_list_for_each(pending, &pending_parent_list, link) {
+    memory->records += sizeof(*pending);
+  }
+
+  struct output_v1 *output;
+  wl_list_for_each(output, &output_list, link) {
+    memory->records += sizeof(*output) + string_size(output->name);
+  }
+
+  memory->records +=
+      (cycle_session.count + saved_layout.count) * sizeof(uint32_t) +
+      identity_cache.previous_count * sizeof(struct identity_record);
+
+  for (size_t i = 0; i < APP_INDEX_BUCKETS; ++i) {
+    for (const struct app_group *group = app_index[i]; group;
+         group = group->next) {
+      memory->indexes += sizeof(*group);
+      memory->app_ids += string_size(group->app_id);
+    }
+  }
+
+  for (size_t i = 0; i < SEARCH_BUCKETS; ++i) {
+    memory->indexes += search_index[i].capacity * sizeof(struct search_posting);
+  }
+
+  for (size_t i = 0; i < USAGE_APPS; ++i) {
+    memory->app_ids += string_size(usage.apps[i].app_id);
+  }
+
+  count_desktop_index_memory(memory);
+  ext_list_count_memory(memory);
+}
+
+// ---- Wayland Connection ----
+
+static bool reconnect_pending = false;
+static uint64_t reconnect_at_ms = 0;
+static uint32_t reconnect_backoff_ms = 0;
+
+// A wl_display.sync in flight, see wlrapps_sync().
+struct sync_request {
+  struct wl_list link;
+  struct wl_callback *callback;
+  void (*done)(void *data);
+  void *data;
+};
+
+static struct wl_list sync_requests;
+
+static void destroy_sync_request(struct sync_request *request) {
+  wl_callback_destroy(request->callback);
+  wl_list_remove(&request->link);
+  free(request);
+}
+
+// The compositor answers the sync after every request sent before it, and
+// the events those caused, went through.
+static void sync_callback_done(void *data, struct wl_callback *callback,
+                               uint32_t serial) {
+  struct sync_request *request = data;
+  void (*done)(void *data) = request->done;
+  void *done_data = request->data;
+
+  destroy_sync_request(request);
+  done(done_data);
+}
+
+static const struct wl_callback_listener sync_callback_listener = {
+    .done = sync_callback_done,
+};
+
+// Tears down every object of the connection. Safe to call on a half set up
+// or already broken connection.
+static void wayland_disconnect(void) {
+  bool was_resyncing = resyncing;
+  resyncing = true;
+
+  struct toplevel_v1 *toplevel, *toplevel_tmp;
+  wl_list_for_each_safe(toplevel, toplevel_tmp, &toplevel_list, link) {
+    destroy_toplevel(toplevel);
+  }
+
+  struct output_v1 *output, *output_tmp;
+  wl_list_for_each_safe(output, output_tmp, &output_list, link) {
+    remove_output(output->global_name);
+  }
+  thumbnails_disconnect();
+  ext_list_disconnect();
+
+  // Nobody answers the syncs anymore, their callers have to time out.
+  struct sync_request *request, *request_tmp;
+  wl_list_for_each_safe(request, request_tmp, &sync_requests, link) {
+    destroy_sync_request(request);
+  }
+
+  // The toplevels are gone, whatever was saved refers to nothing anymore.
+  end_cycle_session();
+  free(saved_layout.ids);
+  saved_layout = (struct saved_layout){.active_id = UINT32_MAX};
+
+  if (toplevel_manager) {
+    zwlr_foreign_toplevel_manager_v1_destroy(toplevel_manager);
+    toplevel_manager = NULL;
+  }
+  ext_backend_only = false;
+  if (seat) {
+    wl_seat_destroy(seat);
+    seat = NULL;
+  }
+  if (registry) {
+    wl_registry_destroy(registry);
+    registry = NULL;
+  }
+  if (global_display) {
+    wl_display_disconnect(global_display);
+    global_display = NULL;
+  }
+
+  resyncing = was_resyncing;
+}
+
+// Connects and loads the complete toplevel state. No events are sent while
+// the state is loaded, the records are complete once this returns.
+static bool wayland_connect(void) {
+  global_display = wl_display_connect(NULL);
+  if (global_display == NULL) {
+    fprintf(stderr, "Failed to connect to Wayland display.\n");
+    return false;
+  }
+
+  registry = wl_display_get_registry(global_display);
+  if (registry == NULL) {
+    fprintf(stderr, "Failed to get Wayland registry.\n");
+    wayland_disconnect();
+    return false;
+  }
+  wl_registry_add_listener(registry, &registry_listener, NULL);
+
+  resyncing = true;
+  identity_restore_begin();
+
+  // Initial Wayland dispatch to get global objects
+  if (wl_display_roundtrip(global_display) == -1) {
+    fprintf(stderr, "Wayland initial roundtrip failed.\n");
+    resyncing = false;
+    wayland_disconnect();
+    return false;
+  }
+
+  // Either protocol lists the toplevels, wlr-foreign-toplevel-management is
+  // preferred since it also has their state and the actions.
+  if (toplevel_manager == NULL && !ext_list_available()) {
+    fprintf(stderr, "Neither wlr-foreign-toplevel-management nor "
+                    "ext-foreign-toplevel-list available\n");
+    resyncing = false;
+    wayland_disconnect();
+    return false;
+  }
+  ext_backend_only = toplevel_manager == NULL;
+
+  // Another roundtrip to load toplevel details after binding to
+  // the managers
+  if (wl_display_roundtrip(global_display) == -1) {
+    fprintf(stderr, "Wayland second roundtrip failed.\n");
+    resyncing = false;
+    wayland_disconnect();
+    return false;
+  }
+
+  identity_restore_finish();
+  resyncing = false;
+  return true;
+}
+
+static void schedule_reconnect(void) {
+  if (reconnect_backoff_ms == 0) {
+    reconnect_backoff_ms = RECONNECT_MIN_MS;
+  } else if (reconnect_backoff_ms < RECONNECT_MAX_MS) {
+    reconnect_backoff_ms *= 2;
+    if (reconnect_backoff_ms > RECONNECT_MAX_MS) {
+      reconnect_backoff_ms = RECONNECT_MAX_MS;
+    }
+  }
+
+  reconnect_at_ms = monotonic_ms() + reconnect_backoff_ms;
+  reconnect_pending = true;
+}
+
+static int reconnect_poll_timeout(void) {
+  if (!reconnect_pending) {
+    return -1;
+  }
+  uint64_t now = monotonic_ms();
+  return now >= reconnect_at_ms ? 0 : (int)(reconnect_at_ms - now);
+}
+
+// Called when the connection broke, keeps going in reconnect mode. Returns
+// false if the caller should give up instead.
+static bool handle_wayland_lost(void) {
+  fprintf(stderr, "Wayland display disconnected.\n");
+  if (!reconnect_mode) {
+    return false;
+  }
+
+  wayland_disconnect();
+  if (listener && listener->disconnected) {
+    listener->disconnected(listener_data);
+  }
+  schedule_reconnect();
+  return true;
+}
+
+// Retries the connection once it's due. Returns true after a successful
+// reconnect.
+static bool try_reconnect(void) {
+  if (!reconnect_pending || monotonic_ms() < reconnect_at_ms) {
+    return false;
+  }
+
+  if (!wayland_connect()) {
+    schedule_reconnect();
+    return false;
+  }
+
+  reconnect_pending = false;
+  reconnect_backoff_ms = 0;
+  wl_display_flush(global_display);
+  if (listener && listener->reconnected) {
+    listener->reconnected(listener_data);
+  }
+  return true;
+}
+
+static int earliest_timeout(int a, int b) {
+  if (a < 0) {
+    return b;
+  }
+  if (b < 0) {
+    return a;
+  }
+  return a < b ? a : b;
+}
+
+// ---- Public API ----
+
+void wlrapps_init(uint32_t flags, const struct wlrapps_listener *new_listener,
+                  void *data) {
+  listener = new_listener;
+  listener_data = data;
+  reconnect_mode = flags & WLRAPPS_RECONNECT;
+
+  wl_list_init(&output_list);
+  wl_list_init(&toplevel_list);
+  wl_list_init(&mru_list);
+  wl_list_init(&pending_parent_list);
+  wl_list_init(&sync_requests);
+
+  // Built before the first roundtrip so the initial toplevels resolve their
+  // desktop entries right away.
+  desktop_index_init(flags & WLRAPPS_WATCH_DESKTOP_ENTRIES);
+}
+
+bool wlrapps_connect(void) {
+  if (wayland_connect()) {
+    return true;
+  }
+  if (reconnect_mode) {
+    // The compositor may not be up yet, keep retrying from the timers.
+    schedule_reconnect();
+  }
+  return false;
+}
+
+void wlrapps_finish(void) {
+  wayland_disconnect();
+  desktop_index_finish();
+  search_index_finish();
+  identity_cache_finish();
+  usage_finish();
+  thumbnails_finish();
+
+  reconnect_pending = false;
+  reconnect_backoff_ms = 0;
+  listener = NULL;
+  listener_data = NULL;
+}
+
+void wlrapps_set_fullscreen_output(uint32_t global_name) {
+  pref_output_id = global_name;
+}
+
+bool wlrapps_set_id_cache(const char *path) {
+  identity_cache_finish();
+
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open the id cache %s: ", path);
+    perror(NULL);
+    return false;
+  }
+  // Two daemons writing the same records would hand out each other's ids.
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    if (errno == EWOULDBLOCK) {
+      fprintf(stderr, "The id cache %s is used by another process\n", path);
+    } else {
+      perror("Failed to lock the id cache");
+    }
+    close(fd);
+    return false;
+  }
+
+  // A file of the wrong size is from another version, start over.
+  struct stat st;
+  bool fresh = fstat(fd, &st) == -1 ||
+               st.st_size != (off_t)sizeof(struct identity_file);
+  if (fresh && (ftruncate(fd, 0) == -1 ||
+                ftruncate(fd, sizeof(struct identity_file)) == -1)) {
+    perror("Failed to resize the id cache");
+    close(fd);
+    return false;
+  }
+
+  struct identity_file *file =
+      mmap(NULL, sizeof(*file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (file == MAP_FAILED) {
+    perror("Failed to map the id cache");
+    close(fd);
+    return false;
+  }
+
+  if (file->magic != IDENTITY_CACHE_MAGIC ||
+      file->count > IDENTITY_CACHE_RECORDS) {
+    memset(file, 0, sizeof(*file));
+    file->magic = IDENTITY_CACHE_MAGIC;
+  }
+  identity_cache.file = file;
+  identity_cache.fd = fd;
+  return true;
+}
+
+void wlrapps_set_max_title_length(size_t max) { max_title_length = max; }
+
+bool wlrapps_set_usage_log(const char *path) {
+  int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to open the usage log %s: ", path);
+    perror(NULL);
+    return false;
+  }
+
+  if (usage.log_fd != -1) {
+    usage_flush();
+    close(usage.log_fd);
+  }
+  usage.log_fd = fd;
+  usage.logged_at_ms = monotonic_ms();
+  return true;
+}
+
+size_t wlrapps_get_usage(struct wlrapps_usage *out, size_t max) {
+  uint64_t running = usage.focused ? monotonic_ms() - usage.since_ms : 0;
+  size_t count = 0;
+  for (size_t i = 0; i < USAGE_APPS; ++i) {
+    struct usage_app *app = &usage.apps[i];
+    if (!app->app_id) {
+      continue;
+    }
+    if (count < max) {
+      out[count] = (struct wlrapps_usage){
+          .app_id = app->app_id,
+          .focused_ms = app->focused_ms + (app == usage.focused ? running : 0),
+          .activations = app->activations,
+      };
+    }
+    count++;
+  }
+  return count;
+}
+
+int wlrapps_get_fd(void) {
+  return global_display ? wl_display_get_fd(global_display) : -1;
+}
+
+int wlrapps_get_watch_fd(void) { return desktop_index.inotify_fd; }
+
+int wlrapps_get_timeout(void) {
+  return earliest_timeout(
+      earliest_timeout(cycle_poll_timeout(), reconnect_poll_timeout()),
+      usage_poll_timeout());
+}
+
+bool wlrapps_dispatch(void) {
+  if (global_display == NULL) {
+    return true;
+  }
+
+  if (wl_display_dispatch(global_display) == -1) {
+    return handle_wayland_lost();
+  }
+
+  // After dispatching, flush any pending requests to the compositor
+  wl_display_flush(global_display);
+  return true;
+}
+
+bool wlrapps_dispatch_watch(void) {
+  return desktop_index.inotify_fd != -1 && handle_desktop_index_events();
+}
+
+bool wlrapps_dispatch_timers(void) {
+  try_reconnect();
+  if (usage_poll_timeout() == 0) {
+    usage_flush();
+  }
+  return expire_cycle_session();
+}
+
+void wlrapps_flush(void) {
+  if (global_display) {
+    wl_display_flush(global_display);
+  }
+}
+
+struct wl_display *wlrapps_get_display(void) { return global_display; }
+
+static struct toplevel_v1 *
+toplevel_from_info(const struct wlrapps_toplevel *info) {
+  struct toplevel_v1 *toplevel;
+  return wl_container_of((struct wlrapps_toplevel *)info, toplevel, info);
+}
+
+size_t wlrapps_toplevel_count(void) { return toplevel_count; }
+
+// The MRU ranks are only written when somebody looks at them.
+const struct wlrapps_toplevel *wlrapps_first_toplevel(void) {
+  update_mru_ranks();
+  if (wl_list_empty(&toplevel_list)) {
+    return NULL;
+  }
+
+  struct toplevel_v1 *toplevel =
+      wl_container_of(toplevel_list.next, toplevel, link);
+  return &toplevel->info;
+}
+
+const struct wlrapps_toplevel *
+wlrapps_next_toplevel(const struct wlrapps_toplevel *info) {
+  struct toplevel_v1 *toplevel = toplevel_from_info(info);
+  if (toplevel->link.next == &toplevel_list) {
+    return NULL;
+  }
+
+  toplevel = wl_container_of(toplevel->link.next, toplevel, link);
+  return &toplevel->info;
+}
+
+size_t wlrapps_child_count(const struct wlrapps_toplevel *info) {
+  return (size_t)wl_list_length(&toplevel_from_info(info)->children);
+}
+
+const struct wlrapps_toplevel *
+wlrapps_first_child(const struct wlrapps_toplevel *info) {
+  struct toplevel_v1 *toplevel = toplevel_from_info(info);
+  if (wl_list_empty(&toplevel->children)) {
+    return NULL;
+  }
+
+  struct toplevel_v1 *child =
+      wl_container_of(toplevel->children.next, child, child_link);
+  return &child->info;
+}
+
+const struct wlrapps_toplevel *
+wlrapps_next_sibling(const struct wlrapps_toplevel *info) {
+  struct toplevel_v1 *toplevel = toplevel_from_info(info);
+  struct toplevel_v1 *parent = toplevel->current.parent;
+  if (!parent || toplevel->child_link.next == &parent->children) {
+    return NULL;
+  }
+
+  struct toplevel_v1 *sibling =
+      wl_container_of(toplevel->child_link.next, sibling, child_link);
+  return &sibling->info;
+}
+
+const struct wlrapps_toplevel *wlrapps_find_toplevel(uint32_t id) {
+  struct toplevel_v1 *toplevel = toplevel_by_id_or_bail((int32_t)id);
+  if (!toplevel) {
+    return NULL;
+  }
+
+  update_mru_ranks();
+  return &toplevel->info;
+}
+
+bool wlrapps_toplevel_action(uint32_t id, enum wlrapps_action action) {
+  toplevel_action run = action_for_id(action);
+  struct toplevel_v1 *toplevel = toplevel_by_id_or_bail((int32_t)id);
+  if (!run || !toplevel) {
+    return false;
+  }
+  return run_action(toplevel, run);
+}
+
+int wlrapps_target_action(const char *target, enum wlrapps_action action) {
+  return wlrapps_target_action_ids(target, action, NULL, 0);
+}
+
+int wlrapps_target_action_ids(const char *target, enum wlrapps_action action,
+                              uint32_t *ids, size_t max_ids) {
+  toplevel_action run = action_for_id(action);
+  struct target_ids result = {.ids = ids, .max = max_ids};
+  if (!run) {
+    return -1;
+  }
+  return apply_to_target(target, run, &result);
+}
+
+bool wlrapps_sync(void (*done)(void *data), void *data) {
+  if (global_display == NULL) {
+    return false;
+  }
+
+  struct sync_request *request = calloc(1, sizeof(*request));
+  if (!request) {
+    return false;
+  }
+
+  request->callback = wl_display_sync(global_display);
+  if (!request->callback) {
+    free(request);
+    return false;
+  }
+  request->done = done;
+  request->data = data;
+  wl_callback_add_listener(request->callback, &sync_callback_listener,
+                           request);
+  wl_list_insert(&sync_requests, &request->link);
+  return true;
+}
+
+#ifdef WLRAPPS_THUMBNAILS
+
+bool wlrapps_enable_thumbnails(uint32_t max_size, size_t budget) {
+  return thumbnail_cache_init(max_size, budget);
+}
+
+int wlrapps_get_thumbnail_pool(size_t *size) {
+  *size = thumbnail_cache.size;
+  return thumbnail_cache.fd;
+}
+
+bool wlrapps_capture_thumbnail(uint32_t id, bool follow_damage) {
+  struct toplevel_v1 *toplevel = toplevel_by_id_or_bail((int32_t)id);
+  return toplevel && capture_toplevel(toplevel, follow_damage);
+}
+
+void wlrapps_stop_thumbnail(uint32_t id) {
+  struct toplevel_v1 *toplevel = toplevel_by_id_or_bail((int32_t)id);
+  if (toplevel && toplevel->capture) {
+    capture_stop(toplevel->capture);
+  }
+}
+
+const struct wlrapps_thumbnail *wlrapps_get_thumbnail(uint32_t id) {
+  struct toplevel_v1 *toplevel = toplevel_by_id_or_bail((int32_t)id);
+  if (!toplevel || !toplevel->capture || !toplevel->capture->slot) {
+    return NULL;
+  }
+
+  thumbnail_slot_touch(toplevel->capture->slot);
+  return &toplevel->capture->slot->info;
+}
+
+#else
+
+bool wlrapps_enable_thumbnails(uint32_t max_size, size_t budget) {
+  fprintf(stderr, "libwlrapps was built without thumbnail support\n");
+  return false;
+}
+
+int wlrapps_get_thumbnail_pool(size_t *size) {
+  *size = 0;
+  return -1;
+}
+
+bool wlrapps_capture_thumbnail(uint32_t id, bool follow_damage) {
+  return false;
+}
+
+void wlrapps_stop_thumbnail(uint32_t id) {}
+
+const struct wlrapps_thumbnail *wlrapps_get_thumbnail(uint32_t id) {
+  return NULL;
+}
+
+#endif
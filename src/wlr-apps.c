@@ -1,106 +1,76 @@
 #define _POSIX_C_SOURCE 200809L
-#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+#define _GNU_SOURCE // SO_DOMAIN, struct ucred
+#include "control.h"
+#include "json-escape.h"
+#include "wlrapps.h"
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
-#include <wayland-client-core.h>
-#include <wayland-client.h>
 
 // ----- Macros -----
 
-#define WLR_FOREIGN_TOPLEVEL_MANAGEMENT_VERSION 3
-#define SOCKET_PATH "/tmp/wlr-apps.socket"
-#define BUFFER_SIZE 256
-#define MAX_CLIENTS 1
+#define BUFFER_SIZE CONTROL_BUFFER_SIZE
+#define MAX_CLIENTS 256 // Every blocked "wait" holds a connection
 #define POLL_TIMEOUT_MS 100
-
-// ---- Enums -----
-
-enum toplevel_state_field {
-  TOPLEVEL_STATE_MAXIMIZED = (1 << 0),
-  TOPLEVEL_STATE_MINIMIZED = (1 << 1),
-  TOPLEVEL_STATE_ACTIVATED = (1 << 2),
-  TOPLEVEL_STATE_FULLSCREEN = (1 << 3),
-  TOPLEVEL_STATE_INVALID = (1 << 4),
-};
+#define FIXED_FDS 3 // listen socket, wayland and inotify
+#define MAX_TREE_DEPTH 16
+#define MAX_FILTER_DEPTH 32
+#define SYNC_TIMEOUT_MS CONTROL_SYNC_TIMEOUT_MS
+#define MAX_ACK_IDS 64 // Toplevels a synchronous action waits for
+#define LISTEN_FDS_START 3 // First fd passed by socket activation
+#define THUMBNAIL_SIZE 256
+#define THUMBNAIL_BUDGET (16 << 20) // 64 thumbnails of the default size
+#define MAX_THUMBNAIL_SIZE 2048 // A single one fills the budget
 
 // ---- Structs ----
 
-static struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager = NULL;
-static struct wl_list toplevel_list;
-
-struct toplevel_state {
-  char *title;
-  char *app_id;
-
-  uint32_t state;
-  uint32_t parent_id;
-};
-
-static uint32_t global_id = 0;
-struct toplevel_v1 {
-  struct wl_list link;
-  struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel;
-
-  uint32_t seed;
-  uint32_t id;
-  struct toplevel_state current, pending;
-};
-
-static struct wl_output *pref_output = NULL;
-struct wl_seat *seat = NULL;
-
-struct toplevel_info {
-  uint32_t tl_id;
-  char *tl_title;
-  char *tl_app_id;
-  uint32_t tl_parent_id;
-  bool maximized;
-  bool minimized;
-  bool active;
-  bool fullscreen;
-};
-
+// The toplevels in output order, sorting only reorders the pointers to the
+// records owned by libwlrapps.
 struct toplevel_list {
-  struct toplevel_info *items;
+  const struct wlrapps_toplevel **items;
   size_t count;
   size_t capacity;
 };
 
-struct toplevel_list global_info_list = {0};
-
-struct wl_display *global_display = NULL;
-struct wl_display *wl_display_get_default(void) {
-  return global_display; // Provide access to the global display
-}
-struct wl_registry *registry = NULL;
+static struct toplevel_list global_info_list = {0};
 
-struct toplevel_info *find_info_by_id(struct toplevel_list *list, uint32_t id) {
-  for (size_t i = 0; i < list->count; ++i) {
-    if (list->items[i].tl_id == id) {
-      return &list->items[i];
-    }
-  }
-  return NULL;
-}
+// A consumer of snapshots with its own filter, see Filter Expressions. The
+// encoders only need to know which toplevels it currently matches.
+struct subscription;
+static bool subscription_matches(const struct subscription *sub, uint32_t id);
 
 // ---- Global Variables ----
 
-static const uint32_t no_parent = (uint32_t)-1;
 static uint32_t pref_output_id = UINT32_MAX;
-bool json_out = false;
-bool sort_out = false;
-int sort_type = -1;
-static void update_toplevel_info_state(struct toplevel_v1 *toplevel);
+enum output_format {
+  OUTPUT_TEXT,
+  OUTPUT_JSON,
+  OUTPUT_CBOR,
+  OUTPUT_MSGPACK,
+  OUTPUT_TEMPLATE,
+};
+
+static enum output_format output_format = OUTPUT_TEXT;
+static bool sort_out = false;
+static bool nested_out = false;
+static bool reconnect_mode = false;
+static int sort_type = -1;
+static int max_clients = MAX_CLIENTS;
 
 // ---- Print Functions ----
 
@@ -140,24 +110,96 @@ static void print_help(void) {
       "  |                \"i <id>\" (minimize)\n"
       "  |                \"r <id>\" (restore)\n"
       "  |                \"c <id>\" (close)\n"
+      "  |               Instead of <id> the actions also take \"app:<app_id>\",\n"
+      "  |               \"output:<name>\" or \"all\" to act on every matching\n"
+      "  |               toplevel at once.\n"
       "  |                \"q\" (toggle sorting on/off)\n"
+      "  |                \"focus-prev\" (focus the previously active toplevel)\n"
+      "  |                \"focus-next-in-app\" (cycle through the windows\n"
+      "  |                 of the active app)\n"
+      "  |                \"cycle\" / \"cycle-back\" (alt-tab through the\n"
+      "  |                 toplevels in most recently used order)\n"
+      "  |                \"focus-app <app_id>\" (focus the app or cycle\n"
+      "  |                 through its windows if it's already active)\n"
+      "  |                \"show-desktop\" (minimize every toplevel)\n"
+      "  |                \"restore-layout\" (undo show-desktop)\n"
+      "  |                \"subscribe [<filter>]\" (stay connected and receive\n"
+      "  |                 a json snapshot of the matching toplevels whenever\n"
+      "  |                 they change, see --filter)\n"
+      "  |                \"since [<seq>]\" (stay connected and receive every\n"
+      "  |                 change event after <seq>, or a snapshot first)\n"
+      "  |                \"search <query>\" (reply with the ids of the toplevels\n"
+      "  |                 whose title or app_id fuzzy matches, best first)\n"
+      "  |                \"usage\" (reply with the focus time of every app)\n"
+      "  |                \"mem\" (reply with the memory held, by category)\n"
+      "  |                \"thumbnail <id> [follow|stop]\" (capture the toplevel,\n"
+      "  |                 see --thumbnails)\n"
+      "  |                \"wait [new] [timeout=<ms>] [<filter>]\" (block until a\n"
+      "  |                 toplevel matches, reply \"ok <id>\" or \"timeout\")\n"
       "                  Example: wlr-apps -x \"close <id>\".\n"
+      "  --sync[=<ms>]   With -x, wait until the compositor applied the action\n"
+      "                  and print \"ok <latency in ms>\", or \"timeout\" after\n"
+      "                  <ms> (default 1000) and exit with an error.\n";
+  // Split in two, ISO C only guarantees string literals of 4095 characters.
+  static const char output_usage[] =
       "  -j              Print the output in json format, this can used alone "
       "                  to print\n"
       "                  once and exit, or along -m to continously print "
       "                  changes in json format\n"
+      "  -R              Keep running when the compositor goes away and reconnect\n"
+      "                  with backoff, use it along -m. While disconnected the\n"
+      "                  output is {\"status\":\"disconnected\"} in json.\n"
+      "  -T              Nest child toplevels such as dialogs under their parent\n"
+      "                  in a \"children\" array instead of listing them at the top\n"
+      "                  level.\n"
+      "  -F <format>     Output format, \"json\" (same as -j), \"cbor\" or\n"
+      "                  \"msgpack\". The binary formats have the same schema as\n"
+      "                  json, each snapshot is prefixed by its length as a 32 bit\n"
+      "                  big endian integer instead of ending with a newline.\n"
+      "  --format <tpl>  Print every toplevel through a template instead of\n"
+      "                  json, one line per update. {field} inserts a field,\n"
+      "                  {field|trunc 30}, {field|upper} and {field|lower}\n"
+      "                  filter it and {field?text} or {!field?text} only\n"
+      "                  print text when the field is set, true or non empty.\n"
+      "                  Example: --format '{app_id}:{title|trunc 30}{active? *}'\n"
+      "  --separator <s> Text between toplevels in --format output (default \" \").\n"
+      "  --filter <expr> Only output toplevels matching the expression. Updates\n"
+      "                  to other toplevels print nothing. Fields are tested\n"
+      "                  with ==, !=, ~ and !~ (glob) or on their own for being\n"
+      "                  set, and combined with and, or, not and parentheses.\n"
+      "                  Example: --filter 'app_id ~ \"org.gnome.*\" and not minimized'\n"
+      "  --thumbnails[=<px>]\n"
+      "                  Let socket clients capture thumbnails of the toplevels,\n"
+      "                  scaled to fit <px> x <px> (default 256, at most 2048),\n"
+      "                  use it along -m.\n"
+      "                  The reply to \"thumbnail <id>\" is a line with the id,\n"
+      "                  width, height, stride, wl_shm format, offset and pool\n"
+      "                  size, the pool's fd is passed with it. \"follow\" keeps\n"
+      "                  the thumbnail up to date on damage until \"stop\".\n"
+      "  --max-title <n> Cut titles after <n> bytes.\n"
+      "  --max-clients <n>\n"
+      "                  Connections the daemon takes at once, 1 to 256\n"
+      "                  (default 256).\n"
+      "  --usage-log <path>\n"
+      "                  Append the focus time every app gained to <path> once\n"
+      "                  a minute, use it along -m.\n"
       "  -h              print help message and quit\n";
-  fprintf(stderr, "%s", usage);
+  fprintf(stderr, "%s%s", usage, output_usage);
 }
 
-static void print_toplevel(struct toplevel_v1 *toplevel, bool print_endl) {
+static void print_toplevel(const struct wlrapps_toplevel *toplevel,
+                           bool print_endl) {
 
   printf("-> %d. title=%s app_id=%s", toplevel->id,
-         toplevel->current.title ?: "(nil)",
-         toplevel->current.app_id ?: "(nil)");
+         toplevel->title ?: "(nil)",
+         toplevel->app_id ?: "(nil)");
+
+  if (toplevel->name) {
+    printf(" name=%s", toplevel->name);
+  }
 
-  if (toplevel->current.parent_id != no_parent) {
-    printf(" parent=%u", toplevel->current.parent_id);
+  if (toplevel->parent_id != WLRAPPS_NO_PARENT) {
+    printf(" parent=%u", toplevel->parent_id);
   } else {
     printf(" no parent");
   }
@@ -167,28 +209,28 @@ static void print_toplevel(struct toplevel_v1 *toplevel, bool print_endl) {
   }
 }
 
-static void print_toplevel_state(struct toplevel_v1 *toplevel,
+static void print_toplevel_state(const struct wlrapps_toplevel *toplevel,
                                  bool print_endl) {
 
-  if (toplevel->current.state & TOPLEVEL_STATE_MAXIMIZED) {
+  if (toplevel->maximized) {
     printf(" maximized");
   } else {
     printf(" unmaximized");
   }
 
-  if (toplevel->current.state & TOPLEVEL_STATE_MINIMIZED) {
+  if (toplevel->minimized) {
     printf(" minimized");
   } else {
     printf(" unminimized");
   }
 
-  if (toplevel->current.state & TOPLEVEL_STATE_ACTIVATED) {
+  if (toplevel->active) {
     printf(" active");
   } else {
     printf(" inactive");
   }
 
-  if (toplevel->current.state & TOPLEVEL_STATE_FULLSCREEN) {
+  if (toplevel->fullscreen) {
     printf(" fullscreen");
   }
 
@@ -197,592 +239,3440 @@ static void print_toplevel_state(struct toplevel_v1 *toplevel,
   }
 }
 
-void print_json_string(const char *str) {
+// Output buffer shared by every encoder, a snapshot is built in full and then
+// written with a single call.
+struct output_buffer {
+  char *data;
+  size_t len;
+  size_t cap;
+};
+
+static struct output_buffer output_buffer = {0};
 
-  if (str == NULL) {
-    printf("null");
-    return;
+static bool output_buffer_reserve(struct output_buffer *buf, size_t extra) {
+  if (buf->len + extra <= buf->cap) {
+    return true;
   }
 
-  printf("\"");
-
-  for (const char *p = str; *p; ++p) {
-    switch (*p) {
-    case '"':
-      printf("\\\"");
-      break;
-    case '\\':
-      printf("\\\\");
-      break;
-    case '\b':
-      printf("\\\\");
-      break;
-    case '\f':
-      printf("\\\\");
-      break;
-    case '\n':
-      printf("\\\\");
-      break;
-    case '\r':
-      printf("\\\\");
-      break;
-    case '\t':
-      printf("\\\\");
-      break;
-    default:
-      if (*p >= 0x00 && *p <= 0x1F) {
-        printf("\\u%04x", (unsigned int)*p);
-      } else {
-        printf("%c", *p);
-      }
-      break;
-    }
+  size_t new_cap = buf->cap ? buf->cap : 1024;
+  while (new_cap < buf->len + extra) {
+    new_cap *= 2;
   }
 
-  printf("\"");
+  char *data = realloc(buf->data, new_cap);
+  if (!data) {
+    return false;
+  }
+  buf->data = data;
+  buf->cap = new_cap;
+  return true;
 }
 
-int compare_toplevel_info(const void *a, const void *b){
-  const struct toplevel_info *info_a = (const struct toplevel_info *)a;
-  const struct toplevel_info *info_b = (const struct toplevel_info *)b;
-
-  // Sort based on the sort_type that's currently enabled. 
-  // This could probably be faster but they are simple int comparisons so I don't think the performance penalty of this
-  // Nested if's statements is important.
-  if (sort_type == 1 || sort_type == 2){
-    if (info_a->tl_id < info_b->tl_id){
-      if (sort_type == 1){
-        return -1;
-      } else return 1;
-    } else if (info_a->tl_id > info_b->tl_id) {
-      if (sort_type == 1){
-        return 1;
-      } else return -1;
-    } else {
-      return 0;
-    }
-  } else if (sort_type == 3 || sort_type == 4) {
-    if (info_a->tl_app_id[0] < info_b->tl_app_id[0]){
-      if (sort_type == 4) {
-        return 1;
-      } else return -1;
-    } else if (info_a->tl_app_id[0] > info_b->tl_app_id[0]){
-      if (sort_type == 4){
-        return -1;
-      } else return 1;
-    } else {
-      return 0;
-    }
-
-  } 
-  // Just so that the compiler doesn't complain.
-  else return 0;
+static void output_buffer_append(struct output_buffer *buf, const void *data,
+                                 size_t len) {
+  if (output_buffer_reserve(buf, len)) {
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+  }
 }
 
-void print_toplevel_json_array(void) {
+// Gives back what a burst of large snapshots left behind. Only shrinks once the
+// buffer is mostly unused, so sizes going back and forth don't realloc.
+static void output_buffer_trim(struct output_buffer *buf) {
+  if (buf->cap <= (64 << 10) || buf->len > buf->cap / 4) {
+    return;
+  }
 
-  if (global_info_list.count > 0 && sort_out) {
-    qsort(global_info_list.items, global_info_list.count, sizeof(struct toplevel_info), compare_toplevel_info);
+  char *data = realloc(buf->data, buf->cap / 2);
+  if (data) {
+    buf->data = data;
+    buf->cap /= 2;
   }
+}
 
-  printf("[");
+static void output_buffer_putc(struct output_buffer *buf, char c) {
+  output_buffer_append(buf, &c, 1);
+}
 
-  for (size_t i = 0; i < global_info_list.count; ++i) {
-    struct toplevel_info *info = &global_info_list.items[i];
+static void output_buffer_puts(struct output_buffer *buf, const char *str) {
+  output_buffer_append(buf, str, strlen(str));
+}
 
-    printf("{\"id\":%u,", info->tl_id);
+// Every field of a toplevel record, in output order. Encoders only know about
+// field_value, so adding a field here adds it to every output format.
+enum toplevel_field {
+  FIELD_ID,
+  FIELD_TITLE,
+  FIELD_APP_ID,
+  FIELD_NAME,
+  FIELD_ICON,
+  FIELD_STARTUP_WM_CLASS,
+  FIELD_PARENT_ID,
+  FIELD_MRU,
+  FIELD_MAXIMIZED,
+  FIELD_MINIMIZED,
+  FIELD_ACTIVE,
+  FIELD_FULLSCREEN,
+  FIELD_COUNT,
+};
 
-    printf("\"title\":");
-    print_json_string(info->tl_title);
-    printf(",");
+static const char *const field_names[FIELD_COUNT] = {
+    [FIELD_ID] = "id",
+    [FIELD_TITLE] = "title",
+    [FIELD_APP_ID] = "app_id",
+    [FIELD_NAME] = "name",
+    [FIELD_ICON] = "icon",
+    [FIELD_STARTUP_WM_CLASS] = "startup_wm_class",
+    [FIELD_PARENT_ID] = "parent_id",
+    [FIELD_MRU] = "mru",
+    [FIELD_MAXIMIZED] = "maximized",
+    [FIELD_MINIMIZED] = "minimized",
+    [FIELD_ACTIVE] = "active",
+    [FIELD_FULLSCREEN] = "fullscreen",
+};
 
-    printf("\"app_id\":");
-    print_json_string(info->tl_app_id);
-    printf(",");
+enum field_type {
+  FIELD_TYPE_NULL,
+  FIELD_TYPE_UINT,
+  FIELD_TYPE_STRING,
+  FIELD_TYPE_BOOL,
+};
 
-    if (info->tl_parent_id != no_parent) {
-      printf("\"parent_id\":%u,", info->tl_parent_id);
-    } else {
-      printf("\"parent_id\":null,");
-    }
+struct field_value {
+  enum field_type type;
+  union {
+    uint64_t uint; // Only the history's sequence numbers go beyond 32 bits
+    const char *string;
+    bool boolean;
+  };
+};
 
-    printf(
-        "\"maximized\":%s,\"minimized\":%s,\"active\":%s,\"fullscreen\":%s}%s",
-        info->maximized ? "true" : "false", info->minimized ? "true" : "false",
-        info->active ? "true" : "false", info->fullscreen ? "true" : "false",
-        (i < global_info_list.count - 1) ? "," : "");
+static struct field_value string_value(const char *str) {
+  if (str == NULL) {
+    return (struct field_value){.type = FIELD_TYPE_NULL};
   }
+  return (struct field_value){.type = FIELD_TYPE_STRING, .string = str};
+}
 
-  printf("]\n");
-  fflush(stdout);
+static struct field_value get_field(const struct wlrapps_toplevel *info,
+                                    enum toplevel_field field) {
+  switch (field) {
+  case FIELD_ID:
+    return (struct field_value){.type = FIELD_TYPE_UINT, .uint = info->id};
+  case FIELD_TITLE:
+    return string_value(info->title);
+  case FIELD_APP_ID:
+    return string_value(info->app_id);
+  case FIELD_NAME:
+    return string_value(info->name);
+  case FIELD_ICON:
+    return string_value(info->icon);
+  case FIELD_STARTUP_WM_CLASS:
+    return string_value(info->startup_wm_class);
+  case FIELD_PARENT_ID:
+    if (info->parent_id == WLRAPPS_NO_PARENT) {
+      return (struct field_value){.type = FIELD_TYPE_NULL};
+    }
+    return (struct field_value){.type = FIELD_TYPE_UINT,
+                                .uint = info->parent_id};
+  case FIELD_MRU:
+    return (struct field_value){.type = FIELD_TYPE_UINT, .uint = info->mru};
+  case FIELD_MAXIMIZED:
+    return (struct field_value){.type = FIELD_TYPE_BOOL,
+                                .boolean = info->maximized};
+  case FIELD_MINIMIZED:
+    return (struct field_value){.type = FIELD_TYPE_BOOL,
+                                .boolean = info->minimized};
+  case FIELD_ACTIVE:
+    return (struct field_value){.type = FIELD_TYPE_BOOL,
+                                .boolean = info->active};
+  case FIELD_FULLSCREEN:
+    return (struct field_value){.type = FIELD_TYPE_BOOL,
+                                .boolean = info->fullscreen};
+  default:
+    return (struct field_value){.type = FIELD_TYPE_NULL};
+  }
 }
 
-// ---- Helper Functions ----
+// The encoded fields of a toplevel, everything between its map header and
+// the children. Only rebuilt after the toplevel changed, so a snapshot
+// mostly copies the fragments of the toplevels that didn't.
+struct fragment {
+  uint32_t id;
+  uint32_t mru; // Encoded as well but changes without an event
+  bool valid;
+  struct output_buffer data;
+};
 
-void init_toplevel_list(struct toplevel_list *list) {
-  list->items = NULL;
-  list->count = 0;
-  list->capacity = 0;
-}
+struct fragment_cache {
+  struct fragment *items; // Sorted by id
+  size_t count;
+  size_t capacity;
+};
 
-static void copy_state(struct toplevel_state *current,
-                       struct toplevel_state *pending,
-                       struct toplevel_v1 *toplevel) {
-  if (current->title && pending->title) {
-    free(current->title);
-  }
+static struct fragment_cache json_fragments = {0};
+static struct fragment_cache cbor_fragments = {0};
+static struct fragment_cache msgpack_fragments = {0};
 
-  if (current->app_id && pending->app_id) {
-    free(current->app_id);
-  }
+static struct fragment_cache *const fragment_caches[] = {
+    &json_fragments,
+    &cbor_fragments,
+    &msgpack_fragments,
+};
+
+// A structured output format. Containers announce their size up front since
+// the binary formats need it, json only uses it to place the separators.
+struct encoder {
+  bool binary; // Frames are length prefixed instead of newline terminated
+  struct fragment_cache *fragments;
+  void (*begin_array)(struct output_buffer *buf, size_t count);
+  void (*array_item)(struct output_buffer *buf, size_t index);
+  void (*end_array)(struct output_buffer *buf);
+  void (*begin_map)(struct output_buffer *buf, size_t count);
+  void (*map_key)(struct output_buffer *buf, const char *key, size_t index);
+  void (*end_map)(struct output_buffer *buf);
+  void (*value)(struct output_buffer *buf, const struct field_value *value);
+};
+
+// ---- Json Strings ----
 
-  if (pending->title) {
-    current->title = pending->title;
-    pending->title = NULL;
+static void json_append_escape(struct output_buffer *buf, unsigned char c) {
+  switch (c) {
+  case '"':
+    output_buffer_puts(buf, "\\\"");
+    break;
+  case '\\':
+    output_buffer_puts(buf, "\\\\");
+    break;
+  case '\b':
+    output_buffer_puts(buf, "\\b");
+    break;
+  case '\f':
+    output_buffer_puts(buf, "\\f");
+    break;
+  case '\n':
+    output_buffer_puts(buf, "\\n");
+    break;
+  case '\r':
+    output_buffer_puts(buf, "\\r");
+    break;
+  case '\t':
+    output_buffer_puts(buf, "\\t");
+    break;
+  default: {
+    char escaped[8];
+    snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned int)c);
+    output_buffer_puts(buf, escaped);
+    break;
   }
+  }
+}
 
-  if (pending->app_id) {
-    /*
-    This implementation is kinda dumb but it's the best I could come up with. Basically the -gtk-icontheme doesn't match upper and lowercase, meaning that
-    if your app_id is, for example, "org.xfce.Thunar" but the icon is found under "org.xfce.thunar" it will return null and empty icon. So we need to convert it to
-    lowercase first in order for gtk to return a valid icon. HOWEVER, the same thing occurs the other way arround, for example, "org.gnome.Calculator" only matches with the
-    uppercase, so if we convert ALL app_ids to lowercase this one won't match. From testing I think only gnome has the icon with upper case rather than lowecase.
-    To make things worse this seems to only happen with "org.something.something" app_ids, any other app in my testing matches correctly regardless of upper or lowercase.
-    I couldn't look deeper into how gtk handles this but could be a bug.
-    */
-    char gnome[] = "gnome";
-    char *res = strstr(pending->app_id, gnome);
-    // If the app_id doesn't contain "gnome" we convert everything to lowercase. if it does we leave it as it is.
-    if (res == NULL) {
-      for (int i = 0; i < strlen(pending->app_id); i++){
-        pending->app_id[i] = tolower(pending->app_id[i]);
-      }
+static void json_append_string(struct output_buffer *buf, const char *str) {
+  size_t len = strlen(str);
+  size_t i = 0;
+
+  output_buffer_reserve(buf, len + 2);
+  output_buffer_putc(buf, '"');
+
+  while (i < len) {
+    size_t clean = json_clean_run(str + i, len - i);
+    output_buffer_append(buf, str + i, clean);
+    i += clean;
+    if (i < len) {
+      json_append_escape(buf, (unsigned char)str[i++]);
     }
-    current->app_id = pending->app_id;
-    pending->app_id = NULL;
   }
 
-  if (!(pending->state & TOPLEVEL_STATE_INVALID)) {
-    current->state = pending->state;
+  output_buffer_putc(buf, '"');
+}
+
+static void json_begin_array(struct output_buffer *buf, size_t count) {
+  output_buffer_putc(buf, '[');
+}
+
+static void json_separator(struct output_buffer *buf, size_t index) {
+  if (index > 0) {
+    output_buffer_putc(buf, ',');
   }
+}
 
-  current->parent_id = pending->parent_id;
-  pending->state = TOPLEVEL_STATE_INVALID;
+static void json_end_array(struct output_buffer *buf) {
+  output_buffer_putc(buf, ']');
+}
 
-  update_toplevel_info_state(toplevel);
+static void json_begin_map(struct output_buffer *buf, size_t count) {
+  output_buffer_putc(buf, '{');
 }
 
-static void update_toplevel_info_state(struct toplevel_v1 *toplevel) {
-  struct toplevel_info *info = find_info_by_id(&global_info_list, toplevel->id);
+static void json_map_key(struct output_buffer *buf, const char *key,
+                         size_t index) {
+  json_separator(buf, index);
+  json_append_string(buf, key);
+  output_buffer_putc(buf, ':');
+}
 
-  if (!info)
-    return;
+static void json_end_map(struct output_buffer *buf) {
+  output_buffer_putc(buf, '}');
+}
 
-  info->tl_parent_id = toplevel->current.parent_id;
-  info->maximized = toplevel->current.state & TOPLEVEL_STATE_MAXIMIZED;
-  info->minimized = toplevel->current.state & TOPLEVEL_STATE_MINIMIZED;
-  info->active = toplevel->current.state & TOPLEVEL_STATE_ACTIVATED;
-  info->fullscreen = toplevel->current.state & TOPLEVEL_STATE_FULLSCREEN;
+static void json_value(struct output_buffer *buf,
+                       const struct field_value *value) {
+  char number[24];
 
-  if (toplevel->current.title) {
-    free(info->tl_title);
-    info->tl_title = strdup(toplevel->current.title);
+  switch (value->type) {
+  case FIELD_TYPE_NULL:
+    output_buffer_puts(buf, "null");
+    break;
+  case FIELD_TYPE_UINT:
+    snprintf(number, sizeof(number), "%" PRIu64, value->uint);
+    output_buffer_puts(buf, number);
+    break;
+  case FIELD_TYPE_STRING:
+    json_append_string(buf, value->string);
+    break;
+  case FIELD_TYPE_BOOL:
+    output_buffer_puts(buf, value->boolean ? "true" : "false");
+    break;
   }
+}
+
+static const struct encoder json_encoder = {
+    .binary = false,
+    .fragments = &json_fragments,
+    .begin_array = json_begin_array,
+    .array_item = json_separator,
+    .end_array = json_end_array,
+    .begin_map = json_begin_map,
+    .map_key = json_map_key,
+    .end_map = json_end_map,
+    .value = json_value,
+};
 
-  if (toplevel->current.app_id) {
-    free(info->tl_app_id);
-    info->tl_app_id = strdup(toplevel->current.app_id);
+static void append_be(struct output_buffer *buf, uint64_t value, size_t bytes) {
+  for (size_t i = bytes; i > 0; --i) {
+    output_buffer_putc(buf, (char)((value >> ((i - 1) * 8)) & 0xff));
   }
 }
 
-bool add_toplevel_info(struct toplevel_list *list,
-                       struct toplevel_info *new_info) {
-  if (list->count == list->capacity) {
-    size_t new_capacity = (list->capacity == 0) ? 4 : list->capacity * 2;
-    struct toplevel_info *new_items =
-        realloc(list->items, new_capacity * sizeof(struct toplevel_info));
-    if (!new_items)
-      return false;
-    list->items = new_items;
-    list->capacity = new_capacity;
+// Initial byte plus the shortest argument encoding, RFC 8949 section 3.
+static void cbor_head(struct output_buffer *buf, uint8_t major,
+                      uint64_t value) {
+  major <<= 5;
+  if (value < 24) {
+    output_buffer_putc(buf, (char)(major | value));
+  } else if (value <= UINT8_MAX) {
+    output_buffer_putc(buf, (char)(major | 24));
+    append_be(buf, value, 1);
+  } else if (value <= UINT16_MAX) {
+    output_buffer_putc(buf, (char)(major | 25));
+    append_be(buf, value, 2);
+  } else if (value <= UINT32_MAX) {
+    output_buffer_putc(buf, (char)(major | 26));
+    append_be(buf, value, 4);
+  } else {
+    output_buffer_putc(buf, (char)(major | 27));
+    append_be(buf, value, 8);
   }
+}
 
-  list->items[list->count++] = *new_info;
-  return true;
+static void cbor_string(struct output_buffer *buf, const char *str) {
+  size_t len = strlen(str);
+  cbor_head(buf, 3, len);
+  output_buffer_append(buf, str, len);
 }
 
-void remove_toplevel_info(struct toplevel_list *list, uint32_t id) {
-  for (size_t i = 0; i < list->count; ++i) {
-    if (list->items[i].tl_id == id) {
-      free(list->items[i].tl_title);
-      free(list->items[i].tl_app_id);
+static void cbor_begin_array(struct output_buffer *buf, size_t count) {
+  cbor_head(buf, 4, count);
+}
 
-      list->items[i] = list->items[list->count - 1];
-      list->count--;
+static void cbor_begin_map(struct output_buffer *buf, size_t count) {
+  cbor_head(buf, 5, count);
+}
 
-      return;
-    }
+static void cbor_map_key(struct output_buffer *buf, const char *key,
+                         size_t index) {
+  cbor_string(buf, key);
+}
+
+static void cbor_value(struct output_buffer *buf,
+                       const struct field_value *value) {
+  switch (value->type) {
+  case FIELD_TYPE_NULL:
+    output_buffer_putc(buf, (char)0xf6);
+    break;
+  case FIELD_TYPE_UINT:
+    cbor_head(buf, 0, value->uint);
+    break;
+  case FIELD_TYPE_STRING:
+    cbor_string(buf, value->string);
+    break;
+  case FIELD_TYPE_BOOL:
+    output_buffer_putc(buf, (char)(value->boolean ? 0xf5 : 0xf4));
+    break;
   }
 }
 
-// ---- Wayland Callback Functions ----
+static void noop_item(struct output_buffer *buf, size_t index) {}
+
+static void noop_end(struct output_buffer *buf) {}
 
-static void toplevel_handle_title(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    const char *title) {
-  struct toplevel_v1 *toplevel = data;
-  free(toplevel->pending.title);
-  toplevel->pending.title = strdup(title);
+static const struct encoder cbor_encoder = {
+    .binary = true,
+    .fragments = &cbor_fragments,
+    .begin_array = cbor_begin_array,
+    .array_item = noop_item,
+    .end_array = noop_end,
+    .begin_map = cbor_begin_map,
+    .map_key = cbor_map_key,
+    .end_map = noop_end,
+    .value = cbor_value,
+};
+
+// Picks the fix, 16 or 32 bit variant of a MessagePack container or string.
+static void msgpack_head(struct output_buffer *buf, uint8_t fix_type,
+                         size_t fix_max, uint8_t type8, uint8_t type16,
+                         size_t count) {
+  if (count <= fix_max) {
+    output_buffer_putc(buf, (char)(fix_type | count));
+  } else if (type8 && count <= UINT8_MAX) {
+    output_buffer_putc(buf, (char)type8);
+    append_be(buf, count, 1);
+  } else if (count <= UINT16_MAX) {
+    output_buffer_putc(buf, (char)type16);
+    append_be(buf, count, 2);
+  } else {
+    output_buffer_putc(buf, (char)(type16 + 1));
+    append_be(buf, count, 4);
+  }
 }
 
-static void toplevel_handle_app_id(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    const char *app_id) {
-  struct toplevel_v1 *toplevel = data;
-  free(toplevel->pending.app_id);
-  toplevel->pending.app_id = strdup(app_id);
+static void msgpack_string(struct output_buffer *buf, const char *str) {
+  size_t len = strlen(str);
+  msgpack_head(buf, 0xa0, 31, 0xd9, 0xda, len);
+  output_buffer_append(buf, str, len);
 }
 
-static void toplevel_handle_output_enter(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    struct wl_output *output) {
-   struct toplevel_v1 *toplevel = data;
-  //print_toplevel(toplevel, false);
-  printf(" enter output %u\n",
-         (uint32_t)(size_t)wl_output_get_user_data(output));
+static void msgpack_begin_array(struct output_buffer *buf, size_t count) {
+  msgpack_head(buf, 0x90, 15, 0, 0xdc, count);
 }
 
-static void toplevel_handle_output_leave(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    struct wl_output *output) {
-      struct toplevel_v1 *toplevel = data;
-      print_toplevel(toplevel, false);
-  
-      printf(" leave output %u\n",
-         (uint32_t)(size_t)wl_output_get_user_data(output));
+static void msgpack_begin_map(struct output_buffer *buf, size_t count) {
+  msgpack_head(buf, 0x80, 15, 0, 0xde, count);
 }
 
-static uint32_t array_to_state(struct wl_array *array) {
-  uint32_t state = 0;
-  uint32_t *entry;
+static void msgpack_map_key(struct output_buffer *buf, const char *key,
+                            size_t index) {
+  msgpack_string(buf, key);
+}
 
-  wl_array_for_each(entry, array) {
-    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED)
-      state |= TOPLEVEL_STATE_MAXIMIZED;
-    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED)
-      state |= TOPLEVEL_STATE_MINIMIZED;
-    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED)
-      state |= TOPLEVEL_STATE_ACTIVATED;
-    if (*entry == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN)
-      state |= TOPLEVEL_STATE_FULLSCREEN;
+static void msgpack_value(struct output_buffer *buf,
+                          const struct field_value *value) {
+  switch (value->type) {
+  case FIELD_TYPE_NULL:
+    output_buffer_putc(buf, (char)0xc0);
+    break;
+  case FIELD_TYPE_UINT:
+    if (value->uint <= 0x7f) {
+      output_buffer_putc(buf, (char)value->uint);
+    } else if (value->uint <= UINT8_MAX) {
+      output_buffer_putc(buf, (char)0xcc);
+      append_be(buf, value->uint, 1);
+    } else if (value->uint <= UINT16_MAX) {
+      output_buffer_putc(buf, (char)0xcd);
+      append_be(buf, value->uint, 2);
+    } else if (value->uint <= UINT32_MAX) {
+      output_buffer_putc(buf, (char)0xce);
+      append_be(buf, value->uint, 4);
+    } else {
+      output_buffer_putc(buf, (char)0xcf);
+      append_be(buf, value->uint, 8);
+    }
+    break;
+  case FIELD_TYPE_STRING:
+    msgpack_string(buf, value->string);
+    break;
+  case FIELD_TYPE_BOOL:
+    output_buffer_putc(buf, (char)(value->boolean ? 0xc3 : 0xc2));
+    break;
   }
-
-  return state;
 }
 
-static void toplevel_handle_state(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    struct wl_array *state) {
-  struct toplevel_v1 *toplevel = data;
-  toplevel->pending.state = array_to_state(state);
-}
+static const struct encoder msgpack_encoder = {
+    .binary = true,
+    .fragments = &msgpack_fragments,
+    .begin_array = msgpack_begin_array,
+    .array_item = noop_item,
+    .end_array = noop_end,
+    .begin_map = msgpack_begin_map,
+    .map_key = msgpack_map_key,
+    .end_map = noop_end,
+    .value = msgpack_value,
+};
 
-static void finish_toplevel_state(struct toplevel_state *state) {
-  free(state->title);
-  free(state->app_id);
+static const struct encoder *encoder_for_format(enum output_format format) {
+  switch (format) {
+  case OUTPUT_CBOR:
+    return &cbor_encoder;
+  case OUTPUT_MSGPACK:
+    return &msgpack_encoder;
+  default:
+    return &json_encoder;
+  }
 }
 
-static void toplevel_handle_parent(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel,
-    struct zwlr_foreign_toplevel_handle_v1 *zwlr_parent) {
-  struct toplevel_v1 *toplevel = data;
-  toplevel->pending.parent_id = no_parent;
+// Returns whether the id is in the cache, *index is where it is or would go.
+static bool fragment_find(const struct fragment_cache *cache, uint32_t id,
+                          size_t *index) {
+  size_t low = 0, high = cache->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (cache->items[mid].id < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  *index = low;
+  return low < cache->count && cache->items[low].id == id;
+}
 
-  if (zwlr_parent) {
-    struct toplevel_v1 *toplevel_tmp;
-    wl_list_for_each(toplevel_tmp, &toplevel_list, link) {
+static struct fragment *fragment_get(struct fragment_cache *cache,
+                                     uint32_t id) {
+  size_t index;
+  if (fragment_find(cache, id, &index)) {
+    return &cache->items[index];
+  }
 
-      if (toplevel_tmp->zwlr_toplevel == zwlr_parent) {
-        toplevel->pending.parent_id = toplevel_tmp->id;
-        break;
-      }
+  if (cache->count == cache->capacity) {
+    size_t new_capacity = cache->capacity ? cache->capacity * 2 : 8;
+    struct fragment *items =
+        realloc(cache->items, new_capacity * sizeof(struct fragment));
+    if (!items) {
+      return NULL;
     }
+    cache->items = items;
+    cache->capacity = new_capacity;
+  }
 
-    if (toplevel->pending.parent_id == no_parent) {
-      fprintf(stderr, "Cannot find parent toplevel!\n");
+  memmove(&cache->items[index + 1], &cache->items[index],
+          (cache->count - index) * sizeof(struct fragment));
+  cache->items[index] = (struct fragment){.id = id};
+  cache->count++;
+  return &cache->items[index];
+}
+
+// Called for every change event, the next snapshot encodes it again.
+static void fragments_invalidate(uint32_t id) {
+  size_t index;
+  for (size_t i = 0; i < sizeof(fragment_caches) / sizeof(fragment_caches[0]);
+       ++i) {
+    if (fragment_find(fragment_caches[i], id, &index)) {
+      fragment_caches[i]->items[index].valid = false;
     }
   }
 }
 
-static void toplevel_handle_done(
-    void *data,
-     struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
-  struct toplevel_v1 *toplevel = data;
-  bool state_changed = toplevel->current.state != toplevel->pending.state;
+static void fragments_invalidate_all(void) {
+  for (size_t i = 0; i < sizeof(fragment_caches) / sizeof(fragment_caches[0]);
+       ++i) {
+    for (size_t j = 0; j < fragment_caches[i]->count; ++j) {
+      fragment_caches[i]->items[j].valid = false;
+    }
+  }
+}
 
-  copy_state(&toplevel->current, &toplevel->pending, toplevel);
+static void fragments_remove(uint32_t id) {
+  size_t index;
+  for (size_t i = 0; i < sizeof(fragment_caches) / sizeof(fragment_caches[0]);
+       ++i) {
+    struct fragment_cache *cache = fragment_caches[i];
+    if (fragment_find(cache, id, &index)) {
+      free(cache->items[index].data.data);
+      memmove(&cache->items[index], &cache->items[index + 1],
+              (cache->count - index - 1) * sizeof(struct fragment));
+      cache->count--;
+    }
+  }
+}
 
-  if (!json_out) {
-    print_toplevel(toplevel, !state_changed);
-    if (state_changed) {
-      print_toplevel_state(toplevel, true);
+// Ids are only unique within a connection, so the caches start over when
+// the compositor goes away.
+static void fragments_clear(void) {
+  for (size_t i = 0; i < sizeof(fragment_caches) / sizeof(fragment_caches[0]);
+       ++i) {
+    struct fragment_cache *cache = fragment_caches[i];
+    for (size_t j = 0; j < cache->count; ++j) {
+      free(cache->items[j].data.data);
     }
+    cache->count = 0;
   }
 }
 
-static void
-toplevel_handle_closed(void *data,
-                       struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
-  struct toplevel_v1 *toplevel = data;
+static void encode_toplevel_fields(const struct encoder *encoder,
+                                   struct output_buffer *buf,
+                                   const struct wlrapps_toplevel *info) {
+  struct fragment *fragment = fragment_get(encoder->fragments, info->id);
+  struct output_buffer *out = fragment ? &fragment->data : buf;
 
-  if (!json_out) {
-    print_toplevel(toplevel, false);
+  if (fragment && fragment->valid && fragment->mru == info->mru) {
+    output_buffer_append(buf, fragment->data.data, fragment->data.len);
+    return;
+  }
+
+  // Without memory for the cache the fields go straight to the output.
+  if (fragment) {
+    fragment->data.len = 0;
+  }
+  for (size_t field = 0; field < FIELD_COUNT; ++field) {
+    struct field_value value = get_field(info, field);
+    encoder->map_key(out, field_names[field], field);
+    encoder->value(out, &value);
+  }
+
+  if (fragment) {
+    fragment->valid = true;
+    fragment->mru = info->mru;
+    output_buffer_append(buf, fragment->data.data, fragment->data.len);
   }
+}
 
-  remove_toplevel_info(&global_info_list, toplevel->id);
-  wl_list_remove(&toplevel->link);
+// In nested mode every record also holds its children, so dialogs end up
+// under the window they belong to.
+static void encode_toplevel(const struct encoder *encoder,
+                            struct output_buffer *buf,
+                            const struct subscription *sub,
+                            const struct wlrapps_toplevel *info, int depth) {
+  encoder->begin_map(buf, FIELD_COUNT + (nested_out ? 1 : 0));
+  encode_toplevel_fields(encoder, buf, info);
+
+  if (nested_out) {
+    const struct wlrapps_toplevel *child;
+    size_t count = 0;
+    size_t index = 0;
+
+    if (depth < MAX_TREE_DEPTH) {
+      wlrapps_for_each_child(child, info) {
+        count += subscription_matches(sub, child->id);
+      }
+    }
 
-  zwlr_foreign_toplevel_handle_v1_destroy(zwlr_toplevel);
+    encoder->map_key(buf, "children", FIELD_COUNT);
+    encoder->begin_array(buf, count);
+    if (count > 0) {
+      wlrapps_for_each_child(child, info) {
+        if (subscription_matches(sub, child->id)) {
+          encoder->array_item(buf, index++);
+          encode_toplevel(encoder, buf, sub, child, depth + 1);
+        }
+      }
+    }
+    encoder->end_array(buf);
+  }
 
-  finish_toplevel_state(&toplevel->current);
-  finish_toplevel_state(&toplevel->pending);
+  encoder->end_map(buf);
+}
 
-  free(toplevel);
+// A child whose parent is filtered out moves up to the top level.
+static bool is_root_toplevel(const struct subscription *sub,
+                             const struct wlrapps_toplevel *info) {
+  return !nested_out || info->parent_id == WLRAPPS_NO_PARENT ||
+         !subscription_matches(sub, info->parent_id);
 }
 
-static const struct zwlr_foreign_toplevel_handle_v1_listener toplevel_impl = {
-    .title = toplevel_handle_title,
-    .app_id = toplevel_handle_app_id,
-    .output_enter = toplevel_handle_output_enter,
-    .output_leave = toplevel_handle_output_leave,
-    .state = toplevel_handle_state,
-    .done = toplevel_handle_done,
-    .closed = toplevel_handle_closed,
-    .parent = toplevel_handle_parent};
+// Json frames end with a newline, binary frames start with their length as a
+// 32 bit big endian integer.
+static size_t begin_frame(const struct encoder *encoder,
+                          struct output_buffer *buf) {
+  size_t frame_start = buf->len;
+  if (encoder->binary) {
+    append_be(buf, 0, 4);
+  }
+  return frame_start;
+}
 
-static void toplevel_manager_handle_toplevel(
-     void *data,
-     struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager,
-    struct zwlr_foreign_toplevel_handle_v1 *zwlr_toplevel) {
-  struct toplevel_v1 *toplevel = calloc(1, sizeof(*toplevel));
-  if (!toplevel) {
-    fprintf(stderr, "Failed to allocate memory for toplevel\n");
-    return;
+static void end_frame(const struct encoder *encoder, struct output_buffer *buf,
+                      size_t frame_start) {
+  if (encoder->binary) {
+    uint32_t len = (uint32_t)(buf->len - frame_start - 4);
+    for (size_t i = 0; i < 4; ++i) {
+      buf->data[frame_start + i] = (char)((len >> ((3 - i) * 8)) & 0xff);
+    }
+  } else {
+    output_buffer_putc(buf, '\n');
   }
+}
 
-  toplevel->id = global_id;
-  global_id++;
+// Appends an array of every collected toplevel.
+static void encode_toplevels(const struct encoder *encoder,
+                             struct output_buffer *buf,
+                             const struct subscription *sub) {
+  size_t count = 0;
+  for (size_t i = 0; i < global_info_list.count; ++i) {
+    count += is_root_toplevel(sub, global_info_list.items[i]);
+  }
 
-  toplevel->zwlr_toplevel = zwlr_toplevel;
-  toplevel->current.parent_id = no_parent;
-  toplevel->pending.parent_id = no_parent;
+  size_t index = 0;
+  encoder->begin_array(buf, count);
+  for (size_t i = 0; i < global_info_list.count; ++i) {
+    if (is_root_toplevel(sub, global_info_list.items[i])) {
+      encoder->array_item(buf, index++);
+      encode_toplevel(encoder, buf, sub, global_info_list.items[i], 0);
+    }
+  }
+  encoder->end_array(buf);
+}
 
-  wl_list_insert(&toplevel_list, &toplevel->link);
+// Appends one frame holding every collected toplevel.
+static void encode_toplevel_array(const struct encoder *encoder,
+                                  struct output_buffer *buf,
+                                  const struct subscription *sub) {
+  size_t frame_start = begin_frame(encoder, buf);
+  encode_toplevels(encoder, buf, sub);
+  end_frame(encoder, buf, frame_start);
+}
 
-  struct toplevel_info new_info = {.tl_id = toplevel->id,
-                                   .tl_title = NULL,
-                                   .tl_app_id = NULL,
-                                   .tl_parent_id = no_parent,
-                                   .maximized = false,
-                                   .minimized = false,
-                                   .active = false,
-                                   .fullscreen = false};
+// A frame with a {"status": ...} object instead of the toplevel array, only
+// sent in reconnect mode while the compositor is gone.
+static void encode_status(const struct encoder *encoder,
+                          struct output_buffer *buf, const char *status) {
+  size_t frame_start = begin_frame(encoder, buf);
+  struct field_value value = string_value(status);
 
-  add_toplevel_info(&global_info_list, &new_info);
+  encoder->begin_map(buf, 1);
+  encoder->map_key(buf, "status", 0);
+  encoder->value(buf, &value);
+  encoder->end_map(buf);
 
-  zwlr_foreign_toplevel_handle_v1_add_listener(zwlr_toplevel, &toplevel_impl,
-                                               toplevel);
+  end_frame(encoder, buf, frame_start);
 }
 
-static void toplevel_manager_handle_finished(
-    void *data, struct zwlr_foreign_toplevel_manager_v1 *toplevel_manager) {
-  zwlr_foreign_toplevel_manager_v1_destroy(toplevel_manager);
-}
+// ---- Format Templates ----
+
+// A --format template is compiled once into a flat list of ops that runs
+// directly against the toplevel records. A field op renders the value into a
+// scratch buffer, filter ops rewrite it and an emit op appends it to the
+// output. A conditional skips the ops of its body when the field is falsy.
+enum template_op_type {
+  TEMPLATE_LITERAL,
+  TEMPLATE_FIELD,
+  TEMPLATE_FILTER,
+  TEMPLATE_EMIT,
+  TEMPLATE_COND,
+};
 
-static const struct zwlr_foreign_toplevel_manager_v1_listener
-    toplevel_manager_impl = {
-        .toplevel = toplevel_manager_handle_toplevel,
-        .finished = toplevel_manager_handle_finished,
+enum template_filter {
+  TEMPLATE_FILTER_TRUNC,
+  TEMPLATE_FILTER_UPPER,
+  TEMPLATE_FILTER_LOWER,
 };
 
-static void handle_global( void *data,
-                          struct wl_registry *registry, uint32_t name,
-                          const char *interface, uint32_t version) {
+struct template_op {
+  enum template_op_type type;
+  union {
+    struct {
+      size_t offset; // Into template.literals
+      size_t len;
+    } literal;
+    enum toplevel_field field;
+    struct {
+      enum template_filter filter;
+      size_t arg;
+    } filter;
+    struct {
+      enum toplevel_field field;
+      bool negate;
+      size_t skip; // Number of ops in the body
+    } cond;
+  };
+};
 
-  if (strcmp(interface, wl_output_interface.name) == 0) {
-    if (name == pref_output_id) {
-      pref_output =
-          wl_registry_bind(registry, name, &wl_output_interface, version);
-    }
-  } else if (strcmp(interface,
-                    zwlr_foreign_toplevel_manager_v1_interface.name) == 0) {
-    toplevel_manager = wl_registry_bind(
-        registry, name, &zwlr_foreign_toplevel_manager_v1_interface,
-        WLR_FOREIGN_TOPLEVEL_MANAGEMENT_VERSION);
+struct template {
+  struct template_op *ops;
+  size_t count;
+  size_t capacity;
+  struct output_buffer literals;
+};
 
-    wl_list_init(&toplevel_list);
-    zwlr_foreign_toplevel_manager_v1_add_listener(toplevel_manager,
-                                                  &toplevel_manager_impl, NULL);
-  } else if (strcmp(interface, wl_seat_interface.name) == 0 && seat == NULL) {
-    seat = wl_registry_bind(registry, name, &wl_seat_interface, version);
+static struct template toplevel_template = {0};
+static char *template_separator = NULL;
+
+static struct template_op *template_add_op(struct template *tpl,
+                                           enum template_op_type type) {
+  if (tpl->count == tpl->capacity) {
+    size_t new_capacity = tpl->capacity ? tpl->capacity * 2 : 8;
+    struct template_op *ops =
+        realloc(tpl->ops, new_capacity * sizeof(struct template_op));
+    if (!ops) {
+      return NULL;
+    }
+    tpl->ops = ops;
+    tpl->capacity = new_capacity;
   }
+
+  struct template_op *op = &tpl->ops[tpl->count++];
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  return op;
 }
 
-static void handle_global_remove( void *data,
-                                  struct wl_registry *registry,
-                                  uint32_t name) {
-  // who cares
+// Appends a literal character, merging it with the previous op if that one
+// is a literal as well.
+static bool template_add_char(struct template *tpl, char c) {
+  struct template_op *op = tpl->count ? &tpl->ops[tpl->count - 1] : NULL;
+  if (!op || op->type != TEMPLATE_LITERAL) {
+    if (!(op = template_add_op(tpl, TEMPLATE_LITERAL))) {
+      return false;
+    }
+    op->literal.offset = tpl->literals.len;
+  }
+  output_buffer_putc(&tpl->literals, c);
+  op->literal.len++;
+  return true;
 }
 
-static const struct wl_registry_listener registry_listener = {
-    .global = handle_global,
-    .global_remove = handle_global_remove,
-};
+static char unescape_char(char c) {
+  switch (c) {
+  case 'n':
+    return '\n';
+  case 't':
+    return '\t';
+  default:
+    return c;
+  }
+}
 
-static struct toplevel_v1 *toplevel_by_id_or_bail(int32_t id) {
-  if (id == -1) {
-    return NULL;
+static bool parse_template_field(const char **src, enum toplevel_field *field) {
+  size_t len = 0;
+  while (isalnum((unsigned char)(*src)[len]) || (*src)[len] == '_') {
+    len++;
   }
 
-  struct toplevel_v1 *toplevel;
-  wl_list_for_each(toplevel, &toplevel_list, link) {
-    if (toplevel->id == (uint32_t)id) {
-      return toplevel;
+  for (size_t i = 0; i < FIELD_COUNT; ++i) {
+    if (strlen(field_names[i]) == len && strncmp(field_names[i], *src, len) == 0) {
+      *field = i;
+      *src += len;
+      return true;
     }
   }
-  return 0;
+  return false;
 }
 
-// ---- Unix Socket Event Handler ---- //
-
-void handle_event(int client_fd, const char *event_data) {
+static bool parse_template_filter(struct template *tpl, const char **src) {
+  const char *p = *src;
+  while (*p == ' ') {
+    p++;
+  }
 
-  int focus_id = -1, close_id = -1;
-  int maximize_id = -1, unmaximize_id = -1;
-  int minimize_id = -1, restore_id = -1;
-  int fullscreen_id = -1, unfullscreen_id = -1;
+  struct template_op *op = template_add_op(tpl, TEMPLATE_FILTER);
+  if (!op) {
+    return false;
+  }
 
-  if (event_data == NULL || *event_data == '\0') {
-    fprintf(stderr, "Received empty data event from client %d.\n", client_fd);
-    return;
+  if (strncmp(p, "trunc", 5) == 0) {
+    char *endptr;
+    op->filter.filter = TEMPLATE_FILTER_TRUNC;
+    op->filter.arg = strtoul(p + 5, &endptr, 10);
+    if (endptr == p + 5) {
+      return false;
+    }
+    p = endptr;
+  } else if (strncmp(p, "upper", 5) == 0) {
+    op->filter.filter = TEMPLATE_FILTER_UPPER;
+    p += 5;
+  } else if (strncmp(p, "lower", 5) == 0) {
+    op->filter.filter = TEMPLATE_FILTER_LOWER;
+    p += 5;
+  } else {
+    return false;
   }
 
-  if ((strlen(event_data) < 3) || (event_data[1] != ' ')) {
-    fprintf(stderr,
-            "Invalid event data format from client %d: '%s'. Expected 'opt "
-            "<id>'.\n",
-            client_fd, event_data);
-    print_help();
-    return;
+  while (*p == ' ') {
+    p++;
   }
+  *src = p;
+  return true;
+}
 
-  char command_char = event_data[0];
-  const char *argument_str = event_data + 2;
+// Compiles until the end of the string or, inside a conditional body, until
+// the closing brace. On error *src points at the offending character.
+static bool compile_template_ops(struct template *tpl, const char **src,
+                                 bool nested) {
+  while (**src) {
+    char c = **src;
 
-  char *endptr;
-  uint32_t window_id;
+    if (c == '}') {
+      if (nested) {
+        return true;
+      }
+      return false;
+    }
 
-  window_id = strtol(argument_str, &endptr, 10);
+    if (c == '\\' && (*src)[1]) {
+      if (!template_add_char(tpl, unescape_char((*src)[1]))) {
+        return false;
+      }
+      *src += 2;
+      continue;
+    }
 
-  if (endptr == argument_str) {
-    fprintf(stderr, "Error: no digits found in argument '%s' from client %d.\n",
-            argument_str, client_fd);
-    print_help();
-    return;
+    if (c != '{') {
+      if (!template_add_char(tpl, c)) {
+        return false;
+      }
+      (*src)++;
+      continue;
+    }
+
+    (*src)++;
+    bool negate = **src == '!';
+    if (negate) {
+      (*src)++;
+    }
+
+    enum toplevel_field field;
+    if (!parse_template_field(src, &field)) {
+      return false;
+    }
+
+    if (**src == '?') {
+      (*src)++;
+      size_t cond_index = tpl->count;
+      struct template_op *op = template_add_op(tpl, TEMPLATE_COND);
+      if (!op) {
+        return false;
+      }
+      op->cond.field = field;
+      op->cond.negate = negate;
+
+      if (!compile_template_ops(tpl, src, true) || **src != '}') {
+        return false;
+      }
+      tpl->ops[cond_index].cond.skip = tpl->count - cond_index - 1;
+      (*src)++;
+      continue;
+    }
+
+    if (negate) {
+      return false;
+    }
+
+    struct template_op *op = template_add_op(tpl, TEMPLATE_FIELD);
+    if (!op) {
+      return false;
+    }
+    op->field = field;
+
+    while (**src == '|') {
+      (*src)++;
+      if (!parse_template_filter(tpl, src)) {
+        return false;
+      }
+    }
+
+    if (**src != '}' || !template_add_op(tpl, TEMPLATE_EMIT)) {
+      return false;
+    }
+    (*src)++;
+  }
+
+  return !nested;
+}
+
+static bool compile_template(struct template *tpl, const char *src) {
+  const char *pos = src;
+  if (compile_template_ops(tpl, &pos, false)) {
+    return true;
+  }
+
+  fprintf(stderr, "Invalid format template at position %zu: %s\n",
+          (size_t)(pos - src), src);
+  return false;
+}
+
+static char *unescape_string(const char *src) {
+  char *str = malloc(strlen(src) + 1);
+  if (!str) {
+    return NULL;
+  }
+
+  char *dst = str;
+  for (; *src; ++src) {
+    if (*src == '\\' && src[1]) {
+      *dst++ = unescape_char(*++src);
+    } else {
+      *dst++ = *src;
+    }
+  }
+  *dst = '\0';
+  return str;
+}
+
+static bool field_is_truthy(const struct field_value *value) {
+  switch (value->type) {
+  case FIELD_TYPE_NULL:
+    return false;
+  case FIELD_TYPE_STRING:
+    return value->string[0] != '\0';
+  case FIELD_TYPE_BOOL:
+    return value->boolean;
+  default:
+    return true;
+  }
+}
+
+static void render_field_value(struct output_buffer *buf,
+                               const struct field_value *value) {
+  char number[24];
+
+  switch (value->type) {
+  case FIELD_TYPE_NULL:
+    break;
+  case FIELD_TYPE_UINT:
+    snprintf(number, sizeof(number), "%" PRIu64, value->uint);
+    output_buffer_puts(buf, number);
+    break;
+  case FIELD_TYPE_STRING:
+    output_buffer_puts(buf, value->string);
+    break;
+  case FIELD_TYPE_BOOL:
+    output_buffer_puts(buf, value->boolean ? "true" : "false");
+    break;
+  }
+}
+
+static void apply_template_filter(struct output_buffer *scratch,
+                                  const struct template_op *op) {
+  switch (op->filter.filter) {
+  case TEMPLATE_FILTER_TRUNC: {
+    // Counts UTF-8 characters rather than bytes, continuation bytes don't
+    // start a new character.
+    size_t chars = 0;
+    for (size_t i = 0; i < scratch->len; ++i) {
+      if (((unsigned char)scratch->data[i] & 0xc0) != 0x80 &&
+          chars++ == op->filter.arg) {
+        scratch->len = i;
+        output_buffer_puts(scratch, "…");
+        break;
+      }
+    }
+    break;
+  }
+  case TEMPLATE_FILTER_UPPER:
+    for (size_t i = 0; i < scratch->len; ++i) {
+      scratch->data[i] = toupper((unsigned char)scratch->data[i]);
+    }
+    break;
+  case TEMPLATE_FILTER_LOWER:
+    for (size_t i = 0; i < scratch->len; ++i) {
+      scratch->data[i] = tolower((unsigned char)scratch->data[i]);
+    }
+    break;
+  }
+}
+
+static void run_template(const struct template *tpl, struct output_buffer *buf,
+                         const struct wlrapps_toplevel *info) {
+  static struct output_buffer scratch = {0};
+  struct field_value value;
+
+  for (size_t i = 0; i < tpl->count; ++i) {
+    const struct template_op *op = &tpl->ops[i];
+
+    switch (op->type) {
+    case TEMPLATE_LITERAL:
+      output_buffer_append(buf, tpl->literals.data + op->literal.offset,
+                           op->literal.len);
+      break;
+    case TEMPLATE_FIELD:
+      scratch.len = 0;
+      value = get_field(info, op->field);
+      render_field_value(&scratch, &value);
+      break;
+    case TEMPLATE_FILTER:
+      apply_template_filter(&scratch, op);
+      break;
+    case TEMPLATE_EMIT:
+      output_buffer_append(buf, scratch.data, scratch.len);
+      break;
+    case TEMPLATE_COND:
+      value = get_field(info, op->cond.field);
+      if (field_is_truthy(&value) == op->cond.negate) {
+        i += op->cond.skip;
+      }
+      break;
+    }
+  }
+}
+
+// Appends one line with every toplevel rendered through the template.
+static void render_toplevel_templates(struct output_buffer *buf) {
+  for (size_t i = 0; i < global_info_list.count; ++i) {
+    if (i > 0) {
+      output_buffer_puts(buf, template_separator ? template_separator : " ");
+    }
+    run_template(&toplevel_template, buf, global_info_list.items[i]);
+  }
+  output_buffer_putc(buf, '\n');
+}
+
+static int compare_toplevel_info(const void *a, const void *b){
+  const struct wlrapps_toplevel *info_a =
+      *(const struct wlrapps_toplevel *const *)a;
+  const struct wlrapps_toplevel *info_b =
+      *(const struct wlrapps_toplevel *const *)b;
+
+  // Sort based on the sort_type that's currently enabled. 
+  // This could probably be faster but they are simple int comparisons so I don't think the performance penalty of this
+  // Nested if's statements is important.
+  if (sort_type == 1 || sort_type == 2){
+    if (info_a->id < info_b->id){
+      if (sort_type == 1){
+        return -1;
+      } else return 1;
+    } else if (info_a->id > info_b->id) {
+      if (sort_type == 1){
+        return 1;
+      } else return -1;
+    } else {
+      return 0;
+    }
+  } else if (sort_type == 3 || sort_type == 4) {
+    if (info_a->app_id[0] < info_b->app_id[0]){
+      if (sort_type == 4) {
+        return 1;
+      } else return -1;
+    } else if (info_a->app_id[0] > info_b->app_id[0]){
+      if (sort_type == 4){
+        return -1;
+      } else return 1;
+    } else {
+      return 0;
+    }
+
+  } 
+  // Just so that the compiler doesn't complain.
+  else return 0;
+}
+
+// Points the list at every record the subscription matches, in library
+// order. The records themselves aren't copied.
+static bool collect_toplevel_info(struct toplevel_list *list,
+                                  const struct subscription *sub) {
+  size_t count = wlrapps_toplevel_count();
+  // Shrinks again once most of the toplevels are gone.
+  if (count > list->capacity ||
+      (list->capacity > 64 && count < list->capacity / 4)) {
+    size_t new_capacity = 4;
+    while (new_capacity < count) {
+      new_capacity *= 2;
+    }
+    const struct wlrapps_toplevel **new_items =
+        realloc(list->items, new_capacity * sizeof(*new_items));
+    if (!new_items) {
+      return false;
+    }
+    list->items = new_items;
+    list->capacity = new_capacity;
+  }
+
+  list->count = 0;
+  const struct wlrapps_toplevel *toplevel;
+  wlrapps_for_each_toplevel(toplevel) {
+    if (subscription_matches(sub, toplevel->id)) {
+      list->items[list->count++] = toplevel;
+    }
+  }
+  return true;
+}
+
+// ---- Filter Expressions ----
+
+// A --filter expression is compiled once into bytecode that runs against a
+// single toplevel whenever it changes. "and" and "or" jump over their right
+// hand side as soon as the result is known, so the only state the evaluator
+// needs is the result of the previous op.
+enum filter_op_type {
+  FILTER_TRUTHY,
+  FILTER_EQUAL,
+  FILTER_GLOB,
+  FILTER_NOT,
+  FILTER_AND, // Jumps to the target if the result is false
+  FILTER_OR,  // Jumps to the target if the result is true
+};
+
+struct filter_op {
+  enum filter_op_type type;
+  enum toplevel_field field;
+  size_t target;
+  struct field_value constant;
+  char *text; // The constant as written, compared against string fields
+  bool required; // Every match passes this term, it's outside "not" and "or"
+};
+
+struct filter {
+  struct filter_op *ops;
+  size_t count;
+  size_t capacity;
+  bool uses_mru; // The ranks change without a toplevel event
+};
+
+struct filter_parser {
+  struct filter *filter;
+  const char *pos;
+  int depth;
+};
+
+static struct filter_op *filter_add_op(struct filter *filter,
+                                       enum filter_op_type type) {
+  if (filter->count == filter->capacity) {
+    size_t new_capacity = filter->capacity ? filter->capacity * 2 : 8;
+    struct filter_op *ops =
+        realloc(filter->ops, new_capacity * sizeof(struct filter_op));
+    if (!ops) {
+      return NULL;
+    }
+    filter->ops = ops;
+    filter->capacity = new_capacity;
+  }
+
+  struct filter_op *op = &filter->ops[filter->count++];
+  memset(op, 0, sizeof(*op));
+  op->type = type;
+  return op;
+}
+
+static void filter_finish(struct filter *filter) {
+  for (size_t i = 0; i < filter->count; ++i) {
+    free(filter->ops[i].text);
+  }
+  free(filter->ops);
+  memset(filter, 0, sizeof(*filter));
+}
+
+// The terms from start on sit under a "not" or an "or".
+static void filter_clear_required(struct filter *filter, size_t start) {
+  for (size_t i = start; i < filter->count; ++i) {
+    filter->ops[i].required = false;
+  }
+}
+
+// Consumes the operator or keyword if it comes next, keywords have to end at
+// a word boundary so "notify" isn't read as "not ify".
+static bool filter_accept(struct filter_parser *p, const char *token) {
+  while (isspace((unsigned char)*p->pos)) {
+    p->pos++;
+  }
+
+  size_t len = strlen(token);
+  if (strncmp(p->pos, token, len) != 0) {
+    return false;
+  }
+  if (isalpha((unsigned char)token[0]) &&
+      (isalnum((unsigned char)p->pos[len]) || p->pos[len] == '_')) {
+    return false;
+  }
+  p->pos += len;
+  return true;
+}
+
+// Values are quoted strings or barewords up to the next space or
+// parenthesis. Unquoted true, false, null and numbers compare against the
+// typed fields, every value also compares against string fields as text.
+static bool parse_filter_value(struct filter_parser *p, struct filter_op *op) {
+  while (isspace((unsigned char)*p->pos)) {
+    p->pos++;
+  }
+
+  const char *start = p->pos;
+  bool quoted = *p->pos == '"' || *p->pos == '\'';
+  if (quoted) {
+    char quote = *p->pos++;
+    start = p->pos;
+    while (*p->pos && *p->pos != quote) {
+      p->pos++;
+    }
+    if (!*p->pos) {
+      return false;
+    }
+  } else {
+    while (*p->pos && !isspace((unsigned char)*p->pos) && *p->pos != '(' &&
+           *p->pos != ')') {
+      p->pos++;
+    }
+    if (p->pos == start) {
+      return false;
+    }
+  }
+
+  if (!(op->text = strndup(start, p->pos - start))) {
+    return false;
+  }
+  if (quoted) {
+    p->pos++;
+  }
+
+  char *endptr;
+  unsigned long number = strtoul(op->text, &endptr, 10);
+  if (quoted) {
+    op->constant = string_value(op->text);
+  } else if (strcmp(op->text, "true") == 0 || strcmp(op->text, "false") == 0) {
+    op->constant.type = FIELD_TYPE_BOOL;
+    op->constant.boolean = op->text[0] == 't';
+  } else if (strcmp(op->text, "null") == 0) {
+    op->constant.type = FIELD_TYPE_NULL;
+  } else if (isdigit((unsigned char)op->text[0]) && *endptr == '\0' &&
+             number <= UINT32_MAX) {
+    op->constant.type = FIELD_TYPE_UINT;
+    op->constant.uint = (uint32_t)number;
+  } else {
+    op->constant = string_value(op->text);
+  }
+  return true;
+}
+
+static bool compile_filter_or(struct filter_parser *p);
+
+static bool compile_filter_unary(struct filter_parser *p) {
+  if (++p->depth > MAX_FILTER_DEPTH) {
+    return false;
+  }
+
+  size_t start = p->filter->count;
+  if (filter_accept(p, "not") || filter_accept(p, "!")) {
+    if (!compile_filter_unary(p) || !filter_add_op(p->filter, FILTER_NOT)) {
+      return false;
+    }
+    filter_clear_required(p->filter, start);
+  } else if (filter_accept(p, "(")) {
+    if (!compile_filter_or(p) || !filter_accept(p, ")")) {
+      return false;
+    }
+  } else {
+    enum toplevel_field field;
+    if (!parse_template_field(&p->pos, &field)) {
+      return false;
+    }
+    p->filter->uses_mru |= field == FIELD_MRU;
+
+    enum filter_op_type type = FILTER_TRUTHY;
+    bool negate = false;
+    if (filter_accept(p, "==")) {
+      type = FILTER_EQUAL;
+    } else if (filter_accept(p, "!=")) {
+      type = FILTER_EQUAL;
+      negate = true;
+    } else if (filter_accept(p, "~")) {
+      type = FILTER_GLOB;
+    } else if (filter_accept(p, "!~")) {
+      type = FILTER_GLOB;
+      negate = true;
+    }
+
+    struct filter_op *op = filter_add_op(p->filter, type);
+    if (!op) {
+      return false;
+    }
+    op->field = field;
+    op->required = !negate;
+    if (type != FILTER_TRUTHY && !parse_filter_value(p, op)) {
+      return false;
+    }
+    if (negate && !filter_add_op(p->filter, FILTER_NOT)) {
+      return false;
+    }
+  }
+
+  p->depth--;
+  return true;
+}
+
+static bool compile_filter_and(struct filter_parser *p) {
+  if (!compile_filter_unary(p)) {
+    return false;
+  }
+
+  while (filter_accept(p, "and") || filter_accept(p, "&&")) {
+    size_t jump = p->filter->count;
+    if (!filter_add_op(p->filter, FILTER_AND) || !compile_filter_unary(p)) {
+      return false;
+    }
+    p->filter->ops[jump].target = p->filter->count;
+  }
+  return true;
+}
+
+static bool compile_filter_or(struct filter_parser *p) {
+  size_t start = p->filter->count;
+  if (!compile_filter_and(p)) {
+    return false;
+  }
+
+  while (filter_accept(p, "or") || filter_accept(p, "||")) {
+    size_t jump = p->filter->count;
+    if (!filter_add_op(p->filter, FILTER_OR) || !compile_filter_and(p)) {
+      return false;
+    }
+    p->filter->ops[jump].target = p->filter->count;
+    filter_clear_required(p->filter, start);
+  }
+  return true;
+}
+
+static bool compile_filter(struct filter *filter, const char *src) {
+  struct filter_parser parser = {.filter = filter, .pos = src};
+  if (compile_filter_or(&parser)) {
+    while (isspace((unsigned char)*parser.pos)) {
+      parser.pos++;
+    }
+    if (*parser.pos == '\0') {
+      return true;
+    }
+  }
+
+  fprintf(stderr, "Invalid filter at position %zu: %s\n",
+          (size_t)(parser.pos - src), src);
+  filter_finish(filter);
+  return false;
+}
+
+// Null only equals null, a string field compares against the constant as
+// written and the other types have to match exactly.
+static bool filter_equal(const struct field_value *value,
+                         const struct filter_op *op) {
+  if (value->type == FIELD_TYPE_NULL || op->constant.type == FIELD_TYPE_NULL) {
+    return value->type == op->constant.type;
+  }
+
+  switch (value->type) {
+  case FIELD_TYPE_STRING:
+    return strcmp(value->string, op->text) == 0;
+  case FIELD_TYPE_UINT:
+    return op->constant.type == FIELD_TYPE_UINT &&
+           value->uint == op->constant.uint;
+  case FIELD_TYPE_BOOL:
+    return op->constant.type == FIELD_TYPE_BOOL &&
+           value->boolean == op->constant.boolean;
+  default:
+    return false;
+  }
+}
+
+// Globs match the value as --format would print it, a null field never
+// matches.
+static bool filter_glob(const struct field_value *value,
+                        const struct filter_op *op) {
+  static struct output_buffer scratch = {0};
+
+  if (value->type == FIELD_TYPE_NULL) {
+    return false;
+  }
+  if (value->type == FIELD_TYPE_STRING) {
+    return fnmatch(op->text, value->string, 0) == 0;
+  }
+
+  scratch.len = 0;
+  render_field_value(&scratch, value);
+  output_buffer_putc(&scratch, '\0');
+  return fnmatch(op->text, scratch.data, 0) == 0;
+}
+
+// An empty filter matches every toplevel.
+static bool filter_matches(const struct filter *filter,
+                           const struct wlrapps_toplevel *info) {
+  bool result = true;
+  size_t pc = 0;
+
+  while (pc < filter->count) {
+    const struct filter_op *op = &filter->ops[pc++];
+    struct field_value value;
+
+    switch (op->type) {
+    case FILTER_TRUTHY:
+      value = get_field(info, op->field);
+      result = field_is_truthy(&value);
+      break;
+    case FILTER_EQUAL:
+      value = get_field(info, op->field);
+      result = filter_equal(&value, op);
+      break;
+    case FILTER_GLOB:
+      value = get_field(info, op->field);
+      result = filter_glob(&value, op);
+      break;
+    case FILTER_NOT:
+      result = !result;
+      break;
+    case FILTER_AND:
+      if (!result) {
+        pc = op->target;
+      }
+      break;
+    case FILTER_OR:
+      if (result) {
+        pc = op->target;
+      }
+      break;
+    }
+  }
+  return result;
+}
+
+// ---- Subscriptions ----
+
+// The toplevels that currently pass a filter, sorted by id. The mru rank
+// from the last snapshot is kept to notice when only the order changed.
+struct match_entry {
+  uint32_t id;
+  uint32_t mru;
+};
+
+struct match_set {
+  struct match_entry *entries;
+  size_t count;
+  size_t capacity;
+};
+
+// Stdout and every subscribed socket client get their own filter and
+// matching set. Snapshots are only written when a toplevel entered, left or
+// changed inside that set, so updates to filtered out toplevels produce no
+// output at all.
+struct subscription {
+  struct subscription *next;
+  int fd; // -1 for stdout
+  struct filter filter;
+  struct match_set matches;
+  struct output_buffer last; // The last write, to skip identical ones
+  bool dirty;
+  bool failed;
+  bool history; // Sent the history's events instead of snapshots
+};
+
+static struct subscription stdout_subscription = {.fd = -1};
+static struct subscription *subscribers = NULL;
+
+#define for_each_subscription(sub)                                             \
+  for (sub = &stdout_subscription; sub;                                        \
+       sub = sub == &stdout_subscription ? subscribers : sub->next)
+
+// Returns whether the id is in the set, *index is where it is or would go.
+static bool match_set_find(const struct match_set *set, uint32_t id,
+                           size_t *index) {
+  size_t low = 0, high = set->count;
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (set->entries[mid].id < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  *index = low;
+  return low < set->count && set->entries[low].id == id;
+}
+
+static bool match_set_insert(struct match_set *set, size_t index,
+                             uint32_t id, uint32_t mru) {
+  if (set->count == set->capacity) {
+    size_t new_capacity = set->capacity ? set->capacity * 2 : 8;
+    struct match_entry *entries =
+        realloc(set->entries, new_capacity * sizeof(struct match_entry));
+    if (!entries) {
+      return false;
+    }
+    set->entries = entries;
+    set->capacity = new_capacity;
+  }
+
+  memmove(&set->entries[index + 1], &set->entries[index],
+          (set->count - index) * sizeof(struct match_entry));
+  set->entries[index] = (struct match_entry){.id = id, .mru = mru};
+  set->count++;
+  return true;
+}
+
+static void match_set_remove(struct match_set *set, size_t index) {
+  memmove(&set->entries[index], &set->entries[index + 1],
+          (set->count - index - 1) * sizeof(struct match_entry));
+  set->count--;
+}
+
+static bool subscription_matches(const struct subscription *sub, uint32_t id) {
+  size_t index;
+  return match_set_find(&sub->matches, id, &index);
+}
+
+// Runs the filter on a single toplevel. The subscription needs a new
+// snapshot if the toplevel entered or left the set, or changed inside it.
+static void subscription_update(struct subscription *sub,
+                                const struct wlrapps_toplevel *toplevel,
+                                bool changed) {
+  size_t index;
+  bool was_matching = match_set_find(&sub->matches, toplevel->id, &index);
+  bool matching = filter_matches(&sub->filter, toplevel);
+
+  if (matching && !was_matching &&
+      !match_set_insert(&sub->matches, index, toplevel->id, toplevel->mru)) {
+    fprintf(stderr, "Failed to allocate memory for the filter matches\n");
+    return;
+  }
+  if (!matching && was_matching) {
+    match_set_remove(&sub->matches, index);
+  }
+
+  sub->dirty |= matching != was_matching || (matching && changed);
+}
+
+static void subscription_remove(struct subscription *sub, uint32_t id) {
+  size_t index;
+  if (match_set_find(&sub->matches, id, &index)) {
+    match_set_remove(&sub->matches, index);
+    sub->dirty = true;
+  }
+}
+
+// Rebuilds the set from scratch, after (re)connecting.
+static void subscription_refresh(struct subscription *sub) {
+  const struct wlrapps_toplevel *toplevel;
+
+  sub->matches.count = 0;
+  wlrapps_for_each_toplevel(toplevel) {
+    subscription_update(sub, toplevel, false);
+  }
+  sub->dirty = true;
+}
+
+// Ranks are recomputed lazily by libwlrapps, so order changes are only seen
+// by comparing them against the last snapshot.
+static void subscription_check_order(struct subscription *sub) {
+  const struct wlrapps_toplevel *toplevel;
+  size_t index;
+
+  wlrapps_for_each_toplevel(toplevel) {
+    if (sub->filter.uses_mru) {
+      subscription_update(sub, toplevel, false);
+    }
+    if (match_set_find(&sub->matches, toplevel->id, &index) &&
+        sub->matches.entries[index].mru != toplevel->mru) {
+      sub->dirty = true;
+    }
+  }
+}
+
+static struct subscription *find_subscriber(int fd) {
+  for (struct subscription *sub = subscribers; sub; sub = sub->next) {
+    if (sub->fd == fd) {
+      return sub;
+    }
+  }
+  return NULL;
+}
+
+static void remove_subscriber(int fd) {
+  for (struct subscription **link = &subscribers; *link;
+       link = &(*link)->next) {
+    struct subscription *sub = *link;
+    if (sub->fd == fd) {
+      *link = sub->next;
+      filter_finish(&sub->filter);
+      free(sub->matches.entries);
+      free(sub->last.data);
+      free(sub);
+      return;
+    }
+  }
+}
+
+// The history is encoded once for every consumer, json unless stdout is
+// binary.
+static enum output_format history_format(void) {
+  if (output_format == OUTPUT_CBOR || output_format == OUTPUT_MSGPACK) {
+    return output_format;
+  }
+  return OUTPUT_JSON;
+}
+
+// Socket subscribers always get a structured format, json if stdout is text.
+static enum output_format subscription_format(const struct subscription *sub) {
+  if (sub->history) {
+    return history_format();
+  }
+  if (sub->fd != -1 && output_format == OUTPUT_TEXT) {
+    return OUTPUT_JSON;
+  }
+  return output_format;
+}
+
+// A subscriber that can't take a whole frame right away is dropped rather
+// than blocking the daemon or leaving it with a torn frame. Shutting the
+// socket down makes poll report the hang-up, which frees the slot.
+static void subscription_send(struct subscription *sub, const char *data,
+                              size_t len) {
+  if (sub->failed) {
+    return;
+  }
+
+  ssize_t sent = send(sub->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent != (ssize_t)len) {
+    fprintf(stderr, "Dropping subscriber %d, it isn't reading.\n", sub->fd);
+    sub->failed = true;
+    shutdown(sub->fd, SHUT_RDWR);
+  }
+}
+
+static void subscription_write(struct subscription *sub,
+                               const struct output_buffer *buf) {
+  // A state that flapped and settled back encodes to the same bytes as the
+  // last write, the consumer already has it.
+  if (sub->last.len > 0 && sub->last.len == buf->len &&
+      memcmp(sub->last.data, buf->data, buf->len) == 0) {
+    return;
+  }
+  sub->last.len = 0;
+  output_buffer_append(&sub->last, buf->data, buf->len);
+  output_buffer_trim(&sub->last);
+
+  if (sub->fd == -1) {
+    fwrite(buf->data, 1, buf->len, stdout);
+    fflush(stdout);
+    return;
+  }
+  subscription_send(sub, buf->data, buf->len);
+}
+
+// Collects the toplevels matching the subscription in output order.
+static bool collect_snapshot(const struct subscription *sub) {
+  if (!collect_toplevel_info(&global_info_list, sub)) {
+    fprintf(stderr, "Failed to allocate memory for the toplevel list\n");
+    return false;
+  }
+
+  if (global_info_list.count > 0 && sort_out) {
+    qsort(global_info_list.items, global_info_list.count, sizeof(global_info_list.items[0]), compare_toplevel_info);
+  }
+  return true;
+}
+
+static void print_snapshot(struct subscription *sub) {
+  enum output_format format = subscription_format(sub);
+
+  if (!collect_snapshot(sub)) {
+    return;
+  }
+
+  output_buffer.len = 0;
+  if (format == OUTPUT_TEMPLATE) {
+    render_toplevel_templates(&output_buffer);
+  } else {
+    encode_toplevel_array(encoder_for_format(format), &output_buffer, sub);
+  }
+  subscription_write(sub, &output_buffer);
+  output_buffer_trim(&output_buffer);
+
+  size_t index;
+  for (size_t i = 0; i < global_info_list.count; ++i) {
+    if (match_set_find(&sub->matches, global_info_list.items[i]->id, &index)) {
+      sub->matches.entries[index].mru = global_info_list.items[i]->mru;
+    }
+  }
+  sub->dirty = false;
+}
+
+void print_toplevel_array(void) { print_snapshot(&stdout_subscription); }
+
+// Writes a snapshot to every structured consumer whose set changed. Text
+// output on stdout is printed by the event handlers instead.
+static void publish_snapshots(void) {
+  struct subscription *sub;
+  for_each_subscription(sub) {
+    if ((sub->fd == -1 && output_format == OUTPUT_TEXT) || sub->history) {
+      continue;
+    }
+    subscription_check_order(sub);
+    if (sub->dirty) {
+      print_snapshot(sub);
+    }
+  }
+}
+
+// Desktop entries changed names or icons of toplevels that didn't send any
+// event, so every toplevel counts as changed.
+static void reevaluate_subscriptions(void) {
+  const struct wlrapps_toplevel *toplevel;
+  struct subscription *sub;
+
+  fragments_invalidate_all();
+  for_each_subscription(sub) {
+    wlrapps_for_each_toplevel(toplevel) {
+      subscription_update(sub, toplevel, true);
+    }
+  }
+}
+
+static void refresh_subscriptions(void) {
+  struct subscription *sub;
+  for_each_subscription(sub) { subscription_refresh(sub); }
+}
+
+// ---- Event History ----
+
+// Every toplevel event gets a sequence number and is kept, encoded once, in a
+// ring bounded by both its number of events and their bytes. A consumer that
+// reconnects with "since <seq>" is sent the events it missed, or a snapshot
+// once they aren't all in the ring anymore. Sequence numbers start at the
+// daemon's start time in microseconds, so those handed out by an earlier
+// daemon always get a snapshot.
+#define HISTORY_EVENTS 1024
+#define HISTORY_BYTES (256 << 10)
+#define HISTORY_REPLAY_BYTES (64 << 10) // Past this a snapshot is cheaper
+
+struct history_event {
+  size_t offset; // In history_data
+  size_t len;
+};
+
+static struct history_event history_events[HISTORY_EVENTS];
+static char *history_data = NULL; // Only allocated in server mode
+static size_t history_first = 0;  // The oldest event
+static size_t history_count = 0;
+static uint64_t history_seq = 0; // Of the newest event
+static struct output_buffer history_buffer = {0};
+
+static bool history_init(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  history_seq = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+
+  if (!(history_data = malloc(HISTORY_BYTES))) {
+    fprintf(stderr, "Failed to allocate memory for the event history\n");
+    return false;
+  }
+  return true;
+}
+
+static struct history_event *history_at(size_t index) {
+  return &history_events[(history_first + index) % HISTORY_EVENTS];
+}
+
+// Evicts the oldest events until len bytes fit behind the newest one or,
+// wrapping around, in front of the oldest. Returns where they go.
+static size_t history_reserve(size_t len) {
+  while (history_count > 0) {
+    const struct history_event *oldest = history_at(0);
+    const struct history_event *newest = history_at(history_count - 1);
+    size_t end = newest->offset + newest->len;
+
+    if (history_count < HISTORY_EVENTS) {
+      if (newest->offset >= oldest->offset) {
+        if (HISTORY_BYTES - end >= len) {
+          return end;
+        }
+        if (oldest->offset >= len) {
+          return 0;
+        }
+      } else if (oldest->offset - end >= len) {
+        return end;
+      }
+    }
+
+    history_first = (history_first + 1) % HISTORY_EVENTS;
+    history_count--;
+  }
+  return 0;
+}
+
+// A {"seq": <n>, "event": <name>, ...} map, the caller adds the third key.
+static void history_begin_event(const struct encoder *encoder,
+                                struct output_buffer *buf, const char *name) {
+  struct field_value seq = {.type = FIELD_TYPE_UINT, .uint = history_seq};
+  struct field_value event = string_value(name);
+
+  encoder->begin_map(buf, 3);
+  encoder->map_key(buf, "seq", 0);
+  encoder->value(buf, &seq);
+  encoder->map_key(buf, "event", 1);
+  encoder->value(buf, &event);
+}
+
+// The toplevels the subscriber can see as an event at the current sequence
+// number.
+static void history_send_snapshot(struct subscription *sub) {
+  const struct encoder *encoder = encoder_for_format(history_format());
+  if (!collect_snapshot(sub)) {
+    return;
+  }
+
+  output_buffer.len = 0;
+  size_t frame_start = begin_frame(encoder, &output_buffer);
+  history_begin_event(encoder, &output_buffer, "snapshot");
+  encoder->map_key(&output_buffer, "toplevels", 2);
+  encode_toplevels(encoder, &output_buffer, sub);
+  encoder->end_map(&output_buffer);
+  end_frame(encoder, &output_buffer, frame_start);
+  subscription_send(sub, output_buffer.data, output_buffer.len);
+}
+
+// Stores a "changed" event with the toplevel's fields, or a "closed" event
+// with its id, and streams it to the history subscribers.
+static void history_record(const struct wlrapps_toplevel *toplevel,
+                           bool closed) {
+  if (!history_data) {
+    return;
+  }
+
+  const struct encoder *encoder = encoder_for_format(history_format());
+  struct output_buffer *buf = &history_buffer;
+  history_seq++;
+  buf->len = 0;
+  size_t frame_start = begin_frame(encoder, buf);
+  history_begin_event(encoder, buf, closed ? "closed" : "changed");
+  if (closed) {
+    struct field_value id = {.type = FIELD_TYPE_UINT, .uint = toplevel->id};
+    encoder->map_key(buf, "id", 2);
+    encoder->value(buf, &id);
+  } else {
+    encoder->map_key(buf, "toplevel", 2);
+    encoder->begin_map(buf, FIELD_COUNT);
+    encode_toplevel_fields(encoder, buf, toplevel);
+    encoder->end_map(buf);
+  }
+  encoder->end_map(buf);
+  end_frame(encoder, buf, frame_start);
+
+  // Without memory for the frame or room for it in the ring, the events
+  // before it can't be replayed either.
+  if (!buf->data || buf->len > HISTORY_BYTES) {
+    history_count = 0;
+  } else {
+    size_t offset = history_reserve(buf->len);
+    memcpy(history_data + offset, buf->data, buf->len);
+    *history_at(history_count) =
+        (struct history_event){.offset = offset, .len = buf->len};
+    history_count++;
+  }
+
+  for (struct subscription *sub = subscribers; buf->data && sub;
+       sub = sub->next) {
+    if (sub->history) {
+      subscription_send(sub, buf->data, buf->len);
+    }
+  }
+}
+
+// What the compositor did while it was gone isn't known, the reconnect is an
+// event that only a snapshot describes.
+static void history_reset(void) {
+  if (!history_data) {
+    return;
+  }
+
+  history_seq++;
+  history_count = 0;
+  for (struct subscription *sub = subscribers; sub; sub = sub->next) {
+    if (sub->history) {
+      history_send_snapshot(sub);
+    }
+  }
+}
+
+// Sends the events after seq in one write, false if some of them are gone or
+// a snapshot would be smaller.
+static bool history_replay(struct subscription *sub, uint64_t seq) {
+  uint64_t first_seq = history_seq - history_count + 1;
+  if (seq > history_seq || seq + 1 < first_seq) {
+    return false;
+  }
+
+  size_t skip = (size_t)(seq + 1 - first_seq);
+  size_t len = 0;
+  for (size_t i = skip; i < history_count; ++i) {
+    len += history_at(i)->len;
+  }
+  if (len > HISTORY_REPLAY_BYTES) {
+    return false;
+  }
+
+  output_buffer.len = 0;
+  for (size_t i = skip; i < history_count; ++i) {
+    const struct history_event *event = history_at(i);
+    output_buffer_append(&output_buffer, history_data + event->offset,
+                         event->len);
+  }
+  if (output_buffer.len > 0) {
+    subscription_send(sub, output_buffer.data, output_buffer.len);
+  }
+  return true;
+}
+
+// "since [<seq>]", the missed events or a snapshot and then every new event
+// as it happens.
+static bool history_client(int client_fd, const char *args) {
+  uint64_t seq = 0;
+  if (*args) {
+    char *endptr;
+    errno = 0;
+    seq = strtoull(args, &endptr, 10);
+    if (endptr == args || *endptr != '\0' || errno == ERANGE) {
+      fprintf(stderr,
+              "Error: invalid sequence number '%s' from client %d.\n", args,
+              client_fd);
+      return false;
+    }
+  }
+
+  if (!history_data) {
+    return false;
+  }
+
+  struct subscription *sub = find_subscriber(client_fd);
+  if (!sub) {
+    if (!(sub = calloc(1, sizeof(*sub)))) {
+      fprintf(stderr, "Failed to allocate memory for the subscription\n");
+      return false;
+    }
+    sub->fd = client_fd;
+    sub->next = subscribers;
+    subscribers = sub;
+  } else {
+    filter_finish(&sub->filter);
+  }
+  sub->history = true;
+  subscription_refresh(sub);
+
+  if (wlrapps_get_fd() == -1) {
+    // The snapshot follows with the reconnect.
+    output_buffer.len = 0;
+    encode_status(encoder_for_format(history_format()), &output_buffer,
+                  "disconnected");
+    subscription_send(sub, output_buffer.data, output_buffer.len);
+  } else if (!*args || !history_replay(sub, seq)) {
+    history_send_snapshot(sub);
+  }
+  return true;
+}
+
+// ---- Acknowledged Actions ----
+
+// A client that sent "sync <command>" and waits for the compositor to apply
+// it. The wl_display.sync barrier guarantees the compositor has seen the
+// requests, the ack then waits until the toplevels it ran on show the
+// resulting state.
+struct pending_ack {
+  struct pending_ack *next;
+  int fd;
+  uint32_t serial; // Identifies the ack in the sync callback
+  bool synced;
+  bool has_action; // Named commands only wait for the barrier
+  bool thumbnail;  // Waits for a new thumbnail of ids[0] instead
+  uint32_t thumbnail_serial;
+  enum wlrapps_action action;
+  uint32_t ids[MAX_ACK_IDS];
+  size_t id_count;
+  uint64_t start_ns;
+  uint64_t deadline_ns;
+};
+
+static struct pending_ack *pending_acks = NULL;
+static uint32_t ack_serial = 0;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void send_ack_reply(const struct pending_ack *ack, const char *reply) {
+  if (send(ack->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+    perror("Error sending reply");
+  }
+}
+
+// The ack may be gone already if its client hung up.
+static void handle_ack_synced(void *data) {
+  uint32_t serial = (uint32_t)(uintptr_t)data;
+  for (struct pending_ack *ack = pending_acks; ack; ack = ack->next) {
+    if (ack->serial == serial) {
+      ack->synced = true;
+      return;
+    }
+  }
+}
+
+// A focus only has to land on one of the toplevels, every other action on
+// all of them.
+static bool ack_applied(const struct pending_ack *ack) {
+  bool focused = false;
+
+  if (!ack->has_action) {
+    return true;
+  }
+
+  for (size_t i = 0; i < ack->id_count; ++i) {
+    const struct wlrapps_toplevel *toplevel = wlrapps_find_toplevel(ack->ids[i]);
+    if (ack->action == WLRAPPS_ACTION_CLOSE) {
+      if (toplevel) {
+        return false;
+      }
+      continue;
+    }
+    if (!toplevel) {
+      return false;
+    }
+
+    switch (ack->action) {
+    case WLRAPPS_ACTION_FOCUS:
+      focused |= toplevel->active;
+      break;
+    case WLRAPPS_ACTION_MAXIMIZE:
+    case WLRAPPS_ACTION_UNMAXIMIZE:
+      if (toplevel->maximized != (ack->action == WLRAPPS_ACTION_MAXIMIZE)) {
+        return false;
+      }
+      break;
+    case WLRAPPS_ACTION_MINIMIZE:
+    case WLRAPPS_ACTION_RESTORE:
+      if (toplevel->minimized != (ack->action == WLRAPPS_ACTION_MINIMIZE)) {
+        return false;
+      }
+      break;
+    case WLRAPPS_ACTION_FULLSCREEN:
+    case WLRAPPS_ACTION_UNFULLSCREEN:
+      if (toplevel->fullscreen != (ack->action == WLRAPPS_ACTION_FULLSCREEN)) {
+        return false;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  return ack->action != WLRAPPS_ACTION_FOCUS || focused || ack->id_count == 0;
+}
+
+static void remove_pending_ack(int fd) {
+  for (struct pending_ack **link = &pending_acks; *link;
+       link = &(*link)->next) {
+    struct pending_ack *ack = *link;
+    if (ack->fd == fd) {
+      *link = ack->next;
+      free(ack);
+      return;
+    }
+  }
+}
+
+// Answers "thumbnail <id>" with the geometry of the thumbnail and the fd of
+// the pool, which the client maps to read the pixels.
+static void send_thumbnail_reply(int fd,
+                                 const struct wlrapps_thumbnail *thumbnail) {
+  size_t pool_size;
+  int pool_fd = wlrapps_get_thumbnail_pool(&pool_size);
+  char reply[128];
+  int len = snprintf(reply, sizeof(reply), "thumbnail %u %u %u %u %u %zu %zu\n",
+                     (unsigned)thumbnail->toplevel_id,
+                     (unsigned)thumbnail->width, (unsigned)thumbnail->height,
+                     (unsigned)thumbnail->stride, (unsigned)thumbnail->format,
+                     thumbnail->offset, pool_size);
+
+  union {
+    struct cmsghdr header;
+    char data[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct iovec iov = {.iov_base = reply, .iov_len = (size_t)len};
+  struct msghdr message = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.data,
+      .msg_controllen = sizeof(control.data),
+  };
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(header), &pool_fd, sizeof(int));
+
+  if (sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+    perror("Error sending reply");
+  }
+}
+
+// Replies "ok <milliseconds>" once the action is visible, or "timeout".
+// Returns true if the client got its answer and can be hung up on.
+static bool answer_pending_ack(int fd) {
+  struct pending_ack *ack = pending_acks;
+  while (ack && ack->fd != fd) {
+    ack = ack->next;
+  }
+  if (!ack) {
+    return false;
+  }
+
+  uint64_t now = now_ns();
+  const struct wlrapps_thumbnail *thumbnail =
+      ack->thumbnail ? wlrapps_get_thumbnail(ack->ids[0]) : NULL;
+  if (thumbnail && thumbnail->serial != ack->thumbnail_serial) {
+    send_thumbnail_reply(ack->fd, thumbnail);
+  } else if (ack->thumbnail && !wlrapps_find_toplevel(ack->ids[0])) {
+    send_ack_reply(ack, "error\n");
+  } else if (!ack->thumbnail && ack->synced && ack_applied(ack)) {
+    char reply[32];
+    snprintf(reply, sizeof(reply), "ok %.3f\n",
+             (double)(now - ack->start_ns) / 1000000.0);
+    send_ack_reply(ack, reply);
+  } else if (now >= ack->deadline_ns) {
+    send_ack_reply(ack, "timeout\n");
+  } else {
+    return false;
+  }
+
+  remove_pending_ack(fd);
+  return true;
+}
+
+// The poll timeout, shortened to wake up for the earliest ack deadline.
+static int pending_ack_timeout(int timeout) {
+  uint64_t now = now_ns();
+  for (struct pending_ack *ack = pending_acks; ack; ack = ack->next) {
+    int remaining = ack->deadline_ns > now
+                        ? (int)((ack->deadline_ns - now + 999999) / 1000000)
+                        : 0;
+    if (timeout < 0 || remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+  return timeout;
+}
+
+// ---- Waiters ----
+
+// A client that sent "wait" and blocks until a toplevel matches its filter.
+// Waiters cost nothing between the events that can answer them: one whose
+// filter requires an app_id sits in the bucket of that app_id, and only the
+// changes to fields its filter reads evaluate it.
+#define WAITER_BUCKETS 64 // Power of two
+
+struct waiter {
+  struct waiter *next;
+  struct waiter **link; // The pointer to this waiter, NULL once answered
+  int fd;
+  struct filter filter;
+  uint32_t changes;         // The WLRAPPS_CHANGED_* bits that can answer it
+  struct match_set ignored; // "new" skips the toplevels matching already
+  uint64_t deadline_ns;     // UINT64_MAX waits until the client hangs up
+};
+
+static struct waiter *waiter_buckets[WAITER_BUCKETS];
+static struct waiter *unindexed_waiters = NULL;
+static struct waiter **waiters_by_fd = NULL;
+static size_t waiters_by_fd_size = 0;
+static uint64_t waiters_deadline_ns = UINT64_MAX; // May be one already gone
+
+static uint32_t waiter_bucket(const char *app_id) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (; *app_id; ++app_id) {
+    hash = (hash ^ (unsigned char)*app_id) * 16777619u;
+  }
+  return hash & (WAITER_BUCKETS - 1);
+}
+
+// The app_id of every toplevel the filter accepts, NULL if it can accept
+// different ones.
+static const char *filter_required_app_id(const struct filter *filter) {
+  for (size_t i = 0; i < filter->count; ++i) {
+    const struct filter_op *op = &filter->ops[i];
+    if (op->type == FILTER_EQUAL && op->field == FIELD_APP_ID &&
+        op->required && op->constant.type != FIELD_TYPE_NULL) {
+      return op->text;
+    }
+  }
+  return NULL;
+}
+
+// The changes that can flip the result of the filter. A toplevel's mru rank
+// is only looked at when its own state changes.
+static uint32_t filter_changes(const struct filter *filter) {
+  uint32_t changes = WLRAPPS_CHANGED_CREATED;
+  for (size_t i = 0; i < filter->count; ++i) {
+    const struct filter_op *op = &filter->ops[i];
+    if (op->type != FILTER_TRUTHY && op->type != FILTER_EQUAL &&
+        op->type != FILTER_GLOB) {
+      continue;
+    }
+
+    switch (op->field) {
+    case FIELD_ID:
+      break;
+    case FIELD_TITLE:
+      changes |= WLRAPPS_CHANGED_TITLE;
+      break;
+    case FIELD_APP_ID:
+    case FIELD_NAME:
+    case FIELD_ICON:
+    case FIELD_STARTUP_WM_CLASS:
+      changes |= WLRAPPS_CHANGED_APP_ID;
+      break;
+    case FIELD_PARENT_ID:
+      changes |= WLRAPPS_CHANGED_PARENT;
+      break;
+    default:
+      changes |= WLRAPPS_CHANGED_STATE;
+      break;
+    }
+  }
+  return changes;
+}
+
+static void waiter_push(struct waiter **list, struct waiter *waiter) {
+  waiter->next = *list;
+  if (*list) {
+    (*list)->link = &waiter->next;
+  }
+  waiter->link = list;
+  *list = waiter;
+}
+
+static void waiter_unlink(struct waiter *waiter) {
+  if (!waiter->link) {
+    return;
+  }
+  *waiter->link = waiter->next;
+  if (waiter->next) {
+    waiter->next->link = waiter->link;
+  }
+  waiter->next = NULL;
+  waiter->link = NULL;
+}
+
+// Replies and takes the waiter out of the index, the loop hangs up on the
+// client afterwards.
+static void answer_waiter(struct waiter *waiter, const char *reply) {
+  if (send(waiter->fd, reply, strlen(reply), MSG_NOSIGNAL | MSG_DONTWAIT) ==
+      -1) {
+    perror("Error sending reply");
+  }
+  waiter_unlink(waiter);
+}
+
+static void answer_waiter_with(struct waiter *waiter, uint32_t id) {
+  char reply[32];
+  snprintf(reply, sizeof(reply), "ok %u\n", (unsigned)id);
+  answer_waiter(waiter, reply);
+}
+
+static void free_waiter(struct waiter *waiter) {
+  waiter_unlink(waiter);
+  filter_finish(&waiter->filter);
+  free(waiter->ignored.entries);
+  free(waiter);
+}
+
+static void remove_waiter(int fd) {
+  if (fd >= 0 && (size_t)fd < waiters_by_fd_size && waiters_by_fd[fd]) {
+    free_waiter(waiters_by_fd[fd]);
+    waiters_by_fd[fd] = NULL;
+  }
+}
+
+static bool waiter_answered(int fd) {
+  return fd >= 0 && (size_t)fd < waiters_by_fd_size && waiters_by_fd[fd] &&
+         !waiters_by_fd[fd]->link;
+}
+
+// Indexes the waiter, replacing an earlier wait of the same client.
+static bool add_waiter(struct waiter *waiter) {
+  if ((size_t)waiter->fd >= waiters_by_fd_size) {
+    size_t new_size = waiters_by_fd_size ? waiters_by_fd_size : 64;
+    while (new_size <= (size_t)waiter->fd) {
+      new_size *= 2;
+    }
+    struct waiter **by_fd =
+        realloc(waiters_by_fd, new_size * sizeof(struct waiter *));
+    if (!by_fd) {
+      return false;
+    }
+    memset(by_fd + waiters_by_fd_size, 0,
+           (new_size - waiters_by_fd_size) * sizeof(struct waiter *));
+    waiters_by_fd = by_fd;
+    waiters_by_fd_size = new_size;
+  }
+
+  remove_waiter(waiter->fd);
+  waiters_by_fd[waiter->fd] = waiter;
+
+  const char *app_id = filter_required_app_id(&waiter->filter);
+  waiter_push(app_id ? &waiter_buckets[waiter_bucket(app_id)]
+                     : &unindexed_waiters,
+              waiter);
+  if (waiter->deadline_ns < waiters_deadline_ns) {
+    waiters_deadline_ns = waiter->deadline_ns;
+  }
+  return true;
+}
+
+static void notify_waiter_list(struct waiter *list,
+                               const struct wlrapps_toplevel *toplevel,
+                               uint32_t changes) {
+  struct waiter *next;
+  for (struct waiter *waiter = list; waiter; waiter = next) {
+    next = waiter->next;
+    if (!(waiter->changes & changes)) {
+      continue;
+    }
+
+    size_t index;
+    bool matches = filter_matches(&waiter->filter, toplevel);
+    if (match_set_find(&waiter->ignored, toplevel->id, &index)) {
+      // Counts as new once it stopped matching.
+      if (!matches) {
+        match_set_remove(&waiter->ignored, index);
+      }
+    } else if (matches) {
+      answer_waiter_with(waiter, toplevel->id);
+    }
+  }
+}
+
+static void notify_waiters(const struct wlrapps_toplevel *toplevel,
+                           uint32_t changes) {
+  if (toplevel->app_id) {
+    notify_waiter_list(waiter_buckets[waiter_bucket(toplevel->app_id)],
+                       toplevel, changes);
+  }
+  notify_waiter_list(unindexed_waiters, toplevel, changes);
+}
+
+// Replies "timeout" to the waiters past their deadline. Only scans them
+// once the earliest deadline passed.
+static void expire_waiters(void) {
+  if (waiters_deadline_ns == UINT64_MAX) {
+    return;
+  }
+  uint64_t now = now_ns();
+  if (now < waiters_deadline_ns) {
+    return;
+  }
+
+  waiters_deadline_ns = UINT64_MAX;
+  for (size_t fd = 0; fd < waiters_by_fd_size; ++fd) {
+    struct waiter *waiter = waiters_by_fd[fd];
+    if (!waiter || !waiter->link) {
+      continue;
+    }
+    if (waiter->deadline_ns <= now) {
+      answer_waiter(waiter, "timeout\n");
+    } else if (waiter->deadline_ns < waiters_deadline_ns) {
+      waiters_deadline_ns = waiter->deadline_ns;
+    }
+  }
+}
+
+// The poll timeout, shortened to wake up for the earliest wait deadline.
+static int waiter_timeout(int timeout) {
+  if (waiters_deadline_ns == UINT64_MAX) {
+    return timeout;
+  }
+  uint64_t now = now_ns();
+  uint64_t remaining = waiters_deadline_ns > now
+                           ? (waiters_deadline_ns - now + 999999) / 1000000
+                           : 0;
+  return timeout < 0 || remaining < (uint64_t)timeout ? (int)remaining
+                                                       : timeout;
+}
+
+// ---- Unix Socket Event Handler ---- //
+
+static void command_focus_prev(const char *args) { wlrapps_focus_prev(); }
+
+static void command_focus_next_in_app(const char *args) {
+  wlrapps_focus_next_in_app();
+}
+
+static void command_cycle(const char *args) { wlrapps_cycle(false); }
+
+static void command_cycle_back(const char *args) { wlrapps_cycle(true); }
+
+static void command_focus_app(const char *args) {
+  if (!wlrapps_focus_app(args)) {
+    fprintf(stderr, "No toplevel with app_id '%s'.\n", args);
+  }
+}
+
+static void command_show_desktop(const char *args) { wlrapps_show_desktop(); }
+
+static void command_restore_layout(const char *args) {
+  wlrapps_restore_layout();
+}
+
+static bool action_for_command(char command_char,
+                               enum wlrapps_action *action) {
+  switch (command_char) {
+  case 'f':
+    *action = WLRAPPS_ACTION_FOCUS;
+    return true;
+  case 'a':
+    *action = WLRAPPS_ACTION_MAXIMIZE;
+    return true;
+  case 'u':
+    *action = WLRAPPS_ACTION_UNMAXIMIZE;
+    return true;
+  case 'i':
+    *action = WLRAPPS_ACTION_MINIMIZE;
+    return true;
+  case 'r':
+    *action = WLRAPPS_ACTION_RESTORE;
+    return true;
+  case 'c':
+    *action = WLRAPPS_ACTION_CLOSE;
+    return true;
+  case 's':
+    *action = WLRAPPS_ACTION_FULLSCREEN;
+    return true;
+  case 'S':
+    *action = WLRAPPS_ACTION_UNFULLSCREEN;
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Commands longer than a single letter, resolved entirely in the daemon.
+static const struct named_command {
+  const char *name;
+  void (*handler)(const char *args);
+} named_commands[] = {
+    {"focus-prev", command_focus_prev},
+    {"focus-next-in-app", command_focus_next_in_app},
+    {"cycle", command_cycle},
+    {"cycle-back", command_cycle_back},
+    {"focus-app", command_focus_app},
+    {"show-desktop", command_show_desktop},
+    {"restore-layout", command_restore_layout},
+};
+
+// Keeps the client connected and streams it a snapshot of the toplevels
+// matching its filter whenever they change. Subscribing again replaces the
+// filter.
+static bool subscribe_client(int client_fd, const char *args) {
+  struct subscription *sub = find_subscriber(client_fd);
+  struct filter filter = {0};
+
+  if (*args && !compile_filter(&filter, args)) {
+    return sub != NULL;
+  }
+
+  if (!sub) {
+    if (!(sub = calloc(1, sizeof(*sub)))) {
+      fprintf(stderr, "Failed to allocate memory for the subscription\n");
+      filter_finish(&filter);
+      return false;
+    }
+    sub->fd = client_fd;
+    sub->next = subscribers;
+    subscribers = sub;
+  } else {
+    filter_finish(&sub->filter);
+  }
+
+  sub->filter = filter;
+  subscription_refresh(sub);
+  if (wlrapps_get_fd() == -1) {
+    output_buffer.len = 0;
+    encode_status(encoder_for_format(subscription_format(sub)), &output_buffer,
+                  "disconnected");
+    subscription_write(sub, &output_buffer);
+    sub->dirty = false;
+  } else {
+    print_snapshot(sub);
+  }
+  return true;
+}
+
+enum command_result {
+  COMMAND_DONE,
+  COMMAND_FAILED,
+  COMMAND_KEEP_OPEN, // The client subscribed or waits for an answer
+};
+
+// "search <query>", replies with the ids of the matching toplevels on a
+// single line, best match first.
+static enum command_result search_toplevels(int client_fd, const char *query) {
+  size_t max = wlrapps_toplevel_count();
+  struct wlrapps_search_result *results = calloc(max + 1, sizeof(*results));
+  if (!results) {
+    fprintf(stderr, "Failed to allocate memory for the search\n");
+    return COMMAND_FAILED;
+  }
+
+  size_t count = wlrapps_search(query, results, max);
+  struct output_buffer reply = {0};
+  char id[16];
+  for (size_t i = 0; i < count && i < max; ++i) {
+    snprintf(id, sizeof(id), i ? " %u" : "%u", (unsigned)results[i].id);
+    output_buffer_puts(&reply, id);
+  }
+  output_buffer_putc(&reply, '\n');
+
+  if (reply.data && send(client_fd, reply.data, reply.len,
+                         MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+    perror("Error sending reply");
+  }
+  free(reply.data);
+  free(results);
+  return COMMAND_DONE;
+}
+
+static int compare_usage(const void *a, const void *b) {
+  const struct wlrapps_usage *ua = a, *ub = b;
+  return (ua->focused_ms < ub->focused_ms) - (ua->focused_ms > ub->focused_ms);
+}
+
+// "usage", replies a line "<ms> <activations> <app_id>" per app, the one that
+// had the focus longest first.
+static enum command_result send_usage(int client_fd) {
+  size_t count = wlrapps_get_usage(NULL, 0);
+  struct wlrapps_usage *usage = calloc(count + 1, sizeof(*usage));
+  if (!usage) {
+    fprintf(stderr, "Failed to allocate memory for the usage\n");
+    return COMMAND_FAILED;
+  }
+  count = wlrapps_get_usage(usage, count);
+  qsort(usage, count, sizeof(*usage), compare_usage);
+
+  struct output_buffer reply = {0};
+  char numbers[48];
+  for (size_t i = 0; i < count; ++i) {
+    snprintf(numbers, sizeof(numbers), "%" PRIu64 " %" PRIu32 " ",
+             usage[i].focused_ms, usage[i].activations);
+    output_buffer_puts(&reply, numbers);
+    output_buffer_puts(&reply, usage[i].app_id);
+    output_buffer_putc(&reply, '\n');
+  }
+
+  if (reply.data && send(client_fd, reply.data, reply.len,
+                         MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+    perror("Error sending reply");
+  }
+  free(reply.data);
+  free(usage);
+  return COMMAND_DONE;
+}
+
+static size_t filter_memory(const struct filter *filter) {
+  size_t size = filter->capacity * sizeof(struct filter_op);
+  for (size_t i = 0; i < filter->count; ++i) {
+    size += filter->ops[i].text ? strlen(filter->ops[i].text) + 1 : 0;
+  }
+  return size;
+}
+
+static size_t subscription_memory(const struct subscription *sub) {
+  return filter_memory(&sub->filter) +
+         sub->matches.capacity * sizeof(struct match_entry) + sub->last.cap;
+}
+
+// Bytes the daemon holds to encode and send the output, shared by every
+// client, and bytes held for each connected client.
+static void count_memory(size_t *output_buffers, size_t *client_buffers) {
+  *output_buffers = output_buffer.cap + history_buffer.cap +
+                    (history_data ? HISTORY_BYTES : 0) +
+                    global_info_list.capacity * sizeof(*global_info_list.items) +
+                    subscription_memory(&stdout_subscription);
+  for (size_t i = 0; i < sizeof(fragment_caches) / sizeof(fragment_caches[0]);
+       ++i) {
+    const struct fragment_cache *cache = fragment_caches[i];
+    *output_buffers += cache->capacity * sizeof(struct fragment);
+    for (size_t j = 0; j < cache->count; ++j) {
+      *output_buffers += cache->items[j].data.cap;
+    }
+  }
+
+  *client_buffers = waiters_by_fd_size * sizeof(*waiters_by_fd);
+  for (const struct subscription *sub = subscribers; sub; sub = sub->next) {
+    *client_buffers += sizeof(*sub) + subscription_memory(sub);
+  }
+  for (size_t fd = 0; fd < waiters_by_fd_size; ++fd) {
+    const struct waiter *waiter = waiters_by_fd[fd];
+    if (waiter) {
+      *client_buffers += sizeof(*waiter) + filter_memory(&waiter->filter) +
+                         waiter->ignored.capacity * sizeof(struct match_entry);
+    }
+  }
+  for (const struct pending_ack *ack = pending_acks; ack; ack = ack->next) {
+    *client_buffers += sizeof(*ack);
+  }
+}
+
+// "mem", replies a line "<category> <bytes>" per category and the total.
+static enum command_result send_memory(int client_fd) {
+  struct wlrapps_memory lib;
+  size_t output_buffers, client_buffers;
+  wlrapps_get_memory(&lib);
+  count_memory(&output_buffers, &client_buffers);
+
+  char reply[512];
+  int len = snprintf(
+      reply, sizeof(reply),
+      "records %zu\ntitles %zu\napp_ids %zu\nindexes %zu\n"
+      "output_buffers %zu\nclient_buffers %zu\ntotal %zu\n",
+      lib.records, lib.titles, lib.app_ids, lib.indexes, output_buffers,
+      client_buffers,
+      lib.records + lib.titles + lib.app_ids + lib.indexes + output_buffers +
+          client_buffers);
+  if (send(client_fd, reply, (size_t)len, MSG_NOSIGNAL | MSG_DONTWAIT) == -1) {
+    perror("Error sending reply");
+  }
+  return COMMAND_DONE;
+}
+
+// "wait [new] [timeout=<ms>] [<filter>]", replies "ok <id>" once a toplevel
+// matches, the most recently used if several match already, or "timeout".
+// With "new" only toplevels that start matching after the request count.
+static enum command_result wait_for_toplevel(int client_fd, const char *args) {
+  uint64_t start_ns = now_ns();
+  uint64_t deadline_ns = UINT64_MAX;
+  bool fresh = false;
+
+  // The options come before the filter, a filter never starts with them.
+  for (;;) {
+    size_t len = strcspn(args, " \t\n");
+    if (len == 3 && strncmp(args, "new", 3) == 0) {
+      fresh = true;
+    } else if (len > 8 && strncmp(args, "timeout=", 8) == 0) {
+      char *end;
+      errno = 0;
+      unsigned long long timeout_ms = strtoull(args + 8, &end, 10);
+      if (!isdigit((unsigned char)args[8]) || errno == ERANGE ||
+          end != args + len) {
+        send(client_fd, "error\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+        return COMMAND_FAILED;
+      }
+      if (timeout_ms < (UINT64_MAX - start_ns) / 1000000) {
+        deadline_ns = start_ns + (uint64_t)timeout_ms * 1000000;
+      }
+    } else {
+      break;
+    }
+    args += len;
+    while (isspace((unsigned char)*args)) {
+      args++;
+    }
+  }
+  struct waiter *waiter = calloc(1, sizeof(*waiter));
+  if (!waiter) {
+    fprintf(stderr, "Failed to allocate memory for the waiter\n");
+    return COMMAND_FAILED;
+  }
+  waiter->fd = client_fd;
+  waiter->deadline_ns = deadline_ns;
+  if (*args && !compile_filter(&waiter->filter, args)) {
+    free(waiter); // compile_filter() freed the ops
+    send(client_fd, "error\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return COMMAND_FAILED;
+  }
+  waiter->changes = filter_changes(&waiter->filter);
+
+  const struct wlrapps_toplevel *toplevel, *best = NULL;
+  bool indexed = true;
+  wlrapps_for_each_toplevel(toplevel) {
+    if (!filter_matches(&waiter->filter, toplevel)) {
+      continue;
+    }
+    if (!fresh) {
+      if (!best || toplevel->mru < best->mru) {
+        best = toplevel;
+      }
+      continue;
+    }
+
+    size_t index;
+    if (!match_set_find(&waiter->ignored, toplevel->id, &index)) {
+      indexed &= match_set_insert(&waiter->ignored, index, toplevel->id,
+                                  toplevel->mru);
+    }
+  }
+
+  if (best) {
+    answer_waiter_with(waiter, best->id);
+    free_waiter(waiter);
+    return COMMAND_DONE;
+  }
+  if (!indexed || !add_waiter(waiter)) {
+    fprintf(stderr, "Failed to allocate memory for the waiter\n");
+    free_waiter(waiter);
+    return COMMAND_FAILED;
+  }
+  return COMMAND_KEEP_OPEN;
+}
+
+// "thumbnail <id> [follow|stop]". The client waits until the capture is done,
+// a thumbnail that follows the damage is current and answered right away.
+static enum command_result request_thumbnail(int client_fd, const char *args) {
+  char *endptr;
+  unsigned long id = strtoul(args, &endptr, 10);
+  const char *mode = endptr;
+  while (isspace((unsigned char)*mode)) {
+    mode++;
+  }
+
+  bool follow = strcmp(mode, "follow") == 0;
+  if (endptr == args || (*mode && !follow && strcmp(mode, "stop") != 0)) {
+    fprintf(stderr,
+            "Error: invalid thumbnail request '%s' from client %d. Expected "
+            "'<id> [follow|stop]'.\n",
+            args, client_fd);
+    return COMMAND_FAILED;
+  }
+
+  if (strcmp(mode, "stop") == 0) {
+    wlrapps_stop_thumbnail((uint32_t)id);
+    return COMMAND_DONE;
+  }
+
+  const struct wlrapps_thumbnail *thumbnail =
+      wlrapps_get_thumbnail((uint32_t)id);
+  bool current = thumbnail && thumbnail->live;
+  uint32_t serial = thumbnail ? thumbnail->serial : 0;
+
+  if (!wlrapps_capture_thumbnail((uint32_t)id, follow)) {
+    fprintf(stderr, "Toplevel %lu can't be captured.\n", id);
+    send(client_fd, "error\n", 6, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return COMMAND_FAILED;
+  }
+  if (current) {
+    send_thumbnail_reply(client_fd, thumbnail);
+    return COMMAND_DONE;
+  }
+
+  struct pending_ack *ack = calloc(1, sizeof(*ack));
+  if (!ack) {
+    fprintf(stderr, "Failed to allocate memory for the acknowledgement\n");
+    return COMMAND_FAILED;
+  }
+  ack->fd = client_fd;
+  ack->start_ns = now_ns();
+  ack->deadline_ns = ack->start_ns + (uint64_t)SYNC_TIMEOUT_MS * 1000000;
+  ack->thumbnail = true;
+  ack->thumbnail_serial = serial;
+  ack->ids[0] = (uint32_t)id;
+  ack->id_count = 1;
+  ack->next = pending_acks;
+  pending_acks = ack;
+  return COMMAND_KEEP_OPEN;
+}
+
+// Runs a single command. With an ack the ids an action ran on are stored so
+// the ack can wait for them.
+static enum command_result run_command(int client_fd, const char *command,
+                                       struct pending_ack *ack) {
+  size_t command_len = strlen(command);
+  size_t name_len = strcspn(command, " ");
+  if (name_len > 1) {
+    const char *args = command + name_len;
+    while (isspace((unsigned char)*args)) {
+      args++;
+    }
+
+    if (name_len == strlen("subscribe") &&
+        strncmp(command, "subscribe", name_len) == 0) {
+      return subscribe_client(client_fd, args) ? COMMAND_KEEP_OPEN
+                                                : COMMAND_FAILED;
+    }
+
+    if (name_len == strlen("since") &&
+        strncmp(command, "since", name_len) == 0) {
+      return history_client(client_fd, args) ? COMMAND_KEEP_OPEN
+                                              : COMMAND_FAILED;
+    }
+
+    if (name_len == strlen("search") &&
+        strncmp(command, "search", name_len) == 0) {
+      return search_toplevels(client_fd, args);
+    }
+
+    if (name_len == strlen("mem") && strncmp(command, "mem", name_len) == 0) {
+      return send_memory(client_fd);
+    }
+
+    if (name_len == strlen("usage") &&
+        strncmp(command, "usage", name_len) == 0) {
+      return send_usage(client_fd);
+    }
+
+    if (name_len == strlen("thumbnail") &&
+        strncmp(command, "thumbnail", name_len) == 0) {
+      return request_thumbnail(client_fd, args);
+    }
+
+    if (name_len == strlen("wait") && strncmp(command, "wait", name_len) == 0) {
+      return wait_for_toplevel(client_fd, args);
+    }
+
+    for (size_t i = 0; i < sizeof(named_commands) / sizeof(named_commands[0]);
+         ++i) {
+      if (strlen(named_commands[i].name) == name_len &&
+          strncmp(named_commands[i].name, command, name_len) == 0) {
+        named_commands[i].handler(args);
+        return COMMAND_DONE;
+      }
+    }
+
+    fprintf(stderr, "Unknown command '%.*s' from client %d.\n", (int)name_len,
+            command, client_fd);
+    print_help();
+    return COMMAND_FAILED;
+  }
+
+  if ((command_len < 3) || (command[1] != ' ')) {
+    fprintf(stderr,
+            "Invalid event data format from client %d: '%s'. Expected 'opt "
+            "<target>'.\n",
+            client_fd, command);
+    print_help();
+    return COMMAND_FAILED;
+  }
+
+  char command_char = command[0];
+  const char *argument_str = command + 2;
+
+  if (command_char == '?') {
+    print_help();
+    return COMMAND_DONE;
+  }
+
+  if (command_char == 'q') {
+    char *endptr;
+    long sort = strtol(argument_str, &endptr, 10);
+
+    if (endptr == argument_str || *endptr != '\0') {
+      fprintf(stderr,
+              "Error: invalid sorting type '%s' from client %d.\n",
+              argument_str, client_fd);
+      print_help();
+      return COMMAND_FAILED;
+    }
+
+    if (sort == 0) {
+      sort_out = false;
+    } else {
+      sort_out = true;
+      sort_type = sort;
+    }
+    return COMMAND_DONE;
+  }
+
+  enum wlrapps_action action;
+  if (!action_for_command(command_char, &action)) {
+    fprintf(stderr, "Unknown option '%c' from client %d.\n", command_char,
+            client_fd);
+    print_help();
+    return COMMAND_FAILED;
+  }
+
+  int count = ack ? wlrapps_target_action_ids(argument_str, action, ack->ids,
+                                              MAX_ACK_IDS)
+                 : wlrapps_target_action(argument_str, action);
+  if (count == -1) {
+    fprintf(stderr,
+            "Error: invalid target '%s' from client %d. Expected an id, "
+            "app:<app_id>, output:<name> or all.\n",
+            argument_str, client_fd);
+    print_help();
+    return COMMAND_FAILED;
+  }
+
+  if (ack) {
+    ack->has_action = true;
+    ack->action = action;
+    ack->id_count = (size_t)count < MAX_ACK_IDS ? (size_t)count : MAX_ACK_IDS;
+  }
+  return COMMAND_DONE;
+}
+
+// Returns whether the client stays connected after the command.
+static bool handle_event(int client_fd, const char *event_data) {
+
+  if (event_data == NULL || *event_data == '\0') {
+    fprintf(stderr, "Received empty data event from client %d.\n", client_fd);
+    return false;
+  }
+
+  // Work on a copy without the trailing whitespace so arguments such as
+  // app_ids can be compared as they are.
+  char command[BUFFER_SIZE];
+  snprintf(command, sizeof(command), "%s", event_data);
+  size_t command_len = strlen(command);
+  while (command_len > 0 && isspace((unsigned char)command[command_len - 1])) {
+    command[--command_len] = '\0';
+  }
+
+  if (strncmp(command, "sync ", 5) != 0) {
+    return run_command(client_fd, command, NULL) == COMMAND_KEEP_OPEN;
+  }
+
+  // "sync [<timeout_ms>] <command>"
+  const char *rest = command + 5;
+  char *endptr;
+  unsigned long timeout_ms = SYNC_TIMEOUT_MS;
+  if (isdigit((unsigned char)*rest)) {
+    timeout_ms = strtoul(rest, &endptr, 10);
+    rest = endptr;
+  }
+  while (isspace((unsigned char)*rest)) {
+    rest++;
+  }
+
+  struct pending_ack *ack = calloc(1, sizeof(*ack));
+  if (!ack) {
+    fprintf(stderr, "Failed to allocate memory for the acknowledgement\n");
+    return false;
+  }
+  ack->fd = client_fd;
+  ack->start_ns = now_ns();
+  ack->deadline_ns = ack->start_ns + (uint64_t)timeout_ms * 1000000;
+  ack->serial = ++ack_serial;
+
+  enum command_result result = run_command(client_fd, rest, ack);
+  if (result == COMMAND_KEEP_OPEN) {
+    free(ack); // A subscription answers with snapshots instead
+    return true;
+  }
+
+  if (result == COMMAND_FAILED ||
+      !wlrapps_sync(handle_ack_synced, (void *)(uintptr_t)ack->serial)) {
+    send_ack_reply(ack, "error\n");
+    free(ack);
+    return false;
+  }
+
+  ack->next = pending_acks;
+  pending_acks = ack;
+  return true;
+}
+
+
+
+// ---- Library Events ----
+
+static void handle_toplevel_changed(const struct wlrapps_toplevel *toplevel,
+                                    uint32_t changes, void *data) {
+  struct subscription *sub;
+  fragments_invalidate(toplevel->id);
+  for_each_subscription(sub) { subscription_update(sub, toplevel, true); }
+  notify_waiters(toplevel, changes);
+  history_record(toplevel, false);
+
+  if (output_format != OUTPUT_TEXT ||
+      !subscription_matches(&stdout_subscription, toplevel->id)) {
+    return;
+  }
+
+  bool state_changed =
+      changes & (WLRAPPS_CHANGED_CREATED | WLRAPPS_CHANGED_STATE);
+  print_toplevel(toplevel, !state_changed);
+  if (state_changed) {
+    print_toplevel_state(toplevel, true);
+  }
+}
+
+static void handle_toplevel_closed(const struct wlrapps_toplevel *toplevel,
+                                   void *data) {
+  if (output_format == OUTPUT_TEXT &&
+      subscription_matches(&stdout_subscription, toplevel->id)) {
+    print_toplevel(toplevel, false);
+  }
+
+  struct subscription *sub;
+  fragments_remove(toplevel->id);
+  for_each_subscription(sub) { subscription_remove(sub, toplevel->id); }
+  history_record(toplevel, true);
+}
+
+// Prints the complete state after (re)connecting.
+static void print_full_state(void) {
+  if (output_format != OUTPUT_TEXT) {
+    print_toplevel_array();
+    return;
   }
 
-  if (*endptr != '\0' && !isspace((unsigned char)*endptr)) {
-    fprintf(stderr,
-            "Error: Invalid characters in argument '%s' after number for "
-            "client %d.\n",
-            argument_str, client_fd);
-    print_help();
-    return;
+  const struct wlrapps_toplevel *toplevel;
+  wlrapps_for_each_toplevel(toplevel) {
+    if (subscription_matches(&stdout_subscription, toplevel->id)) {
+      print_toplevel(toplevel, false);
+      print_toplevel_state(toplevel, true);
+    }
   }
+  fflush(stdout);
+}
 
-  switch (command_char) {
-  case 'q':
-    if (window_id == 0) {
-      sort_out = false;
-    } else {
-      sort_out = true;
-      sort_type = window_id;
+// Subscribers are told as well, their sets are empty until the compositor
+// is back.
+static void print_disconnected_status(void) {
+  struct subscription *sub;
+  fragments_clear();
+  for_each_subscription(sub) {
+    sub->matches.count = 0;
+    if (sub->fd != -1) {
+      output_buffer.len = 0;
+      encode_status(encoder_for_format(subscription_format(sub)),
+                    &output_buffer, "disconnected");
+      subscription_write(sub, &output_buffer);
     }
+  }
+
+  output_buffer.len = 0;
+
+  switch (output_format) {
+  case OUTPUT_TEXT:
+    output_buffer_puts(&output_buffer, "-> disconnected\n");
     break;
-  case 'f':
-    focus_id = window_id;
-    break;
-  case 'a':
-    maximize_id = window_id;
-    break;
-  case 'u':
-    unmaximize_id = window_id;
-    break;
-  case 'i':
-    minimize_id = window_id;
-    break;
-  case 'r':
-    restore_id = window_id;
-    break;
-  case 'c':
-    close_id = window_id;
-    break;
-  case 's':
-    fullscreen_id = window_id;
+  case OUTPUT_TEMPLATE:
+    // Templates only render toplevels, an empty line clears the bar.
+    output_buffer_putc(&output_buffer, '\n');
     break;
-  case 'S':
-    unfullscreen_id = window_id;
+  default:
+    encode_status(encoder_for_format(output_format), &output_buffer,
+                  "disconnected");
     break;
-  case '?':
-    print_help();
-    return;
   }
 
-  struct toplevel_v1 *toplevel;
-  if ((toplevel = toplevel_by_id_or_bail(focus_id))) {
-    zwlr_foreign_toplevel_handle_v1_activate(toplevel->zwlr_toplevel, seat);
+  subscription_write(&stdout_subscription, &output_buffer);
+}
+
+static void handle_disconnected(void *data) { print_disconnected_status(); }
+
+static void handle_reconnected(void *data) {
+  refresh_subscriptions();
+  history_reset();
+  print_full_state();
+  publish_snapshots();
+}
+
+// ---- Main Function ---- //
+
+// Parses a whole decimal number in [min, max] for a command line option.
+static bool parse_option_number(const char *option, const char *value, int min,
+                                int max, int *number) {
+  char *endptr;
+  errno = 0;
+  long parsed = strtol(value, &endptr, 10);
+  if (endptr == value || *endptr != '\0' || errno == ERANGE || parsed < min ||
+      parsed > max) {
+    fprintf(stderr, "%s takes a number from %d to %d, not '%s'.\n", option,
+            min, max, value);
+    return false;
+  }
+  *number = (int)parsed;
+  return true;
+}
+
+// Whether the process that listens on the connected socket is still alive.
+// A daemon that just exited can leave its socket listening for a moment
+// when the kernel releases its files after the process is gone.
+static bool listener_alive(int fd) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1 ||
+      cred.pid <= 0) {
+    return true;
+  }
+  return kill(cred.pid, 0) == 0 || errno != ESRCH;
+}
+
+// Clears the way for binding the control socket. A socket file nobody
+// answers on was left behind by a daemon that's gone and is removed. Returns
+// false if another daemon still answers on it, or the path can't be checked.
+static bool claim_socket_path(const struct sockaddr_un *addr) {
+  int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (probe == -1) {
+    perror("Error creating socket");
+    return false;
+  }
+  int result = connect(probe, (const struct sockaddr *)addr, sizeof(*addr));
+  int error = errno;
+  bool running = result == 0 && listener_alive(probe);
+  close(probe);
+
+  if (running) {
+    fprintf(stderr, "wlr-apps is already running on %s.\n", addr->sun_path);
+    return false;
+  }
+  if (result == -1 && error == ENOENT) {
+    return true;
+  }
+  if (result == -1 && error != ECONNREFUSED) {
+    fprintf(stderr, "Error checking %s: %s\n", addr->sun_path,
+            strerror(error));
+    return false;
+  }
+  if (unlink(addr->sun_path) == -1 && errno != ENOENT) {
+    perror("Error removing the stale socket");
+    return false;
+  }
+  return true;
+}
+
+// Takes the listening socket passed by a service manager following the
+// LISTEN_FDS convention (systemd socket units, or any launcher setting
+// LISTEN_PID and LISTEN_FDS). *fd is -1 if there is none. Returns false if
+// something was passed that the daemon can't listen on.
+static bool inherited_listen_socket(int *fd) {
+  const char *listen_pid = getenv("LISTEN_PID");
+  const char *listen_fds = getenv("LISTEN_FDS");
+  *fd = -1;
+  if (!listen_pid || !listen_fds ||
+      strtol(listen_pid, NULL, 10) != (long)getpid()) {
+    return true;
+  }
+
+  char *endptr;
+  long count = strtol(listen_fds, &endptr, 10);
+  bool valid = endptr != listen_fds && *endptr == '\0' && count >= 0;
+  if (!valid || count > 1) {
+    fprintf(stderr,
+            "LISTEN_FDS is '%s', the daemon takes a single socket.\n",
+            listen_fds);
+    return false;
+  }
+
+  // Not passed on to anything the daemon might spawn.
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  if (count == 0) {
+    return true;
+  }
+
+  int inherited = LISTEN_FDS_START;
+  struct stat st;
+  int accepting = 0, domain = 0;
+  socklen_t accepting_len = sizeof(accepting), domain_len = sizeof(domain);
+  if (fstat(inherited, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "The inherited fd %d isn't a socket.\n", inherited);
+    return false;
+  }
+  if (getsockopt(inherited, SOL_SOCKET, SO_ACCEPTCONN, &accepting,
+                 &accepting_len) == -1 ||
+      !accepting) {
+    fprintf(stderr, "The inherited socket isn't listening.\n");
+    return false;
   }
-  if ((toplevel = toplevel_by_id_or_bail(maximize_id))) {
-    zwlr_foreign_toplevel_handle_v1_set_maximized(toplevel->zwlr_toplevel);
+  if (getsockopt(inherited, SOL_SOCKET, SO_DOMAIN, &domain, &domain_len) ==
+          -1 ||
+      domain != AF_UNIX) {
+    fprintf(stderr, "The inherited socket isn't a unix socket.\n");
+    return false;
   }
-  if ((toplevel = toplevel_by_id_or_bail(unmaximize_id))) {
-    zwlr_foreign_toplevel_handle_v1_unset_maximized(toplevel->zwlr_toplevel);
+
+  if (fcntl(inherited, F_SETFD, FD_CLOEXEC) == -1) {
+    perror("Error using the inherited socket");
+    return false;
+  }
+  *fd = inherited;
+  return true;
+}
+
+static void close_client(struct pollfd *fds, int *nfds, int slot) {
+  remove_subscriber(fds[slot].fd);
+  remove_pending_ack(fds[slot].fd);
+  remove_waiter(fds[slot].fd);
+  close(fds[slot].fd);
+  fds[slot].fd = -1; // Mark slot as unused
+
+  // Adjust nfds if the highest index fd disconnected
+  while (*nfds > FIXED_FDS && fds[*nfds - 1].fd == -1) {
+    (*nfds)--;
   }
-  if ((toplevel = toplevel_by_id_or_bail(minimize_id))) {
-    zwlr_foreign_toplevel_handle_v1_set_minimized(toplevel->zwlr_toplevel);
+}
+
+// Answers the clients whose synchronous action went through or timed out and
+// hangs up on the answered waiters.
+static void answer_pending_acks(struct pollfd *fds, int *nfds) {
+  expire_waiters();
+  for (int i = FIXED_FDS; i < *nfds; ++i) {
+    if (fds[i].fd >= 0 &&
+        (answer_pending_ack(fds[i].fd) || waiter_answered(fds[i].fd))) {
+      close_client(fds, nfds, i);
+    }
   }
-  if ((toplevel = toplevel_by_id_or_bail(restore_id))) {
-    zwlr_foreign_toplevel_handle_v1_unset_minimized(toplevel->zwlr_toplevel);
+}
+
+// Takes a connection the listening socket accepted. Returns its slot, or -1
+// if every slot is taken and the connection was closed again.
+static int add_client(struct pollfd *fds, int *nfds, int client_socket) {
+  for (int j = FIXED_FDS; j < max_clients + FIXED_FDS; ++j) {
+    if (fds[j].fd == -1) { // Find the first unused slot
+      fds[j].fd = client_socket;
+      fds[j].events = POLLIN;
+      fds[j].revents = 0;
+
+      // Update nfds if we added beyond the current count
+      if (j >= *nfds) {
+        *nfds = j + 1;
+      }
+      return j;
+    }
   }
-  if ((toplevel = toplevel_by_id_or_bail(fullscreen_id))) {
-    if (pref_output_id != UINT32_MAX && pref_output == NULL) {
-      fprintf(stderr, "Could not find output %i\n", pref_output_id);
+
+  fprintf(stderr, "Maximum number of clients reached. Connection rejected.\n");
+  close(client_socket); // Close the new connection immediately
+  return -1;
+}
+
+// Handles what receiving from a client returned, a negative length with the
+// error in errno. Returns true if the client stays connected.
+static bool handle_client_data(struct pollfd *fds, int *nfds, int slot,
+                               char *buffer, ssize_t bytes_received) {
+  if (bytes_received > 0) {
+
+    buffer[bytes_received] = '\0';
+    bool keep_open = handle_event(fds[slot].fd, buffer);
+    wlrapps_flush();
+
+    // Clients normally send one event and exit, so the socket is closed
+    // right away unless it subscribed to updates.
+    if (!keep_open && !find_subscriber(fds[slot].fd)) {
+      close_client(fds, nfds, slot);
+      return false;
+    }
+    return true;
+
+  } else if (bytes_received == 0) {
+
+    // Client disconnected, subscribers leave this way as well.
+    if (!find_subscriber(fds[slot].fd)) {
+      printf("Client disconnected (fd: %d).\n", fds[slot].fd);
+    }
+    close_client(fds, nfds, slot);
+
+  } else {
+
+    // Error receiving data
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      perror("Error receiving data.");
     }
-    zwlr_foreign_toplevel_handle_v1_set_fullscreen(toplevel->zwlr_toplevel,
-                                                   pref_output);
+    close_client(fds, nfds, slot);
   }
-  if ((toplevel = toplevel_by_id_or_bail(unfullscreen_id))) {
-    zwlr_foreign_toplevel_handle_v1_unset_fullscreen(toplevel->zwlr_toplevel);
+  return false;
+}
+
+// Returns false if the daemon should exit, the connection is gone for good.
+static bool handle_wayland_readable(void) {
+  if (!wlrapps_dispatch()) {
+    return false;
   }
-  if ((toplevel = toplevel_by_id_or_bail(close_id))) {
-    zwlr_foreign_toplevel_handle_v1_close(toplevel->zwlr_toplevel);
+
+  // Disconnected in reconnect mode, already reported.
+  if (wlrapps_get_fd() != -1) {
+    publish_snapshots();
+  }
+  return true;
+}
+
+static void handle_watch_readable(void) {
+  if (wlrapps_dispatch_watch()) {
+    reevaluate_subscriptions();
+    publish_snapshots();
+  }
+}
+
+static void run_poll_loop(struct pollfd *fds, int *nfds, int listen_socket) {
+  while (true) {
+    // The Wayland fd changes when libwlrapps reconnects.
+    fds[1].fd = wlrapps_get_fd();
+
+    // While the compositor is gone the clients aren't polled, so their
+    // commands wait in the sockets until the toplevel set is loaded again.
+    int polled_fds = fds[1].fd == -1 ? FIXED_FDS : *nfds;
+
+    // Wait for events on monitored file descriptors (sockets and Wayland)
+    int timeout = waiter_timeout(pending_ack_timeout(wlrapps_get_timeout()));
+    int poll_count = poll(fds, polled_fds, timeout);
+
+    if (poll_count == -1) {
+      if (errno == EINTR) {
+        continue; // Interrupted by signal, continue.
+      }
+      perror("poll error");
+      return; // Exit loop on poll error.
+    }
+
+    // Client traffic can keep poll from timing out, so the timers are
+    // checked on every wake up and not only on timeouts.
+    if (wlrapps_dispatch_timers()) {
+      publish_snapshots();
+    }
+
+    if (poll_count == 0) {
+      answer_pending_acks(fds, nfds);
+      continue;
+    }
+
+    // Process events on file descriptors
+    for (int i = 0; i < polled_fds; i++) {
+
+      // Check if the descriptor is valid and has events, a hang-up on the
+      // Wayland fd is handled by the failing dispatch.
+      short events = i == 1 ? (POLLIN | POLLERR | POLLHUP) : POLLIN;
+      if (fds[i].fd >= 0 && (fds[i].revents & events)) {
+
+        if (i == 0) {
+
+          // Event on the listening socket
+          struct sockaddr_un client_addr;
+          socklen_t client_addr_len = sizeof(client_addr);
+
+          int client_socket = accept(
+              listen_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+
+          if (client_socket == -1) {
+            perror("Error accepting connection");
+            continue; // Continue processing other events
+          }
+
+          // Add the new client socket to the list of monitored fds
+          add_client(fds, nfds, client_socket);
+
+        } else if (i == 1) {
+
+          if (!handle_wayland_readable()) {
+            return; // Exit the loop on Wayland disconnection
+          }
+          fds[1].fd = wlrapps_get_fd();
+
+        } else if (i == 2) {
+
+          handle_watch_readable();
+
+        } else {
+
+          // Event on a client socket
+          char buffer[BUFFER_SIZE];
+          ssize_t bytes_received =
+              recv(fds[i].fd, buffer, BUFFER_SIZE - 1, 0);
+          handle_client_data(fds, nfds, i, buffer, bytes_received);
+        }
+      }
+
+      // Check for other events like POLLERR, POLLHUP, etc. on any valid fd
+      if (fds[i].fd >= 0 &&
+          (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        fprintf(stderr, "Error or hang-up on fd %d (events: %x). Closing.\n",
+                fds[i].fd, fds[i].revents);
+        close_client(fds, nfds, i);
+      }
+    }
+
+    // The events just dispatched may have completed an action.
+    answer_pending_acks(fds, nfds);
   }
 }
 
-// ---- Main Function ---- //
 
 int main(int argc, char **argv) {
-  int listen_socket = -1, client_socket = -1;
+  int listen_socket = -1;
   struct sockaddr_un server_addr;
-  struct pollfd fds[MAX_CLIENTS + 2];
+  struct pollfd fds[MAX_CLIENTS + FIXED_FDS];
   int nfds = 0;
-  socklen_t client_addr_len;
   const char *event_message = NULL;
   int focus_id = -1, close_id = -1;
   int maximize_id = -1, unmaximize_id = -1;
@@ -790,15 +3680,92 @@ int main(int argc, char **argv) {
   int fullscreen_id = -1, unfullscreen_id = -1;
   int one_shot = 1;
   int client_mode = 0;
+  int sync_timeout = -1;
+  int thumbnail_size = 0;
+  const char *usage_log = NULL;
+  int max_title = 0;
+  bool socket_activated = false;
+  int exit_status = EXIT_SUCCESS;
   int c;
 
+  static const struct wlrapps_listener listener = {
+      .toplevel_changed = handle_toplevel_changed,
+      .toplevel_closed = handle_toplevel_closed,
+      .disconnected = handle_disconnected,
+      .reconnected = handle_reconnected,
+  };
+
   // Initialize fds entries to -1
-  for (int i = 0; i < MAX_CLIENTS + 2; i++) {
+  for (int i = 0; i < MAX_CLIENTS + FIXED_FDS; i++) {
     fds[i].fd = -1;
   }
 
-  while ((c = getopt(argc, argv, "f:a:u:i:r:c:s:S:mo:mjq:h:mjx")) != -1) {
+  enum {
+    OPT_FORMAT = 256,
+    OPT_SEPARATOR,
+    OPT_FILTER,
+    OPT_SYNC,
+    OPT_THUMBNAILS,
+    OPT_USAGE_LOG,
+    OPT_MAX_TITLE,
+    OPT_MAX_CLIENTS,
+  };
+  static const struct option long_options[] = {
+      {"format", required_argument, NULL, OPT_FORMAT},
+      {"separator", required_argument, NULL, OPT_SEPARATOR},
+      {"filter", required_argument, NULL, OPT_FILTER},
+      {"sync", optional_argument, NULL, OPT_SYNC},
+      {"thumbnails", optional_argument, NULL, OPT_THUMBNAILS},
+      {"usage-log", required_argument, NULL, OPT_USAGE_LOG},
+      {"max-title", required_argument, NULL, OPT_MAX_TITLE},
+      {"max-clients", required_argument, NULL, OPT_MAX_CLIENTS},
+      {NULL, 0, NULL, 0},
+  };
+
+  while ((c = getopt_long(argc, argv, "f:a:u:i:r:c:s:S:mo:mjTRF:q:h:mjx",
+                          long_options, NULL)) != -1) {
     switch (c) {
+    case OPT_FORMAT:
+      if (!compile_template(&toplevel_template, optarg)) {
+        return EXIT_FAILURE;
+      }
+      output_format = OUTPUT_TEMPLATE;
+      break;
+    case OPT_SEPARATOR:
+      free(template_separator);
+      template_separator = unescape_string(optarg);
+      break;
+    case OPT_SYNC:
+      sync_timeout = optarg ? atoi(optarg) : SYNC_TIMEOUT_MS;
+      break;
+    case OPT_THUMBNAILS:
+      thumbnail_size = THUMBNAIL_SIZE;
+      if (optarg && !parse_option_number("--thumbnails", optarg, 1,
+                                         MAX_THUMBNAIL_SIZE, &thumbnail_size)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_USAGE_LOG:
+      usage_log = optarg;
+      break;
+    case OPT_MAX_TITLE:
+      if (!parse_option_number("--max-title", optarg, 1, INT_MAX,
+                               &max_title)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_MAX_CLIENTS:
+      if (!parse_option_number("--max-clients", optarg, 1, MAX_CLIENTS,
+                               &max_clients)) {
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_FILTER:
+      filter_finish(&stdout_subscription.filter);
+      if (!compile_filter(&stdout_subscription.filter, optarg)) {
+        return EXIT_FAILURE;
+      }
+      break;
     case 'q':
       sort_out = true;
       sort_type = atoi(optarg);
@@ -830,8 +3797,27 @@ int main(int argc, char **argv) {
     case 'm':
       one_shot = 0; // Server mode
       break;
+    case 'T':
+      nested_out = true;
+      break;
+    case 'R':
+      reconnect_mode = true;
+      break;
     case 'j':
-      json_out = true; // Use boolean true
+      output_format = OUTPUT_JSON;
+      break;
+    case 'F':
+      if (strcmp(optarg, "json") == 0) {
+        output_format = OUTPUT_JSON;
+      } else if (strcmp(optarg, "cbor") == 0) {
+        output_format = OUTPUT_CBOR;
+      } else if (strcmp(optarg, "msgpack") == 0) {
+        output_format = OUTPUT_MSGPACK;
+      } else {
+        fprintf(stderr, "Unknown output format '%s'\n", optarg);
+        print_help();
+        return EXIT_FAILURE;
+      }
       break;
     case 'x':
       // Check if there's an argument after -x
@@ -860,342 +3846,156 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (one_shot == 0) { // Server mode
-
-    global_display = wl_display_connect(NULL);
-    if (global_display == NULL) {
-      fprintf(stderr, "Failed to connect to Wayland display.\n");
-      return EXIT_FAILURE;
-    }
-    // printf("Connected to Wayland display.\n");
+  if (pref_output_id != UINT32_MAX) {
+    wlrapps_set_fullscreen_output(pref_output_id);
+  }
 
-    struct wl_registry *registry = wl_display_get_registry(global_display);
-    if (registry == NULL) {
-      fprintf(stderr, "Failed to get Wayland registry.\n");
-      wl_display_disconnect(global_display);
-      return EXIT_FAILURE;
-    }
-    wl_registry_add_listener(registry, &registry_listener, NULL);
+  if (one_shot == 0) { // Server mode
 
-    // Initial Wayland dispatch to get global objects
-    if (wl_display_roundtrip(global_display) == -1) {
-      fprintf(stderr, "Wayland initial roundtrip failed.\n");
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      return EXIT_FAILURE;
+    // The socket is up before the desktop entries are indexed and the
+    // Wayland handshake runs, clients connecting in the meantime wait in the
+    // backlog instead of failing.
+    if (!inherited_listen_socket(&listen_socket)) {
+      exit(EXIT_FAILURE);
     }
-    //printf("Wayland initial roundtrip complete.\n");
+    socket_activated = listen_socket != -1;
+    if (!socket_activated) {
+      listen_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (listen_socket == -1) {
+        perror("Error creating socket");
+        exit(EXIT_FAILURE);
+      }
 
-    // Check if toplevel_manager is available after the roundtrip
-    if (toplevel_manager == NULL) {
-      fprintf(stderr, "wlr-foreign-toplevel not available\n");
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      return EXIT_FAILURE;
-    }
+      if (!control_socket_address(&server_addr)) {
+        close(listen_socket);
+        exit(EXIT_FAILURE);
+      }
 
-    // Another roundtrip to load toplevel details after binding to
-    // toplevel_manager
-    if (wl_display_roundtrip(global_display) == -1) {
+      if (!claim_socket_path(&server_addr)) {
+        close(listen_socket);
+        exit(EXIT_FAILURE);
+      }
 
-      fprintf(stderr, "Wayland second roundtrip failed.\n");
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
+      if (bind(listen_socket, (struct sockaddr *)&server_addr,
+               sizeof(server_addr)) == -1) {
+        perror("Error binding socket");
+        close(listen_socket);
+        exit(EXIT_FAILURE);
+      }
 
-      return EXIT_FAILURE;
+      if (listen(listen_socket, SOMAXCONN) == -1) {
+        perror("Error listening on a socket");
+        close(listen_socket);
+        exit(EXIT_FAILURE);
+      }
     }
-    //printf("Wayland second roundtrip complete (toplevel details loaded).\n");
 
-    listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (listen_socket == -1) {
-      perror("Error creating socket");
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      exit(EXIT_FAILURE);
+    wlrapps_init(WLRAPPS_WATCH_DESKTOP_ENTRIES |
+                     (reconnect_mode ? WLRAPPS_RECONNECT : 0),
+                 &listener, NULL);
+    if (thumbnail_size > 0 &&
+        !wlrapps_enable_thumbnails((uint32_t)thumbnail_size,
+                                   THUMBNAIL_BUDGET)) {
+      fprintf(stderr, "Continuing without thumbnails.\n");
     }
-
-    int wayland_fd = wl_display_get_fd(global_display);
-    if (wayland_fd < 0) {
-      fprintf(stderr, "Failed to get Wayland display file descriptor. \n");
-      close(listen_socket);
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      exit(EXIT_FAILURE);
+    if (!history_init()) {
+      fprintf(stderr, "Continuing without the event history.\n");
+    }
+    if (max_title > 0) {
+      wlrapps_set_max_title_length((size_t)max_title);
+    }
+    if (usage_log && !wlrapps_set_usage_log(usage_log)) {
+      fprintf(stderr, "Continuing without the usage log.\n");
     }
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, SOCKET_PATH,
-            sizeof(server_addr.sun_path) - 1);
-
-    unlink(SOCKET_PATH); // Remove the socket file if it already exists
-
-    if (bind(listen_socket, (struct sockaddr *)&server_addr,
-             sizeof(server_addr)) == -1) {
-      perror("Error binding socket");
-      close(listen_socket);
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      exit(EXIT_FAILURE);
+    // Widgets keyed by id survive a daemon restart.
+    char id_cache[PATH_MAX];
+    if (!control_runtime_path(id_cache, sizeof(id_cache), ".ids") ||
+        !wlrapps_set_id_cache(id_cache)) {
+      fprintf(stderr, "Continuing without stable ids.\n");
     }
 
-    if (listen(listen_socket, 5) == -1) {
-      perror("Error listening on a socket");
+    bool connected = wlrapps_connect();
+    if (!connected && !reconnect_mode) {
       close(listen_socket);
-      wl_registry_destroy(registry);
-      wl_display_disconnect(global_display);
-      exit(EXIT_FAILURE);
+      if (!socket_activated) {
+        unlink(server_addr.sun_path);
+      }
+      wlrapps_finish();
+      return EXIT_FAILURE;
     }
 
-    // printf("Listening for connections on socket: %s\n", SOCKET_PATH);
-
     // Add listening socket and Wayland FD to pollfds
     fds[0].fd = listen_socket;
     fds[0].events = POLLIN;
     nfds++;
 
-    fds[1].fd = wayland_fd;
+    fds[1].fd = wlrapps_get_fd();
     fds[1].events = POLLIN;
     nfds++;
 
-    wl_display_flush(global_display);
-
-    int running = 1;
-    while (running) {
-      client_addr_len = sizeof(struct sockaddr_un);
-
-      // printf("listening for wayland/socket events...\n");
-      // Wait for events on monitored file descriptors (sockets and Wayland)
-      int poll_count = poll(fds, nfds, -1);
-
-      if (poll_count == -1) {
-        if (errno == EINTR) {
-          continue; // Interrupted by signal, continue.
-        }
-        perror("poll error");
-        running = 0; // Exit loop on poll error.
-        break;
-      }
-
-      // Process events on file descriptors
-      for (int i = 0; i < nfds; i++) {
-
-        // Check if the descriptor is valid and has events
-        if (fds[i].fd >= 0 && (fds[i].revents & POLLIN)) {
-
-          if (i == 0) {
-
-            // Event on the listening socket
-            struct sockaddr_un client_addr;
-            socklen_t current_client_addr_len = sizeof(client_addr);
-
-            int client_socket =
-                accept(listen_socket, (struct sockaddr *)&client_addr,
-                       &current_client_addr_len);
-
-            if (client_socket == -1) {
-              perror("Error accepting connection");
-              continue; // Continue processing other events
-            }
-
-            // printf("Client connected (fd: %d).\n", client_socket);
-
-            // Add the new client socket to the list of monitored fds
-            int j;
-
-            for (j = 2; j < MAX_CLIENTS + 2; ++j) {
-              if (fds[j].fd == -1) { // Find the first unused slot
-
-                fds[j].fd = client_socket;
-                fds[j].events = POLLIN;
-
-                if (j >=
-                    nfds) { // Update nfds if we added beyond the current count
-
-                  nfds = j + 1;
-                }
-                break;
-              }
-            }
-
-            if (j >= MAX_CLIENTS + 2) {
-
-              fprintf(
-                  stderr,
-                  "Maximum number of clients reached. Connection rejected.\n");
-              close(client_socket); // Close the new connection immediately
-            }
-
-          } else if (i == 1) {
-
-            if (wl_display_dispatch(global_display) == -1) {
-              fprintf(stderr, "Wayland display disconnected.\n");
-              running = 0; // Exit the loop on Wayland disconnection
-              break;       // Exit the inner for loop as well
-            }
-
-            // After dispatching, flush any pending requests to the compositor
-            wl_display_flush(global_display);
-
-            if (json_out) {
-              print_toplevel_json_array();
-            }
-
-          } else {
-
-            // Event on a client socket
-            char buffer[BUFFER_SIZE];
-            int bytes_received = recv(fds[i].fd, buffer, BUFFER_SIZE - 1, 0);
-
-            if (bytes_received > 0) {
-
-              buffer[bytes_received] = '\0';
-              handle_event(fds[i].fd, buffer);
-              wl_display_flush(global_display);
-
-              // Since the client is only meant to send one event and exit, we
-              // close the socket right away to avoid it being left open.
-              close(client_socket);
-              fds[i].fd = -1; // Mark slot as unused
-              // Adjust nfds if the highest index fd disconnected
-              while (nfds > 2 &&
-                     fds[nfds - 1].fd == -1) { // Start checking from index 2
-                nfds--;
-              }
-
-            } else if (bytes_received == 0) {
-
-              // Client disconnected
-              printf("Client disconnected (fd: %d).\n", fds[i].fd);
-              close(fds[i].fd);
-
-              fds[i].fd = -1;
-              while (nfds > 2 &&
-                     fds[nfds - 1].fd == -1) { // Start checking from index 2
-                nfds--;
-              }
-
-            } else {
-
-              // Error receiving data
-              if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                perror("Error receiving data.");
-              }
-              close(fds[i].fd);
-              fds[i].fd = -1;
-              while (nfds > 2 && fds[nfds - 1].fd == -1) {
-                nfds--;
-              }
-            }
-          }
-        }
-
-        // Check for other events like POLLERR, POLLHUP, etc. on any valid fd
-        if (fds[i].fd >= 0 &&
-            (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))) {
-          fprintf(stderr, "Error or hang-up on fd %d (events: %x). Closing.\n",
-                  fds[i].fd, fds[i].revents);
-          close(fds[i].fd);
-          fds[i].fd = -1;
-          while (nfds > 2 && fds[nfds - 1].fd == -1) {
-            nfds--;
-          }
-        }
-      }
-    }
-  } else if (client_mode == 1) {
-
-    // Client mode
-    client_socket = socket(AF_UNIX, SOCK_STREAM, 0);
-
-    if (client_socket == -1) {
-      perror("Error creating client socket.");
-      exit(EXIT_FAILURE);
-    }
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, SOCKET_PATH,
-            sizeof(server_addr.sun_path) - 1);
+    // Poll ignores the slot if inotify isn't available.
+    fds[2].fd = wlrapps_get_watch_fd();
+    fds[2].events = POLLIN;
+    nfds++;
 
-    if (connect(client_socket, (struct sockaddr *)&server_addr,
-                sizeof(server_addr)) == -1) {
-      perror("Error connecting to socket");
-      close(client_socket);
-      exit(EXIT_FAILURE);
+    if (connected) {
+      refresh_subscriptions();
+      print_full_state();
+    } else {
+      // The compositor may not be up yet, libwlrapps keeps retrying.
+      print_disconnected_status();
     }
 
-    printf("Connected to socket: %s\n", SOCKET_PATH);
-
-    if (event_message != NULL &&
-        send(client_socket, event_message, strlen(event_message), 0) == -1) {
-      perror("Error sending data");
-      close(client_socket);
-      exit(EXIT_FAILURE);
-    }
+    run_poll_loop(fds, &nfds, listen_socket);
+  } else if (client_mode == 1) {
 
-    printf("Sent Message: %s\n", event_message);
+    // Client mode, the same as wlr-appsctl.
+    exit_status = control_send(event_message, sync_timeout);
 
   } else {
     // Default single run.
-    struct wl_display *display = wl_display_connect(NULL);
-    if (display == NULL) {
-      fprintf(stderr, "Failed to create display\n");
+    wlrapps_init(0, &listener, NULL);
+    if (!wlrapps_connect()) {
       return EXIT_FAILURE;
     }
 
-    struct wl_registry *registry = wl_display_get_registry(display);
-    wl_registry_add_listener(registry, &registry_listener, NULL);
-    wl_display_roundtrip(display);
-
-    if (toplevel_manager == NULL) {
-      fprintf(stderr, "wlr-foreign-toplevel not available\n");
-      return EXIT_FAILURE;
+    refresh_subscriptions();
+    if (output_format == OUTPUT_TEXT) {
+      print_full_state();
     }
-    wl_display_roundtrip(display); // load list of toplevels
-    wl_display_roundtrip(display); // load toplevel details
 
-    struct toplevel_v1 *toplevel;
-    if ((toplevel = toplevel_by_id_or_bail(focus_id))) {
-      zwlr_foreign_toplevel_handle_v1_activate(toplevel->zwlr_toplevel, seat);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(maximize_id))) {
-      zwlr_foreign_toplevel_handle_v1_set_maximized(toplevel->zwlr_toplevel);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(unmaximize_id))) {
-      zwlr_foreign_toplevel_handle_v1_unset_maximized(toplevel->zwlr_toplevel);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(minimize_id))) {
-      zwlr_foreign_toplevel_handle_v1_set_minimized(toplevel->zwlr_toplevel);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(restore_id))) {
-      zwlr_foreign_toplevel_handle_v1_unset_minimized(toplevel->zwlr_toplevel);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(fullscreen_id))) {
-      if (pref_output_id != UINT32_MAX && pref_output == NULL) {
-        fprintf(stderr, "Could not find output %i\n", pref_output_id);
+    const struct {
+      int id;
+      enum wlrapps_action action;
+    } requests[] = {
+        {focus_id, WLRAPPS_ACTION_FOCUS},
+        {maximize_id, WLRAPPS_ACTION_MAXIMIZE},
+        {unmaximize_id, WLRAPPS_ACTION_UNMAXIMIZE},
+        {minimize_id, WLRAPPS_ACTION_MINIMIZE},
+        {restore_id, WLRAPPS_ACTION_RESTORE},
+        {fullscreen_id, WLRAPPS_ACTION_FULLSCREEN},
+        {unfullscreen_id, WLRAPPS_ACTION_UNFULLSCREEN},
+        {close_id, WLRAPPS_ACTION_CLOSE},
+    };
+
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+      if (requests[i].id != -1) {
+        wlrapps_toplevel_action((uint32_t)requests[i].id, requests[i].action);
       }
-
-      zwlr_foreign_toplevel_handle_v1_set_fullscreen(toplevel->zwlr_toplevel,
-                                                     pref_output);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(unfullscreen_id))) {
-      zwlr_foreign_toplevel_handle_v1_unset_fullscreen(toplevel->zwlr_toplevel);
-    }
-    if ((toplevel = toplevel_by_id_or_bail(close_id))) {
-      zwlr_foreign_toplevel_handle_v1_close(toplevel->zwlr_toplevel);
     }
 
-    wl_display_flush(display);
+    wlrapps_flush();
 
-    if (json_out) {
-      print_toplevel_json_array();
+    if (output_format != OUTPUT_TEXT) {
+      print_toplevel_array();
     }
   }
 
   // Close all active file descriptors
   if (one_shot == 0 || client_mode == 1) {
-    for (int i = 0; i < MAX_CLIENTS + 2; ++i) {
+    // The Wayland and inotify fds belong to libwlrapps.
+    for (int i = FIXED_FDS; i < MAX_CLIENTS + FIXED_FDS; ++i) {
       if (fds[i].fd >= 0) {
         close(fds[i].fd);
         fds[i].fd = -1;
@@ -1206,16 +4006,16 @@ int main(int argc, char **argv) {
     if (listen_socket != -1) {
       close(listen_socket);
     }
-    // Close client socket if it was opened in client mode
-    if (client_socket != -1) {
-      // sleep(0.2);
-      close(client_socket);
-    }
 
-    // Remove the socket file if it exists and we were in server mode
-    if (one_shot == 0) {
-      unlink(SOCKET_PATH);
+    // Remove the socket file if it exists and we were in server mode, an
+    // inherited one belongs to the service manager.
+    if (one_shot == 0 && !socket_activated) {
+      unlink(server_addr.sun_path);
     }
   }
-  return EXIT_SUCCESS;
+  if (client_mode == 0) {
+    wlrapps_finish();
+  }
+  return exit_status;
 }
+
@@ -0,0 +1,66 @@
+#define _POSIX_C_SOURCE 200809L
+#include "control.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A minimal client for the wlr-apps daemon, meant to be run on every click
+// of a bar or dock. It doesn't link Wayland or the library and only joins
+// its arguments into one command.
+
+static void print_help(void) {
+  fprintf(stderr,
+          "Usage: wlr-appsctl [--sync[=<ms>]] <command> [<argument>]...\n"
+          "Send a command to the running 'wlr-apps -m' daemon.\n"
+          "\n"
+          "  wlr-appsctl f 3             focus toplevel 3, see 'wlr-apps -h'\n"
+          "                              for every command\n"
+          "  wlr-appsctl i app:firefox   minimize every firefox window\n"
+          "  wlr-appsctl subscribe active\n"
+          "                              print a json snapshot of the\n"
+          "                              matching toplevels on every change\n"
+          "  wlr-appsctl wait new timeout=5000 app_id == foot\n"
+          "                              print \"ok <id>\" once a new foot\n"
+          "                              window appears, fail with\n"
+          "                              \"timeout\" after 5 seconds\n"
+          "  --sync[=<ms>]               wait until the compositor applied\n"
+          "                              the action, print \"ok <ms>\" or\n"
+          "                              fail with \"timeout\" after <ms>\n");
+}
+
+int main(int argc, char **argv) {
+  char message[CONTROL_BUFFER_SIZE];
+  int sync_timeout = -1;
+  int first = 1;
+
+  if (argc > 1 && strncmp(argv[1], "--sync", 6) == 0) {
+    if (argv[1][6] == '=') {
+      sync_timeout = atoi(argv[1] + 7);
+    } else if (argv[1][6] == '\0') {
+      sync_timeout = CONTROL_SYNC_TIMEOUT_MS;
+    } else {
+      print_help();
+      return EXIT_FAILURE;
+    }
+    first++;
+  }
+
+  if (first >= argc || strcmp(argv[first], "-h") == 0 ||
+      strcmp(argv[first], "--help") == 0) {
+    print_help();
+    return first >= argc ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  size_t len = 0;
+  for (int i = first; i < argc; ++i) {
+    int written = snprintf(message + len, sizeof(message) - len, "%s%s",
+                           i > first ? " " : "", argv[i]);
+    if (written < 0 || (size_t)written >= sizeof(message) - len) {
+      fprintf(stderr, "Command is too long\n");
+      return EXIT_FAILURE;
+    }
+    len += written;
+  }
+
+  return control_send(message, sync_timeout);
+}
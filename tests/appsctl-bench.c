@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include "daemon-harness.h"
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Times a click: from spawning the client to the command arriving on the
+// control socket, and until the client exited. The socket is a bare
+// listener, no daemon or compositor is involved, so the numbers are the
+// client's startup and connect alone.
+
+#define RUNS 500
+
+extern char **environ;
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static bool run(const char *name, int listener, char *const argv[]) {
+  static double arrived[RUNS], exited[RUNS];
+  char command[CONTROL_BUFFER_SIZE];
+  long max_rss = 0;
+
+  for (int i = 0; i < RUNS; ++i) {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    double start = now_ms();
+    if (posix_spawn(&pid, argv[0], NULL, NULL, argv, environ) != 0) {
+      perror("Error spawning the client");
+      return false;
+    }
+
+    int fd = accept(listener, NULL, NULL);
+    ssize_t len = fd == -1 ? -1 : recv(fd, command, sizeof(command) - 1, 0);
+    arrived[i] = now_ms() - start;
+    if (fd != -1) {
+      close(fd);
+    }
+    wait4(pid, &status, 0, &usage);
+    exited[i] = now_ms() - start;
+    max_rss = usage.ru_maxrss > max_rss ? usage.ru_maxrss : max_rss;
+
+    if (len <= 0 || strncmp(command, "f 1", 3) != 0) {
+      fprintf(stderr, "%s didn't send the command\n", name);
+      return false;
+    }
+  }
+
+  qsort(arrived, RUNS, sizeof(arrived[0]), compare_doubles);
+  qsort(exited, RUNS, sizeof(exited[0]), compare_doubles);
+  printf("%-20s median %.2f ms to the command (p90 %.2f), %.2f ms to the "
+         "exit, max rss %ld KiB\n",
+         name, arrived[RUNS / 2], arrived[RUNS * 9 / 10], exited[RUNS / 2],
+         max_rss);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_un addr;
+
+  if (argc < 3 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps> <wlr-appsctl>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener == -1 || !control_socket_address(&addr) ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener, SOMAXCONN) == -1) {
+    perror("Error setting up the listener");
+    harness_finish();
+    return EXIT_FAILURE;
+  }
+
+  char *const appsctl[] = {argv[2], "f", "1", NULL};
+  char *const daemon_client[] = {argv[1], "-x", "f 1", NULL};
+  bool ok = run("wlr-appsctl f 1", listener, appsctl) &&
+            run("wlr-apps -x \"f 1\"", listener, daemon_client);
+
+  close(listener);
+  harness_finish();
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
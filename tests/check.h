@@ -0,0 +1,30 @@
+#ifndef WLRAPPS_CHECK_H
+#define WLRAPPS_CHECK_H
+
+// What the tests check with: a failed check is reported with its line and
+// counted, and check_status() turns the count into the exit status.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int failures = 0;
+
+#define check(condition, ...)                                                  \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      fprintf(stderr, "%s:%d: ", __FILE__, __LINE__);                          \
+      fprintf(stderr, __VA_ARGS__);                                            \
+      fprintf(stderr, "\n");                                                   \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+static inline int check_status(void) {
+  if (failures > 0) {
+    fprintf(stderr, "%d checks failed\n", failures);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+#endif
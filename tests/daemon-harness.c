@@ -0,0 +1,312 @@
+#define _GNU_SOURCE
+#include "daemon-harness.h"
+#include "control.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define START_TIMEOUT_MS 5000
+
+static const char *daemon_path = NULL;
+static char runtime_dir[64];
+static int fifo_fd = -1;
+
+double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1e6;
+}
+
+// ---- Setup ----
+
+bool harness_init(const char *path) {
+  char fifo[128];
+
+  daemon_path = path;
+  strcpy(runtime_dir, "/tmp/wlr-apps-test-XXXXXX");
+  if (!mkdtemp(runtime_dir)) {
+    perror("Error creating the runtime dir");
+    return false;
+  }
+
+  snprintf(fifo, sizeof(fifo), "%s/mock.fifo", runtime_dir);
+  if (mkfifo(fifo, 0600) == -1) {
+    perror("Error creating the FIFO");
+    return false;
+  }
+  // Opened for reading too, so writes work before the daemon is up.
+  fifo_fd = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fifo_fd == -1) {
+    perror("Error opening the FIFO");
+    return false;
+  }
+
+  setenv("XDG_RUNTIME_DIR", runtime_dir, 1);
+  setenv("WAYLAND_DISPLAY", "mock-0", 1);
+  setenv("WLRAPPS_MOCK_FIFO", fifo, 1);
+  signal(SIGPIPE, SIG_IGN);
+  return true;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag,
+                        struct FTW *ftw) {
+  remove(path);
+  return 0;
+}
+
+void harness_finish(void) {
+  if (fifo_fd != -1) {
+    close(fifo_fd);
+    fifo_fd = -1;
+  }
+  if (runtime_dir[0]) {
+    nftw(runtime_dir, remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+    runtime_dir[0] = '\0';
+  }
+}
+
+const char *harness_runtime_dir(void) { return runtime_dir; }
+
+// ---- Daemon ----
+
+static bool spawn(struct daemon *daemon, const char *const *args,
+                  bool capture_stdout, int fd, const char *listen_fds) {
+  const char *argv[32] = {daemon_path};
+  size_t argc = 1;
+  for (; args && args[argc - 1] && argc < 31; ++argc) {
+    argv[argc] = args[argc - 1];
+  }
+  argv[argc] = NULL;
+
+  int out[2] = {-1, -1};
+  if (capture_stdout && pipe2(out, O_CLOEXEC) == -1) {
+    perror("Error creating a pipe");
+    return false;
+  }
+
+  daemon->pid = fork();
+  if (daemon->pid == -1) {
+    perror("Error forking");
+    return false;
+  }
+
+  if (daemon->pid == 0) {
+    if (capture_stdout) {
+      dup2(out[1], STDOUT_FILENO);
+    }
+    if (listen_fds) {
+      char pid[32];
+      if (fd == 3) {
+        fcntl(fd, F_SETFD, 0);
+      } else {
+        dup2(fd, 3);
+      }
+      snprintf(pid, sizeof(pid), "%ld", (long)getpid());
+      setenv("LISTEN_PID", pid, 1);
+      setenv("LISTEN_FDS", listen_fds, 1);
+    }
+    execv(daemon_path, (char *const *)argv);
+    perror("Error starting the daemon");
+    _exit(127);
+  }
+
+  daemon->out = out[0];
+  if (capture_stdout) {
+    close(out[1]);
+  }
+  return true;
+}
+
+bool daemon_start(struct daemon *daemon, const char *const *args,
+                  bool capture_stdout) {
+  if (!spawn(daemon, args, capture_stdout, -1, NULL)) {
+    return false;
+  }
+
+  // The socket of a daemon that just exited may still be listening, only
+  // the new daemon's own one counts.
+  double deadline = now_ms() + START_TIMEOUT_MS;
+  while (now_ms() < deadline) {
+    int fd = control_connect();
+    if (fd != -1) {
+      struct ucred cred;
+      socklen_t len = sizeof(cred);
+      bool own = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 &&
+                 cred.pid == daemon->pid;
+      close(fd);
+      if (own) {
+        return true;
+      }
+    }
+    if (waitpid(daemon->pid, NULL, WNOHANG) == daemon->pid) {
+      fprintf(stderr, "The daemon exited while starting\n");
+      daemon->pid = -1;
+      return false;
+    }
+    usleep(2000);
+  }
+
+  fprintf(stderr, "The daemon's socket didn't come up\n");
+  daemon_stop(daemon);
+  return false;
+}
+
+bool daemon_start_activated(struct daemon *daemon, const char *const *args,
+                            int fd, const char *listen_fds) {
+  return spawn(daemon, args, false, fd, listen_fds);
+}
+
+int daemon_wait(struct daemon *daemon, int timeout_ms) {
+  int status = 0;
+  double deadline = now_ms() + timeout_ms;
+  pid_t pid;
+
+  if (daemon->pid <= 0) {
+    return -1;
+  }
+  while ((pid = waitpid(daemon->pid, &status, WNOHANG)) == 0 &&
+         now_ms() < deadline) {
+    usleep(1000);
+  }
+  if (pid == 0) {
+    kill(daemon->pid, SIGKILL);
+    waitpid(daemon->pid, &status, 0);
+  }
+
+  daemon->pid = -1;
+  if (daemon->out != -1) {
+    close(daemon->out);
+    daemon->out = -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int daemon_stop(struct daemon *daemon) {
+  if (daemon->pid > 0) {
+    kill(daemon->pid, SIGTERM);
+  }
+  return daemon_wait(daemon, START_TIMEOUT_MS);
+}
+
+size_t daemon_rss(const struct daemon *daemon) {
+  char path[64], line[256];
+  size_t rss = 0;
+
+  snprintf(path, sizeof(path), "/proc/%ld/status", (long)daemon->pid);
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "VmRSS: %zu kB", &rss) == 1) {
+      break;
+    }
+  }
+  fclose(file);
+  return rss;
+}
+
+// ---- Talking to It ----
+
+bool mock_send(const char *format, ...) {
+  char line[512];
+  va_list ap;
+
+  va_start(ap, format);
+  int len = vsnprintf(line, sizeof(line) - 1, format, ap);
+  va_end(ap);
+  if (len < 0 || (size_t)len >= sizeof(line) - 1) {
+    return false;
+  }
+  line[len++] = '\n';
+
+  // The FIFO keeps a line in one piece, a full one is waited out.
+  for (int tries = 0; tries < 1000; ++tries) {
+    if (write(fifo_fd, line, (size_t)len) == len) {
+      return true;
+    }
+    if (errno != EAGAIN) {
+      break;
+    }
+    usleep(1000);
+  }
+  perror("Error writing to the FIFO");
+  return false;
+}
+
+int control_connect(void) {
+  struct sockaddr_un addr;
+  if (!control_socket_address(&addr)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static ssize_t read_reply(int fd, char *buffer, size_t size, bool line,
+                          int timeout_ms) {
+  double deadline = now_ms() + timeout_ms;
+  size_t len = 0;
+
+  buffer[0] = '\0';
+  while (len < size - 1) {
+    int left = (int)(deadline - now_ms());
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return -1;
+    }
+
+    ssize_t n = read(fd, buffer + len, size - 1 - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    len += (size_t)n;
+    buffer[len] = '\0';
+    if (line && buffer[len - 1] == '\n') {
+      break;
+    }
+  }
+  return (ssize_t)len;
+}
+
+ssize_t read_line(int fd, char *buffer, size_t size, int timeout_ms) {
+  return read_reply(fd, buffer, size, true, timeout_ms);
+}
+
+ssize_t control_request(const char *command, char *reply, size_t size,
+                        bool line, int timeout_ms) {
+  int fd = control_connect();
+  if (fd == -1) {
+    reply[0] = '\0';
+    return -1;
+  }
+
+  ssize_t len = -1;
+  if (send(fd, command, strlen(command), MSG_NOSIGNAL) != -1) {
+    len = read_reply(fd, reply, size, line, timeout_ms);
+  }
+  close(fd);
+  return len;
+}
@@ -0,0 +1,59 @@
+#ifndef WLRAPPS_DAEMON_HARNESS_H
+#define WLRAPPS_DAEMON_HARNESS_H
+
+// Runs wlr-apps-mock, the daemon built against the mock compositor, in a
+// private runtime dir and talks to it the way its clients do. The compositor
+// inside it is scripted through the FIFO commands of mock-compositor.h.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct daemon {
+  pid_t pid;
+  int out; // The daemon's stdout, -1 unless it was captured
+};
+
+// Creates the runtime dir and the FIFO and points the environment at them.
+// path is the daemon executable, the tests take it as their first argument.
+bool harness_init(const char *path);
+// Removes the runtime dir and everything in it.
+void harness_finish(void);
+const char *harness_runtime_dir(void);
+
+// Starts the daemon with args (NULL terminated, without argv[0]) and waits
+// until its control socket accepts connections.
+bool daemon_start(struct daemon *daemon, const char *const *args,
+                  bool capture_stdout);
+// Starts the daemon like a service manager would, with fd passed as fd 3 and
+// LISTEN_FDS set to listen_fds, or plainly if listen_fds is NULL. Doesn't
+// wait for anything.
+bool daemon_start_activated(struct daemon *daemon, const char *const *args,
+                            int fd, const char *listen_fds);
+// Returns the exit status, or 128 + the signal. Waits at most timeout_ms,
+// then kills the daemon.
+int daemon_wait(struct daemon *daemon, int timeout_ms);
+// SIGTERM and daemon_wait().
+int daemon_stop(struct daemon *daemon);
+// The resident set of the daemon in KiB, from /proc, 0 if unknown.
+size_t daemon_rss(const struct daemon *daemon);
+
+// Writes a command line to the mock compositor.
+bool mock_send(const char *format, ...)
+    __attribute__((format(printf, 1, 2)));
+
+// Connects to the control socket, -1 on failure.
+int control_connect(void);
+// Sends a command and reads the reply until the daemon hangs up, a newline
+// ends it early if line is true. Returns the length, -1 on a timeout or
+// error. reply is always terminated.
+ssize_t control_request(const char *command, char *reply, size_t size,
+                        bool line, int timeout_ms);
+// Reads from fd until the reply ends with a newline, the daemon hangs up or
+// timeout_ms pass.
+ssize_t read_line(int fd, char *buffer, size_t size, int timeout_ms);
+
+// Milliseconds on the monotonic clock.
+double now_ms(void);
+
+#endif
@@ -0,0 +1,159 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "mock-compositor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wlrapps.h>
+
+// Runs libwlrapps against the mock compositor with private application
+// directories and checks that a hidden entry in XDG_DATA_HOME masks the
+// system entry with the same id, at startup and as the files change.
+
+#define SETTLE_PASSES 4
+
+static const struct wlrapps_listener listener = {0};
+static char root[] = "/tmp/wlr-apps-desktop-XXXXXX";
+
+static void settle(void) {
+  for (int i = 0; i < SETTLE_PASSES; ++i) {
+    wlrapps_dispatch();
+  }
+}
+
+static void path_of(char *path, size_t size, const char *dir,
+                    const char *file_name) {
+  snprintf(path, size, "%s/%s/applications/%s", root, dir, file_name);
+}
+
+// Writes next to the file and renames it in, the way package managers and
+// editors replace entries.
+static bool write_entry(const char *dir, const char *file_name,
+                        const char *contents) {
+  char path[256], tmp[272];
+  path_of(path, sizeof(path), dir, file_name);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *file = fopen(tmp, "w");
+  if (!file) {
+    perror("Error writing a desktop entry");
+    return false;
+  }
+  fprintf(file, "[Desktop Entry]\n%s", contents);
+  fclose(file);
+  return rename(tmp, path) == 0;
+}
+
+static void remove_entry(const char *dir, const char *file_name) {
+  char path[256];
+  path_of(path, sizeof(path), dir, file_name);
+  unlink(path);
+}
+
+static const char *name_of(const char *app_id) {
+  for (const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+       toplevel; toplevel = wlrapps_next_toplevel(toplevel)) {
+    if (toplevel->app_id && strcmp(toplevel->app_id, app_id) == 0) {
+      return toplevel->name ? toplevel->name : "(none)";
+    }
+  }
+  return "(no window)";
+}
+
+static void expect_name(const char *app_id, const char *name) {
+  const char *actual = name_of(app_id);
+  check(strcmp(actual, name) == 0, "%s is named '%s' instead of '%s'", app_id,
+        actual, name);
+}
+
+static bool make_dirs(void) {
+  char path[256];
+  const char *const dirs[] = {"home", "home/applications", "usr",
+                              "usr/applications"};
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+    snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+    if (mkdir(path, 0700) == -1) {
+      perror("Error creating a directory");
+      return false;
+    }
+  }
+  snprintf(path, sizeof(path), "%s/home", root);
+  setenv("XDG_DATA_HOME", path, 1);
+  snprintf(path, sizeof(path), "%s/usr", root);
+  setenv("XDG_DATA_DIRS", path, 1);
+  return true;
+}
+
+static void remove_dirs(void) {
+  const char *const files[] = {"foot.desktop", "firefox.desktop",
+                               "gimp.desktop"};
+  char path[256];
+  for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); ++i) {
+    remove_entry("home", files[i]);
+    remove_entry("usr", files[i]);
+  }
+  const char *const dirs[] = {"home/applications", "home", "usr/applications",
+                              "usr"};
+  for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); ++i) {
+    snprintf(path, sizeof(path), "%s/%s", root, dirs[i]);
+    rmdir(path);
+  }
+  rmdir(root);
+}
+
+int main(void) {
+  if (!mkdtemp(root)) {
+    perror("Error creating a directory");
+    return EXIT_FAILURE;
+  }
+  if (!make_dirs() ||
+      !write_entry("usr", "foot.desktop", "Name=Foot\n") ||
+      !write_entry("usr", "firefox.desktop",
+                   "Name=Firefox\nStartupWMClass=Navigator\n") ||
+      !write_entry("usr", "gimp.desktop",
+                   "Name=GIMP\nStartupWMClass=gimp-2.10\n") ||
+      !write_entry("home", "foot.desktop", "Name=Foot\nHidden=true\n") ||
+      !write_entry("home", "firefox.desktop", "Hidden=true\n")) {
+    remove_dirs();
+    return EXIT_FAILURE;
+  }
+
+  mock_command("new term foot ~");
+  mock_command("new web navigator Start Page");
+  mock_command("new paint gimp-2.10 Untitled");
+
+  wlrapps_init(WLRAPPS_WATCH_DESKTOP_ENTRIES, &listener, NULL);
+  if (!wlrapps_connect()) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    remove_dirs();
+    return EXIT_FAILURE;
+  }
+  settle();
+
+  // Hidden in the home directory, the system entries don't count either,
+  // not even through their StartupWMClass.
+  expect_name("foot", "(none)");
+  expect_name("navigator", "(none)");
+  expect_name("gimp-2.10", "GIMP");
+
+  // Deleting the override brings back the system entry.
+  remove_entry("home", "foot.desktop");
+  wlrapps_dispatch_watch();
+  expect_name("foot", "Foot");
+
+  // Hiding an entry that is in use takes it away.
+  write_entry("home", "gimp.desktop", "Hidden=true\n");
+  wlrapps_dispatch_watch();
+  expect_name("gimp-2.10", "(none)");
+
+  // An override that isn't hidden any more replaces the placeholder.
+  write_entry("home", "firefox.desktop",
+              "Name=Firefox Nightly\nStartupWMClass=Navigator\n");
+  wlrapps_dispatch_watch();
+  expect_name("navigator", "Firefox Nightly");
+
+  wlrapps_finish();
+  remove_dirs();
+  return check_status();
+}
@@ -0,0 +1,89 @@
+// Times the daemon's snapshot encoders on toplevels served by the mock
+// compositor, titles around 75 bytes. "cold" encodes every toplevel again,
+// like the first snapshot or one after every record changed, "warm" reuses
+// the cached fragments like a snapshot after a single change.
+//
+// The encoders are file local, so the daemon is compiled in with its main
+// renamed.
+#define main wlr_apps_main
+#include "wlr-apps.c"
+#undef main
+
+#include "mock-compositor.h"
+
+#define RUN_NS 200000000 // Per format and size
+
+static void add_windows(size_t count) {
+  static const char *const apps[] = {"org.gnome.Nautilus", "firefox", "foot",
+                                     "code", "org.telegram.desktop"};
+  static size_t serial = 0;
+
+  for (size_t i = 0; i < count; ++i, ++serial) {
+    char title[128];
+    snprintf(title, sizeof(title),
+             "%03zu README.md \"draft\" - wayland-toplevel-info - Visual "
+             "Studio Code \xe2\x80\x94 d\xc3\xa9j\xc3\xa0 vu",
+             serial);
+    mock_add_toplevel(apps[serial % (sizeof(apps) / sizeof(apps[0]))], title);
+  }
+
+  // The new windows are announced on the next pass.
+  wlrapps_dispatch();
+  wlrapps_dispatch();
+  refresh_subscriptions();
+  collect_snapshot(&stdout_subscription);
+}
+
+static void run(const char *name, enum output_format format, bool cold) {
+  const struct encoder *encoder = encoder_for_format(format);
+  size_t bytes = 0;
+
+  uint64_t start = now_ns(), elapsed = 0;
+  size_t rounds = 0;
+  while (elapsed < RUN_NS) {
+    for (int i = 0; i < 16; ++i, ++rounds) {
+      if (cold) {
+        fragments_invalidate_all();
+      }
+      output_buffer.len = 0;
+      encode_toplevel_array(encoder, &output_buffer, &stdout_subscription);
+      bytes = output_buffer.len;
+    }
+    elapsed = now_ns() - start;
+  }
+
+  printf("%3zu toplevels %-8s %-5s %8.2f us %6zu bytes\n",
+         global_info_list.count, name, cold ? "cold" : "warm",
+         (double)elapsed / (double)rounds / 1000.0, bytes);
+}
+
+int main(void) {
+  static const struct wlrapps_listener bench_listener = {0};
+  const size_t sizes[] = {10, 50, 200};
+
+  wlrapps_init(0, &bench_listener, NULL);
+  if (!wlrapps_connect()) {
+    return EXIT_FAILURE;
+  }
+
+  size_t windows = 0;
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    add_windows(sizes[i] - windows);
+    windows = sizes[i];
+    if (global_info_list.count != windows) {
+      fprintf(stderr, "%zu toplevels, expected %zu\n", global_info_list.count,
+              windows);
+      return EXIT_FAILURE;
+    }
+
+    for (int cold = 1; cold >= 0; --cold) {
+      run("json", OUTPUT_JSON, cold);
+      run("cbor", OUTPUT_CBOR, cold);
+      run("msgpack", OUTPUT_MSGPACK, cold);
+    }
+  }
+
+  fragments_clear();
+  wlrapps_finish();
+  return EXIT_SUCCESS;
+}
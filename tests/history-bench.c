@@ -0,0 +1,51 @@
+// Times recording a toplevel event in the daemon's history: the json frame,
+// its copy into the ring and the eviction of the oldest events. Titles are
+// around 75 bytes, and every event encodes the toplevel again like after a
+// real change.
+//
+// The history is file local, so the daemon is compiled in with its main
+// renamed.
+#define main wlr_apps_main
+#include "wlr-apps.c"
+#undef main
+
+#include "mock-compositor.h"
+
+#define RUN_NS 200000000
+
+int main(void) {
+  static const struct wlrapps_listener bench_listener = {0};
+
+  wlrapps_init(0, &bench_listener, NULL);
+  mock_add_toplevel("code", "README.md \"draft\" - wayland-toplevel-info - "
+                            "Visual Studio Code \xe2\x80\x94 d\xc3\xa9j\xc3"
+                            "\xa0 vu");
+  if (!wlrapps_connect() || !history_init()) {
+    return EXIT_FAILURE;
+  }
+  wlrapps_dispatch();
+  const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+  if (!toplevel) {
+    fprintf(stderr, "The mock announced no toplevel\n");
+    return EXIT_FAILURE;
+  }
+
+  uint64_t first_seq = history_seq;
+  uint64_t start = now_ns(), elapsed = 0;
+  while (elapsed < RUN_NS) {
+    for (int i = 0; i < 256; ++i) {
+      fragments_invalidate(toplevel->id);
+      history_record(toplevel, false);
+    }
+    elapsed = now_ns() - start;
+  }
+
+  uint64_t events = history_seq - first_seq;
+  printf("%" PRIu64 " events, %.2f us per event, %zu kept, %zu bytes each\n",
+         events, (double)elapsed / (double)events / 1000.0, history_count,
+         history_at(history_count - 1)->len);
+
+  fragments_clear();
+  wlrapps_finish();
+  return EXIT_SUCCESS;
+}
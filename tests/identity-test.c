@@ -0,0 +1,147 @@
+#define _DEFAULT_SOURCE
+#include "check.h"
+#include "mock-compositor.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wlrapps.h>
+
+// Restarts libwlrapps against the mock compositor and checks that the id
+// cache gives the windows their ids back, windows with the same app_id and
+// title in order, and that a second process can't use the cache.
+
+#define WINDOWS 4
+
+// The layout of the cache file in libwlrapps.c.
+struct record {
+  uint32_t id;
+  uint32_t parent_id;
+  uint64_t key;
+  uint64_t identifier;
+};
+
+struct header {
+  uint32_t magic;
+  uint32_t next_id;
+  uint32_t count;
+  uint32_t reserved;
+};
+
+static const struct wlrapps_listener listener = {0};
+static char cache[64];
+
+static bool start(void) {
+  wlrapps_init(0, &listener, NULL);
+  return wlrapps_set_id_cache(cache) && wlrapps_connect();
+}
+
+// The ids in creation order.
+static size_t get_ids(uint32_t ids[WINDOWS]) {
+  size_t count = 0;
+  for (const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+       toplevel && count < WINDOWS;
+       toplevel = wlrapps_next_toplevel(toplevel)) {
+    ids[count++] = toplevel->id;
+  }
+  return count;
+}
+
+static void test_restart(const uint32_t before[WINDOWS]) {
+  uint32_t after[WINDOWS];
+  if (!start()) {
+    check(false, "can't reconnect");
+    return;
+  }
+  check(get_ids(after) == WINDOWS, "windows went missing");
+  for (size_t i = 0; i < WINDOWS; ++i) {
+    check(after[i] == before[i], "window %zu came back as %u, was %u", i,
+          after[i], before[i]);
+  }
+  wlrapps_finish();
+}
+
+// Swaps the records of the first two windows, which share app_id and title.
+// Their ids have to follow the windows' order, not the file's.
+static void shuffle_records(void) {
+  int fd = open(cache, O_RDWR | O_CLOEXEC);
+  size_t size = sizeof(struct header) + 2 * sizeof(struct record);
+  void *map = fd == -1 ? MAP_FAILED
+                       : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              fd, 0);
+  if (map == MAP_FAILED) {
+    check(false, "can't map the cache");
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+  struct record *records =
+      (struct record *)((char *)map + sizeof(struct header));
+  check(records[0].key == records[1].key, "the first records differ");
+  uint32_t id = records[0].id;
+  records[0].id = records[1].id;
+  records[1].id = id;
+  munmap(map, size);
+  close(fd);
+}
+
+static void test_lock(void) {
+  int fd = open(cache, O_RDWR | O_CLOEXEC);
+  check(fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == 0, "can't lock the cache");
+  wlrapps_init(0, &listener, NULL);
+  check(!wlrapps_set_id_cache(cache), "a locked cache was used");
+  wlrapps_finish();
+  if (fd != -1) {
+    close(fd);
+  }
+
+  // And the other way around.
+  wlrapps_init(0, &listener, NULL);
+  check(wlrapps_set_id_cache(cache), "can't use the cache once it's unlocked");
+  fd = open(cache, O_RDWR | O_CLOEXEC);
+  check(fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1,
+        "the cache isn't locked while in use");
+  wlrapps_finish();
+  if (fd != -1) {
+    close(fd);
+  }
+}
+
+int main(void) {
+  char dir[] = "/tmp/wlr-apps-identity-XXXXXX";
+  uint32_t ids[WINDOWS];
+
+  if (!mkdtemp(dir)) {
+    perror("Error creating a directory");
+    return EXIT_FAILURE;
+  }
+  snprintf(cache, sizeof(cache), "%s/ids", dir);
+
+  // Without ext-foreign-toplevel-list identifiers the windows are only
+  // told apart by their app_id, title and order.
+  mock_configure(&(struct mock_config){.no_ext = true});
+  mock_command("new first foot ~");
+  mock_command("new second foot ~");
+  mock_command("new mail thunderbird Inbox");
+  mock_command("new third foot ~");
+
+  if (!start() || get_ids(ids) != WINDOWS) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    return EXIT_FAILURE;
+  }
+  wlrapps_finish();
+
+  test_restart(ids);
+  shuffle_records();
+  test_restart(ids);
+  test_lock();
+
+  unlink(cache);
+  rmdir(dir);
+  return check_status();
+}
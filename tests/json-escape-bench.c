@@ -0,0 +1,69 @@
+#define _POSIX_C_SOURCE 200809L
+#include "json-escape.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Times every json_clean_run kernel on the kinds of strings the daemon
+// escapes: short ascii titles, long clean titles and UTF-8 heavy ones.
+
+#define TOTAL_BYTES (256u << 20) // Scanned per kernel and input
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void run(const char *kernel_name,
+                size_t (*kernel)(const char *, size_t), const char *input_name,
+                const char *str) {
+  size_t len = strlen(str);
+  size_t rounds = TOTAL_BYTES / len;
+  volatile size_t sink = 0;
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < rounds; ++i) {
+    // Stop at every special byte and carry on, like the escaper does.
+    for (size_t pos = 0; pos < len;) {
+      pos += kernel(str + pos, len - pos) + 1;
+      sink += pos;
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  printf("%-8s %-8s %6zu bytes %8.3f ns/byte %8.1f ns/string\n", kernel_name,
+         input_name, len, (double)elapsed / ((double)rounds * (double)len),
+         (double)elapsed / (double)rounds);
+}
+
+int main(void) {
+  static char long_clean[4097];
+  memset(long_clean, 'x', sizeof(long_clean) - 1);
+
+  const struct {
+    const char *name;
+    const char *str;
+  } inputs[] = {
+      {"short", "Terminal"},
+      {"title", "README.md - wlr-apps - Visual Studio Code"},
+      {"utf8", "\xe6\x96\x87\xe6\xa1\xa3 \xe2\x80\x94 \xf0\x9f\x93\x81 "
+               "\xd0\x94\xd0\xbe\xd0\xba\xd1\x83\xd0\xbc\xd0\xb5\xd0\xbd\xd1"
+               "\x82\xd1\x8b \xe2\x80\x94 Files"},
+      {"quoted", "vim \"src/wlr-apps.c\" \\ line\t42"},
+      {"long", long_clean},
+  };
+
+  for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+    run("scalar", json_clean_run_scalar, inputs[i].name, inputs[i].str);
+#ifdef JSON_SIMD
+    run("sse2", json_clean_run_sse2, inputs[i].name, inputs[i].str);
+    if (json_cpu_has_avx2()) {
+      run("avx2", json_clean_run_avx2, inputs[i].name, inputs[i].str);
+    }
+#endif
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#define _DEFAULT_SOURCE
+#include "json-escape.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Fuzzes random UTF-8 mixed with control characters, quotes and backslashes
+// through every json_clean_run kernel the cpu runs and compares them with the
+// scalar reference. The strings end right before an unmapped page, so a
+// kernel reading past the end crashes instead of passing by luck.
+
+#define ITERATIONS 200000
+#define MAX_LENGTH 300
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint32_t next_random(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 32);
+}
+
+// Appends one character, mostly clean text so the runs get long enough for
+// the vector loops.
+static size_t random_char(unsigned char *out) {
+  static const unsigned char special[] = {'"', '\\', '\n', '\t', '\0', 0x1f,
+                                          0x7f, 0x20, 0x80, 0xff};
+  uint32_t r = next_random() % 100;
+  if (r < 55) {
+    out[0] = (unsigned char)(0x20 + next_random() % 0x5f);
+    return 1;
+  }
+  if (r < 65) {
+    out[0] = special[next_random() % sizeof(special)];
+    return 1;
+  }
+  if (r < 80) { // Two bytes, U+0080 to U+07FF
+    uint32_t cp = 0x80 + next_random() % 0x780;
+    out[0] = (unsigned char)(0xc0 | cp >> 6);
+    out[1] = (unsigned char)(0x80 | (cp & 0x3f));
+    return 2;
+  }
+  if (r < 92) { // Three bytes, CJK and friends
+    uint32_t cp = 0x800 + next_random() % 0xf000;
+    out[0] = (unsigned char)(0xe0 | cp >> 12);
+    out[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+    out[2] = (unsigned char)(0x80 | (cp & 0x3f));
+    return 3;
+  }
+  uint32_t cp = 0x10000 + next_random() % 0x100000; // Emoji range and above
+  out[0] = (unsigned char)(0xf0 | cp >> 18);
+  out[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3f));
+  out[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3f));
+  out[3] = (unsigned char)(0x80 | (cp & 0x3f));
+  return 4;
+}
+
+static bool check(const char *name, size_t (*kernel)(const char *, size_t),
+                  const char *str, size_t len) {
+  size_t expected = json_clean_run_scalar(str, len);
+  size_t got = kernel(str, len);
+  if (got == expected) {
+    return true;
+  }
+
+  fprintf(stderr, "%s: %zu instead of %zu for", name, got, expected);
+  for (size_t i = 0; i < len; ++i) {
+    fprintf(stderr, " %02x", (unsigned char)str[i]);
+  }
+  fprintf(stderr, "\n");
+  return false;
+}
+
+int main(void) {
+  long page = sysconf(_SC_PAGESIZE);
+  unsigned char *pages = mmap(NULL, (size_t)page * 2, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED || mprotect(pages + page, (size_t)page, PROT_NONE)) {
+    perror("Error mapping the guard page");
+    return EXIT_FAILURE;
+  }
+  unsigned char *end = pages + page;
+
+#ifdef JSON_SIMD
+  bool avx2 = json_cpu_has_avx2();
+  printf("kernels: scalar sse2%s\n", avx2 ? " avx2" : "");
+#else
+  printf("kernels: scalar\n");
+#endif
+
+  unsigned char text[MAX_LENGTH + 4];
+  size_t failures = 0;
+  for (int n = 0; n < ITERATIONS && failures < 10; ++n) {
+    size_t len = 0;
+    size_t target = next_random() % MAX_LENGTH;
+    while (len < target) {
+      len += random_char(text + len);
+    }
+    // Sometimes a long clean run with the special byte at every position.
+    if (n % 8 == 0 && len > 0) {
+      memset(text, 'a', len);
+      text[next_random() % len] = "\"\\\x01"[next_random() % 3];
+    }
+
+    char *str = (char *)end - len;
+    memcpy(str, text, len);
+
+    bool ok = check("dispatch", json_clean_run, str, len);
+#ifdef JSON_SIMD
+    ok &= check("sse2", json_clean_run_sse2, str, len);
+    if (avx2) {
+      ok &= check("avx2", json_clean_run_avx2, str, len);
+    }
+#endif
+    failures += !ok;
+  }
+
+  munmap(pages, (size_t)page * 2);
+  if (failures) {
+    fprintf(stderr, "%zu mismatches\n", failures);
+    return EXIT_FAILURE;
+  }
+  printf("%d strings, all kernels agree\n", ITERATIONS);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "control.h"
+#include "daemon-harness.h"
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Hands the daemon sockets the way a service manager does and checks that it
+// refuses everything but a single listening unix socket.
+
+static int unix_socket(bool listening) {
+  struct sockaddr_un addr;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || !control_socket_address(&addr)) {
+    return -1;
+  }
+  unlink(addr.sun_path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      (listening && listen(fd, SOMAXCONN) == -1)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int tcp_socket(void) {
+  struct sockaddr_in addr = {.sin_family = AF_INET,
+                             .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(fd, 1) == -1) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+// The daemon has to exit with an error on its own.
+static void expect_refused(const char *name, int fd, const char *listen_fds) {
+  static const char *const args[] = {"-m", NULL};
+  struct daemon daemon;
+
+  if (fd == -1 || !daemon_start_activated(&daemon, args, fd, listen_fds)) {
+    fprintf(stderr, "%s: can't set up the socket\n", name);
+    failures++;
+    return;
+  }
+  int status = daemon_wait(&daemon, 2000);
+  if (status != EXIT_FAILURE) {
+    fprintf(stderr, "%s: the daemon exited with %d, expected %d\n", name,
+            status, EXIT_FAILURE);
+    failures++;
+  }
+  close(fd);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps-mock>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  expect_refused("a regular file", open(argv[1], O_RDONLY | O_CLOEXEC), "1");
+  expect_refused("a socket that isn't listening", unix_socket(false), "1");
+  expect_refused("a tcp socket", tcp_socket(), "1");
+  expect_refused("two sockets", unix_socket(true), "2");
+  expect_refused("a garbled count", unix_socket(true), "1x");
+
+  // A proper socket is served, without the daemon binding one itself.
+  static const char *const args[] = {"-m", NULL};
+  struct daemon daemon;
+  char reply[4096];
+  int fd = unix_socket(true);
+  if (fd == -1 || !daemon_start_activated(&daemon, args, fd, "1")) {
+    fprintf(stderr, "can't start the daemon with a listening socket\n");
+    failures++;
+  } else {
+    close(fd);
+    if (control_request("mem", reply, sizeof(reply), true, 5000) <= 0 ||
+        strncmp(reply, "records ", 8) != 0) {
+      fprintf(stderr, "no reply through the inherited socket: '%s'\n",
+              reply);
+      failures++;
+    }
+    daemon_stop(&daemon);
+  }
+
+  harness_finish();
+  return check_status();
+}
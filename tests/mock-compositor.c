@@ -0,0 +1,1086 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mock-compositor.h"
+#include "mock-wayland.h"
+#include "wlr-foreign-toplevel-management-unstable-v1-client-protocol.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client-protocol.h>
+
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+#include "ext-foreign-toplevel-list-v1-client-protocol.h"
+#endif
+#ifdef WLRAPPS_THUMBNAILS
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#endif
+
+// The compositor half of the mock, see mock-compositor.h. It serves a single
+// client connection, the windows outlive it so a reconnecting client finds
+// them again.
+
+// ---- Macros ----
+
+#define DEFAULT_WIDTH 320
+#define DEFAULT_HEIGHT 200
+#define CHURN_BATCH 16
+#define CHURN_APP_IDS 8
+
+// Calls the client's listener, if it still wants the object's events.
+#define send_event(type, event, proxy, ...)                                    \
+  do {                                                                         \
+    struct wl_proxy *target_ = (proxy);                                        \
+    const struct type##_listener *listener_ = target_->listener;               \
+    if (!target_->dead && listener_ && listener_->event) {                     \
+      events_sent++;                                                           \
+      listener_->event(target_->user_data, (struct type *)target_,             \
+                       __VA_ARGS__);                                           \
+    }                                                                          \
+  } while (0)
+
+#define send_event0(type, event, proxy)                                        \
+  do {                                                                         \
+    struct wl_proxy *target_ = (proxy);                                        \
+    const struct type##_listener *listener_ = target_->listener;               \
+    if (!target_->dead && listener_ && listener_->event) {                     \
+      events_sent++;                                                           \
+      listener_->event(target_->user_data, (struct type *)target_);            \
+    }                                                                          \
+  } while (0)
+
+// ---- Structs ----
+
+enum window_dirty {
+  DIRTY_TITLE = 1 << 0,
+  DIRTY_APP_ID = 1 << 1,
+  DIRTY_STATE = 1 << 2,
+};
+
+struct mock_window {
+  struct wl_list link; // windows, oldest first
+  uint64_t serial;
+  char *key; // Named by the FIFO commands, NULL otherwise
+  char *app_id;
+  char *title;
+  char identifier[32];
+  uint32_t state; // Bits of zwlr_foreign_toplevel_handle_v1_state
+  uint32_t dirty;
+  bool closed;
+  int churn_age; // Passes since a churn window opened, -1 otherwise
+
+  struct wl_proxy *wlr_handle;
+  struct wl_proxy *ext_handle;
+
+  uint32_t width, height;
+  uint32_t *pixels; // Allocated once something looks at them
+};
+
+struct shm_pool {
+  int fd;
+  int32_t size;
+};
+
+struct shm_buffer {
+  uint8_t *data;
+  size_t map_size;
+  int32_t offset, width, height, stride;
+};
+
+struct capture_session {
+  struct mock_window *window;
+  bool stopped;
+  uint64_t frames;
+  bool damaged;
+  uint32_t damage_x0, damage_y0, damage_x1, damage_y1;
+};
+
+struct capture_frame {
+  struct wl_proxy *session;
+  struct wl_proxy *buffer;
+  bool capture;
+  bool answered;
+};
+
+enum global_name {
+  GLOBAL_SEAT = 1,
+  GLOBAL_OUTPUT,
+  GLOBAL_WLR,
+  GLOBAL_EXT,
+  GLOBAL_SHM,
+  GLOBAL_CAPTURE_SOURCE,
+  GLOBAL_COPY_CAPTURE,
+};
+
+// ---- Global Variables ----
+
+static struct wl_list windows = {&windows, &windows};
+static struct mock_config config = {0};
+static struct mock_stats stats = {0};
+static struct wl_display *client = NULL;
+static uint64_t window_serial = 0;
+static bool broken = false;
+static bool down = false;
+static bool wlr_stopped = false;
+static bool ext_stopped = false;
+static size_t churn_remaining = 0;
+static int events_sent = 0;
+
+// The client polls the read end, every request and command writes to it so
+// the client dispatches and gets its answers. With WLRAPPS_MOCK_FIFO both are
+// the FIFO, which also carries the commands.
+static int wire_read = -1;
+static int wire_write = -1;
+static bool wire_fifo = false;
+static char command_buffer[4096];
+static size_t command_length = 0;
+
+// ---- Helpers ----
+
+static char *copy_string(const char *str) {
+  char *copy = strdup(str);
+  if (!copy) {
+    fprintf(stderr, "mock: out of memory\n");
+    abort();
+  }
+  return copy;
+}
+
+static bool open_wire(void) {
+  if (wire_read != -1) {
+    return true;
+  }
+
+  const char *fifo = getenv("WLRAPPS_MOCK_FIFO");
+  if (fifo && *fifo) {
+    // Opened for writing too, so it never reports end of file.
+    wire_read = open(fifo, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (wire_read == -1) {
+      perror("mock: opening WLRAPPS_MOCK_FIFO");
+      return false;
+    }
+    wire_write = wire_read;
+    wire_fifo = true;
+    return true;
+  }
+
+  int fds[2];
+  if (pipe(fds) == -1) {
+    perror("mock: creating the wire");
+    return false;
+  }
+  for (int i = 0; i < 2; ++i) {
+    fcntl(fds[i], F_SETFL, O_NONBLOCK);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  wire_read = fds[0];
+  wire_write = fds[1];
+  return true;
+}
+
+static void wake(void) {
+  if (wire_write != -1 && write(wire_write, "\n", 1) == -1 &&
+      errno != EAGAIN) {
+    perror("mock: waking the client");
+  }
+}
+
+static bool proxy_is(const struct wl_proxy *proxy,
+                     const struct wl_interface *interface) {
+  return proxy->interface == interface;
+}
+
+// The newest live object of the interface that the client already had a
+// roundtrip for.
+static struct wl_proxy *bound_object(const struct wl_interface *interface) {
+  struct wl_proxy *proxy, *found = NULL;
+  wl_list_for_each(proxy, &client->proxies, link) {
+    if (proxy_is(proxy, interface) && !proxy->dead &&
+        proxy->pass < client->pass) {
+      found = proxy;
+    }
+  }
+  return found;
+}
+
+static struct mock_window *window_of_handle(struct wl_proxy *handle) {
+  struct mock_window *window;
+  wl_list_for_each(window, &windows, link) {
+    if (window->wlr_handle == handle || window->ext_handle == handle) {
+      return window;
+    }
+  }
+  return NULL;
+}
+
+// ---- Window Contents ----
+
+static void fill_pattern(struct mock_window *window) {
+  for (uint32_t y = 0; y < window->height; ++y) {
+    for (uint32_t x = 0; x < window->width; ++x) {
+      uint32_t r = (x * 7 + (uint32_t)window->serial * 31) & 0xff;
+      uint32_t g = (y * 3 + (uint32_t)window->serial * 17) & 0xff;
+      uint32_t b = (x ^ y) & 0xff;
+      window->pixels[(size_t)y * window->width + x] =
+          0xff000000u | r << 16 | g << 8 | b;
+    }
+  }
+}
+
+static void ensure_pixels(struct mock_window *window) {
+  if (window->pixels) {
+    return;
+  }
+  window->pixels =
+      malloc((size_t)window->width * window->height * sizeof(uint32_t));
+  if (!window->pixels) {
+    fprintf(stderr, "mock: out of memory\n");
+    abort();
+  }
+  fill_pattern(window);
+}
+
+void mock_resize(struct mock_window *window, uint32_t width, uint32_t height) {
+  free(window->pixels);
+  window->pixels = NULL;
+  window->width = width ? width : 1;
+  window->height = height ? height : 1;
+  ensure_pixels(window);
+}
+
+uint32_t *mock_get_pixels(struct mock_window *window, uint32_t *width,
+                          uint32_t *height) {
+  ensure_pixels(window);
+  *width = window->width;
+  *height = window->height;
+  return window->pixels;
+}
+
+// ---- Windows ----
+
+static void mark_dirty(struct mock_window *window, uint32_t dirty) {
+  window->dirty |= dirty;
+  wake();
+}
+
+struct mock_window *mock_add_toplevel(const char *app_id, const char *title) {
+  struct mock_window *window = calloc(1, sizeof(*window));
+  if (!window) {
+    fprintf(stderr, "mock: out of memory\n");
+    abort();
+  }
+
+  window->serial = ++window_serial;
+  window->app_id = copy_string(app_id);
+  window->title = copy_string(title);
+  snprintf(window->identifier, sizeof(window->identifier), "mock-%llu",
+           (unsigned long long)window->serial);
+  window->churn_age = -1;
+  window->width = DEFAULT_WIDTH;
+  window->height = DEFAULT_HEIGHT;
+  wl_list_insert(windows.prev, &window->link);
+  wake();
+  return window;
+}
+
+struct mock_window *mock_find_window(const char *key) {
+  struct mock_window *window;
+  wl_list_for_each(window, &windows, link) {
+    if (!window->closed && window->key && strcmp(window->key, key) == 0) {
+      return window;
+    }
+  }
+  return NULL;
+}
+
+void mock_set_title(struct mock_window *window, const char *title) {
+  free(window->title);
+  window->title = copy_string(title);
+  mark_dirty(window, DIRTY_TITLE);
+}
+
+void mock_set_app_id(struct mock_window *window, const char *app_id) {
+  free(window->app_id);
+  window->app_id = copy_string(app_id);
+  mark_dirty(window, DIRTY_APP_ID);
+}
+
+static void set_state(struct mock_window *window, uint32_t bit, bool set) {
+  uint32_t state = set ? window->state | 1u << bit : window->state & ~(1u << bit);
+  if (state != window->state) {
+    window->state = state;
+    mark_dirty(window, DIRTY_STATE);
+  }
+}
+
+void mock_activate(struct mock_window *window) {
+  struct mock_window *other;
+  wl_list_for_each(other, &windows, link) {
+    if (other != window) {
+      set_state(other, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED, false);
+    }
+  }
+  set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED, false);
+  set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_ACTIVATED, true);
+}
+
+void mock_close(struct mock_window *window) {
+  window->closed = true;
+  wake();
+}
+
+bool mock_is_open(const struct mock_window *window) { return !window->closed; }
+
+size_t mock_window_count(void) {
+  size_t count = 0;
+  struct mock_window *window;
+  wl_list_for_each(window, &windows, link) {
+    count += !window->closed;
+  }
+  return count;
+}
+
+const char *mock_get_identifier(const struct mock_window *window) {
+  return window->identifier;
+}
+
+static void free_window(struct mock_window *window) {
+  // Capture objects may outlive the window.
+  if (client) {
+    struct wl_proxy *proxy;
+    wl_list_for_each(proxy, &client->proxies, link) {
+#ifdef WLRAPPS_THUMBNAILS
+      if (proxy_is(proxy, &ext_image_capture_source_v1_interface) &&
+          proxy->data == window) {
+        proxy->data = NULL;
+      } else if (proxy_is(proxy,
+                          &ext_image_copy_capture_session_v1_interface)) {
+        struct capture_session *session = proxy->data;
+        if (session->window == window) {
+          session->window = NULL;
+        }
+      }
+#else
+      (void)proxy;
+#endif
+    }
+  }
+
+  wl_list_remove(&window->link);
+  free(window->key);
+  free(window->app_id);
+  free(window->title);
+  free(window->pixels);
+  free(window);
+}
+
+// Closed windows go once every handle was told.
+static void reap_windows(void) {
+  struct mock_window *window, *tmp;
+  wl_list_for_each_safe(window, tmp, &windows, link) {
+    if (window->closed && !window->wlr_handle && !window->ext_handle) {
+      free_window(window);
+    }
+  }
+}
+
+void mock_damage(struct mock_window *window, uint32_t x, uint32_t y,
+                 uint32_t width, uint32_t height) {
+#ifdef WLRAPPS_THUMBNAILS
+  if (client) {
+    struct wl_proxy *proxy;
+    wl_list_for_each(proxy, &client->proxies, link) {
+      struct capture_session *session = proxy->data;
+      if (!proxy_is(proxy, &ext_image_copy_capture_session_v1_interface) ||
+          proxy->dead || session->window != window) {
+        continue;
+      }
+      uint32_t x1 = x + width, y1 = y + height;
+      if (!session->damaged) {
+        session->damage_x0 = x;
+        session->damage_y0 = y;
+        session->damage_x1 = x1;
+        session->damage_y1 = y1;
+      } else {
+        session->damage_x0 = x < session->damage_x0 ? x : session->damage_x0;
+        session->damage_y0 = y < session->damage_y0 ? y : session->damage_y0;
+        session->damage_x1 = x1 > session->damage_x1 ? x1 : session->damage_x1;
+        session->damage_y1 = y1 > session->damage_y1 ? y1 : session->damage_y1;
+      }
+      session->damaged = true;
+    }
+  }
+#endif
+  wake();
+}
+
+// ---- Commands ----
+
+void mock_configure(const struct mock_config *new_config) {
+  config = *new_config;
+}
+
+const struct mock_stats *mock_get_stats(void) {
+  stats.live_objects = 0;
+  if (client) {
+    struct wl_proxy *proxy;
+    wl_list_for_each(proxy, &client->proxies, link) {
+      stats.live_objects += !proxy->dead;
+    }
+  }
+  return &stats;
+}
+
+void mock_disconnect(void) {
+  broken = true;
+  wake();
+}
+
+void mock_set_down(bool new_down) { down = new_down; }
+
+// Every pass retitles the churn windows of the previous one, closes those
+// of the one before and opens the next batch.
+static void churn_step(void) {
+  struct mock_window *window;
+  wl_list_for_each(window, &windows, link) {
+    if (window->churn_age < 0 || window->closed) {
+      continue;
+    }
+    if (++window->churn_age == 1) {
+      char title[64];
+      snprintf(title, sizeof(title), "Churn window %llu (edited)",
+               (unsigned long long)window->serial);
+      mock_set_title(window, title);
+    } else {
+      mock_close(window);
+    }
+  }
+
+  for (int i = 0; i < CHURN_BATCH && churn_remaining > 0; ++i) {
+    char app_id[32], title[64];
+    snprintf(app_id, sizeof(app_id), "churn-%llu",
+             (unsigned long long)(window_serial % CHURN_APP_IDS));
+    snprintf(title, sizeof(title), "Churn window %llu",
+             (unsigned long long)window_serial + 1);
+    mock_add_toplevel(app_id, title)->churn_age = 0;
+    churn_remaining--;
+  }
+
+  wl_list_for_each(window, &windows, link) {
+    if (window->churn_age >= 0 && !window->closed) {
+      wake(); // Keep stepping until the last batch is closed
+      break;
+    }
+  }
+}
+
+bool mock_command(const char *line) {
+  char command[32], key[64];
+  int rest = 0;
+  if (sscanf(line, "%31s%n", command, &rest) != 1) {
+    return true; // A wake up
+  }
+
+  const char *args = line + rest;
+  while (*args == ' ') {
+    args++;
+  }
+
+  if (strcmp(command, "disconnect") == 0) {
+    mock_disconnect();
+    return true;
+  }
+  if (strcmp(command, "down") == 0) {
+    mock_set_down(true);
+    return true;
+  }
+  if (strcmp(command, "up") == 0) {
+    mock_set_down(false);
+    return true;
+  }
+  if (strcmp(command, "churn") == 0) {
+    churn_remaining += strtoul(args, NULL, 10);
+    wake();
+    return true;
+  }
+
+  int key_length = 0;
+  if (sscanf(args, "%63s%n", key, &key_length) != 1) {
+    return false;
+  }
+  args += key_length;
+  while (*args == ' ') {
+    args++;
+  }
+
+  if (strcmp(command, "new") == 0) {
+    char app_id[128];
+    int app_id_length = 0;
+    if (sscanf(args, "%127s%n", app_id, &app_id_length) != 1) {
+      return false;
+    }
+    args += app_id_length;
+    while (*args == ' ') {
+      args++;
+    }
+    struct mock_window *window = mock_add_toplevel(app_id, args);
+    window->key = copy_string(key);
+    return true;
+  }
+
+  struct mock_window *window = mock_find_window(key);
+  if (!window) {
+    fprintf(stderr, "mock: no window '%s'\n", key);
+    return false;
+  }
+
+  if (strcmp(command, "title") == 0) {
+    mock_set_title(window, args);
+  } else if (strcmp(command, "app_id") == 0) {
+    mock_set_app_id(window, args);
+  } else if (strcmp(command, "activate") == 0) {
+    mock_activate(window);
+  } else if (strcmp(command, "minimize") == 0) {
+    set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED, true);
+  } else if (strcmp(command, "maximize") == 0) {
+    set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED, true);
+  } else if (strcmp(command, "close") == 0) {
+    mock_close(window);
+  } else if (strcmp(command, "damage") == 0) {
+    mock_damage(window, 0, 0, window->width, window->height);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static void read_commands(void) {
+  char buffer[4096];
+  ssize_t len;
+  while ((len = read(wire_read, buffer, sizeof(buffer))) > 0) {
+    if (!wire_fifo) {
+      continue;
+    }
+
+    for (ssize_t i = 0; i < len; ++i) {
+      if (buffer[i] != '\n') {
+        if (command_length < sizeof(command_buffer) - 1) {
+          command_buffer[command_length++] = buffer[i];
+        }
+        continue;
+      }
+      command_buffer[command_length] = '\0';
+      command_length = 0;
+      if (!mock_command(command_buffer)) {
+        fprintf(stderr, "mock: bad command '%s'\n", command_buffer);
+      }
+    }
+  }
+}
+
+// ---- Requests ----
+
+#ifdef WLRAPPS_THUMBNAILS
+
+static void free_data(struct wl_proxy *proxy) { free(proxy->data); }
+
+static void pool_cleanup(struct wl_proxy *proxy) {
+  struct shm_pool *pool = proxy->data;
+  close(pool->fd);
+  free(pool);
+}
+
+static void buffer_cleanup(struct wl_proxy *proxy) {
+  struct shm_buffer *buffer = proxy->data;
+  if (buffer->data != MAP_FAILED) {
+    munmap(buffer->data, buffer->map_size);
+  }
+  free(buffer);
+}
+
+static void *new_data(struct wl_proxy *proxy, size_t size,
+                      void (*cleanup)(struct wl_proxy *proxy)) {
+  proxy->data = calloc(1, size);
+  if (!proxy->data) {
+    fprintf(stderr, "mock: out of memory\n");
+    abort();
+  }
+  proxy->cleanup = cleanup;
+  return proxy->data;
+}
+
+static void capture_request(struct wl_proxy *proxy, uint32_t opcode,
+                            const union mock_arg *args,
+                            struct wl_proxy *new_proxy) {
+  if (proxy_is(proxy, &wl_shm_interface) && opcode == WL_SHM_CREATE_POOL) {
+    struct shm_pool *pool = new_data(new_proxy, sizeof(*pool), pool_cleanup);
+    pool->fd = args[1].h;
+    pool->size = args[2].i;
+  } else if (proxy_is(proxy, &wl_shm_pool_interface) &&
+             opcode == WL_SHM_POOL_CREATE_BUFFER) {
+    struct shm_pool *pool = proxy->data;
+    struct shm_buffer *buffer =
+        new_data(new_proxy, sizeof(*buffer), buffer_cleanup);
+    buffer->offset = args[1].i;
+    buffer->width = args[2].i;
+    buffer->height = args[3].i;
+    buffer->stride = args[4].i;
+    buffer->map_size = (size_t)pool->size;
+    buffer->data = mmap(NULL, buffer->map_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, pool->fd, 0);
+  } else if (proxy_is(proxy, &wl_shm_pool_interface) &&
+             opcode == WL_SHM_POOL_RESIZE) {
+    ((struct shm_pool *)proxy->data)->size = args[0].i;
+  } else if (proxy_is(proxy,
+                      &ext_foreign_toplevel_image_capture_source_manager_v1_interface) &&
+             opcode ==
+                 EXT_FOREIGN_TOPLEVEL_IMAGE_CAPTURE_SOURCE_MANAGER_V1_CREATE_SOURCE) {
+    new_proxy->data = window_of_handle(args[1].o);
+  } else if (proxy_is(proxy, &ext_image_copy_capture_manager_v1_interface) &&
+             opcode == EXT_IMAGE_COPY_CAPTURE_MANAGER_V1_CREATE_SESSION) {
+    struct capture_session *session =
+        new_data(new_proxy, sizeof(*session), free_data);
+    session->window = args[1].o->data;
+  } else if (proxy_is(proxy, &ext_image_copy_capture_session_v1_interface) &&
+             opcode == EXT_IMAGE_COPY_CAPTURE_SESSION_V1_CREATE_FRAME) {
+    struct capture_frame *frame =
+        new_data(new_proxy, sizeof(*frame), free_data);
+    frame->session = proxy;
+  } else if (proxy_is(proxy, &ext_image_copy_capture_frame_v1_interface)) {
+    struct capture_frame *frame = proxy->data;
+    if (opcode == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_ATTACH_BUFFER) {
+      frame->buffer = args[0].o;
+    } else if (opcode == EXT_IMAGE_COPY_CAPTURE_FRAME_V1_CAPTURE) {
+      frame->capture = true;
+    }
+  }
+}
+
+#endif
+
+static void handle_request(struct wl_proxy *proxy, uint32_t opcode) {
+  if (proxy_is(proxy, &zwlr_foreign_toplevel_manager_v1_interface)) {
+    wlr_stopped |= opcode == ZWLR_FOREIGN_TOPLEVEL_MANAGER_V1_STOP;
+    return;
+  }
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+  if (proxy_is(proxy, &ext_foreign_toplevel_list_v1_interface)) {
+    ext_stopped |= opcode == EXT_FOREIGN_TOPLEVEL_LIST_V1_STOP;
+    return;
+  }
+  if (proxy_is(proxy, &ext_foreign_toplevel_handle_v1_interface)) {
+    struct mock_window *window = window_of_handle(proxy);
+    if (window && opcode == EXT_FOREIGN_TOPLEVEL_HANDLE_V1_DESTROY) {
+      window->ext_handle = NULL;
+    }
+    return;
+  }
+#endif
+  if (!proxy_is(proxy, &zwlr_foreign_toplevel_handle_v1_interface)) {
+    return;
+  }
+
+  struct mock_window *window = window_of_handle(proxy);
+  if (!window) {
+    return;
+  }
+
+  switch (opcode) {
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_MAXIMIZED:
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_UNSET_MAXIMIZED:
+    set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MAXIMIZED,
+              opcode == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_MAXIMIZED);
+    break;
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_MINIMIZED:
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_UNSET_MINIMIZED:
+    set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_MINIMIZED,
+              opcode == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_MINIMIZED);
+    break;
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_FULLSCREEN:
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_UNSET_FULLSCREEN:
+    set_state(window, ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_STATE_FULLSCREEN,
+              opcode == ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_SET_FULLSCREEN);
+    break;
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_ACTIVATE:
+    mock_activate(window);
+    break;
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_CLOSE:
+    mock_close(window);
+    break;
+  case ZWLR_FOREIGN_TOPLEVEL_HANDLE_V1_DESTROY:
+    window->wlr_handle = NULL;
+    return;
+  default:
+    return;
+  }
+  stats.actions++;
+}
+
+void mock_compositor_request(struct wl_proxy *proxy, uint32_t opcode,
+                             const union mock_arg *args,
+                             struct wl_proxy *new_proxy) {
+  stats.requests++;
+  handle_request(proxy, opcode);
+#ifdef WLRAPPS_THUMBNAILS
+  capture_request(proxy, opcode, args, new_proxy);
+#endif
+  wake();
+}
+
+// ---- Events ----
+
+static void announce_globals(struct wl_proxy *registry) {
+  const struct {
+    uint32_t name;
+    const struct wl_interface *interface;
+    bool offered;
+  } globals[] = {
+      {GLOBAL_SEAT, &wl_seat_interface, true},
+      {GLOBAL_OUTPUT, &wl_output_interface, true},
+      {GLOBAL_WLR, &zwlr_foreign_toplevel_manager_v1_interface,
+       !config.no_wlr},
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+      {GLOBAL_EXT, &ext_foreign_toplevel_list_v1_interface, !config.no_ext},
+#endif
+#ifdef WLRAPPS_THUMBNAILS
+      {GLOBAL_SHM, &wl_shm_interface, true},
+      {GLOBAL_CAPTURE_SOURCE,
+       &ext_foreign_toplevel_image_capture_source_manager_v1_interface,
+       !config.no_capture},
+      {GLOBAL_COPY_CAPTURE, &ext_image_copy_capture_manager_v1_interface,
+       !config.no_capture},
+#endif
+  };
+
+  for (size_t i = 0; i < sizeof(globals) / sizeof(globals[0]); ++i) {
+    if (globals[i].offered) {
+      send_event(wl_registry, global, registry, globals[i].name,
+                 globals[i].interface->name,
+                 (uint32_t)globals[i].interface->version);
+    }
+  }
+}
+
+static void send_wlr_state(struct wl_proxy *handle,
+                           const struct mock_window *window) {
+  struct wl_array state;
+  wl_array_init(&state);
+  for (uint32_t bit = 0; bit < 32; ++bit) {
+    uint32_t *entry;
+    if ((window->state & 1u << bit) &&
+        (entry = wl_array_add(&state, sizeof(*entry)))) {
+      *entry = bit;
+    }
+  }
+  send_event(zwlr_foreign_toplevel_handle_v1, state, handle, &state);
+  wl_array_release(&state);
+}
+
+static void serve_wlr(struct wl_proxy *manager, struct mock_window *window) {
+  struct wl_proxy *handle = window->wlr_handle;
+  if (window->closed) {
+    if (handle) {
+      window->wlr_handle = NULL;
+      send_event0(zwlr_foreign_toplevel_handle_v1, closed, handle);
+    }
+    return;
+  }
+
+  uint32_t dirty = window->dirty;
+  if (!handle) {
+    handle = mock_proxy_create(client,
+                               &zwlr_foreign_toplevel_handle_v1_interface,
+                               manager->version);
+    window->wlr_handle = handle;
+    send_event(zwlr_foreign_toplevel_manager_v1, toplevel, manager,
+               (struct zwlr_foreign_toplevel_handle_v1 *)handle);
+    struct wl_proxy *output = bound_object(&wl_output_interface);
+    if (output) {
+      send_event(zwlr_foreign_toplevel_handle_v1, output_enter, handle,
+                 (struct wl_output *)output);
+    }
+    dirty = DIRTY_TITLE | DIRTY_APP_ID | DIRTY_STATE;
+  }
+  if (!dirty) {
+    return;
+  }
+
+  if (dirty & DIRTY_TITLE) {
+    send_event(zwlr_foreign_toplevel_handle_v1, title, handle, window->title);
+  }
+  if (dirty & DIRTY_APP_ID) {
+    send_event(zwlr_foreign_toplevel_handle_v1, app_id, handle,
+               window->app_id);
+  }
+  if (dirty & DIRTY_STATE) {
+    send_wlr_state(handle, window);
+  }
+  send_event0(zwlr_foreign_toplevel_handle_v1, done, handle);
+}
+
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+static void serve_ext(struct wl_proxy *list, struct mock_window *window) {
+  struct wl_proxy *handle = window->ext_handle;
+  if (window->closed) {
+    if (handle) {
+      window->ext_handle = NULL;
+      send_event0(ext_foreign_toplevel_handle_v1, closed, handle);
+    }
+    return;
+  }
+
+  uint32_t dirty = window->dirty & (DIRTY_TITLE | DIRTY_APP_ID);
+  if (!handle) {
+    handle = mock_proxy_create(client, &ext_foreign_toplevel_handle_v1_interface,
+                               list->version);
+    window->ext_handle = handle;
+    send_event(ext_foreign_toplevel_list_v1, toplevel, list,
+               (struct ext_foreign_toplevel_handle_v1 *)handle);
+    send_event(ext_foreign_toplevel_handle_v1, identifier, handle,
+               window->identifier);
+    dirty = DIRTY_TITLE | DIRTY_APP_ID;
+  }
+  if (!dirty) {
+    return;
+  }
+
+  if (dirty & DIRTY_TITLE) {
+    send_event(ext_foreign_toplevel_handle_v1, title, handle, window->title);
+  }
+  if (dirty & DIRTY_APP_ID) {
+    send_event(ext_foreign_toplevel_handle_v1, app_id, handle, window->app_id);
+  }
+  send_event0(ext_foreign_toplevel_handle_v1, done, handle);
+}
+#endif
+
+static void serve_windows(void) {
+  struct wl_proxy *manager =
+      bound_object(&zwlr_foreign_toplevel_manager_v1_interface);
+  struct mock_window *window, *tmp;
+  if (manager && wlr_stopped) {
+    wlr_stopped = false;
+    send_event0(zwlr_foreign_toplevel_manager_v1, finished, manager);
+  } else if (manager) {
+    wl_list_for_each_safe(window, tmp, &windows, link) {
+      serve_wlr(manager, window);
+    }
+  }
+
+#ifdef WLRAPPS_EXT_TOPLEVEL_LIST
+  struct wl_proxy *list = bound_object(&ext_foreign_toplevel_list_v1_interface);
+  if (list && ext_stopped) {
+    ext_stopped = false;
+    send_event0(ext_foreign_toplevel_list_v1, finished, list);
+  } else if (list && config.ext_reverse) {
+    wl_list_for_each_reverse_safe(window, tmp, &windows, link) {
+      serve_ext(list, window);
+    }
+  } else if (list) {
+    wl_list_for_each_safe(window, tmp, &windows, link) {
+      serve_ext(list, window);
+    }
+  }
+#endif
+
+  wl_list_for_each(window, &windows, link) {
+    window->dirty = 0;
+  }
+}
+
+#ifdef WLRAPPS_THUMBNAILS
+
+static void serve_session(struct wl_proxy *proxy) {
+  struct capture_session *session = proxy->data;
+  struct mock_window *window = session->window;
+
+  if (!window || window->closed) {
+    if (!session->stopped) {
+      session->stopped = true;
+      send_event0(ext_image_copy_capture_session_v1, stopped, proxy);
+    }
+    return;
+  }
+  if (proxy->served) {
+    return;
+  }
+
+  proxy->served = true;
+  ensure_pixels(window);
+  send_event(ext_image_copy_capture_session_v1, buffer_size, proxy,
+             window->width, window->height);
+  send_event(ext_image_copy_capture_session_v1, shm_format, proxy,
+             (uint32_t)WL_SHM_FORMAT_ARGB8888);
+  send_event0(ext_image_copy_capture_session_v1, done, proxy);
+}
+
+static bool copy_frame(struct capture_frame *frame,
+                       const struct mock_window *window) {
+  struct wl_proxy *proxy = frame->buffer;
+  if (!proxy || proxy->dead) {
+    return false;
+  }
+
+  struct shm_buffer *buffer = proxy->data;
+  if (buffer->data == MAP_FAILED || buffer->width != (int32_t)window->width ||
+      buffer->height != (int32_t)window->height ||
+      (size_t)buffer->offset + (size_t)buffer->stride * window->height >
+          buffer->map_size) {
+    return false;
+  }
+
+  for (uint32_t y = 0; y < window->height; ++y) {
+    memcpy(buffer->data + buffer->offset + (size_t)y * buffer->stride,
+           window->pixels + (size_t)y * window->width,
+           (size_t)window->width * 4);
+  }
+  return true;
+}
+
+// The first frame of a session is answered right away, the following ones
+// once the window was damaged.
+static void serve_frame(struct wl_proxy *proxy) {
+  struct capture_frame *frame = proxy->data;
+  if (!frame->capture || frame->answered) {
+    return;
+  }
+
+  struct wl_proxy *session_proxy = frame->session;
+  struct capture_session *session = session_proxy->data;
+  struct mock_window *window = session->window;
+  if (session_proxy->dead || session->stopped || !window || window->closed) {
+    frame->answered = true;
+    send_event(ext_image_copy_capture_frame_v1, failed, proxy,
+               (uint32_t)EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED);
+    return;
+  }
+  if (session->frames > 0 && !session->damaged) {
+    return;
+  }
+
+  frame->answered = true;
+  ensure_pixels(window);
+  if (!copy_frame(frame, window)) {
+    send_event(
+        ext_image_copy_capture_frame_v1, failed, proxy,
+        (uint32_t)
+            EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_BUFFER_CONSTRAINTS);
+    return;
+  }
+
+  uint32_t x0 = 0, y0 = 0, x1 = window->width, y1 = window->height;
+  if (session->frames > 0) {
+    x0 = session->damage_x0;
+    y0 = session->damage_y0;
+    x1 = session->damage_x1 < x1 ? session->damage_x1 : x1;
+    y1 = session->damage_y1 < y1 ? session->damage_y1 : y1;
+  }
+  session->frames++;
+  session->damaged = false;
+  stats.frames++;
+
+  send_event(ext_image_copy_capture_frame_v1, damage, proxy, (int32_t)x0,
+             (int32_t)y0, (int32_t)(x1 - x0), (int32_t)(y1 - y0));
+  send_event(ext_image_copy_capture_frame_v1, presentation_time, proxy, 0u, 0u,
+             0u);
+  send_event0(ext_image_copy_capture_frame_v1, ready, proxy);
+}
+
+#endif
+
+static void serve_object(struct wl_proxy *proxy) {
+  if (proxy_is(proxy, &wl_registry_interface) && !proxy->served) {
+    proxy->served = true;
+    announce_globals(proxy);
+  } else if (proxy_is(proxy, &wl_output_interface) && !proxy->served) {
+    proxy->served = true;
+    if (proxy->version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+      send_event(wl_output, name, proxy, "MOCK-1");
+    }
+    if (proxy->version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+      send_event0(wl_output, done, proxy);
+    }
+  }
+#ifdef WLRAPPS_THUMBNAILS
+  else if (proxy_is(proxy, &wl_shm_interface) && !proxy->served) {
+    proxy->served = true;
+    send_event(wl_shm, format, proxy, (uint32_t)WL_SHM_FORMAT_ARGB8888);
+    send_event(wl_shm, format, proxy, (uint32_t)WL_SHM_FORMAT_XRGB8888);
+  } else if (proxy_is(proxy, &ext_image_copy_capture_session_v1_interface)) {
+    serve_session(proxy);
+  } else if (proxy_is(proxy, &ext_image_copy_capture_frame_v1_interface)) {
+    serve_frame(proxy);
+  }
+#endif
+}
+
+// ---- Connection ----
+
+bool mock_compositor_connect(struct wl_display *display) {
+  if (down || client || !open_wire()) {
+    return false;
+  }
+
+  client = display;
+  broken = false;
+  wlr_stopped = ext_stopped = false;
+  stats.connects++;
+  return true;
+}
+
+void mock_compositor_disconnect(struct wl_display *display) {
+  struct wl_proxy *proxy;
+  wl_list_for_each(proxy, &display->proxies, link) {
+    stats.leaked_objects += !proxy->dead;
+  }
+
+  struct mock_window *window;
+  wl_list_for_each(window, &windows, link) {
+    window->wlr_handle = NULL;
+    window->ext_handle = NULL;
+    window->dirty = 0;
+  }
+  client = NULL;
+  reap_windows();
+}
+
+int mock_compositor_fd(void) { return wire_read; }
+
+int mock_compositor_pass(struct wl_display *display) {
+  read_commands();
+  if (broken) {
+    return -1;
+  }
+  if (churn_remaining > 0 || !wl_list_empty(&windows)) {
+    churn_step();
+  }
+
+  events_sent = 0;
+  display->pass++;
+
+  // New objects are appended, the ones created by the events sent here wait
+  // for the next pass.
+  struct wl_proxy *proxy;
+  wl_list_for_each(proxy, &display->proxies, link) {
+    if (!proxy->dead && proxy->pass < display->pass) {
+      serve_object(proxy);
+    }
+  }
+  serve_windows();
+
+  // Last, the callbacks answer for everything before them.
+  wl_list_for_each(proxy, &display->proxies, link) {
+    if (proxy_is(proxy, &wl_callback_interface) && !proxy->dead &&
+        !proxy->served && proxy->pass < display->pass) {
+      proxy->served = true;
+      send_event(wl_callback, done, proxy, (uint32_t)display->pass);
+    }
+  }
+
+  reap_windows();
+  mock_proxy_free_dead(display);
+  return events_sent;
+}
@@ -0,0 +1,76 @@
+#ifndef WLRAPPS_MOCK_COMPOSITOR_H
+#define WLRAPPS_MOCK_COMPOSITOR_H
+
+// A scripted compositor behind the stand-in libwayland-client. It offers an
+// output, a seat, wlr-foreign-toplevel-management, ext-foreign-toplevel-list
+// and ext-image-copy-capture with synthetic shm frames. Tests drive it
+// directly, a daemon built against it reads the same commands from the FIFO
+// named by WLRAPPS_MOCK_FIFO:
+//
+//   new <key> <app_id> <title...>   title <key> <title...>
+//   app_id <key> <app_id>           activate <key>
+//   minimize <key>                  maximize <key>
+//   close <key>                     churn <count>
+//   damage <key>                    disconnect
+//   down                            up
+//
+// churn opens count windows with unique titles, retitles and closes them, the
+// soak load. An empty line only wakes the daemon.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct mock_window;
+
+// Which globals are offered, set before connecting.
+struct mock_config {
+  bool no_wlr;
+  bool no_ext;
+  bool no_capture;
+  // ext-foreign-toplevel-list announces the windows newest first, so equal
+  // titles pair crosswise.
+  bool ext_reverse;
+};
+
+struct mock_stats {
+  unsigned connects;
+  unsigned requests;
+  unsigned actions; // activate, close and the state requests
+  unsigned frames;  // Frames copied into a client buffer
+  size_t live_objects;
+  size_t leaked_objects; // Still alive when the client disconnected
+};
+
+void mock_configure(const struct mock_config *config);
+const struct mock_stats *mock_get_stats(void);
+
+struct mock_window *mock_add_toplevel(const char *app_id, const char *title);
+struct mock_window *mock_find_window(const char *key);
+void mock_set_title(struct mock_window *window, const char *title);
+void mock_set_app_id(struct mock_window *window, const char *app_id);
+void mock_activate(struct mock_window *window);
+void mock_close(struct mock_window *window);
+bool mock_is_open(const struct mock_window *window);
+size_t mock_window_count(void);
+const char *mock_get_identifier(const struct mock_window *window);
+
+// The window contents, ARGB8888 without padding. Resizing fills it with a
+// pattern unique to the window.
+void mock_resize(struct mock_window *window, uint32_t width, uint32_t height);
+uint32_t *mock_get_pixels(struct mock_window *window, uint32_t *width,
+                          uint32_t *height);
+// Reports the rectangle as damaged to the running captures. The frames copy
+// the whole window anyway, only what is reported differs.
+void mock_damage(struct mock_window *window, uint32_t x, uint32_t y,
+                 uint32_t width, uint32_t height);
+
+// Breaks the connection, the client sees EPIPE on its next dispatch. While
+// down, connecting fails.
+void mock_disconnect(void);
+void mock_set_down(bool down);
+
+// Runs a command line, as read from the FIFO. Returns false if it is unknown.
+bool mock_command(const char *line);
+
+#endif
@@ -0,0 +1,364 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mock-wayland.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wayland-client-protocol.h>
+
+// A stand-in for libwayland-client, just the part libwlrapps uses. It lets
+// the real library and daemon run against mock-compositor.c without a
+// Wayland compositor or socket.
+
+// ---- Proxies ----
+
+struct wl_proxy *mock_proxy_create(struct wl_display *display,
+                                   const struct wl_interface *interface,
+                                   uint32_t version) {
+  struct wl_proxy *proxy = calloc(1, sizeof(*proxy));
+  if (!proxy) {
+    fprintf(stderr, "mock: out of memory\n");
+    abort();
+  }
+
+  proxy->interface = interface;
+  proxy->version = version;
+  proxy->id = ++display->next_id;
+  proxy->display = display;
+  proxy->pass = display->pass;
+  wl_list_insert(display->proxies.prev, &proxy->link);
+  return proxy;
+}
+
+static void proxy_free(struct wl_proxy *proxy) {
+  if (proxy->cleanup) {
+    proxy->cleanup(proxy);
+  }
+  wl_list_remove(&proxy->link);
+  free(proxy);
+}
+
+void mock_proxy_free_dead(struct wl_display *display) {
+  struct wl_proxy *proxy, *tmp;
+  wl_list_for_each_safe(proxy, tmp, &display->proxies, link) {
+    if (proxy->dead) {
+      proxy_free(proxy);
+    }
+  }
+}
+
+// Parses the request arguments by the message signature. New ids are
+// created here, fds are duplicated like sending them would.
+static struct wl_proxy *marshal(struct wl_proxy *proxy, uint32_t opcode,
+                                const struct wl_interface *interface,
+                                uint32_t version, uint32_t flags,
+                                union mock_arg *args) {
+  struct wl_proxy *new_proxy = NULL;
+  if (interface) {
+    new_proxy = mock_proxy_create(proxy->display, interface, version);
+    const char *signature = proxy->interface->methods[opcode].signature;
+    int index = 0;
+    for (const char *c = signature; *c; ++c) {
+      if (*c == 'n') {
+        args[index].o = new_proxy;
+      }
+      index += isalpha((unsigned char)*c) ? 1 : 0;
+    }
+  }
+
+  if (proxy->display->error == 0) {
+    mock_compositor_request(proxy, opcode, args, new_proxy);
+  }
+  if (flags & WL_MARSHAL_FLAG_DESTROY) {
+    wl_proxy_destroy(proxy);
+  }
+  return new_proxy;
+}
+
+#define MAX_ARGS 20
+
+struct wl_proxy *wl_proxy_marshal_flags(struct wl_proxy *proxy,
+                                        uint32_t opcode,
+                                        const struct wl_interface *interface,
+                                        uint32_t version, uint32_t flags,
+                                        ...) {
+  union mock_arg args[MAX_ARGS] = {0};
+  const char *signature = proxy->interface->methods[opcode].signature;
+  int index = 0;
+  va_list ap;
+
+  va_start(ap, flags);
+  for (const char *c = signature; *c && index < MAX_ARGS; ++c) {
+    switch (*c) {
+    case 'i':
+    case 'f':
+      args[index++].i = va_arg(ap, int32_t);
+      break;
+    case 'u':
+      args[index++].u = va_arg(ap, uint32_t);
+      break;
+    case 's':
+      args[index++].s = va_arg(ap, const char *);
+      break;
+    case 'o':
+    case 'n':
+      args[index++].o = va_arg(ap, struct wl_proxy *);
+      break;
+    case 'a':
+      args[index++].a = va_arg(ap, struct wl_array *);
+      break;
+    case 'h':
+      args[index++].h = fcntl(va_arg(ap, int32_t), F_DUPFD_CLOEXEC, 0);
+      break;
+    default: // Since version and nullable markers
+      break;
+    }
+  }
+  va_end(ap);
+
+  return marshal(proxy, opcode, interface, version, flags, args);
+}
+
+struct wl_proxy *
+wl_proxy_marshal_array_flags(struct wl_proxy *proxy, uint32_t opcode,
+                             const struct wl_interface *interface,
+                             uint32_t version, uint32_t flags,
+                             union wl_argument *wire_args) {
+  union mock_arg args[MAX_ARGS] = {0};
+  const char *signature = proxy->interface->methods[opcode].signature;
+  int index = 0;
+
+  for (const char *c = signature; *c && index < MAX_ARGS; ++c) {
+    union wl_argument *arg = &wire_args[index];
+    switch (*c) {
+    case 'i':
+    case 'f':
+      args[index++].i = arg->i;
+      break;
+    case 'u':
+    case 'n':
+      args[index++].u = arg->u;
+      break;
+    case 's':
+      args[index++].s = arg->s;
+      break;
+    case 'o':
+      args[index++].o = (struct wl_proxy *)arg->o;
+      break;
+    case 'a':
+      args[index++].a = arg->a;
+      break;
+    case 'h':
+      args[index++].h = fcntl(arg->h, F_DUPFD_CLOEXEC, 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  return marshal(proxy, opcode, interface, version, flags, args);
+}
+
+void wl_proxy_destroy(struct wl_proxy *proxy) {
+  // Events may still be on their way to it within the running pass.
+  proxy->dead = true;
+}
+
+int wl_proxy_add_listener(struct wl_proxy *proxy, void (**implementation)(void),
+                          void *data) {
+  if (proxy->listener) {
+    fprintf(stderr, "mock: %s@%u already has a listener\n",
+            proxy->interface->name, proxy->id);
+    return -1;
+  }
+  proxy->listener = implementation;
+  proxy->user_data = data;
+  return 0;
+}
+
+const void *wl_proxy_get_listener(struct wl_proxy *proxy) {
+  return proxy->listener;
+}
+
+void wl_proxy_set_user_data(struct wl_proxy *proxy, void *user_data) {
+  proxy->user_data = user_data;
+}
+
+void *wl_proxy_get_user_data(struct wl_proxy *proxy) {
+  return proxy->user_data;
+}
+
+uint32_t wl_proxy_get_version(struct wl_proxy *proxy) {
+  return proxy->version;
+}
+
+uint32_t wl_proxy_get_id(struct wl_proxy *proxy) { return proxy->id; }
+
+const char *wl_proxy_get_class(struct wl_proxy *proxy) {
+  return proxy->interface->name;
+}
+
+// ---- Display ----
+
+struct wl_display *wl_display_connect(const char *name) {
+  struct wl_display *display = calloc(1, sizeof(*display));
+  if (!display) {
+    return NULL;
+  }
+
+  display->proxy.interface = &wl_display_interface;
+  display->proxy.version = 1;
+  display->proxy.id = display->next_id = 1;
+  display->proxy.display = display;
+  wl_list_init(&display->proxy.link);
+  wl_list_init(&display->proxies);
+
+  if (!mock_compositor_connect(display)) {
+    free(display);
+    errno = ECONNREFUSED;
+    return NULL;
+  }
+  return display;
+}
+
+void wl_display_disconnect(struct wl_display *display) {
+  mock_compositor_disconnect(display);
+
+  struct wl_proxy *proxy, *tmp;
+  wl_list_for_each_safe(proxy, tmp, &display->proxies, link) {
+    proxy_free(proxy);
+  }
+  free(display);
+}
+
+int wl_display_get_fd(struct wl_display *display) {
+  return mock_compositor_fd();
+}
+
+static int run_pass(struct wl_display *display) {
+  if (display->error) {
+    errno = display->error;
+    return -1;
+  }
+
+  int events = mock_compositor_pass(display);
+  if (events == -1) {
+    display->error = EPIPE;
+    errno = EPIPE;
+  }
+  return events;
+}
+
+int wl_display_dispatch(struct wl_display *display) {
+  return run_pass(display);
+}
+
+int wl_display_dispatch_pending(struct wl_display *display) {
+  return run_pass(display);
+}
+
+// Objects created by the requests before the roundtrip are served in the
+// pass it runs, so one pass is a complete roundtrip.
+int wl_display_roundtrip(struct wl_display *display) {
+  return run_pass(display);
+}
+
+int wl_display_flush(struct wl_display *display) {
+  if (display->error) {
+    errno = display->error;
+    return -1;
+  }
+  return 0;
+}
+
+int wl_display_get_error(struct wl_display *display) { return display->error; }
+
+int wl_display_prepare_read(struct wl_display *display) { return 0; }
+
+int wl_display_read_events(struct wl_display *display) {
+  return display->error ? -1 : 0;
+}
+
+void wl_display_cancel_read(struct wl_display *display) {}
+
+// ---- Utilities ----
+
+void wl_list_init(struct wl_list *list) {
+  list->prev = list;
+  list->next = list;
+}
+
+void wl_list_insert(struct wl_list *list, struct wl_list *elm) {
+  elm->prev = list;
+  elm->next = list->next;
+  list->next = elm;
+  elm->next->prev = elm;
+}
+
+void wl_list_remove(struct wl_list *elm) {
+  elm->prev->next = elm->next;
+  elm->next->prev = elm->prev;
+  elm->next = NULL;
+  elm->prev = NULL;
+}
+
+int wl_list_length(const struct wl_list *list) {
+  int count = 0;
+  for (const struct wl_list *e = list->next; e != list; e = e->next) {
+    count++;
+  }
+  return count;
+}
+
+int wl_list_empty(const struct wl_list *list) { return list->next == list; }
+
+void wl_list_insert_list(struct wl_list *list, struct wl_list *other) {
+  if (wl_list_empty(other)) {
+    return;
+  }
+  other->next->prev = list;
+  other->prev->next = list->next;
+  list->next->prev = other->prev;
+  list->next = other->next;
+}
+
+void wl_array_init(struct wl_array *array) {
+  memset(array, 0, sizeof(*array));
+}
+
+void wl_array_release(struct wl_array *array) { free(array->data); }
+
+void *wl_array_add(struct wl_array *array, size_t size) {
+  size_t needed = array->size + size;
+  if (needed > array->alloc) {
+    size_t alloc = array->alloc ? array->alloc : 16;
+    while (alloc < needed) {
+      alloc *= 2;
+    }
+    void *data = realloc(array->data, alloc);
+    if (!data) {
+      return NULL;
+    }
+    array->data = data;
+    array->alloc = alloc;
+  }
+
+  void *p = (char *)array->data + array->size;
+  array->size = needed;
+  return p;
+}
+
+int wl_array_copy(struct wl_array *array, struct wl_array *source) {
+  array->size = 0;
+  if (source->size > 0 && !wl_array_add(array, source->size)) {
+    return -1;
+  }
+  if (source->size > 0) {
+    memcpy(array->data, source->data, source->size);
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+#ifndef WLRAPPS_MOCK_WAYLAND_H
+#define WLRAPPS_MOCK_WAYLAND_H
+
+// The seam between the stand-in libwayland-client (mock-wayland.c) and the
+// scripted compositor behind it (mock-compositor.c). Requests are handed to
+// the compositor as they are marshalled, events are delivered by calling the
+// listeners directly, there is no wire format.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <wayland-client-core.h>
+
+struct wl_proxy {
+  const struct wl_interface *interface;
+  uint32_t version;
+  uint32_t id;
+  const void *listener;
+  void *user_data;
+  struct wl_display *display;
+
+  // Objects are served by the compositor from the pass after the one they
+  // were created in, like a roundtrip needs to go through before the
+  // compositor answers.
+  uint64_t pass;
+  bool served;
+  bool dead; // Destroyed by the client, freed after the pass
+
+  // Compositor side state and what frees it.
+  void *data;
+  void (*cleanup)(struct wl_proxy *proxy);
+
+  struct wl_list link; // wl_display.proxies, in creation order
+};
+
+struct wl_display {
+  struct wl_proxy proxy;
+  struct wl_list proxies;
+  uint32_t next_id;
+  uint64_t pass;
+  int error; // errno once the connection broke
+};
+
+union mock_arg {
+  int32_t i;
+  uint32_t u;
+  const char *s;
+  struct wl_proxy *o;
+  struct wl_array *a;
+  int32_t h; // A dup of the client's fd, the compositor owns it
+};
+
+// Implemented by the compositor.
+bool mock_compositor_connect(struct wl_display *display);
+void mock_compositor_disconnect(struct wl_display *display);
+int mock_compositor_fd(void);
+void mock_compositor_request(struct wl_proxy *proxy, uint32_t opcode,
+                             const union mock_arg *args,
+                             struct wl_proxy *new_proxy);
+// Applies the queued commands and sends every event that is due. Returns the
+// number of events sent, -1 once the connection broke.
+int mock_compositor_pass(struct wl_display *display);
+
+// Implemented by the client side, for the compositor to create the objects
+// of events with a new_id argument.
+struct wl_proxy *mock_proxy_create(struct wl_display *display,
+                                   const struct wl_interface *interface,
+                                   uint32_t version);
+void mock_proxy_free_dead(struct wl_display *display);
+
+#endif
@@ -0,0 +1,97 @@
+// Checks how the ext-foreign-toplevel-list handles pair with the wlr ones
+// when the two lists announce identical windows in opposite orders: they may
+// pair crosswise at first, but once the titles differ every window has to
+// carry its own identifier.
+//
+// The pairs are file local, so the library is compiled in.
+#include "libwlrapps.c"
+
+#include "check.h"
+#include "mock-compositor.h"
+
+#define SETTLE_PASSES 4
+
+static const struct wlrapps_listener test_listener = {0};
+
+static void settle(void) {
+  for (int i = 0; i < SETTLE_PASSES; ++i) {
+    wlrapps_dispatch();
+  }
+}
+
+// Every toplevel is paired, and the one showing title carries the window's
+// identifier. Titles given here are unique.
+static void expect_paired(const char *title, const struct mock_window *window,
+                          int line) {
+  struct toplevel_v1 *toplevel, *found = NULL;
+  wl_list_for_each(toplevel, &toplevel_list, link) {
+    if (!toplevel->ext) {
+      fprintf(stderr, "%s:%d: '%s' isn't paired\n", __FILE__, line,
+              toplevel->current.title);
+      failures++;
+    }
+    if (same_string(toplevel->current.title, title, false)) {
+      found = toplevel;
+    }
+  }
+
+  const char *identifier = found ? ext_toplevel_identifier(found) : NULL;
+  if (!identifier || strcmp(identifier, mock_get_identifier(window)) != 0) {
+    fprintf(stderr, "%s:%d: '%s' carries %s instead of %s\n", __FILE__, line,
+            title, identifier ? identifier : "no identifier",
+            mock_get_identifier(window));
+    failures++;
+  }
+}
+
+int main(void) {
+  mock_configure(&(struct mock_config){.ext_reverse = true});
+  struct mock_window *first = mock_add_toplevel("foot", "~");
+  struct mock_window *second = mock_add_toplevel("foot", "~");
+  struct mock_window *mail = mock_add_toplevel("thunderbird", "Inbox");
+
+  wlrapps_init(0, &test_listener, NULL);
+  if (!wlrapps_connect()) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    return EXIT_FAILURE;
+  }
+  settle();
+  check(toplevel_count == 3, "%zu toplevels, expected 3", toplevel_count);
+  expect_paired("Inbox", mail, __LINE__);
+
+  // The retitle reaches the wlr handle first, the pairs are sorted out
+  // once the ext one has it too.
+  mock_set_title(first, "vim");
+  settle();
+  expect_paired("vim", first, __LINE__);
+  expect_paired("~", second, __LINE__);
+
+  // Now equal again, and apart the other way round.
+  mock_set_title(second, "vim");
+  settle();
+  mock_set_title(first, "htop");
+  settle();
+  expect_paired("htop", first, __LINE__);
+  expect_paired("vim", second, __LINE__);
+
+  // Two windows trading titles in the same pass.
+  mock_set_title(first, "vim");
+  mock_set_title(second, "htop");
+  settle();
+  expect_paired("vim", first, __LINE__);
+  expect_paired("htop", second, __LINE__);
+
+  // A window opened next to identical ones pairs with the handle left over.
+  struct mock_window *third = mock_add_toplevel("foot", "vim");
+  settle();
+  mock_close(first);
+  settle();
+  mock_set_title(third, "man");
+  settle();
+  expect_paired("man", third, __LINE__);
+  expect_paired("htop", second, __LINE__);
+  expect_paired("Inbox", mail, __LINE__);
+
+  wlrapps_finish();
+  return check_status();
+}
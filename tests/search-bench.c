@@ -0,0 +1,179 @@
+#define _POSIX_C_SOURCE 200809L
+#include "mock-compositor.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wlrapps.h>
+
+// Times wlrapps_search() on synthetic corpora of 200, 500 and 2000 windows
+// against the linear scan a launcher script does: lowercase every title and
+// app_id and look for the query as a subsequence. Also times a retitle, the
+// title event and the reindex it causes.
+
+#define RUN_NS 100000000ull // Per query and corpus
+#define SETTLE_PASSES 4
+#define MAX_RESULTS 32
+#define RETITLES 1000
+
+static const char *const words[] = {
+    "github",  "pull",    "request", "review",  "docs",     "wayland",
+    "kernel",  "patch",   "mail",    "inbox",   "terminal", "vim",
+    "build",   "release", "notes",   "spotify", "music",    "firefox",
+    "project", "issue",   "meeting", "calendar", "chat",    "video",
+    "slides",  "draft",   "budget",  "report",  "design",   "sprint",
+};
+static const char *const app_ids[] = {
+    "org.mozilla.firefox", "foot",     "thunderbird", "spotify",
+    "org.gnome.Evince",    "code",     "slack",       "org.gnome.Nautilus",
+    "libreoffice-writer",  "chromium",
+};
+static const char *const queries[] = {
+    "github", "pull req", "spotfy", "kernl patch", "fx", "review docs wayland",
+};
+
+#define LENGTH(array) (sizeof(array) / sizeof((array)[0]))
+
+static const struct wlrapps_listener listener = {0};
+
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ull +
+         (unsigned long long)ts.tv_nsec;
+}
+
+static void settle(void) {
+  for (int i = 0; i < SETTLE_PASSES; ++i) {
+    wlrapps_dispatch();
+  }
+}
+
+static void random_title(char *title, size_t size) {
+  size_t len = 0;
+  int count = 3 + rand() % 6;
+  title[0] = '\0';
+  for (int i = 0; i < count && len < size; ++i) {
+    len += (size_t)snprintf(title + len, size - len, "%s%s", i ? " " : "",
+                            words[rand() % LENGTH(words)]);
+  }
+}
+
+static void add_windows(size_t count) {
+  char title[128];
+  for (size_t i = 0; i < count; ++i) {
+    random_title(title, sizeof(title));
+    mock_add_toplevel(app_ids[rand() % LENGTH(app_ids)], title);
+  }
+  settle();
+}
+
+// ---- Linear Scan ----
+
+static bool is_subsequence(const char *query, const char *text) {
+  for (; *text && *query; ++text) {
+    if (*query == ' ') {
+      query++;
+    }
+    if (tolower((unsigned char)*text) == *query) {
+      query++;
+    }
+  }
+  return *query == '\0';
+}
+
+static size_t linear_scan(const char *query) {
+  char lower[128];
+  size_t i = 0, matches = 0;
+  for (; query[i] && i < sizeof(lower) - 1; ++i) {
+    lower[i] = (char)tolower((unsigned char)query[i]);
+  }
+  lower[i] = '\0';
+
+  for (const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+       toplevel; toplevel = wlrapps_next_toplevel(toplevel)) {
+    matches += (toplevel->title && is_subsequence(lower, toplevel->title)) ||
+               (toplevel->app_id && is_subsequence(lower, toplevel->app_id));
+  }
+  return matches;
+}
+
+// ---- Timing ----
+
+static size_t sink = 0;
+
+static double time_query(const char *query, bool indexed) {
+  struct wlrapps_search_result results[MAX_RESULTS];
+  unsigned long long start = now_ns(), elapsed;
+  size_t runs = 0;
+  do {
+    sink += indexed ? wlrapps_search(query, results, MAX_RESULTS)
+                    : linear_scan(query);
+    runs++;
+  } while ((elapsed = now_ns() - start) < RUN_NS);
+  return (double)elapsed / (double)runs / 1000.0;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  unsigned long long x = *(const unsigned long long *)a;
+  unsigned long long y = *(const unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+// A pass of the mock walks every window, so the median idle pass is taken
+// off the median pass with a retitle.
+static double time_retitle(void) {
+  static unsigned long long idle[RETITLES], busy[RETITLES];
+  char title[128];
+  struct mock_window *window = mock_add_toplevel("foot", "retitled");
+  settle();
+
+  for (int i = 0; i < RETITLES; ++i) {
+    unsigned long long start = now_ns();
+    wlrapps_dispatch();
+    idle[i] = now_ns() - start;
+
+    random_title(title, sizeof(title));
+    start = now_ns();
+    mock_set_title(window, title);
+    wlrapps_dispatch();
+    busy[i] = now_ns() - start;
+  }
+  qsort(idle, RETITLES, sizeof(idle[0]), compare_ns);
+  qsort(busy, RETITLES, sizeof(busy[0]), compare_ns);
+
+  mock_close(window);
+  settle();
+  unsigned long long overhead = idle[RETITLES / 2];
+  unsigned long long median = busy[RETITLES / 2];
+  return median > overhead ? (double)(median - overhead) / 1000.0 : 0.0;
+}
+
+static void run(size_t windows) {
+  add_windows(windows - mock_window_count());
+  printf("%zu windows, retitle %.2f us\n",
+         mock_window_count(), time_retitle());
+  for (size_t i = 0; i < LENGTH(queries); ++i) {
+    double indexed = time_query(queries[i], true);
+    double linear = time_query(queries[i], false);
+    printf("  %-22s index %8.2f us   linear scan %8.2f us\n", queries[i],
+           indexed, linear);
+  }
+}
+
+int main(void) {
+  srand(1);
+  wlrapps_init(0, &listener, NULL);
+  if (!wlrapps_connect()) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    return EXIT_FAILURE;
+  }
+
+  run(200);
+  run(500);
+  run(2000);
+
+  wlrapps_finish();
+  return sink > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,138 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "mock-compositor.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlrapps.h>
+
+// Runs libwlrapps against the mock compositor and checks the search: the
+// ranking, typo matches, that retitled and closed windows leave the index,
+// and the focus history order of an empty query.
+
+#define MAX_RESULTS 16
+#define SETTLE_PASSES 4
+
+static const struct wlrapps_listener listener = {0};
+
+// Lets the client see everything the compositor sent.
+static void settle(void) {
+  for (int i = 0; i < SETTLE_PASSES; ++i) {
+    wlrapps_dispatch();
+  }
+}
+
+static uint32_t find_id(const char *title) {
+  for (const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+       toplevel; toplevel = wlrapps_next_toplevel(toplevel)) {
+    if (toplevel->title && strcmp(toplevel->title, title) == 0) {
+      return toplevel->id;
+    }
+  }
+  return 0;
+}
+
+static size_t search(const char *query,
+                     struct wlrapps_search_result results[MAX_RESULTS]) {
+  return wlrapps_search(query, results, MAX_RESULTS);
+}
+
+static bool finds(const char *query, uint32_t id) {
+  struct wlrapps_search_result results[MAX_RESULTS];
+  size_t count = search(query, results);
+  for (size_t i = 0; i < count && i < MAX_RESULTS; ++i) {
+    if (results[i].id == id) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool finds_first(const char *query, uint32_t id) {
+  struct wlrapps_search_result results[MAX_RESULTS];
+  return search(query, results) > 0 && results[0].id == id;
+}
+
+static void test_ranking(void) {
+  uint32_t github = find_id("Pull requests · GitHub — Mozilla Firefox");
+  uint32_t spotify = find_id("Spotify Premium");
+  uint32_t kernel = find_id("[PATCH v3] kernel: fix the scheduler - Mail");
+  uint32_t docs = find_id("Review: Wayland docs");
+
+  check(finds_first("github", github), "github isn't the first match");
+  check(finds_first("pull req", github), "'pull req' misses the pull requests");
+  check(finds("fx", find_id("Firefox Settings")), "fx doesn't find firefox");
+  check(finds_first("review docs wayland", docs),
+        "the words out of order miss the review");
+  check(finds_first("SPOTIFY", spotify), "the search isn't case insensitive");
+  check(finds("org.mozilla", github), "the app_id isn't searched");
+
+  // Typos match through the shared trigrams.
+  check(finds_first("spotfy", spotify), "spotfy doesn't find spotify");
+  check(finds_first("kernl patch", kernel), "'kernl patch' misses the patch");
+
+  struct wlrapps_search_result results[MAX_RESULTS];
+  check(search("qqqzzz", results) == 0, "nonsense matches something");
+  size_t count = search("e", results);
+  for (size_t i = 1; i < count && i < MAX_RESULTS; ++i) {
+    check(results[i - 1].score >= results[i].score,
+          "result %zu scores higher than the one before", i);
+  }
+}
+
+static void test_updates(void) {
+  uint32_t id = find_id("Spotify Premium");
+
+  mock_command("title music Terminal — htop");
+  settle();
+  check(!finds("premium", id), "the old title is still indexed");
+  check(finds_first("htop", id), "the new title isn't indexed");
+
+  uint32_t closing = find_id("Review: Wayland docs");
+  mock_command("close docs");
+  settle();
+  check(!finds("review", closing), "a closed window is still found");
+  check(!finds("", closing), "a closed window is in the empty query");
+}
+
+static void test_empty_query(void) {
+  struct wlrapps_search_result results[MAX_RESULTS];
+  uint32_t kernel = find_id("[PATCH v3] kernel: fix the scheduler - Mail");
+  uint32_t github = find_id("Pull requests · GitHub — Mozilla Firefox");
+
+  mock_command("activate mail");
+  settle();
+  mock_command("activate github");
+  settle();
+
+  size_t count = search("", results);
+  check(count == mock_window_count(), "the empty query found %zu of %zu",
+        count, mock_window_count());
+  check(count >= 2 && results[0].id == github && results[1].id == kernel,
+        "the empty query isn't in focus history order");
+}
+
+int main(void) {
+  mock_command("new github org.mozilla.firefox Pull requests · GitHub — "
+               "Mozilla Firefox");
+  mock_command("new settings org.mozilla.firefox Firefox Settings");
+  mock_command("new music spotify Spotify Premium");
+  mock_command("new mail thunderbird [PATCH v3] kernel: fix the scheduler - "
+               "Mail");
+  mock_command("new docs org.gnome.Evince Review: Wayland docs");
+  mock_command("new term foot ~/src/wlr-apps");
+
+  wlrapps_init(0, &listener, NULL);
+  if (!wlrapps_connect()) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    return EXIT_FAILURE;
+  }
+  settle();
+
+  test_ranking();
+  test_updates();
+  test_empty_query();
+
+  wlrapps_finish();
+  return check_status();
+}
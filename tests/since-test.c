@@ -0,0 +1,203 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "daemon-harness.h"
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Runs the daemon against the mock compositor and checks the since command:
+// live events, the replay of the missed ones byte for byte, snapshots for
+// stale and unknown sequence numbers and after the compositor reconnected.
+
+#define QUIET_MS 200 // How long nothing has to arrive
+
+// A since connection, split into events at the newlines.
+struct stream {
+  int fd;
+  char buffer[65536];
+  size_t len;
+};
+
+struct event {
+  uint64_t seq;
+  char name[16];
+  char line[4096];
+};
+
+static bool stream_open(struct stream *stream, const char *command) {
+  stream->len = 0;
+  stream->fd = control_connect();
+  if (stream->fd == -1 ||
+      send(stream->fd, command, strlen(command), MSG_NOSIGNAL) == -1) {
+    check(false, "can't send '%s'", command);
+    return false;
+  }
+  return true;
+}
+
+static void stream_close(struct stream *stream) {
+  if (stream->fd != -1) {
+    close(stream->fd);
+    stream->fd = -1;
+  }
+}
+
+// The next event, false if none arrived within timeout_ms.
+static bool next_event(struct stream *stream, struct event *event,
+                       int timeout_ms) {
+  double deadline = now_ms() + timeout_ms;
+  char *end;
+  while (!(end = memchr(stream->buffer, '\n', stream->len))) {
+    int left = (int)(deadline - now_ms());
+    struct pollfd pfd = {.fd = stream->fd, .events = POLLIN};
+    if (left <= 0 || poll(&pfd, 1, left) <= 0) {
+      return false;
+    }
+    ssize_t n = read(stream->fd, stream->buffer + stream->len,
+                     sizeof(stream->buffer) - stream->len);
+    if (n <= 0) {
+      return false;
+    }
+    stream->len += (size_t)n;
+  }
+
+  size_t len = (size_t)(end - stream->buffer) + 1;
+  size_t copy = len < sizeof(event->line) ? len : sizeof(event->line) - 1;
+  memcpy(event->line, stream->buffer, copy);
+  event->line[copy] = '\0';
+  memmove(stream->buffer, stream->buffer + len, stream->len - len);
+  stream->len -= len;
+
+  event->seq = 0;
+  event->name[0] = '\0';
+  sscanf(event->line, "{\"seq\":%" SCNu64 ",\"event\":\"%15[a-z]\"",
+         &event->seq, event->name);
+  return true;
+}
+
+static bool expect_event(struct stream *stream, struct event *event,
+                         const char *name) {
+  if (!next_event(stream, event, 2000)) {
+    check(false, "no %s event", name);
+    return false;
+  }
+  check(strcmp(event->name, name) == 0, "expected a %s event, got '%s'", name,
+        event->line);
+  return strcmp(event->name, name) == 0;
+}
+
+static void expect_quiet(struct stream *stream, const char *what) {
+  struct event event;
+  check(!next_event(stream, &event, QUIET_MS), "%s sent '%s'", what,
+        event.line);
+}
+
+static void expect_snapshot_for(const char *command) {
+  struct stream stream;
+  struct event event;
+  if (stream_open(&stream, command)) {
+    expect_event(&stream, &event, "snapshot");
+  }
+  stream_close(&stream);
+}
+
+int main(int argc, char **argv) {
+  static const char *const args[] = {"-m", "-R", NULL};
+  struct daemon daemon;
+  struct stream live, replay;
+  struct event event, missed[2];
+  char command[64];
+
+  if (argc < 2 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps-mock>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  mock_send("new term foot ~");
+  if (!daemon_start(&daemon, args, false) ||
+      !stream_open(&live, "since") ||
+      !expect_event(&live, &event, "snapshot")) {
+    harness_finish();
+    return EXIT_FAILURE;
+  }
+  check(strstr(event.line, "\"app_id\":\"foot\""), "the snapshot misses foot");
+
+  // Live events follow in order.
+  uint64_t seen = event.seq;
+  mock_send("title term one");
+  if (expect_event(&live, &event, "changed")) {
+    check(event.seq == seen + 1, "seq %" PRIu64 " after %" PRIu64, event.seq,
+          seen);
+    check(strstr(event.line, "\"title\":\"one\""), "no new title in '%s'",
+          event.line);
+    seen = event.seq;
+  }
+
+  // A consumer that saw one gets exactly what it missed, byte for byte.
+  // Each title in its own pass, or the two changes arrive as one event.
+  mock_send("title term two");
+  bool ok = expect_event(&live, &missed[0], "changed");
+  mock_send("title term three");
+  ok = expect_event(&live, &missed[1], "changed") && ok;
+  snprintf(command, sizeof(command), "since %" PRIu64, seen);
+  if (ok && stream_open(&replay, command)) {
+    for (int i = 0; i < 2; ++i) {
+      check(next_event(&replay, &event, 2000) &&
+                strcmp(event.line, missed[i].line) == 0,
+            "the replay differs from the live event '%s'", missed[i].line);
+    }
+    expect_quiet(&replay, "the replay");
+    stream_close(&replay);
+  }
+
+  // Up to date, only new events arrive.
+  snprintf(command, sizeof(command), "since %" PRIu64, missed[1].seq);
+  if (stream_open(&replay, command)) {
+    expect_quiet(&replay, "an up to date consumer");
+    mock_send("close term");
+    if (expect_event(&replay, &event, "closed")) {
+      check(event.seq == missed[1].seq + 1, "the close has seq %" PRIu64,
+            event.seq);
+      const char *id = strstr(missed[1].line, "\"id\":");
+      char closed[32];
+      snprintf(closed, sizeof(closed), "\"id\":%u",
+               id ? (unsigned)strtoul(id + 5, NULL, 10) : 0u);
+      check(id && strstr(event.line, closed), "the close names '%s'",
+            event.line);
+    }
+    expect_event(&live, &event, "closed");
+    stream_close(&replay);
+  }
+
+  // Gone, from another daemon or never handed out.
+  expect_snapshot_for("since 1");
+  snprintf(command, sizeof(command), "since %" PRIu64, event.seq + 1000);
+  expect_snapshot_for(command);
+
+  // Broken sequence numbers end the connection.
+  char reply[256];
+  check(control_request("since 12x", reply, sizeof(reply), true, 2000) <= 0,
+        "'since 12x' replied '%s'", reply);
+
+  // What happened while the compositor was away only a snapshot tells.
+  mock_send("new mail thunderbird Inbox");
+  expect_event(&live, &event, "changed");
+  mock_send("disconnect");
+  for (int i = 0; i < 5 && next_event(&live, &event, 5000); ++i) {
+    if (strcmp(event.name, "snapshot") == 0) {
+      break;
+    }
+  }
+  check(strcmp(event.name, "snapshot") == 0,
+        "no snapshot after the reconnect, last '%s'", event.line);
+  check(strstr(event.line, "\"app_id\":\"thunderbird\""),
+        "the snapshot after the reconnect misses the window");
+
+  stream_close(&live);
+  daemon_stop(&daemon);
+  harness_finish();
+  return check_status();
+}
@@ -0,0 +1,195 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "daemon-harness.h"
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Runs the daemon against the mock compositor with a filtered subscriber and
+// a since consumer attached, and churns windows through it: open, retitle
+// and close, round after round. Fails if the memory the daemon accounts for
+// or its resident set grows once the first rounds warmed it up. Also checks
+// that --max-title cuts every title.
+
+#define ROUNDS 8
+#define WARMUP_ROUNDS 2
+#define WINDOWS 20000 // Per round, the soak benchmark passes more as argv[2]
+#define MAX_TITLE 20
+#define MAX_TITLE_ARG "20"
+#define RSS_SLACK_KIB 64 // Allocator noise
+#define CHUNK 64 // Windows in flight, more can overrun the streams' buffers
+#define IDLE_TIMEOUT_MS 10000
+
+// A connection that is read as fast as the daemon writes, split into lines.
+struct stream {
+  int fd;
+  char buffer[65536];
+  size_t len;
+  size_t lines;
+};
+
+static bool stream_open(struct stream *stream, const char *command) {
+  stream->len = 0;
+  stream->lines = 0;
+  stream->fd = control_connect();
+  if (stream->fd == -1 ||
+      send(stream->fd, command, strlen(command), MSG_NOSIGNAL) == -1) {
+    fprintf(stderr, "can't send '%s'\n", command);
+    return false;
+  }
+  return true;
+}
+
+// The title of a history event, cut at the first escape.
+static size_t title_length(const char *line) {
+  const char *title = strstr(line, "\"title\":\"");
+  if (!title) {
+    return 0;
+  }
+  title += strlen("\"title\":\"");
+  return strcspn(title, "\"\\");
+}
+
+// Reads what arrived, counts the closed events and checks the titles.
+static bool stream_read(struct stream *stream, size_t *closed) {
+  ssize_t n = read(stream->fd, stream->buffer + stream->len,
+                   sizeof(stream->buffer) - stream->len);
+  if (n <= 0) {
+    return false;
+  }
+  stream->len += (size_t)n;
+
+  char *start = stream->buffer, *end;
+  while ((end = memchr(start, '\n', stream->len -
+                                        (size_t)(start - stream->buffer)))) {
+    *end = '\0';
+    stream->lines++;
+    if (closed) {
+      *closed += strstr(start, "\"event\":\"closed\"") != NULL;
+      size_t len = title_length(start);
+      check(len <= MAX_TITLE, "a title of %zu bytes: %s", len, start);
+    }
+    start = end + 1;
+  }
+  stream->len -= (size_t)(start - stream->buffer);
+  memmove(stream->buffer, start, stream->len);
+  if (stream->len == sizeof(stream->buffer)) {
+    stream->len = 0; // A subscriber snapshot longer than the buffer
+  }
+  return true;
+}
+
+// Churns count windows and drains both streams until the last one closed.
+// The daemon drops a consumer that falls a socket buffer behind, so only a
+// chunk is churned at a time.
+static bool churn(struct stream *history, struct stream *subscriber,
+                  size_t count) {
+  size_t closed = 0, sent = 0;
+  while (closed < count) {
+    if (sent == closed && sent < count) {
+      size_t chunk = count - sent < CHUNK ? count - sent : CHUNK;
+      if (!mock_send("churn %zu", chunk)) {
+        return false;
+      }
+      sent += chunk;
+    }
+
+    struct pollfd pfds[] = {
+        {.fd = history->fd, .events = POLLIN},
+        {.fd = subscriber->fd, .events = POLLIN},
+    };
+    if (poll(pfds, 2, IDLE_TIMEOUT_MS) <= 0) {
+      fprintf(stderr, "The daemon went quiet after %zu of %zu windows\n",
+              closed, count);
+      return false;
+    }
+    if ((pfds[0].revents && !stream_read(history, &closed)) ||
+        (pfds[1].revents && !stream_read(subscriber, NULL))) {
+      fprintf(stderr, "The daemon hung up on a stream\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Waits for the first snapshot, the daemon has taken the command then.
+static bool stream_started(struct stream *stream) {
+  size_t closed = 0;
+  while (stream->lines == 0) {
+    struct pollfd pfd = {.fd = stream->fd, .events = POLLIN};
+    if (poll(&pfd, 1, IDLE_TIMEOUT_MS) <= 0 || !stream_read(stream, &closed)) {
+      fprintf(stderr, "No snapshot on a stream\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+static size_t accounted_bytes(void) {
+  char reply[512];
+  size_t total = 0;
+  if (control_request("mem", reply, sizeof(reply), false, 2000) <= 0) {
+    return 0;
+  }
+  const char *line = strstr(reply, "total ");
+  if (line) {
+    total = strtoull(line + strlen("total "), NULL, 10);
+  }
+  return total;
+}
+
+int main(int argc, char **argv) {
+  static const char *const args[] = {
+      "-m", "--max-title", MAX_TITLE_ARG, "--filter", "app_id == none", NULL};
+  struct daemon daemon;
+  struct stream history, subscriber;
+  size_t max_bytes = 0, max_rss = 0;
+
+  if (argc < 2 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps-mock> [<windows per round>]\n",
+            argv[0]);
+    return EXIT_FAILURE;
+  }
+  size_t windows = argc > 2 ? strtoull(argv[2], NULL, 10) : WINDOWS;
+  if (!daemon_start(&daemon, args, false) ||
+      !stream_open(&history, "since") ||
+      !stream_open(&subscriber, "subscribe app_id ~ 'churn-1*'") ||
+      !stream_started(&history) || !stream_started(&subscriber)) {
+    harness_finish();
+    return EXIT_FAILURE;
+  }
+
+  for (int round = 0; round < ROUNDS; ++round) {
+    double start = now_ms();
+    if (!churn(&history, &subscriber, windows)) {
+      failures++;
+      break;
+    }
+    double elapsed = now_ms() - start;
+    size_t bytes = accounted_bytes();
+    size_t rss = daemon_rss(&daemon);
+    printf("round %d: %zu windows in %.0f ms, %zu bytes accounted, "
+           "rss %zu KiB\n",
+           round, windows, elapsed, bytes, rss);
+
+    check(bytes > 0, "no reply to mem");
+    if (round < WARMUP_ROUNDS) {
+      max_bytes = bytes > max_bytes ? bytes : max_bytes;
+      max_rss = rss > max_rss ? rss : max_rss;
+      continue;
+    }
+    check(bytes <= max_bytes, "round %d: accounted memory grew from %zu to %zu",
+          round, max_bytes, bytes);
+    check(rss <= max_rss + RSS_SLACK_KIB,
+          "round %d: rss grew from %zu KiB to %zu KiB", round, max_rss, rss);
+  }
+
+  close(history.fd);
+  close(subscriber.fd);
+  daemon_stop(&daemon);
+  harness_finish();
+  return check_status();
+}
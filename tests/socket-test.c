@@ -0,0 +1,64 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "daemon-harness.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A second daemon on the same display has to leave the running one's socket
+// alone, while the socket of a daemon that died is taken over.
+
+static bool answers(void) {
+  char reply[256];
+  return control_request("mem", reply, sizeof(reply), true, 2000) > 0 &&
+         strncmp(reply, "records ", 8) == 0;
+}
+
+int main(int argc, char **argv) {
+  static const char *const args[] = {"-m", NULL};
+  struct daemon first, second, third;
+
+  if (argc < 2 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps-mock>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (!daemon_start(&first, args, false)) {
+    harness_finish();
+    return EXIT_FAILURE;
+  }
+
+  // The harness waits for the socket, which the running daemon holds.
+  if (!daemon_start_activated(&second, args, -1, NULL)) {
+    failures++;
+  } else {
+    int status = daemon_wait(&second, 2000);
+    if (status != EXIT_FAILURE) {
+      fprintf(stderr, "a second daemon exited with %d\n", status);
+      failures++;
+    }
+  }
+  if (!answers()) {
+    fprintf(stderr, "the first daemon lost its socket\n");
+    failures++;
+  }
+
+  // Killed, it leaves its socket file behind and the next daemon takes it
+  // over right away.
+  kill(first.pid, SIGKILL);
+  daemon_wait(&first, 2000);
+  if (!daemon_start(&third, args, false)) {
+    fprintf(stderr, "the stale socket wasn't taken over\n");
+    failures++;
+  } else {
+    if (!answers()) {
+      fprintf(stderr, "the new daemon doesn't answer\n");
+      failures++;
+    }
+    daemon_stop(&third);
+  }
+
+  harness_finish();
+  return check_status();
+}
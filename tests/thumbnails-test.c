@@ -0,0 +1,242 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "mock-compositor.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wlrapps.h>
+
+// Runs libwlrapps against the mock compositor and checks the thumbnails: the
+// box filter against a straightforward reference, that a damaged frame only
+// recomputes the thumbnail pixels under the damage, and that a full pool
+// evicts the least recently used thumbnail.
+
+#define MAX_SIZE 128
+#define MAX_PASSES 20
+
+static unsigned updates = 0;
+
+static void handle_thumbnail_updated(const struct wlrapps_toplevel *toplevel,
+                                     const struct wlrapps_thumbnail *thumbnail,
+                                     void *data) {
+  updates++;
+}
+
+static const struct wlrapps_listener listener = {
+    .thumbnail_updated = handle_thumbnail_updated,
+};
+
+static uint32_t find_id(const char *title) {
+  for (const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+       toplevel; toplevel = wlrapps_next_toplevel(toplevel)) {
+    if (toplevel->title && strcmp(toplevel->title, title) == 0) {
+      return toplevel->id;
+    }
+  }
+  return 0;
+}
+
+// Dispatches until a thumbnail update arrives.
+static bool wait_for_update(void) {
+  unsigned before = updates;
+  for (int i = 0; i < MAX_PASSES && updates == before; ++i) {
+    if (!wlrapps_dispatch()) {
+      return false;
+    }
+  }
+  return updates != before;
+}
+
+// The average of every source pixel under the thumbnail pixel, per channel
+// and rounded, the boxes split the source like the library does.
+static void reference(const uint32_t *src, uint32_t src_width,
+                      uint32_t src_height, uint32_t width, uint32_t height,
+                      uint32_t x, uint32_t y, uint8_t out[4]) {
+  uint32_t sx0 = (uint32_t)((uint64_t)x * src_width / width);
+  uint32_t sx1 = (uint32_t)((uint64_t)(x + 1) * src_width / width);
+  uint32_t sy0 = (uint32_t)((uint64_t)y * src_height / height);
+  uint32_t sy1 = (uint32_t)((uint64_t)(y + 1) * src_height / height);
+  uint32_t count = (sx1 - sx0) * (sy1 - sy0);
+
+  for (int c = 0; c < 4; ++c) {
+    uint32_t sum = 0;
+    for (uint32_t sy = sy0; sy < sy1; ++sy) {
+      for (uint32_t sx = sx0; sx < sx1; ++sx) {
+        uint32_t pixel = src[(size_t)sy * src_width + sx];
+        sum += pixel >> (8 * c) & 0xff; // Little endian, like the buffer
+      }
+    }
+    out[c] = (uint8_t)((sum + count / 2) / count);
+  }
+}
+
+static bool pixel_matches(const struct wlrapps_thumbnail *thumbnail,
+                          const uint32_t *src, uint32_t src_width,
+                          uint32_t src_height, uint32_t x, uint32_t y) {
+  uint8_t expected[4];
+  reference(src, src_width, src_height, thumbnail->width, thumbnail->height, x,
+            y, expected);
+  const uint8_t *pixel =
+      thumbnail->pixels + (size_t)y * thumbnail->stride + (size_t)x * 4;
+  return memcmp(pixel, expected, 4) == 0;
+}
+
+static size_t count_mismatches(const struct wlrapps_thumbnail *thumbnail,
+                               const uint32_t *src, uint32_t src_width,
+                               uint32_t src_height) {
+  size_t mismatches = 0;
+  for (uint32_t y = 0; y < thumbnail->height; ++y) {
+    for (uint32_t x = 0; x < thumbnail->width; ++x) {
+      mismatches += !pixel_matches(thumbnail, src, src_width, src_height, x, y);
+    }
+  }
+  return mismatches;
+}
+
+static void test_box_filter(void) {
+  struct mock_window *window = mock_find_window("wide");
+  uint32_t width, height;
+  const uint32_t *pixels = mock_get_pixels(window, &width, &height);
+  uint32_t id = find_id("Wide");
+
+  check(wlrapps_capture_thumbnail(id, false), "can't capture the window");
+  check(wait_for_update(), "no thumbnail for the window");
+  const struct wlrapps_thumbnail *thumbnail = wlrapps_get_thumbnail(id);
+  check(thumbnail, "the thumbnail is missing");
+  if (!thumbnail) {
+    return;
+  }
+
+  check(thumbnail->width == 128 && thumbnail->height == 78,
+        "1000x613 scaled to %ux%u, expected 128x78", thumbnail->width,
+        thumbnail->height);
+  check(!thumbnail->live, "a single capture is live");
+  size_t mismatches = count_mismatches(thumbnail, pixels, width, height);
+  check(mismatches == 0, "%zu pixels differ from the reference", mismatches);
+
+  // Smaller windows are copied as they are.
+  window = mock_find_window("small");
+  pixels = mock_get_pixels(window, &width, &height);
+  id = find_id("Small");
+  check(wlrapps_capture_thumbnail(id, false), "can't capture the window");
+  check(wait_for_update(), "no thumbnail for the small window");
+  thumbnail = wlrapps_get_thumbnail(id);
+  if (thumbnail) {
+    check(thumbnail->width == 100 && thumbnail->height == 50,
+          "100x50 scaled to %ux%u", thumbnail->width, thumbnail->height);
+    mismatches = count_mismatches(thumbnail, pixels, width, height);
+    check(mismatches == 0, "%zu pixels differ from the window", mismatches);
+  }
+}
+
+static void test_damage(void) {
+  struct mock_window *window = mock_find_window("wide");
+  uint32_t width, height;
+  uint32_t *pixels = mock_get_pixels(window, &width, &height);
+  uint32_t id = find_id("Wide");
+
+  check(wlrapps_capture_thumbnail(id, true), "can't follow the window");
+  check(wait_for_update(), "no thumbnail while following the window");
+
+  uint32_t *old = malloc((size_t)width * height * sizeof(*old));
+  if (!old) {
+    fprintf(stderr, "out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(old, pixels, (size_t)width * height * sizeof(*old));
+
+  // Every pixel changes but only the top left corner is reported, the rest
+  // of the thumbnail has to stay as it was.
+  for (size_t i = 0; i < (size_t)width * height; ++i) {
+    pixels[i] = ~pixels[i] | 0xff000000u;
+  }
+  uint32_t damage_width = 100, damage_height = 60;
+  mock_damage(window, 0, 0, damage_width, damage_height);
+  check(wait_for_update(), "no update after the damage");
+
+  const struct wlrapps_thumbnail *thumbnail = wlrapps_get_thumbnail(id);
+  if (!thumbnail) {
+    check(false, "the thumbnail is gone");
+    free(old);
+    return;
+  }
+  check(thumbnail->live, "a followed thumbnail isn't live");
+
+  size_t stale = 0, touched = 0;
+  for (uint32_t y = 0; y < thumbnail->height; ++y) {
+    for (uint32_t x = 0; x < thumbnail->width; ++x) {
+      uint32_t sx0 = (uint32_t)((uint64_t)x * width / thumbnail->width);
+      uint32_t sy0 = (uint32_t)((uint64_t)y * height / thumbnail->height);
+      uint32_t sx1 = (uint32_t)((uint64_t)(x + 1) * width / thumbnail->width);
+      uint32_t sy1 = (uint32_t)((uint64_t)(y + 1) * height / thumbnail->height);
+      // One extra pixel around the damage may be recomputed either way.
+      bool inside = sx0 < damage_width && sy0 < damage_height;
+      bool away = sx0 >= damage_width + (sx1 - sx0) ||
+                  sy0 >= damage_height + (sy1 - sy0);
+      if (inside) {
+        stale += !pixel_matches(thumbnail, pixels, width, height, x, y);
+      } else if (away) {
+        touched += !pixel_matches(thumbnail, old, width, height, x, y);
+      }
+    }
+  }
+  check(stale == 0, "%zu damaged thumbnail pixels weren't recomputed", stale);
+  check(touched == 0, "%zu pixels away from the damage were recomputed",
+        touched);
+
+  wlrapps_stop_thumbnail(id);
+  free(old);
+}
+
+// The pool holds two thumbnails, "wide" and "small" are in it already.
+static void test_eviction(void) {
+  uint32_t wide = find_id("Wide"), small = find_id("Small");
+  uint32_t third = find_id("Third");
+
+  check(wlrapps_get_thumbnail(small), "the small thumbnail is missing");
+  check(wlrapps_get_thumbnail(wide), "the wide thumbnail is missing");
+  // Reading wide made small the least recently used one.
+  check(wlrapps_capture_thumbnail(third, false), "can't capture the window");
+  check(wait_for_update(), "no thumbnail for the third window");
+
+  check(wlrapps_get_thumbnail(third), "the new thumbnail is missing");
+  check(wlrapps_get_thumbnail(wide), "the recently used thumbnail was evicted");
+  check(!wlrapps_get_thumbnail(small),
+        "the least recently used thumbnail is still there");
+
+  // Reading third and then wide above left third the oldest one, capturing
+  // small again takes its slot.
+  check(wlrapps_capture_thumbnail(small, false), "can't capture the window");
+  check(wait_for_update(), "no thumbnail after capturing again");
+  check(wlrapps_get_thumbnail(small), "the recaptured thumbnail is missing");
+  check(wlrapps_get_thumbnail(wide), "wide was evicted instead of third");
+  check(!wlrapps_get_thumbnail(third), "third wasn't evicted");
+}
+
+int main(void) {
+  mock_command("new wide org.example.wide Wide");
+  mock_command("new small org.example.small Small");
+  mock_command("new third org.example.third Third");
+  mock_resize(mock_find_window("wide"), 1000, 613);
+  mock_resize(mock_find_window("small"), 100, 50);
+
+  wlrapps_init(0, &listener, NULL);
+  if (!wlrapps_enable_thumbnails(MAX_SIZE, 2 * MAX_SIZE * MAX_SIZE * 4) ||
+      !wlrapps_connect()) {
+    fprintf(stderr, "can't set up libwlrapps\n");
+    return EXIT_FAILURE;
+  }
+
+  test_box_filter();
+  test_damage();
+  test_eviction();
+
+  wlrapps_finish();
+  const struct mock_stats *stats = mock_get_stats();
+  check(stats->leaked_objects == 0, "%zu objects leaked",
+        stats->leaked_objects);
+
+  printf("thumbnails: %u frames captured\n", stats->frames);
+  return check_status();
+}
@@ -0,0 +1,103 @@
+// Times what a toplevel event costs the daemon's waiters: none waiting, 250
+// waiting on other app_ids, which sit in the app_id buckets, and 250 with
+// title globs, which every event has to evaluate. "created" evaluates every
+// waiter the event reaches, "title" only those whose filter reads the title.
+//
+// The waiters are file local, so the daemon is compiled in with its main
+// renamed.
+#define main wlr_apps_main
+#include "wlr-apps.c"
+#undef main
+
+#include "mock-compositor.h"
+
+#define RUN_NS 200000000 // Per case
+#define WAITERS 250
+
+static int waiter_fds[WAITERS][2];
+
+static bool add_waiters(const char *format) {
+  char args[64];
+  for (int i = 0; i < WAITERS; ++i) {
+    snprintf(args, sizeof(args), format, i);
+    if (wait_for_toplevel(waiter_fds[i][0], args) != COMMAND_KEEP_OPEN) {
+      fprintf(stderr, "'wait %s' didn't wait\n", args);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void remove_waiters(void) {
+  for (int i = 0; i < WAITERS; ++i) {
+    remove_waiter(waiter_fds[i][0]);
+  }
+}
+
+static void run(const char *name, const struct wlrapps_toplevel *toplevel) {
+  static const struct {
+    const char *name;
+    uint32_t changes;
+  } events[] = {
+      {"created", WLRAPPS_CHANGED_CREATED},
+      {"title", WLRAPPS_CHANGED_TITLE},
+  };
+
+  for (size_t i = 0; i < sizeof(events) / sizeof(events[0]); ++i) {
+    uint64_t start = now_ns(), elapsed = 0;
+    size_t rounds = 0;
+    while (elapsed < RUN_NS) {
+      for (int j = 0; j < 256; ++j, ++rounds) {
+        notify_waiters(toplevel, events[i].changes);
+      }
+      elapsed = now_ns() - start;
+    }
+    printf("%-10s %-8s %8.1f ns/event\n", name, events[i].name,
+           (double)elapsed / (double)rounds);
+  }
+}
+
+int main(void) {
+  static const struct wlrapps_listener bench_listener = {0};
+
+  for (int i = 0; i < WAITERS; ++i) {
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, waiter_fds[i]) ==
+        -1) {
+      perror("Error creating a socket pair");
+      return EXIT_FAILURE;
+    }
+  }
+
+  wlrapps_init(0, &bench_listener, NULL);
+  mock_add_toplevel("foot", "~/src/wayland-toplevel-info - vim README.md");
+  if (!wlrapps_connect()) {
+    return EXIT_FAILURE;
+  }
+  wlrapps_dispatch();
+  const struct wlrapps_toplevel *toplevel = wlrapps_first_toplevel();
+  if (!toplevel) {
+    fprintf(stderr, "The mock announced no toplevel\n");
+    return EXIT_FAILURE;
+  }
+
+  run("none", toplevel);
+
+  bool ok = add_waiters("new app_id == app-%d");
+  if (ok) {
+    run("indexed", toplevel);
+  }
+  remove_waiters();
+
+  ok = ok && add_waiters("new title ~ '*build-%d*'");
+  if (ok) {
+    run("unindexed", toplevel);
+  }
+  remove_waiters();
+
+  wlrapps_finish();
+  for (int i = 0; i < WAITERS; ++i) {
+    close(waiter_fds[i][0]);
+    close(waiter_fds[i][1]);
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+#define _POSIX_C_SOURCE 200809L
+#include "check.h"
+#include "daemon-harness.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Runs the daemon against the mock compositor and checks the wait command:
+// a toplevel that matches already, one that appears while waiting, the
+// timeout= option and the errors for malformed ones.
+
+static void expect_reply(const char *command, const char *expected,
+                         int timeout_ms) {
+  char reply[256];
+  control_request(command, reply, sizeof(reply), true, timeout_ms);
+  check(strncmp(reply, expected, strlen(expected)) == 0,
+        "'%s' replied '%s', expected '%s'", command, reply, expected);
+}
+
+static void test_existing(void) {
+  expect_reply("wait app_id == foot", "ok ", 2000);
+  expect_reply("wait", "ok ", 2000);
+}
+
+static void test_new(void) {
+  char reply[256];
+  int fd = control_connect();
+  const char *command = "wait new timeout=5000 app_id == foot";
+  if (fd == -1 || send(fd, command, strlen(command), MSG_NOSIGNAL) == -1) {
+    check(false, "can't send the wait");
+    if (fd != -1) {
+      close(fd);
+    }
+    return;
+  }
+
+  // The foot window that is open already doesn't count.
+  double start = now_ms();
+  check(read_line(fd, reply, sizeof(reply), 200) == -1,
+        "answered before a new window appeared: '%s'", reply);
+  mock_send("new second foot ~");
+  read_line(fd, reply, sizeof(reply), 2000);
+  check(strncmp(reply, "ok ", 3) == 0, "the new window gave '%s'", reply);
+  check(now_ms() - start < 4000, "waited for the timeout instead");
+  close(fd);
+}
+
+static void test_timeout(void) {
+  double start = now_ms();
+  expect_reply("wait new timeout=100 app_id == nothing", "timeout", 2000);
+  double elapsed = now_ms() - start;
+  check(elapsed >= 90 && elapsed < 1000, "the timeout took %.0f ms", elapsed);
+
+  // A number in the filter is a value, not a timeout.
+  expect_reply("wait timeout=100 id == 99999", "timeout", 2000);
+  expect_reply("wait new timeout=0", "timeout", 2000);
+}
+
+static void test_errors(void) {
+  expect_reply("wait timeout=abc app_id == foot", "error", 2000);
+  expect_reply("wait timeout=-5", "error", 2000);
+  expect_reply("wait timeout=10x", "error", 2000);
+  expect_reply("wait timeout=99999999999999999999999", "error", 2000);
+  // The timeout isn't taken from the end of the filter any more.
+  expect_reply("wait new app_id == foot 5000", "error", 2000);
+}
+
+int main(int argc, char **argv) {
+  static const char *const args[] = {"-m", NULL};
+  struct daemon daemon;
+
+  if (argc < 2 || !harness_init(argv[1])) {
+    fprintf(stderr, "Usage: %s <wlr-apps-mock>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  mock_send("new first foot ~");
+  if (!daemon_start(&daemon, args, false)) {
+    harness_finish();
+    return EXIT_FAILURE;
+  }
+
+  test_existing();
+  test_new();
+  test_timeout();
+  test_errors();
+
+  daemon_stop(&daemon);
+  harness_finish();
+  return check_status();
+}